@@ -0,0 +1,498 @@
+/// \file accesslog.cpp
+/// Binary, columnar access log files: an asynchronous writer and a reader for offline queries.
+
+#include "accesslog.h"
+#include "bitfields.h"
+#include "checksum.h"
+#include "defines.h"
+#include "timing.h"
+#include "util.h"
+#include <dirent.h>
+#include <map>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/// Magic bytes at the start of every block
+#define ACCESSLOG_MAGIC "MALB"
+/// Size of the block header: magic, payload size, record count, first and last time, payload CRC
+#define ACCESSLOG_HEADER 32
+/// Records per block; a block is written out as soon as it holds this many records
+#define ACCESSLOG_BLOCK_RECORDS 4096
+/// Seconds after which a block that did not fill up is written out anyway
+#define ACCESSLOG_FLUSH_SECS 5
+/// Blocks larger than this are considered corrupt
+#define ACCESSLOG_MAX_BLOCK (64 * 1024 * 1024)
+
+namespace AccessLog{
+
+  /// Appends the given value as variable-length integer: 7 bits per byte, high bit set if more bytes follow
+  static void putVarInt(std::string &out, uint64_t val){
+    char buf[10];
+    size_t len = 0;
+    while (val >= 0x80){
+      buf[len++] = (val & 0x7F) | 0x80;
+      val >>= 7;
+    }
+    buf[len++] = val;
+    out.append(buf, len);
+  }
+
+  /// Reads a variable-length integer at data[pos], advancing pos. Returns false if the data ends first.
+  static bool getVarInt(const char *data, size_t len, size_t &pos, uint64_t &val){
+    val = 0;
+    for (size_t shift = 0; shift < 64; shift += 7){
+      if (pos >= len){return false;}
+      uint8_t b = data[pos++];
+      val |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)){return true;}
+    }
+    return false;
+  }
+
+  static void putString(std::string &out, const std::string &str){
+    putVarInt(out, str.size());
+    out.append(str);
+  }
+
+  static bool getString(const char *data, size_t len, size_t &pos, std::string &str){
+    uint64_t strLen;
+    if (!getVarInt(data, len, pos, strLen) || strLen > len - pos){return false;}
+    str.assign(data + pos, strLen);
+    pos += strLen;
+    return true;
+  }
+
+  /// Writes a string column. Columns with many repeated values (streams, connectors, returning viewers)
+  /// are written as a dictionary followed by an index per record; mostly unique columns are written as-is.
+  static void putStrings(std::string &out, const std::vector<std::string> &col){
+    std::map<std::string, uint64_t> dict;
+    std::vector<const std::string *> entries;
+    for (size_t i = 0; i < col.size() && entries.size() <= col.size() / 2; ++i){
+      if (dict.insert(std::pair<std::string, uint64_t>(col[i], entries.size())).second){
+        entries.push_back(&col[i]);
+      }
+    }
+    if (entries.size() > col.size() / 2){
+      out += (char)0;
+      for (size_t i = 0; i < col.size(); ++i){putString(out, col[i]);}
+      return;
+    }
+    out += (char)1;
+    putVarInt(out, entries.size());
+    for (size_t i = 0; i < entries.size(); ++i){putString(out, *entries[i]);}
+    for (size_t i = 0; i < col.size(); ++i){putVarInt(out, dict[col[i]]);}
+  }
+
+  static bool getStrings(const char *data, size_t len, size_t &pos, size_t count, std::vector<std::string> &col){
+    if (pos >= len){return false;}
+    char mode = data[pos++];
+    col.resize(count);
+    if (!mode){
+      for (size_t i = 0; i < count; ++i){
+        if (!getString(data, len, pos, col[i])){return false;}
+      }
+      return true;
+    }
+    uint64_t dictSize;
+    if (!getVarInt(data, len, pos, dictSize) || dictSize > len - pos){return false;}
+    std::vector<std::string> dict(dictSize);
+    for (size_t i = 0; i < dictSize; ++i){
+      if (!getString(data, len, pos, dict[i])){return false;}
+    }
+    for (size_t i = 0; i < count; ++i){
+      uint64_t idx;
+      if (!getVarInt(data, len, pos, idx) || idx >= dictSize){return false;}
+      col[i] = dict[idx];
+    }
+    return true;
+  }
+
+  static void putInts(std::string &out, const std::vector<uint64_t> &col){
+    for (size_t i = 0; i < col.size(); ++i){putVarInt(out, col[i]);}
+  }
+
+  static bool getInts(const char *data, size_t len, size_t &pos, size_t count, std::vector<uint64_t> &col){
+    col.resize(count);
+    for (size_t i = 0; i < count; ++i){
+      if (!getVarInt(data, len, pos, col[i])){return false;}
+    }
+    return true;
+  }
+
+  size_t Block::size() const{return time.size();}
+
+  void Block::clear(){
+    time.clear();
+    session.clear();
+    stream.clear();
+    connector.clear();
+    host.clear();
+    duration.clear();
+    up.clear();
+    down.clear();
+    tags.clear();
+  }
+
+  void Block::swap(Block &rhs){
+    time.swap(rhs.time);
+    session.swap(rhs.session);
+    stream.swap(rhs.stream);
+    connector.swap(rhs.connector);
+    host.swap(rhs.host);
+    duration.swap(rhs.duration);
+    up.swap(rhs.up);
+    down.swap(rhs.down);
+    tags.swap(rhs.tags);
+  }
+
+  void Block::append(const Record &R){
+    time.push_back(R.time);
+    session.push_back(R.session);
+    stream.push_back(R.stream);
+    connector.push_back(R.connector);
+    host.push_back(R.host);
+    duration.push_back(R.duration);
+    up.push_back(R.up);
+    down.push_back(R.down);
+    tags.push_back(R.tags);
+  }
+
+  void Block::get(size_t i, Record &R) const{
+    R.time = time[i];
+    R.session = session[i];
+    R.stream = stream[i];
+    R.connector = connector[i];
+    R.host = host[i];
+    R.duration = duration[i];
+    R.up = up[i];
+    R.down = down[i];
+    R.tags = tags[i];
+  }
+
+  /// Returns the lowest time in the block
+  uint64_t Block::firstTime() const{
+    uint64_t ret = 0xFFFFFFFFFFFFFFFFull;
+    for (size_t i = 0; i < time.size(); ++i){
+      if (time[i] < ret){ret = time[i];}
+    }
+    return time.size() ? ret : 0;
+  }
+
+  /// Returns the highest time in the block
+  uint64_t Block::lastTime() const{
+    uint64_t ret = 0;
+    for (size_t i = 0; i < time.size(); ++i){
+      if (time[i] > ret){ret = time[i];}
+    }
+    return ret;
+  }
+
+  /// Appends the block, including its header, to out.
+  void Block::encode(std::string &out) const{
+    uint64_t first = firstTime();
+    std::string payload;
+    payload.reserve(size() * 32);
+    // Times are mostly increasing: store them as offsets from the previous time, relative to the lowest time
+    putVarInt(payload, first);
+    uint64_t prev = first;
+    for (size_t i = 0; i < time.size(); ++i){
+      int64_t delta = (int64_t)(time[i] - prev);
+      putVarInt(payload, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+      prev = time[i];
+    }
+    putStrings(payload, session);
+    putStrings(payload, stream);
+    putStrings(payload, connector);
+    putStrings(payload, host);
+    putInts(payload, duration);
+    putInts(payload, up);
+    putInts(payload, down);
+    putStrings(payload, tags);
+
+    char header[ACCESSLOG_HEADER];
+    memcpy(header, ACCESSLOG_MAGIC, 4);
+    Bit::htobl(header + 4, payload.size());
+    Bit::htobl(header + 8, size());
+    Bit::htobll(header + 12, first);
+    Bit::htobll(header + 20, lastTime());
+    Bit::htobl(header + 28, checksum::crc32(0, payload.data(), payload.size()));
+    out.append(header, ACCESSLOG_HEADER);
+    out.append(payload);
+  }
+
+  /// Replaces the contents of this block by the recCount records in the given payload.
+  /// Returns false if the payload could not be decoded, leaving the block empty.
+  bool Block::decode(const char *data, size_t len, size_t recCount){
+    clear();
+    size_t pos = 0;
+    uint64_t prev;
+    if (!getVarInt(data, len, pos, prev)){return false;}
+    time.resize(recCount);
+    for (size_t i = 0; i < recCount; ++i){
+      uint64_t zz;
+      if (!getVarInt(data, len, pos, zz)){
+        clear();
+        return false;
+      }
+      prev += (uint64_t)((int64_t)(zz >> 1) ^ -(int64_t)(zz & 1));
+      time[i] = prev;
+    }
+    if (!getStrings(data, len, pos, recCount, session) || !getStrings(data, len, pos, recCount, stream) ||
+        !getStrings(data, len, pos, recCount, connector) || !getStrings(data, len, pos, recCount, host) ||
+        !getInts(data, len, pos, recCount, duration) || !getInts(data, len, pos, recCount, up) ||
+        !getInts(data, len, pos, recCount, down) || !getStrings(data, len, pos, recCount, tags)){
+      clear();
+      return false;
+    }
+    return true;
+  }
+
+  Writer::Writer(){
+    rotate = 86400;
+    curPeriod = 0;
+    curStart = 0;
+    running = false;
+    thread = 0;
+    file = 0;
+    filePeriod = 0;
+  }
+
+  Writer::~Writer(){close();}
+
+  /// Starts writing to the given directory, creating it if needed, starting a new file every rotation seconds.
+  /// Any previously opened directory is closed first.
+  bool Writer::open(const std::string &directory, uint64_t rotation){
+    close();
+    if (!Util::isDirectory(directory) && !Util::createPath(directory)){
+      FAIL_MSG("Could not create access log directory %s", directory.c_str());
+      return false;
+    }
+    dir = directory;
+    rotate = (rotation < 60 ? 60 : rotation);
+    running = true;
+    thread = new tthread::thread(writerThread, this);
+    return true;
+  }
+
+  /// Writes out all records added so far and stops the background thread.
+  void Writer::close(){
+    if (!thread){return;}
+    {
+      tthread::lock_guard<tthread::mutex> guard(mut);
+      if (cur.size()){queueBlock();}
+      running = false;
+    }
+    thread->join();
+    delete thread;
+    thread = 0;
+  }
+
+  bool Writer::isOpen() const{return thread;}
+
+  const std::string &Writer::getDirectory() const{return dir;}
+
+  /// Adds a record to the current block. Does not block on disk access.
+  void Writer::add(const Record &R){
+    tthread::lock_guard<tthread::mutex> guard(mut);
+    if (!running){return;}
+    uint64_t period = R.time - R.time % rotate;
+    // Blocks never span rotation periods
+    if (cur.size() && period != curPeriod){queueBlock();}
+    if (!cur.size()){
+      curPeriod = period;
+      curStart = Util::bootSecs();
+    }
+    cur.append(R);
+    if (cur.size() >= ACCESSLOG_BLOCK_RECORDS){queueBlock();}
+  }
+
+  /// Moves the current block to the queue of blocks to write. Must be called with mut locked.
+  void Writer::queueBlock(){
+    ready.push_back(Block());
+    ready.back().swap(cur);
+    readyPeriod.push_back(curPeriod);
+  }
+
+  /// Returns the length of the part of the given file made up of complete blocks.
+  /// Anything after it is a block that was only partially written, for example before a crash.
+  static uint64_t completeLength(int fd){
+    struct stat st;
+    if (fstat(fd, &st)){return 0;}
+    uint64_t size = st.st_size;
+    uint64_t pos = 0;
+    char header[ACCESSLOG_HEADER];
+    while (pos + ACCESSLOG_HEADER <= size){
+      if (pread(fd, header, ACCESSLOG_HEADER, pos) != ACCESSLOG_HEADER || memcmp(header, ACCESSLOG_MAGIC, 4)){break;}
+      uint32_t len = Bit::btohl(header + 4);
+      if (len > ACCESSLOG_MAX_BLOCK || pos + ACCESSLOG_HEADER + len > size){break;}
+      pos += ACCESSLOG_HEADER + len;
+    }
+    return pos;
+  }
+
+  /// Appends the given block to the file for the given period, (re)opening that file if needed.
+  /// When opening an existing file, a partially written block at its end is cut off first, since
+  /// readers stop at the first block they cannot read and would never see the blocks appended after it.
+  void Writer::writeBlock(const Block &B, uint64_t period){
+    if (file && period != filePeriod){
+      fclose(file);
+      file = 0;
+    }
+    if (!file){
+      std::string name = fileName(dir, period);
+      file = fopen(name.c_str(), "a+b");
+      if (!file){
+        FAIL_MSG("Could not open access log file %s: %s", name.c_str(), strerror(errno));
+        return;
+      }
+      struct stat st;
+      uint64_t valid = completeLength(fileno(file));
+      if (!fstat(fileno(file), &st) && (uint64_t)st.st_size > valid){
+        WARN_MSG("Cutting %" PRIu64 " bytes of a partially written block off access log file %s",
+                 (uint64_t)st.st_size - valid, name.c_str());
+        if (ftruncate(fileno(file), valid)){
+          FAIL_MSG("Could not repair access log file %s: %s", name.c_str(), strerror(errno));
+          fclose(file);
+          file = 0;
+          return;
+        }
+      }
+      filePeriod = period;
+    }
+    std::string data;
+    B.encode(data);
+    if (fwrite(data.data(), data.size(), 1, file) != 1 || fflush(file)){
+      FAIL_MSG("Could not write %zu access log records: %s", B.size(), strerror(errno));
+      // Reopen on the next block, which cuts off the partially written one before appending more data
+      fclose(file);
+      file = 0;
+    }
+  }
+
+  void Writer::writerThread(void *arg){
+    Writer &W = *(Writer *)arg;
+    W.mut.lock();
+    while (true){
+      if (W.cur.size() && Util::bootSecs() - W.curStart >= ACCESSLOG_FLUSH_SECS){W.queueBlock();}
+      if (!W.ready.size()){
+        if (!W.running){break;}
+        W.mut.unlock();
+        Util::sleep(100);
+        W.mut.lock();
+        continue;
+      }
+      Block B;
+      B.swap(W.ready.front());
+      uint64_t period = W.readyPeriod.front();
+      W.ready.pop_front();
+      W.readyPeriod.pop_front();
+      W.mut.unlock();
+      W.writeBlock(B, period);
+      W.mut.lock();
+    }
+    W.mut.unlock();
+    if (W.file){
+      fclose(W.file);
+      W.file = 0;
+    }
+  }
+
+  Reader::Reader(const std::string &fileName){
+    file = 0;
+    skippedBlocks = 0;
+    if (fileName.size()){open(fileName);}
+  }
+
+  Reader::~Reader(){close();}
+
+  bool Reader::open(const std::string &fileName){
+    close();
+    file = fopen(fileName.c_str(), "rb");
+    if (!file){
+      FAIL_MSG("Could not open access log file %s: %s", fileName.c_str(), strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  void Reader::close(){
+    if (file){fclose(file);}
+    file = 0;
+  }
+
+  /// Reads the next block holding records in the time range [from, to] into B, skipping other blocks
+  /// without decoding them. Blocks with a bad checksum are skipped as well.
+  /// Returns false at the end of the file, or when the rest of the file is unreadable.
+  bool Reader::next(Block &B, uint64_t from, uint64_t to){
+    char header[ACCESSLOG_HEADER];
+    while (file && fread(header, ACCESSLOG_HEADER, 1, file) == 1){
+      if (memcmp(header, ACCESSLOG_MAGIC, 4)){
+        WARN_MSG("Access log file is corrupt, ignoring the rest of it");
+        return false;
+      }
+      uint32_t len = Bit::btohl(header + 4);
+      if (len > ACCESSLOG_MAX_BLOCK){
+        WARN_MSG("Access log block of %" PRIu32 " bytes is too large, ignoring the rest of the file", len);
+        return false;
+      }
+      if (Bit::btohll(header + 20) < from || Bit::btohll(header + 12) > to){
+        ++skippedBlocks;
+        if (Util::fseek(file, len, SEEK_CUR)){return false;}
+        continue;
+      }
+      buffer.resize(len);
+      if (len && fread((char *)buffer.data(), len, 1, file) != 1){
+        // A block that was only partially written, most likely the last one before a crash
+        return false;
+      }
+      if (checksum::crc32(0, buffer.data(), len) != Bit::btohl(header + 28) ||
+          !B.decode(buffer.data(), len, Bit::btohl(header + 8))){
+        WARN_MSG("Skipping corrupt access log block");
+        continue;
+      }
+      return true;
+    }
+    return false;
+  }
+
+  /// Returns the amount of blocks skipped so far because they were outside the requested time range
+  uint64_t Reader::skipped() const{return skippedBlocks;}
+
+  /// Returns the name of the file holding the rotation period starting at the given unix time
+  std::string fileName(const std::string &directory, uint64_t periodStart){
+    time_t t = periodStart;
+    struct tm tmpTime;
+    char buffer[32];
+    strftime(buffer, sizeof(buffer), "access_%Y%m%d%H%M%S.mal", gmtime_r(&t, &tmpTime));
+    return directory + "/" + buffer;
+  }
+
+  /// Adds the names of the files in the given directory that may hold records in the time range [from, to]
+  /// to files, in chronological order. A file covers the time from its own start up to the start of the next.
+  void listFiles(const std::string &directory, uint64_t from, uint64_t to, std::deque<std::string> &files){
+    DIR *d = opendir(directory.c_str());
+    if (!d){
+      FAIL_MSG("Could not open access log directory %s: %s", directory.c_str(), strerror(errno));
+      return;
+    }
+    std::map<uint64_t, std::string> found;
+    struct dirent *dp;
+    while ((dp = readdir(d))){
+      struct tm tmpTime;
+      memset(&tmpTime, 0, sizeof(tmpTime));
+      const char *end = strptime(dp->d_name, "access_%Y%m%d%H%M%S", &tmpTime);
+      if (!end || strcmp(end, ".mal")){continue;}
+      found[timegm(&tmpTime)] = directory + "/" + dp->d_name;
+    }
+    closedir(d);
+    for (std::map<uint64_t, std::string>::iterator it = found.begin(); it != found.end(); ++it){
+      if (it->first > to){break;}
+      std::map<uint64_t, std::string>::iterator nxt = it;
+      ++nxt;
+      if (nxt != found.end() && nxt->first <= from){continue;}
+      files.push_back(it->second);
+    }
+  }
+}// namespace AccessLog
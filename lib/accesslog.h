@@ -0,0 +1,104 @@
+/// \file accesslog.h
+/// Binary, columnar access log files: an asynchronous writer and a reader for offline queries.
+#pragma once
+#include "tinythread.h"
+#include <deque>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+/// Holds the binary access log tools.
+/// An access log is a directory of files, each holding one rotation period, named after the start
+/// of that period in UTC. Files are a sequence of independently decodable blocks, each holding up to
+/// a few thousand records stored per column: strings are dictionary-encoded, numbers as variable-length
+/// integers and times as deltas. A block header holds the time range of the block, so queries can skip
+/// blocks without decoding them. A truncated block at the end of a file (e.g. after a crash) is ignored.
+namespace AccessLog{
+
+  /// A single finished session.
+  struct Record{
+    uint64_t time;     ///< Unix time the session ended at
+    std::string session;
+    std::string stream;
+    std::string connector;
+    std::string host;
+    uint64_t duration; ///< In seconds
+    uint64_t up;       ///< Bytes sent to the viewer
+    uint64_t down;     ///< Bytes received from the viewer
+    std::string tags;
+  };
+
+  /// A set of records, stored per column.
+  class Block{
+  public:
+    std::vector<uint64_t> time;
+    std::vector<std::string> session;
+    std::vector<std::string> stream;
+    std::vector<std::string> connector;
+    std::vector<std::string> host;
+    std::vector<uint64_t> duration;
+    std::vector<uint64_t> up;
+    std::vector<uint64_t> down;
+    std::vector<std::string> tags;
+    size_t size() const;
+    void clear();
+    void swap(Block &rhs);
+    void append(const Record &R);
+    void get(size_t i, Record &R) const;
+    uint64_t firstTime() const;
+    uint64_t lastTime() const;
+    void encode(std::string &out) const;
+    bool decode(const char *data, size_t len, size_t recCount);
+  };
+
+  /// Asynchronously appends records to the files in a directory.
+  /// Adding a record only copies it into the current block; encoding and writing happen in a background
+  /// thread, which also writes out blocks that have not filled up within a few seconds.
+  class Writer{
+  public:
+    Writer();
+    ~Writer();
+    bool open(const std::string &directory, uint64_t rotation = 86400);
+    void close();
+    bool isOpen() const;
+    const std::string &getDirectory() const;
+    void add(const Record &R);
+
+  private:
+    std::string dir;
+    uint64_t rotate;           ///< Length of a rotation period, in seconds
+    uint64_t curPeriod;        ///< Start of the period the current block belongs to
+    uint64_t curStart;         ///< Local boot time in seconds at which the current block was started
+    Block cur;                 ///< Block records are added to
+    std::deque<Block> ready;   ///< Full blocks, waiting to be written
+    std::deque<uint64_t> readyPeriod;
+    bool running;
+    tthread::mutex mut;
+    tthread::thread *thread;
+    FILE *file;                ///< Currently open file
+    uint64_t filePeriod;       ///< Period of the currently open file
+    void queueBlock();
+    void writeBlock(const Block &B, uint64_t period);
+    static void writerThread(void *arg);
+  };
+
+  /// Reads blocks from a single access log file.
+  class Reader{
+  public:
+    Reader(const std::string &fileName = "");
+    ~Reader();
+    bool open(const std::string &fileName);
+    void close();
+    bool next(Block &B, uint64_t from = 0, uint64_t to = 0xFFFFFFFFFFFFFFFFull);
+    uint64_t skipped() const;
+
+  private:
+    FILE *file;
+    uint64_t skippedBlocks; ///< Blocks skipped because they were outside the requested time range
+    std::string buffer;
+  };
+
+  std::string fileName(const std::string &directory, uint64_t periodStart);
+  void listFiles(const std::string &directory, uint64_t from, uint64_t to, std::deque<std::string> &files);
+}// namespace AccessLog
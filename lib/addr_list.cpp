@@ -0,0 +1,242 @@
+/// \file addr_list.cpp
+/// Compiled address lists, as used for host white- and blacklists.
+
+#include "addr_list.h"
+#include "bitfields.h"
+#include <arpa/inet.h>
+#include <cctype>
+#include <cstdlib>
+#include <string.h>
+
+/// Returns the lower-case version of the given string
+static std::string lowerCase(const std::string &str){
+  std::string ret = str;
+  for (size_t i = 0; i < ret.size(); ++i){ret[i] = tolower(ret[i]);}
+  return ret;
+}
+
+/// Node number marking a node as the end of a prefix: everything below it matches
+#define ACL_MATCH 0xFFFFFFFFul
+
+/// Creates a list, compiling the given space-separated entries into it.
+Socket::AddrList::AddrList(const std::string &list){compile(list);}
+
+/// Removes all entries from the list.
+void Socket::AddrList::clear(){
+  nodes.clear();
+  names.clear();
+}
+
+/// Replaces the list contents by the given space-separated entries.
+/// Returns false if any of the entries could not be parsed; all other entries are added regardless.
+bool Socket::AddrList::compile(const std::string &list){
+  clear();
+  bool ret = true;
+  size_t pos = 0;
+  while (pos < list.size()){
+    size_t end = list.find(' ', pos);
+    if (end == std::string::npos){end = list.size();}
+    if (end > pos && !add(list.substr(pos, end - pos))){ret = false;}
+    pos = end + 1;
+  }
+  return ret;
+}
+
+/// Adds a single entry to the list. Accepted are:
+/// - IPv4 and IPv6 addresses, optionally with a /prefix to match a whole subnet;
+/// - addresses ending in `*`, matching any address that starts with the given text;
+/// - host names, optionally starting or ending with `*`, matched against reverse DNS names;
+/// - a single `*`, matching everything.
+/// Returns false if the entry is not valid.
+bool Socket::AddrList::add(const std::string &entry){
+  if (!entry.size()){return false;}
+  if (entry == "*"){
+    addPrefix("\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000\000", 0);
+    names += "<\n";
+    return true;
+  }
+  size_t starPos = entry.find('*');
+  if (starPos == std::string::npos){
+    std::string addr = entry;
+    uint8_t prefixLen = 128;
+    bool hasPrefix = false;
+    if (addr.find('/') != std::string::npos){
+      int len = atoi(addr.c_str() + addr.find('/') + 1);
+      if (len < 0 || len > 128){return false;}
+      prefixLen = len;
+      hasPrefix = true;
+      addr.erase(addr.find('/'));
+    }
+    char bin[16];
+    if (inet_pton(AF_INET6, addr.c_str(), bin) == 1){
+      addPrefix(bin, prefixLen);
+      return true;
+    }
+    if (inet_pton(AF_INET, addr.c_str(), bin + 12) == 1){
+      if (hasPrefix && prefixLen > 32){return false;}
+      memcpy(bin, "\000\000\000\000\000\000\000\000\000\000\377\377", 12);
+      addPrefix(bin, hasPrefix ? prefixLen + 96 : 128);
+      return true;
+    }
+    if (hasPrefix){return false;}
+    names += "=" + lowerCase(entry) + "\n";
+    return true;
+  }
+  if (starPos == entry.size() - 1){
+    std::string prefix = entry.substr(0, starPos);
+    if (addIPv4Prefix(prefix) || addIPv6Prefix(prefix)){return true;}
+    names += ">" + lowerCase(prefix) + "\n";
+    return true;
+  }
+  if (starPos == 0 && entry.find('*', 1) == std::string::npos){
+    names += "<" + lowerCase(entry.substr(1)) + "\n";
+    return true;
+  }
+  return false;
+}
+
+/// Adds the first prefixLen bits of the given 16-byte address to the trie.
+void Socket::AddrList::addPrefix(const char *binAddr, uint8_t prefixLen){
+  if (!nodes.size()){nodes.assign(8, (char)0);}
+  uint32_t n = 0;
+  for (uint8_t i = 0; i < prefixLen; ++i){
+    if (Bit::btohl(nodes.data() + n * 8) == ACL_MATCH){return;} // already covered by a shorter prefix
+    size_t childPos = n * 8 + (((binAddr[i / 8] >> (7 - (i % 8))) & 1) ? 4 : 0);
+    uint32_t child = Bit::btohl(nodes.data() + childPos);
+    if (!child){
+      child = nodes.size() / 8;
+      nodes.append(8, (char)0);
+      Bit::htobl((char *)nodes.data() + childPos, child);
+    }
+    n = child;
+  }
+  // Anything below this node is matched now; the old subtree is simply no longer reachable
+  Bit::htobl((char *)nodes.data() + n * 8, ACL_MATCH);
+  Bit::htobl((char *)nodes.data() + n * 8 + 4, ACL_MATCH);
+}
+
+/// Adds an IPv4 address prefix in text form, such as `192.168.` or `10.1`, matching all addresses
+/// whose dotted notation starts with this text. Returns false if this is not an IPv4 address prefix.
+bool Socket::AddrList::addIPv4Prefix(const std::string &prefix){
+  if (!prefix.size() || prefix.find_first_not_of("0123456789.") != std::string::npos){return false;}
+  char bin[16];
+  memcpy(bin, "\000\000\000\000\000\000\000\000\000\000\377\377\000\000\000\000", 16);
+  size_t octets = 0;
+  size_t pos = 0;
+  size_t dot;
+  while ((dot = prefix.find('.', pos)) != std::string::npos){
+    if (octets >= 3 || dot == pos || dot - pos > 3){return false;}
+    int val = atoi(prefix.substr(pos, dot - pos).c_str());
+    if (val > 255){return false;}
+    bin[12 + octets] = val;
+    ++octets;
+    pos = dot + 1;
+  }
+  std::string partial = prefix.substr(pos);
+  if (!partial.size()){
+    addPrefix(bin, 96 + octets * 8);
+    return true;
+  }
+  // A partial octet matches every value it is the decimal start of
+  bool found = false;
+  for (int val = 0; val < 256; ++val){
+    char valStr[4];
+    snprintf(valStr, 4, "%d", val);
+    if (strncmp(valStr, partial.c_str(), partial.size())){continue;}
+    bin[12 + octets] = val;
+    addPrefix(bin, 104 + octets * 8);
+    found = true;
+  }
+  return found;
+}
+
+/// Adds an IPv6 address prefix in text form consisting of whole groups, such as `2001:db8:`.
+/// Returns false if this is not such an IPv6 address prefix.
+bool Socket::AddrList::addIPv6Prefix(const std::string &prefix){
+  if (prefix.size() < 2 || prefix[prefix.size() - 1] != ':' || prefix.find("::") != std::string::npos){return false;}
+  if (prefix.find_first_not_of("0123456789abcdefABCDEF:") != std::string::npos){return false;}
+  size_t groups = 0;
+  for (size_t i = 0; i < prefix.size(); ++i){
+    if (prefix[i] == ':'){++groups;}
+  }
+  if (groups > 7){return false;}
+  char bin[16];
+  if (inet_pton(AF_INET6, (prefix + ":").c_str(), bin) != 1){return false;}
+  addPrefix(bin, groups * 16);
+  return true;
+}
+
+/// Returns true if the given binary-form IPv6 address is in one of the listed addresses or subnets.
+bool Socket::AddrList::match(const std::string &binAddr) const{
+  std::string p = packed();
+  return match(p.data(), p.size(), binAddr);
+}
+
+/// Returns true if the given host name (or textual address) matches one of the listed host name patterns.
+bool Socket::AddrList::matchHost(const std::string &hostName) const{
+  std::string p = packed();
+  return matchHost(p.data(), p.size(), hostName);
+}
+
+/// Returns true if the list contains host name patterns, so that a reverse DNS lookup may be relevant.
+bool Socket::AddrList::hasHostNames() const{return names.size();}
+
+/// Returns the compiled list: a 4-byte node count, a 4-byte length of the host name patterns,
+/// the trie nodes and finally the host name patterns.
+std::string Socket::AddrList::packed() const{
+  std::string ret(8, (char)0);
+  Bit::htobl((char *)ret.data(), nodes.size() / 8);
+  Bit::htobl((char *)ret.data() + 4, names.size());
+  return ret + nodes + names;
+}
+
+/// Returns true if the given binary-form IPv6 address is matched by the given compiled list.
+bool Socket::AddrList::match(const char *packed, size_t len, const std::string &binAddr){
+  if (len < 8 || binAddr.size() < 16){return false;}
+  uint32_t nodeCount = Bit::btohl(packed);
+  if (!nodeCount || len < 8 + (size_t)nodeCount * 8){return false;}
+  const char *nodes = packed + 8;
+  uint32_t n = 0;
+  for (size_t i = 0; i < 128; ++i){
+    if (Bit::btohl(nodes + n * 8) == ACL_MATCH){return true;}
+    n = Bit::btohl(nodes + n * 8 + (((binAddr[i / 8] >> (7 - (i % 8))) & 1) ? 4 : 0));
+    if (!n || n >= nodeCount){return false;}
+  }
+  return Bit::btohl(nodes + n * 8) == ACL_MATCH;
+}
+
+/// Returns true if the given host name (or textual address) matches one of the host name patterns in
+/// the given compiled list. Matching is case-insensitive.
+bool Socket::AddrList::matchHost(const char *packed, size_t len, const std::string &hostName){
+  if (len < 8 || !hostName.size()){return false;}
+  size_t namesStart = 8 + (size_t)Bit::btohl(packed) * 8;
+  size_t namesEnd = namesStart + Bit::btohl(packed + 4);
+  if (namesEnd > len || namesEnd == namesStart){return false;}
+  std::string host = lowerCase(hostName);
+  size_t pos = namesStart;
+  while (pos < namesEnd){
+    const char *lineEnd = (const char *)memchr(packed + pos, '\n', namesEnd - pos);
+    if (!lineEnd){return false;}
+    size_t patLen = lineEnd - packed - pos - 1;
+    const char *pat = packed + pos + 1;
+    switch (packed[pos]){
+    case '=':
+      if (host.size() == patLen && !memcmp(host.data(), pat, patLen)){return true;}
+      break;
+    case '>':
+      if (host.size() >= patLen && !memcmp(host.data(), pat, patLen)){return true;}
+      break;
+    case '<':
+      if (host.size() >= patLen && !memcmp(host.data() + host.size() - patLen, pat, patLen)){return true;}
+      break;
+    }
+    pos = lineEnd - packed + 1;
+  }
+  return false;
+}
+
+/// Returns true if the given compiled list contains host name patterns.
+bool Socket::AddrList::hasHostNames(const char *packed, size_t len){
+  if (len < 8){return false;}
+  return Bit::btohl(packed + 4) && 8 + (size_t)Bit::btohl(packed) * 8 + Bit::btohl(packed + 4) <= len;
+}
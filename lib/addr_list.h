@@ -0,0 +1,36 @@
+/// \file addr_list.h
+/// Compiled address lists, as used for host white- and blacklists.
+
+#pragma once
+#include <stdint.h>
+#include <string>
+
+namespace Socket{
+
+  /// A list of addresses, subnets and host name patterns, as used for host white- and blacklists.
+  /// Addresses and subnets are compiled into a binary radix trie over their IPv6 (or IPv4-mapped) form,
+  /// so matching costs at most 128 steps no matter how long the list is. The compiled form is a flat
+  /// byte string that can be placed in shared memory and matched there directly.
+  class AddrList{
+  public:
+    AddrList(const std::string &list = "");
+    void clear();
+    bool compile(const std::string &list);
+    bool add(const std::string &entry);
+    bool match(const std::string &binAddr) const;
+    bool matchHost(const std::string &hostName) const;
+    bool hasHostNames() const;
+    std::string packed() const;
+    static bool match(const char *packed, size_t len, const std::string &binAddr);
+    static bool matchHost(const char *packed, size_t len, const std::string &hostName);
+    static bool hasHostNames(const char *packed, size_t len);
+
+  private:
+    std::string nodes; ///< Trie nodes of 8 bytes each: the node numbers of the 0 and 1 children
+    std::string names; ///< Newline-separated host name patterns, each prefixed by its match type
+    void addPrefix(const char *binAddr, uint8_t prefixLen);
+    bool addIPv4Prefix(const std::string &prefix);
+    bool addIPv6Prefix(const std::string &prefix);
+  };
+
+}// namespace Socket
@@ -1,10 +1,12 @@
 #include "auth.h"
 #include "bitfields.h"
+#include "checksum.h"
 #include "comms.h"
 #include "defines.h"
 #include "encode.h"
 #include "stream.h"
 #include "procs.h"
+#include "socket.h"
 #include "timing.h"
 #include <fcntl.h>
 #include <string.h>
@@ -73,9 +75,13 @@ namespace Comms{
     pid = dataAccX.getFieldAccX("pid");
   }
 
+  /// \brief Returns the amount of records that need to be looked at.
+  /// Comm pages keep the index after the highest claimed record in the endPos header field,
+  /// so a master only scans the part of the page that was actually used.
   size_t Comms::recordCount() const{
     if (!master){return index + 1;}
-    return dataAccX.getRCount();
+    uint64_t endPos = dataAccX.getEndPos();
+    return (endPos < dataAccX.getRCount()) ? endPos : dataAccX.getRCount();
   }
 
   uint8_t Comms::getStatus() const{return status.uint(index);}
@@ -113,6 +119,23 @@ namespace Comms{
     }while (keepGoing && ++c < 8);
   }
 
+  /// \brief Releases the given record so it can be claimed again.
+  /// Comm pages keep the lowest record that may be free in the deleted header field, so claiming
+  /// does not have to scan past all records in use. Releasing the highest claimed record also
+  /// lowers the endPos high water mark past any unused records below it.
+  void Comms::freeRecord(size_t idx){
+    if (!master){return;}
+    setStatus(COMM_STATUS_INVALID, idx);
+    if (idx < dataAccX.getDeleted()){dataAccX.setDeleted(idx);}
+    if (idx + 1 == dataAccX.getEndPos() && sem){
+      // Claims raise the high water mark while holding the semaphore, so lower it while holding it too
+      IPC::semGuard G(&sem);
+      uint64_t endPos = dataAccX.getEndPos();
+      while (endPos && status.uint(endPos - 1) == COMM_STATUS_INVALID){--endPos;}
+      dataAccX.setEndPos(endPos);
+    }
+  }
+
   Comms::operator bool() const{
     if (master){return dataPage;}
     return dataPage && (getStatus() != COMM_STATUS_INVALID) && !(getStatus() & COMM_STATUS_DISCONNECT);
@@ -159,17 +182,25 @@ namespace Comms{
     fieldAccess();
     if (index == INVALID_RECORD_INDEX || reIssue){
       size_t reqCount = dataAccX.getRCount();
-      for (index = 0; index < reqCount; ++index){
+      // Start looking at the lowest record that may be free, wrapping around in case that hint is outdated
+      size_t firstFree = dataAccX.getDeleted();
+      if (firstFree >= reqCount){firstFree = 0;}
+      bool claimed = false;
+      for (size_t i = 0; i < reqCount && !claimed; ++i){
+        index = (firstFree + i) % reqCount;
         if (getStatus() == COMM_STATUS_INVALID){
           IPC::semGuard G(&sem);
           if (getStatus() != COMM_STATUS_INVALID){continue;}
           nullFields();
           setStatus(COMM_STATUS_ACTIVE);
-          break;
+          dataAccX.setDeleted(index + 1);
+          if (dataAccX.getEndPos() <= index){dataAccX.setEndPos(index + 1);}
+          claimed = true;
         }
       }
-      if (index >= reqCount){
+      if (!claimed){
         FAIL_MSG("Could not register entry on comm page!");
+        index = INVALID_RECORD_INDEX;
         dataPage.close();
       }
     }
@@ -193,7 +224,7 @@ namespace Comms{
     for (size_t i = 0; i < recordCount(); i++){
       if (getStatus(i) == COMM_STATUS_INVALID || (getStatus(i) & COMM_STATUS_DISCONNECT)){continue;}
       if (getSessId(i) == _sid){
-        if (Util::Procs::isRunning(getPid(i))){
+        if (isProcRunning(getPid(i))){
           return true;
         }
       }
@@ -227,6 +258,190 @@ namespace Comms{
     tags.set(_sid, idx);
   }
 
+  // Field sizes of the session request page; longer values are passed on the command line instead
+  static const size_t reqSessIdSize = 80;
+  static const size_t reqStreamSize = 100;
+  static const size_t reqIpSize = 64;
+  static const size_t reqTknSize = 256;
+  static const size_t reqProtocolSize = 64;
+  static const size_t reqUrlSize = 1024;
+
+  /// The records on this page belong to the inputs and outputs that placed a request, not to processes
+  /// started by the tracker, so unlike other comm pages they are never told to stop when the page is removed.
+  SessionRequests::~SessionRequests(){
+    if (!master){return;}
+    if (dataPage.mapped){dataPage.master = true;}
+    sem.unlink();
+    master = false;
+  }
+
+  void SessionRequests::reload(size_t shard, bool _master, bool reIssue){
+    if (!sem){
+      char semName[NAME_BUFFER_SIZE];
+      snprintf(semName, NAME_BUFFER_SIZE, SEM_SESSTRACKER, (unsigned int)shard);
+      if (_master){
+        sem.open(semName, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+      }else{
+        sem.open(semName, O_RDWR, ACCESSPERMS, 1, true);
+      }
+      if (!sem){return;}
+    }
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, COMMS_SESSTRACKER, (unsigned int)shard);
+    Comms::reload(pageName, COMMS_SESSTRACKER_INITSIZE, _master, reIssue);
+  }
+
+  void SessionRequests::addFields(){
+    Comms::addFields();
+    dataAccX.addField("sessid", RAX_STRING, reqSessIdSize);
+    dataAccX.addField("stream", RAX_STRING, reqStreamSize);
+    dataAccX.addField("ip", RAX_STRING, reqIpSize);
+    dataAccX.addField("tkn", RAX_STRING, reqTknSize);
+    dataAccX.addField("protocol", RAX_STRING, reqProtocolSize);
+    dataAccX.addField("requrl", RAX_STRING, reqUrlSize);
+    dataAccX.addField("sessmode", RAX_UINT);
+  }
+
+  void SessionRequests::nullFields(){
+    Comms::nullFields();
+    setSessId("");
+    setStream("");
+    setIp("");
+    setTkn("");
+    setProtocol("");
+    setReqUrl("");
+    setSessMode(0);
+  }
+
+  void SessionRequests::fieldAccess(){
+    Comms::fieldAccess();
+    sessId = dataAccX.getFieldAccX("sessid");
+    stream = dataAccX.getFieldAccX("stream");
+    ip = dataAccX.getFieldAccX("ip");
+    tkn = dataAccX.getFieldAccX("tkn");
+    protocol = dataAccX.getFieldAccX("protocol");
+    reqUrl = dataAccX.getFieldAccX("requrl");
+    sessMode = dataAccX.getFieldAccX("sessmode");
+  }
+
+  /// \brief Marks the request page as closed, so that no new requests are placed on it
+  void SessionRequests::setExit(){
+    if (!master){return;}
+    dataAccX.setExit();
+  }
+
+  /// \brief Returns the PID of the tracker owning this page, or 0 if the page has no tracker record
+  uint32_t SessionRequests::getTrackerPid() const{
+    if (!dataPage.mapped || !(status.uint(0) & COMM_STATUS_SOURCE)){return 0;}
+    return pid.uint(0);
+  }
+
+  std::string SessionRequests::getSessId(size_t idx) const{return (master ? sessId.string(idx) : "");}
+  void SessionRequests::setSessId(const std::string & _sid){sessId.set(_sid, index);}
+  std::string SessionRequests::getStream(size_t idx) const{return (master ? stream.string(idx) : "");}
+  void SessionRequests::setStream(const std::string & _stream){stream.set(_stream, index);}
+  std::string SessionRequests::getIp(size_t idx) const{return (master ? ip.string(idx) : "");}
+  void SessionRequests::setIp(const std::string & _ip){ip.set(_ip, index);}
+  std::string SessionRequests::getTkn(size_t idx) const{return (master ? tkn.string(idx) : "");}
+  void SessionRequests::setTkn(const std::string & _tkn){tkn.set(_tkn, index);}
+  std::string SessionRequests::getProtocol(size_t idx) const{return (master ? protocol.string(idx) : "");}
+  void SessionRequests::setProtocol(const std::string & _protocol){protocol.set(_protocol, index);}
+  std::string SessionRequests::getReqUrl(size_t idx) const{return (master ? reqUrl.string(idx) : "");}
+  void SessionRequests::setReqUrl(const std::string & _reqUrl){reqUrl.set(_reqUrl, index);}
+  uint8_t SessionRequests::getSessMode(size_t idx) const{return (master ? sessMode.uint(idx) : 0);}
+  void SessionRequests::setSessMode(uint8_t _sessMode){sessMode.set(_sessMode, index);}
+
+  /// \brief Returns the session tracker shard responsible for the given session ID
+  size_t sessionShard(const std::string & sessId){
+    return checksum::crc32(0, sessId.data(), sessId.size()) % SESSION_TRACKER_SHARDS;
+  }
+
+  /// \brief Returns the PID of the MistSession tracker currently accepting requests for the given shard, or 0
+  uint32_t sessionTrackerPid(size_t shard){
+    char pageName[NAME_BUFFER_SIZE];
+    snprintf(pageName, NAME_BUFFER_SIZE, COMMS_SESSTRACKER, (unsigned int)shard);
+    IPC::sharedPage page(pageName, 0, false, false);
+    if (!page.mapped){return 0;}
+    Util::RelAccX A(page.mapped, false);
+    if (!A.isReady() || A.isExit() || !(A.getInt("status", 0) & COMM_STATUS_SOURCE)){return 0;}
+    uint32_t trackerPid = A.getInt("pid", 0);
+    return (trackerPid && Util::Procs::isRunning(trackerPid)) ? trackerPid : 0;
+  }
+
+  /// \brief Returns true if a MistSession tracker is currently accepting requests for the given shard
+  bool sessionTrackerRunning(size_t shard){return sessionTrackerPid(shard);}
+
+  /// \brief Hands a new session over to the tracker shard responsible for it.
+  /// The tracker picks up the request as soon as the record is released, which happens when this function returns.
+  /// \return False if no tracker could take the request, in which case the caller should spawn a MistSession itself
+  bool requestSession(const std::string & sessId, const std::string & streamName, const std::string & ip,
+                      const std::string & tkn, const std::string & protocol, const std::string & reqUrl, uint8_t sessMode){
+    if (sessId.size() >= reqSessIdSize || streamName.size() >= reqStreamSize || ip.size() >= reqIpSize ||
+        tkn.size() >= reqTknSize || protocol.size() >= reqProtocolSize || reqUrl.size() >= reqUrlSize){
+      return false;
+    }
+    size_t shard = sessionShard(sessId);
+    if (!sessionTrackerRunning(shard)){return false;}
+    SessionRequests req;
+    req.reload(shard);
+    if (!req){return false;}
+    req.setStream(streamName);
+    req.setIp(ip);
+    req.setTkn(tkn);
+    req.setProtocol(protocol);
+    req.setReqUrl(reqUrl);
+    req.setSessMode(sessMode);
+    req.setSessId(sessId);
+    return true;
+  }
+
+  /// \brief Starts a dedicated MistSession process for the given session
+  void spawnSession(const std::string & sessId, const std::string & streamName, const std::string & ip,
+                    const std::string & tkn, const std::string & protocol, const std::string & reqUrl, uint8_t sessMode){
+    pid_t thisPid;
+    std::deque<std::string> args;
+    args.push_back(Util::getMyPath() + "MistSession");
+    args.push_back(sessId);
+
+    // First bit defines whether to include stream name
+    if (sessMode & 0x08){
+      args.push_back("--streamname");
+      args.push_back(streamName);
+    }else{
+      setenv("SESSION_STREAM", streamName.c_str(), 1);
+    }
+    // Second bit defines whether to include viewer ip
+    if (sessMode & 0x04){
+      args.push_back("--ip");
+      args.push_back(ip);
+    }else{
+      setenv("SESSION_IP", ip.c_str(), 1);
+    }
+    // Third bit defines whether to include tkn
+    if (sessMode & 0x02){
+      args.push_back("--tkn");
+      args.push_back(tkn);
+    }else{
+      setenv("SESSION_TKN", tkn.c_str(), 1);
+    }
+    // Fourth bit defines whether to include protocol
+    if (sessMode & 0x01){
+      args.push_back("--protocol");
+      args.push_back(protocol);
+    }else{
+      setenv("SESSION_PROTOCOL", protocol.c_str(), 1);
+    }
+    setenv("SESSION_REQURL", reqUrl.c_str(), 1);
+    int err = fileno(stderr);
+    thisPid = Util::Procs::StartPiped(args, 0, 0, &err);
+    Util::Procs::forget(thisPid);
+    unsetenv("SESSION_STREAM");
+    unsetenv("SESSION_IP");
+    unsetenv("SESSION_TKN");
+    unsetenv("SESSION_PROTOCOL");
+    unsetenv("SESSION_REQURL");
+  }
+
   Users::Users() : Comms(){}
 
   Users::Users(const Users &rhs) : Comms(){
@@ -311,8 +526,8 @@ namespace Comms{
   }
 
   /// \brief Claims a spot on the connections page for the input/output which calls this function
-  ///        Starts the MistSession binary for each session, which handles the statistics
-  ///         and the USER_NEW and USER_END triggers
+  ///        Hands each new session to a MistSession tracker shard (or a dedicated MistSession process),
+  ///         which handles the statistics and the USER_NEW and USER_END triggers
   /// \param streamName: Name of the stream the input is providing or an output is making available to viewers
   /// \param ip: IP address of the viewer which wants to access streamName. For inputs this value can be set to any value
   /// \param tkn: Session token given by the player or randomly generated
@@ -358,48 +573,10 @@ namespace Comms{
       if (!dataPage){
         std::string host;
         Socket::hostBytesToStr(ip.data(), ip.size(), host);
-        pid_t thisPid;
-        std::deque<std::string> args;
-        args.push_back(Util::getMyPath() + "MistSession");
-        args.push_back(sessionId);
-
-        // First bit defines whether to include stream name
-        if (sessMode & 0x08){
-          args.push_back("--streamname");
-          args.push_back(streamName);
-        }else{
-          setenv("SESSION_STREAM", streamName.c_str(), 1);
+        // Hand the session to its tracker shard, or fall back to a dedicated process if that is not possible
+        if (!requestSession(sessionId, streamName, host, tkn, protocol, reqUrl, sessMode)){
+          spawnSession(sessionId, streamName, host, tkn, protocol, reqUrl, sessMode);
         }
-        // Second bit defines whether to include viewer ip
-        if (sessMode & 0x04){
-          args.push_back("--ip");
-          args.push_back(host);
-        }else{
-          setenv("SESSION_IP", host.c_str(), 1);
-        }
-        // Third bit defines whether to include tkn
-        if (sessMode & 0x02){
-          args.push_back("--tkn");
-          args.push_back(tkn);
-        }else{
-          setenv("SESSION_TKN", tkn.c_str(), 1);
-        }
-        // Fourth bit defines whether to include protocol
-        if (sessMode & 0x01){
-          args.push_back("--protocol");
-          args.push_back(protocol);
-        }else{
-          setenv("SESSION_PROTOCOL", protocol.c_str(), 1);
-        }
-        setenv("SESSION_REQURL", reqUrl.c_str(), 1);
-        int err = fileno(stderr);
-        thisPid = Util::Procs::StartPiped(args, 0, 0, &err);
-        Util::Procs::forget(thisPid);
-        unsetenv("SESSION_STREAM");
-        unsetenv("SESSION_IP");
-        unsetenv("SESSION_TKN");
-        unsetenv("SESSION_PROTOCOL");
-        unsetenv("SESSION_REQURL");
       }
     }
     reload(sessionId, _master, reIssue);
@@ -614,4 +791,222 @@ namespace Comms{
     VERYHIGH_MSG("%s", debugMsg.c_str());
     return Secure::sha256(concat.c_str(), concat.length());
   }
+
+#define STREAM_TOTALS_MAGIC 0x4D535432 // "MST2"
+#define STREAM_TOTALS_NAMELEN 120
+
+  /// Start of the stream totals page, padded to a multiple of 64 bytes
+  struct streamTotalsHeader{
+    uint32_t magic;
+    uint32_t rows;
+    volatile uint32_t used;   ///< Rows that were ever claimed; readers need not look beyond this
+    volatile uint32_t closed; ///< Set by the controller right before removing the page, so writers reopen it
+    char noBandwidth[STREAM_TOTALS_NOBW]; ///< Host ranges whose traffic is not counted, as set by the controller
+    char padding[64 - (16 + STREAM_TOTALS_NOBW) % 64];
+  };
+
+  /// A single row of the stream totals page, padded to a multiple of 64 bytes so that rows never share a cache line.
+  /// The name is only written while the row is not in use; counters are only ever changed atomically.
+  struct streamTotalsRow{
+    volatile uint32_t inUse;
+    volatile uint32_t lastActive; ///< Local boot time in seconds at which anything was last added to this row
+    char name[STREAM_TOTALS_NAMELEN];
+    volatile uint64_t up;
+    volatile uint64_t down;
+    volatile uint64_t pktCount;
+    volatile uint64_t pktLost;
+    volatile uint64_t pktRetrans;
+    volatile uint64_t seconds; ///< Seconds of viewing time
+    uint64_t reserved[2];
+    volatile uint32_t current[STREAM_TOTALS_COLUMNS][4]; ///< Current sessions per writer column and session type
+    char padding[64 - (STREAM_TOTALS_COLUMNS * 16) % 64];
+  };
+
+#define STREAM_TOTALS_SIZE (sizeof(streamTotalsHeader) + STREAM_TOTALS_ROWS * sizeof(streamTotalsRow))
+
+  static inline streamTotalsHeader *totalsHeader(const IPC::sharedPage &page){
+    return (streamTotalsHeader *)page.mapped;
+  }
+
+  static inline streamTotalsRow *totalsRow(const IPC::sharedPage &page, size_t row){
+    return ((streamTotalsRow *)(page.mapped + sizeof(streamTotalsHeader))) + row;
+  }
+
+  StreamTotals::StreamTotals(){master = false;}
+
+  StreamTotals::~StreamTotals(){
+    if (master && dataPage.mapped){totalsHeader(dataPage)->closed = 1;}
+  }
+
+  /// Opens the stream totals page. The master (the controller) creates it if needed and removes it again when
+  /// done, unless setMaster(false) is called first. Writers should reload whenever this object evaluates to false.
+  void StreamTotals::reload(bool _master){
+    master = _master;
+    dataPage.init(SHM_STREAM_TOTALS, 0, false, false);
+    if (dataPage.mapped && (dataPage.len < STREAM_TOTALS_SIZE || totalsHeader(dataPage)->magic != STREAM_TOTALS_MAGIC ||
+                            totalsHeader(dataPage)->closed)){
+      dataPage.close();
+    }
+    if (!dataPage.mapped && master){
+      dataPage.init(SHM_STREAM_TOTALS, STREAM_TOTALS_SIZE, true);
+      if (dataPage.mapped){
+        memset(dataPage.mapped, 0, STREAM_TOTALS_SIZE);
+        totalsHeader(dataPage)->rows = STREAM_TOTALS_ROWS;
+        totalsHeader(dataPage)->magic = STREAM_TOTALS_MAGIC;
+      }
+    }
+    // Keep the totals of a page that survived a controller restart, but remove it on shutdown as usual
+    dataPage.master = master;
+    if (!sem){sem.open(SEM_STREAM_TOTALS, O_CREAT | O_RDWR, ACCESSPERMS, 1);}
+  }
+
+  /// Sets whether the page gets removed when this object is destroyed
+  void StreamTotals::setMaster(bool _master){
+    master = _master;
+    dataPage.master = _master;
+  }
+
+  StreamTotals::operator bool() const{return dataPage.mapped && !totalsHeader(dataPage)->closed;}
+
+  /// Returns the amount of rows readers need to go through
+  size_t StreamTotals::rowCount() const{
+    if (!*this){return 0;}
+    uint32_t used = totalsHeader(dataPage)->used;
+    return used < STREAM_TOTALS_ROWS ? used : STREAM_TOTALS_ROWS;
+  }
+
+  bool StreamTotals::isUsed(size_t row) const{
+    return row < rowCount() && totalsRow(dataPage, row)->inUse;
+  }
+
+  bool StreamTotals::isStream(size_t row, const std::string &streamName) const{
+    if (!isUsed(row) || streamName.size() >= STREAM_TOTALS_NAMELEN){return false;}
+    return !strncmp(totalsRow(dataPage, row)->name, streamName.c_str(), STREAM_TOTALS_NAMELEN);
+  }
+
+  std::string StreamTotals::getStream(size_t row) const{
+    if (!isUsed(row)){return "";}
+    const char *name = totalsRow(dataPage, row)->name;
+    return std::string(name, strnlen(name, STREAM_TOTALS_NAMELEN));
+  }
+
+  /// Returns the row of the given stream, or INVALID_RECORD_INDEX if there is none.
+  /// If create is true, a row is claimed for the stream if needed, reusing the row of a stream that has had no
+  /// sessions for STREAM_TOTALS_RECYCLE seconds once the table is full.
+  size_t StreamTotals::find(const std::string &streamName, bool create){
+    if (!*this || !streamName.size() || streamName.size() >= STREAM_TOTALS_NAMELEN){
+      return INVALID_RECORD_INDEX;
+    }
+    size_t rows = rowCount();
+    for (size_t i = 0; i < rows; ++i){
+      if (isStream(i, streamName)){return i;}
+    }
+    if (!create || !sem){return INVALID_RECORD_INDEX;}
+    IPC::semGuard G(&sem);
+    // Someone else may have claimed a row for this stream in the meantime
+    streamTotalsHeader *H = totalsHeader(dataPage);
+    rows = rowCount();
+    size_t claim = INVALID_RECORD_INDEX;
+    for (size_t i = 0; i < rows; ++i){
+      if (isStream(i, streamName)){return i;}
+      if (claim == INVALID_RECORD_INDEX && !totalsRow(dataPage, i)->inUse){claim = i;}
+    }
+    if (claim == INVALID_RECORD_INDEX && rows < STREAM_TOTALS_ROWS){claim = rows;}
+    uint64_t now = Util::bootSecs();
+    for (size_t i = 0; claim == INVALID_RECORD_INDEX && i < rows; ++i){
+      if (!getCurrent(i) && totalsRow(dataPage, i)->lastActive + STREAM_TOTALS_RECYCLE < now){claim = i;}
+    }
+    if (claim == INVALID_RECORD_INDEX){
+      WARN_MSG("Stream totals table is full, not keeping totals for stream %s", streamName.c_str());
+      return INVALID_RECORD_INDEX;
+    }
+    streamTotalsRow *R = totalsRow(dataPage, claim);
+    R->inUse = 0;
+    __sync_synchronize();
+    memset((void *)R, 0, sizeof(streamTotalsRow));
+    memcpy(R->name, streamName.data(), streamName.size());
+    R->lastActive = now;
+    __sync_synchronize();
+    R->inUse = 1;
+    if (claim >= H->used){H->used = claim + 1;}
+    return claim;
+  }
+
+  /// Atomically adds to the counters of the given row
+  void StreamTotals::add(size_t row, uint64_t _up, uint64_t _down, uint64_t _pktCount, uint64_t _pktLost,
+                         uint64_t _pktRetrans, uint64_t _seconds){
+    if (!isUsed(row)){return;}
+    streamTotalsRow *R = totalsRow(dataPage, row);
+    if (_up){__sync_fetch_and_add(&R->up, _up);}
+    if (_down){__sync_fetch_and_add(&R->down, _down);}
+    if (_pktCount){__sync_fetch_and_add(&R->pktCount, _pktCount);}
+    if (_pktLost){__sync_fetch_and_add(&R->pktLost, _pktLost);}
+    if (_pktRetrans){__sync_fetch_and_add(&R->pktRetrans, _pktRetrans);}
+    if (_seconds){__sync_fetch_and_add(&R->seconds, _seconds);}
+    R->lastActive = Util::bootSecs();
+  }
+
+  uint64_t StreamTotals::getUp(size_t row) const{return isUsed(row) ? totalsRow(dataPage, row)->up : 0;}
+  uint64_t StreamTotals::getDown(size_t row) const{return isUsed(row) ? totalsRow(dataPage, row)->down : 0;}
+  uint64_t StreamTotals::getPacketCount(size_t row) const{
+    return isUsed(row) ? totalsRow(dataPage, row)->pktCount : 0;
+  }
+  uint64_t StreamTotals::getPacketLostCount(size_t row) const{
+    return isUsed(row) ? totalsRow(dataPage, row)->pktLost : 0;
+  }
+  uint64_t StreamTotals::getPacketRetransmitCount(size_t row) const{
+    return isUsed(row) ? totalsRow(dataPage, row)->pktRetrans : 0;
+  }
+  uint64_t StreamTotals::getViewSeconds(size_t row) const{
+    return isUsed(row) ? totalsRow(dataPage, row)->seconds : 0;
+  }
+
+  /// Sets the host ranges whose traffic is not added to the totals, in the binary form Socket::getBinForms
+  /// produces: 16 bytes of address followed by a prefix length, ending with a zero prefix length.
+  void StreamTotals::setNoBandwidth(const char *matches){
+    if (!*this || !memcmp(totalsHeader(dataPage)->noBandwidth, matches, STREAM_TOTALS_NOBW)){return;}
+    IPC::semGuard G(&sem);
+    memcpy(totalsHeader(dataPage)->noBandwidth, matches, STREAM_TOTALS_NOBW);
+  }
+
+  /// Returns false if traffic of the given host, in 16 byte binary form, is not to be added to the totals
+  bool StreamTotals::countsBandwidth(const std::string &host){
+    if (!*this || host.size() != 16){return true;}
+    IPC::semGuard G(&sem);
+    const char *matches = totalsHeader(dataPage)->noBandwidth;
+    for (size_t offset = 0; offset + 17 <= STREAM_TOTALS_NOBW && matches[offset + 16]; offset += 17){
+      if (Socket::matchIPv6Addr(host, std::string(matches + offset, 16), matches[offset + 16])){return false;}
+    }
+    return true;
+  }
+
+  /// Sets the current amount of sessions of the given type in the given column.
+  /// Session types are numbered as in MistSession: viewer, input, output, unspecified.
+  void StreamTotals::setCurrent(size_t row, size_t column, uint8_t sessType, uint32_t count){
+    if (!isUsed(row) || column >= STREAM_TOTALS_COLUMNS || sessType > 3){return;}
+    streamTotalsRow *R = totalsRow(dataPage, row);
+    R->current[column][sessType] = count;
+    if (count){R->lastActive = Util::bootSecs();}
+  }
+
+  /// Sets all current session counts in the given column to zero
+  void StreamTotals::clearCurrent(size_t row, size_t column){
+    if (!isUsed(row) || column >= STREAM_TOTALS_COLUMNS){return;}
+    streamTotalsRow *R = totalsRow(dataPage, row);
+    for (size_t t = 0; t < 4; ++t){R->current[column][t] = 0;}
+  }
+
+  /// Returns the current amount of sessions of the given type, summed over all columns
+  uint64_t StreamTotals::getCurrent(size_t row, uint8_t sessType) const{
+    if (!isUsed(row) || sessType > 3){return 0;}
+    const streamTotalsRow *R = totalsRow(dataPage, row);
+    uint64_t total = 0;
+    for (size_t c = 0; c < STREAM_TOTALS_COLUMNS; ++c){total += R->current[c][sessType];}
+    return total;
+  }
+
+  /// Returns the current amount of sessions of any type
+  uint64_t StreamTotals::getCurrent(size_t row) const{
+    return getCurrent(row, 0) + getCurrent(row, 1) + getCurrent(row, 2) + getCurrent(row, 3);
+  }
 }// namespace Comms
@@ -7,6 +7,7 @@
 #define COMM_STATUS_DONOTTRACK 0x40
 #define COMM_STATUS_DISCONNECT 0x20
 #define COMM_STATUS_REQDISCONNECT 0x10
+#define COMM_STATUS_RETRIGGER 0x8
 #define COMM_STATUS_ACTIVE 0x1
 #define COMM_STATUS_INVALID 0x0
 #define SESS_BUNDLE_DEFAULT_VIEWER 14
@@ -21,15 +22,16 @@
 
 #define COMM_LOOP(comm, onActive, onDisconnect) \
   {\
+    comm.updateProcs();\
     for (size_t id = 0; id < comm.recordCount(); id++){\
       if (comm.getStatus(id) == COMM_STATUS_INVALID){continue;}\
-      if (!(comm.getStatus(id) & COMM_STATUS_DISCONNECT) && comm.getPid(id) && !Util::Procs::isRunning(comm.getPid(id))){\
+      if (!(comm.getStatus(id) & COMM_STATUS_DISCONNECT) && comm.getPid(id) && !comm.isProcRunning(comm.getPid(id))){\
         comm.setStatus(COMM_STATUS_DISCONNECT | comm.getStatus(id), id);\
       }\
       onActive;\
       if (comm.getStatus(id) & COMM_STATUS_DISCONNECT){\
         onDisconnect;\
-        comm.setStatus(COMM_STATUS_INVALID, id);\
+        comm.freeRecord(id);\
       }\
     }\
   }
@@ -66,6 +68,9 @@ namespace Comms{
     void setPid(uint32_t _pid);
     void setPid(uint32_t _pid, size_t idx);
     void finishAll();
+    void freeRecord(size_t idx);
+    void updateProcs(){procs.update();}
+    bool isProcRunning(uint32_t _pid){return procs.isRunning(_pid);}
     void setMaster(bool _master);
     const std::string &pageName() const{return dataPage.name;}
 
@@ -78,6 +83,7 @@ namespace Comms{
     Util::RelAccX dataAccX;
     Util::FieldAccX status;
     Util::FieldAccX pid;
+    Util::ProcWatcher procs;
   };
 
   class Connections : public Comms{
@@ -218,4 +224,90 @@ namespace Comms{
       void setTags(std::string _sid);
       void setTags(std::string _sid, size_t idx);
   };
+
+  /// \brief Page on which inputs and outputs ask a MistSession tracker shard to start tracking a session.
+  /// Requests are filled in by the requesting process and handed over by releasing the record.
+  /// Record 0 is claimed by the tracker itself, so its PID tells whether the shard is running.
+  class SessionRequests : public Comms{
+  public:
+    ~SessionRequests();
+    void reload(size_t shard, bool _master = false, bool reIssue = false);
+    virtual void addFields();
+    virtual void nullFields();
+    virtual void fieldAccess();
+    void setExit();
+    uint32_t getTrackerPid() const;
+
+    std::string getSessId(size_t idx) const;
+    void setSessId(const std::string & _sid);
+    std::string getStream(size_t idx) const;
+    void setStream(const std::string & _stream);
+    std::string getIp(size_t idx) const;
+    void setIp(const std::string & _ip);
+    std::string getTkn(size_t idx) const;
+    void setTkn(const std::string & _tkn);
+    std::string getProtocol(size_t idx) const;
+    void setProtocol(const std::string & _protocol);
+    std::string getReqUrl(size_t idx) const;
+    void setReqUrl(const std::string & _reqUrl);
+    uint8_t getSessMode(size_t idx) const;
+    void setSessMode(uint8_t _sessMode);
+
+  private:
+    Util::FieldAccX sessId;
+    Util::FieldAccX stream;
+    Util::FieldAccX ip;
+    Util::FieldAccX tkn;
+    Util::FieldAccX protocol;
+    Util::FieldAccX reqUrl;
+    Util::FieldAccX sessMode;
+  };
+
+  /// \brief Table of per-stream totals, kept up to date by the session trackers.
+  /// Every stream has one cache line aligned row, holding counters that are only ever added to atomically,
+  /// and the current amount of sessions per type in one column per writer. Each tracker shard writes only its own
+  /// column, so reading the totals of all streams never requires going through the individual sessions. The last
+  /// column holds the sessions of single-session MistSession processes, which the controller fills in.
+  class StreamTotals{
+  public:
+    StreamTotals();
+    ~StreamTotals();
+    void reload(bool _master = false);
+    void setMaster(bool _master);
+    operator bool() const;
+    size_t rowCount() const;
+    bool isUsed(size_t row) const;
+    bool isStream(size_t row, const std::string & streamName) const;
+    std::string getStream(size_t row) const;
+    size_t find(const std::string & streamName, bool create = false);
+
+    void add(size_t row, uint64_t _up, uint64_t _down, uint64_t _pktCount, uint64_t _pktLost,
+             uint64_t _pktRetrans, uint64_t _seconds);
+    uint64_t getUp(size_t row) const;
+    uint64_t getDown(size_t row) const;
+    uint64_t getPacketCount(size_t row) const;
+    uint64_t getPacketLostCount(size_t row) const;
+    uint64_t getPacketRetransmitCount(size_t row) const;
+    uint64_t getViewSeconds(size_t row) const;
+    void setNoBandwidth(const char *matches);
+    bool countsBandwidth(const std::string &host);
+
+    void setCurrent(size_t row, size_t column, uint8_t sessType, uint32_t count);
+    void clearCurrent(size_t row, size_t column);
+    uint64_t getCurrent(size_t row, uint8_t sessType) const;
+    uint64_t getCurrent(size_t row) const;
+
+  private:
+    bool master;
+    IPC::semaphore sem;
+    IPC::sharedPage dataPage;
+  };
+
+  size_t sessionShard(const std::string & sessId);
+  uint32_t sessionTrackerPid(size_t shard);
+  bool sessionTrackerRunning(size_t shard);
+  bool requestSession(const std::string & sessId, const std::string & streamName, const std::string & ip,
+                      const std::string & tkn, const std::string & protocol, const std::string & reqUrl, uint8_t sessMode);
+  void spawnSession(const std::string & sessId, const std::string & streamName, const std::string & ip,
+                    const std::string & tkn, const std::string & protocol, const std::string & reqUrl, uint8_t sessMode);
 }// namespace Comms
@@ -172,6 +172,10 @@ static inline void show_stackframe(){}
 
 // Pages get marked for deletion after X seconds of no one watching
 #define DEFAULT_PAGE_TIMEOUT 15
+// VoD pages viewers keep coming back to stay loaded up to this many times longer
+#define PAGE_TIMEOUT_MAX_FACTOR 8
+// Once a viewer is this percentage of keys into a VoD page, the next page is loaded with priority
+#define PAGE_PRELOAD_PERCENT 50
 
 /// \TODO These values are hardcoded for now, but the dtsc_sizing_test binary can calculate them accurately.
 #define META_META_OFFSET 138
@@ -181,13 +185,13 @@ static inline void show_stackframe(){}
 #define META_TRACK_RECORDSIZE 1893
 
 #define TRACK_TRACK_OFFSET 193
-#define TRACK_TRACK_RECORDSIZE 1049060
+#define TRACK_TRACK_RECORDSIZE 1049076
 
 #define TRACK_FRAGMENT_OFFSET 68
 #define TRACK_FRAGMENT_RECORDSIZE 14
 
-#define TRACK_KEY_OFFSET 90
-#define TRACK_KEY_RECORDSIZE 40
+#define TRACK_KEY_OFFSET 98
+#define TRACK_KEY_RECORDSIZE 48
 
 #define TRACK_PART_OFFSET 60
 #define TRACK_PART_RECORDSIZE 8
@@ -204,6 +208,19 @@ static inline void show_stackframe(){}
 #define COMMS_SESSIONS "MstSession%s"
 #define COMMS_SESSIONS_INITSIZE 8 * 1024 * 1024
 
+#define COMMS_SESSTRACKER "MstSTrk%u" //%u shard number
+#define COMMS_SESSTRACKER_INITSIZE 512 * 1024
+#define SESSION_TRACKER_SHARDS 8 // Amount of MistSession processes tracking all sessions together
+#define SESSION_SHARD_WORKERS 4 // Threads per tracker shard running session setup, triggers and teardown
+#define PROCWATCH_FD_SHARE 4 // Watched processes may hold at most 1/4th of the file descriptor limit in pidfds
+#define PROCWATCH_FD_BACKOFF 5000 // Milliseconds to check processes one by one after running out of file descriptors
+#define SHM_STREAM_TOTALS "MstStrmTot"
+#define SEM_STREAM_TOTALS "/MstStrmTot"
+#define STREAM_TOTALS_ROWS 4096 // Maximum amount of streams in the per-stream totals table
+#define STREAM_TOTALS_COLUMNS (SESSION_TRACKER_SHARDS + 1) // One per tracker shard, plus one the controller fills for single-session processes
+#define STREAM_TOTALS_NOBW 1717 // Size of the list of host ranges whose traffic is not counted in the stream totals
+#define STREAM_TOTALS_RECYCLE 600 // Seconds a row must have been unused before it is given to another stream
+
 #define CUSTOM_VARIABLES_INITSIZE 64 * 1024
 
 #define EXTWRITERS "MstExtWriters"
@@ -212,6 +229,7 @@ static inline void show_stackframe(){}
 
 #define SEM_STATISTICS "/MstStat"
 #define SEM_USERS "/MstUser%s" //%s stream name
+#define SEM_SESSTRACKER "/MstSTrk%u" //%u shard number
 
 #define SHM_TRACK_DATA "MstData%s@%zu_%" PRIu32 //%s stream name, %zu track ID, %PRIu32 page #
 // End new meta
@@ -241,6 +259,14 @@ static inline void show_stackframe(){}
 #define SHM_CAPA "MstCapa"
 #define SHM_PROTO "MstProt"
 #define SHM_PROXY "MstProx"
+#define SHM_HOST_ACL "MstHACL" // Compiled host white- and blacklists
+#define SHM_HOST_NAMES "MstHName" // Reverse DNS results shared by all processes
+#define SEM_HOST_NAMES "/MstHName"
+#define SHM_HOST_NAMES_LEN 4096 * 288 // 4096 cached names of 288 bytes each
+#define SHM_INSTRUMENT "MstInstr" // Pipeline instrumentation totals per binary
+#define SEM_INSTRUMENT "/MstInstr"
+#define HOST_ACL_HARD 0x1      // Host list entry is a hard limit
+#define HOST_ACL_WHITELIST 0x2 // Host list entry is a whitelist
 #define SHM_STATE_LOGS "MstStateLogs"
 #define SHM_STATE_ACCS "MstStateAccs"
 #define SHM_STATE_STREAMS "MstStateStreams"
@@ -268,6 +294,16 @@ static inline void show_stackframe(){}
 #define UDP_API_PORT 4242
 #endif
 
+// Maximum amount of idle keep-alive connections a process keeps open per trigger destination
+#ifndef TRIGGER_POOL_SIZE
+#define TRIGGER_POOL_SIZE 8
+#endif
+
+// Milliseconds to wait for the response to an asynchronous trigger before closing its connection
+#ifndef TRIGGER_POOL_PENDING_MS
+#define TRIGGER_POOL_PENDING_MS 5000
+#endif
+
 
 // The amount of milliseconds a simulated live stream is allowed to be "behind".
 // Setting this value to lower than 2 seconds **WILL** cause stuttering in playback due to buffer negotiation.
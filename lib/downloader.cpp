@@ -2,11 +2,154 @@
 #include "downloader.h"
 #include "encode.h"
 #include "timing.h"
+#include <poll.h>
 
 namespace HTTP{
 
+  /// False before construction and after destruction of connectionPool, since static Downloader
+  /// objects elsewhere may be destroyed after it.
+  static bool poolAlive = false;
+
+  ConnectionPool connectionPool;
+
+  /// Returns true if the response in the given parser allows the connection to be reused
+  static bool allowsKeepAlive(Parser &H){
+    if (H.protocol == "HTTP/1.0"){return false;}
+    std::string connHeader = H.GetHeader("Connection");
+    Util::stringToLower(connHeader);
+    return connHeader != "close";
+  }
+
+  ConnectionPool::ConnectionPool(){
+    reused = 0;
+    connects = 0;
+    expired = 0;
+    stale = 0;
+    poolPid = getpid();
+    poolAlive = true;
+  }
+
+  /// Closes all idle connections, reporting how many handshakes the pool saved
+  ConnectionPool::~ConnectionPool(){
+    poolAlive = false;
+    if (reused || Socket::sslResumed){
+      MEDIUM_MSG("Connection pool: %" PRIu64 " of %" PRIu64 " requests reused a connection, %" PRIu64
+                 " of %" PRIu64 " SSL handshakes resumed a session",
+                 reused, reused + connects, Socket::sslResumed, Socket::sslResumed + Socket::sslHandshakes);
+    }
+    if (poolPid != getpid()){return;}
+    for (std::map<std::string, std::deque<idleConn> >::iterator it = idle.begin(); it != idle.end(); ++it){
+      for (std::deque<idleConn>::iterator c = it->second.begin(); c != it->second.end(); ++c){
+        c->conn->close();
+        delete c->conn;
+      }
+    }
+  }
+
+  /// Closes idle connections that were idle for longer than POOL_IDLE_TIMEOUT seconds.
+  /// poolMutex must be locked when calling this.
+  void ConnectionPool::evict(uint64_t now){
+    if (poolPid != getpid()){
+      // Inherited from a parent process that may still be using them: forget them without closing,
+      // since closing an SSL connection would send a close notification on the parent's behalf.
+      idle.clear();
+      poolPid = getpid();
+      return;
+    }
+    std::map<std::string, std::deque<idleConn> >::iterator it = idle.begin();
+    while (it != idle.end()){
+      while (it->second.size() && it->second.front().since + POOL_IDLE_TIMEOUT < now){
+        it->second.front().conn->close();
+        delete it->second.front().conn;
+        it->second.pop_front();
+        ++expired;
+      }
+      if (!it->second.size()){
+        idle.erase(it++);
+      }else{
+        ++it;
+      }
+    }
+  }
+
+  /// Moves the most recently used idle connection for the given key into conn, if there is one.
+  /// Connections that the other end closed (or sent unexpected data on) while idle are dropped.
+  /// Returns true if conn now holds a connection ready for a new request.
+  bool ConnectionPool::take(const std::string &key, Socket::Connection &conn){
+    if (!poolAlive){return false;}
+    tthread::lock_guard<tthread::mutex> guard(poolMutex);
+    evict(Util::bootSecs());
+    std::map<std::string, std::deque<idleConn> >::iterator it = idle.find(key);
+    while (it != idle.end() && it->second.size()){
+      Socket::Connection *c = it->second.back().conn;
+      it->second.pop_back();
+      // An idle connection should never be readable: that means it was closed, or is out of sync
+      struct pollfd pfd;
+      pfd.fd = c->getSocket();
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (!*c || poll(&pfd, 1, 0) != 0){
+        c->close();
+        delete c;
+        ++stale;
+        continue;
+      }
+      conn.swap(*c);
+      delete c;
+      ++reused;
+      HIGH_MSG("Reusing pooled connection to %s", key.c_str());
+      return true;
+    }
+    return false;
+  }
+
+  /// Moves the given idle connection into the pool, leaving conn disconnected.
+  /// Connections over the POOL_MAX_PER_HOST limit close the longest idle one for that key.
+  void ConnectionPool::give(const std::string &key, Socket::Connection &conn){
+    if (!conn || !poolAlive){return;}
+    idleConn c;
+    c.conn = new Socket::Connection();
+    c.conn->swap(conn);
+    c.since = Util::bootSecs();
+    tthread::lock_guard<tthread::mutex> guard(poolMutex);
+    evict(c.since);
+    std::deque<idleConn> &list = idle[key];
+    list.push_back(c);
+    while (list.size() > POOL_MAX_PER_HOST){
+      list.front().conn->close();
+      delete list.front().conn;
+      list.pop_front();
+      ++expired;
+    }
+  }
+
+  /// Counts a new connection made because no idle one was available for the given key
+  void ConnectionPool::opened(const std::string &key){
+    if (!poolAlive){return;}
+    tthread::lock_guard<tthread::mutex> guard(poolMutex);
+    ++connects;
+  }
+
+  /// Fills the given JSON object with the pool counters and the amount of idle connections
+  void ConnectionPool::getStats(JSON::Value &ret){
+    tthread::lock_guard<tthread::mutex> guard(poolMutex);
+    ret["reused"] = reused;
+    ret["connects"] = connects;
+    ret["expired"] = expired;
+    ret["stale"] = stale;
+    ret["ssl_handshakes"] = Socket::sslHandshakes;
+    ret["ssl_resumed"] = Socket::sslResumed;
+    uint64_t idleCount = 0;
+    for (std::map<std::string, std::deque<idleConn> >::iterator it = idle.begin(); it != idle.end(); ++it){
+      idleCount += it->second.size();
+    }
+    ret["idle"] = idleCount;
+  }
+
   Downloader::Downloader(){
     progressCallback = 0;
+    isComplete = false;
+    reusable = false;
     connectedPort = 0;
     dataTimeout = 5;
     retryCount = 5;
@@ -73,10 +216,23 @@ namespace HTTP{
 
   void Downloader::clean(){
     H.headerOnly = false;
+    releaseSocket();
     H.Clean();
+    extraHeaders.clear();
+  }
+
+  /// Hands the connection to the connection pool if the last response allowed keeping it alive and
+  /// nothing is left unread, or closes it otherwise.
+  /// Overridden sockets are never pooled, since they are not ours to give away.
+  void Downloader::releaseSocket(){
+    if (!sPtr && reusable && S && !S.Received().size() && connectedHost.size()){
+      connectionPool.give(std::string(ssl ? "https://" : "http://") + connectedHost + ":" +
+                              JSON::Value(connectedPort).asString(),
+                          S);
+    }
+    reusable = false;
     getSocket().close();
     getSocket().Received().clear();
-    extraHeaders.clear();
   }
 
   ///Sets an override to use the given socket
@@ -84,39 +240,51 @@ namespace HTTP{
     sPtr = socketPtr;
   }
 
-  Downloader::~Downloader(){S.close();}
+  Downloader::~Downloader(){
+    if (!sPtr){releaseSocket();}
+    S.close();
+  }
 
   /// Prepares a request for the given URL, does not send anything
   void Downloader::prepareRequest(const HTTP::URL &link, const std::string &method){
     if (!canRequest(link)){return;}
     bool needSSL = (link.protocol == "https" || link.protocol == "wss");
-    H.Clean();
-    // Reconnect if needed
+    // Reconnect if needed, preferably through an idle pooled connection
     if (!proxied || needSSL){
       if (!getSocket() || link.host != connectedHost || link.getPort() != connectedPort || needSSL != ssl){
-        getSocket().close();
-        getSocket().Received().clear();
+        releaseSocket();
         connectedHost = link.host;
         connectedPort = link.getPort();
+        std::string poolKey = std::string(needSSL ? "https://" : "http://") + connectedHost + ":" +
+                              JSON::Value(connectedPort).asString();
+        if (sPtr || !connectionPool.take(poolKey, S)){
 #ifdef SSL
-        if (needSSL){
-          getSocket().open(connectedHost, connectedPort, true, true);
-        }else{
-          getSocket().open(connectedHost, connectedPort, true);
-        }
+          if (needSSL){
+            getSocket().open(connectedHost, connectedPort, true, true);
+          }else{
+            getSocket().open(connectedHost, connectedPort, true);
+          }
 #else
-        getSocket().open(connectedHost, connectedPort, true);
+          getSocket().open(connectedHost, connectedPort, true);
 #endif
+          if (getSocket()){connectionPool.opened(poolKey);}
+        }
       }
     }else{
       if (!getSocket() || proxyUrl.host != connectedHost || proxyUrl.getPort() != connectedPort || needSSL != ssl){
-        getSocket().close();
-        getSocket().Received().clear();
+        releaseSocket();
         connectedHost = proxyUrl.host;
         connectedPort = proxyUrl.getPort();
-        getSocket().open(connectedHost, connectedPort, true);
+        std::string poolKey = "http://" + connectedHost + ":" + JSON::Value(connectedPort).asString();
+        if (sPtr || !connectionPool.take(poolKey, S)){
+          getSocket().open(connectedHost, connectedPort, true);
+          if (getSocket()){connectionPool.opened(poolKey);}
+        }
       }
     }
+    // Whatever happens next, the previous response is no longer a reason to keep this connection
+    reusable = false;
+    H.Clean();
     ssl = needSSL;
     if (!getSocket()){
       H.method = getSocket().getError();
@@ -226,6 +394,7 @@ namespace HTTP{
           }
 
           if (H.protocol == "HTTP/1.0"){getSocket().close();}
+          reusable = allowsKeepAlive(H);
 
           H.headerOnly = false;
           return true; // Success!
@@ -407,6 +576,7 @@ namespace HTTP{
         }
 
         isComplete = true; // Success
+        reusable = allowsKeepAlive(H);
         return true;
       }
     }
@@ -491,6 +661,7 @@ namespace HTTP{
               return post(link, payload, payloadLen, sync, --maxRecursiveDepth);
             }
           }
+          reusable = allowsKeepAlive(H);
           return true; // Success!
         }
         // reset the data timeout
@@ -1,9 +1,48 @@
+#pragma once
 #include "http_parser.h"
+#include "json.h"
 #include "socket.h"
+#include "tinythread.h"
 #include "url.h"
 #include "util.h"
+#include <deque>
+#include <map>
+
+/// Seconds an idle pooled connection is kept before it is closed
+#define POOL_IDLE_TIMEOUT 10
+/// Maximum amount of idle connections kept per scheme/host/port
+#define POOL_MAX_PER_HOST 4
 
 namespace HTTP{
+
+  /// Process-wide pool of idle keep-alive connections, keyed by scheme, host and port.
+  /// Downloaders hand their connection to the pool when they are done with it, and take an idle one
+  /// from the pool instead of connecting when they need a new one. Thread-safe.
+  class ConnectionPool{
+  public:
+    ConnectionPool();
+    ~ConnectionPool();
+    bool take(const std::string &key, Socket::Connection &conn);
+    void give(const std::string &key, Socket::Connection &conn);
+    void opened(const std::string &key);
+    void getStats(JSON::Value &ret);
+
+  private:
+    void evict(uint64_t now);
+    struct idleConn{
+      Socket::Connection *conn;
+      uint64_t since;
+    };
+    std::map<std::string, std::deque<idleConn> > idle; ///< Idle connections, most recent at the back
+    tthread::mutex poolMutex;
+    pid_t poolPid;    ///< Process that owns the idle connections
+    uint64_t reused;  ///< Requests that took an idle connection instead of connecting
+    uint64_t connects; ///< New connections made by downloaders
+    uint64_t expired; ///< Idle connections closed for being idle too long or over the host limit
+    uint64_t stale;   ///< Idle connections closed because the other end closed them
+  };
+
+  extern ConnectionPool connectionPool;
   class Downloader{
   public:
     Downloader();
@@ -53,6 +92,8 @@ namespace HTTP{
 
   private:
     bool isComplete;
+    bool reusable; ///< True if the last response completed and allows the connection to be reused
+    void releaseSocket();
     std::map<std::string, std::string> extraHeaders; ///< Holds extra headers to sent with request
     std::string connectedHost;                       ///< Currently connected host name
     uint32_t connectedPort;                          ///< Currently connected port number
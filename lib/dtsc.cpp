@@ -4,6 +4,7 @@
 #include "bitfields.h"
 #include "defines.h"
 #include "dtsc.h"
+#include "checksum.h"
 #include "encode.h"
 #include "lib/shared_memory.h"
 #include "lib/util.h"
@@ -18,6 +19,7 @@ namespace DTSC{
   char Magic_Packet[] = "DTPD";
   char Magic_Packet2[] = "DTP2";
   char Magic_Command[] = "DTCM";
+  char Magic_Image[] = "DTSI";
 
   /// If non-zero, this variable will override any live jitter value calculations with the set value
   uint64_t veryUglyJitterOverride = 0;
@@ -74,6 +76,28 @@ namespace DTSC{
     }
   }
 
+  /// Exchanges the contents of this packet with those of another packet, without copying any data.
+  void Packet::swap(Packet &rhs){
+    bool tmpMaster = master;
+    packType tmpVersion = version;
+    char *tmpData = data;
+    uint32_t tmpBufferLen = bufferLen;
+    uint32_t tmpDataLen = dataLen;
+    uint64_t tmpPrevNalSize = prevNalSize;
+    master = rhs.master;
+    version = rhs.version;
+    data = rhs.data;
+    bufferLen = rhs.bufferLen;
+    dataLen = rhs.dataLen;
+    prevNalSize = rhs.prevNalSize;
+    rhs.master = tmpMaster;
+    rhs.version = tmpVersion;
+    rhs.data = tmpData;
+    rhs.bufferLen = tmpBufferLen;
+    rhs.dataLen = tmpDataLen;
+    rhs.prevNalSize = tmpPrevNalSize;
+  }
+
   /// Returns true if the packet is deemed valid, false otherwise.
   /// Valid packets have a length of at least 8, known header type, and length equal to the length
   /// set in the header.
@@ -953,6 +977,11 @@ namespace DTSC{
     inFile.read(scanBuf, fileSize);
 
     inFile.close();
+    if (isImage(scanBuf, fileSize)){
+      fromImage(_streamName, scanBuf, fileSize);
+      free(scanBuf);
+      return;
+    }
     DTSC::Packet pkt(scanBuf, fileSize, true);
     reInit(_streamName, pkt.getScan());
     free(scanBuf);
@@ -1232,47 +1261,54 @@ namespace DTSC{
 
       Track &t = tracks[i];
       t.track = Util::RelAccX(p.mapped, true);
-      t.parts = Util::RelAccX(t.track.getPointer("parts"), true);
-      t.keys = Util::RelAccX(t.track.getPointer("keys"), true);
-      t.fragments = Util::RelAccX(t.track.getPointer("fragments"), true);
-      t.pages = Util::RelAccX(t.track.getPointer("pages"), true);
-
-      t.trackIdField = t.track.getFieldData("id");
-      t.trackTypeField = t.track.getFieldData("type");
-      t.trackCodecField = t.track.getFieldData("codec");
-      t.trackFirstmsField = t.track.getFieldData("firstms");
-      t.trackLastmsField = t.track.getFieldData("lastms");
-      t.trackBpsField = t.track.getFieldData("bps");
-      t.trackMaxbpsField = t.track.getFieldData("maxbps");
-      t.trackLangField = t.track.getFieldData("lang");
-      t.trackInitField = t.track.getFieldData("init");
-      t.trackRateField = t.track.getFieldData("rate");
-      t.trackSizeField = t.track.getFieldData("size");
-      t.trackChannelsField = t.track.getFieldData("channels");
-      t.trackWidthField = t.track.getFieldData("width");
-      t.trackHeightField = t.track.getFieldData("height");
-      t.trackFpksField = t.track.getFieldData("fpks");
-      t.trackMissedFragsField = t.track.getFieldData("missedFrags");
-
-      t.partSizeField = t.parts.getFieldData("size");
-      t.partDurationField = t.parts.getFieldData("duration");
-      t.partOffsetField = t.parts.getFieldData("offset");
-
-      t.keyFirstPartField = t.keys.getFieldData("firstpart");
-      t.keyBposField = t.keys.getFieldData("bpos");
-      t.keyDurationField = t.keys.getFieldData("duration");
-      t.keyNumberField = t.keys.getFieldData("number");
-      t.keyPartsField = t.keys.getFieldData("parts");
-      t.keyTimeField = t.keys.getFieldData("time");
-      t.keySizeField = t.keys.getFieldData("size");
-
-      t.fragmentDurationField = t.fragments.getFieldData("duration");
-      t.fragmentKeysField = t.fragments.getFieldData("keys");
-      t.fragmentFirstKeyField = t.fragments.getFieldData("firstkey");
-      t.fragmentSizeField = t.fragments.getFieldData("size");
+      initTrackFields(t);
     }
   }
 
+  /// Sets up the nested accessors and field data members of the given track, whose track page must
+  /// already be set and fully initialized.
+  void Meta::initTrackFields(Track &t){
+    t.parts = Util::RelAccX(t.track.getPointer("parts"), true);
+    t.keys = Util::RelAccX(t.track.getPointer("keys"), true);
+    t.fragments = Util::RelAccX(t.track.getPointer("fragments"), true);
+    t.pages = Util::RelAccX(t.track.getPointer("pages"), true);
+
+    t.trackIdField = t.track.getFieldData("id");
+    t.trackTypeField = t.track.getFieldData("type");
+    t.trackCodecField = t.track.getFieldData("codec");
+    t.trackFirstmsField = t.track.getFieldData("firstms");
+    t.trackLastmsField = t.track.getFieldData("lastms");
+    t.trackBpsField = t.track.getFieldData("bps");
+    t.trackMaxbpsField = t.track.getFieldData("maxbps");
+    t.trackLangField = t.track.getFieldData("lang");
+    t.trackInitField = t.track.getFieldData("init");
+    t.trackRateField = t.track.getFieldData("rate");
+    t.trackSizeField = t.track.getFieldData("size");
+    t.trackChannelsField = t.track.getFieldData("channels");
+    t.trackWidthField = t.track.getFieldData("width");
+    t.trackHeightField = t.track.getFieldData("height");
+    t.trackFpksField = t.track.getFieldData("fpks");
+    t.trackMissedFragsField = t.track.getFieldData("missedFrags");
+
+    t.partSizeField = t.parts.getFieldData("size");
+    t.partDurationField = t.parts.getFieldData("duration");
+    t.partOffsetField = t.parts.getFieldData("offset");
+
+    t.keyFirstPartField = t.keys.getFieldData("firstpart");
+    t.keyBposField = t.keys.getFieldData("bpos");
+    t.keyDurationField = t.keys.getFieldData("duration");
+    t.keyNumberField = t.keys.getFieldData("number");
+    t.keyPartsField = t.keys.getFieldData("parts");
+    t.keyTimeField = t.keys.getFieldData("time");
+    t.keySizeField = t.keys.getFieldData("size");
+    t.keyIngestField = t.keys.getFieldData("ingest");
+
+    t.fragmentDurationField = t.fragments.getFieldData("duration");
+    t.fragmentKeysField = t.fragments.getFieldData("keys");
+    t.fragmentFirstKeyField = t.fragments.getFieldData("firstkey");
+    t.fragmentSizeField = t.fragments.getFieldData("size");
+  }
+
   /// Reloads shared memory pages that are marked as needing an update, if any
   /// Returns true if a reload happened
   bool Meta::reloadReplacedPagesIfNeeded(){
@@ -1354,6 +1390,7 @@ namespace DTSC{
         t.keyPartsField = t.keys.getFieldData("parts");
         t.keyTimeField = t.keys.getFieldData("time");
         t.keySizeField = t.keys.getFieldData("size");
+        t.keyIngestField = t.keys.getFieldData("ingest");
 
         t.fragmentDurationField = t.fragments.getFieldData("duration");
         t.fragmentKeysField = t.fragments.getFieldData("keys");
@@ -1586,6 +1623,7 @@ namespace DTSC{
     Util::FieldAccX origKeyPartsAccX = origKeys.getFieldAccX("parts");
     Util::FieldAccX origKeyTimeAccX = origKeys.getFieldAccX("time");
     Util::FieldAccX origKeySizeAccX = origKeys.getFieldAccX("size");
+    Util::FieldAccX origKeyIngestAccX = origKeys.getFieldAccX("ingest");
 
     Util::FieldAccX keyFirstpartAccX = t.keys.getFieldAccX("firstpart");
     Util::FieldAccX keyBposAccX = t.keys.getFieldAccX("bpos");
@@ -1594,6 +1632,7 @@ namespace DTSC{
     Util::FieldAccX keyPartsAccX = t.keys.getFieldAccX("parts");
     Util::FieldAccX keyTimeAccX = t.keys.getFieldAccX("time");
     Util::FieldAccX keySizeAccX = t.keys.getFieldAccX("size");
+    Util::FieldAccX keyIngestAccX = t.keys.getFieldAccX("ingest");
 
     size_t firstKey = origKeys.getStartPos();
     size_t endKey = origKeys.getEndPos();
@@ -1605,6 +1644,7 @@ namespace DTSC{
       keyPartsAccX.set(origKeyPartsAccX.uint(i), i);
       keyTimeAccX.set(origKeyTimeAccX.uint(i), i);
       keySizeAccX.set(origKeySizeAccX.uint(i), i);
+      keyIngestAccX.set(origKeyIngestAccX.uint(i), i);
     }
 
     t.fragments.setEndPos(origFragments.getEndPos());
@@ -1790,6 +1830,7 @@ namespace DTSC{
     t.keys.addField("parts", RAX_32UINT);
     t.keys.addField("time", RAX_64UINT);
     t.keys.addField("size", RAX_32UINT);
+    t.keys.addField("ingest", RAX_64UINT);
     t.keys.setRCount(keyCount);
     t.keys.setReady();
 
@@ -1829,6 +1870,7 @@ namespace DTSC{
     t.keyPartsField = t.keys.getFieldData("parts");
     t.keyTimeField = t.keys.getFieldData("time");
     t.keySizeField = t.keys.getFieldData("size");
+    t.keyIngestField = t.keys.getFieldData("ingest");
 
     t.fragmentDurationField = t.fragments.getFieldData("duration");
     t.fragmentKeysField = t.fragments.getFieldData("keys");
@@ -2137,6 +2179,19 @@ namespace DTSC{
   }
   int64_t Meta::getUTCOffset() const{return stream.getInt(streamUTCOffsetField);}
 
+  /// Returns the unix time in milliseconds at which the packet with the given timestamp was buffered, or 0 if
+  /// unknown. Only the first packet of every key is stamped; later packets are assumed to have arrived in real
+  /// time after it.
+  uint64_t Meta::getIngestTime(size_t trackIdx, uint64_t time) const{
+    size_t keyNum = getKeyNumForTime(trackIdx, time);
+    if (keyNum == INVALID_KEY_NUM){return 0;}
+    const Track &t = tracks.at(trackIdx);
+    uint64_t ingest = t.keys.getInt(t.keyIngestField, keyNum);
+    uint64_t keyTime = t.keys.getInt(t.keyTimeField, keyNum);
+    if (!ingest || time < keyTime){return ingest;}
+    return ingest + time - keyTime;
+  }
+
   /*LTS-START*/
   void Meta::setMinimumFragmentDuration(uint64_t fragmentDuration){
     stream.setInt(streamMinimumFragmentDurationField, fragmentDuration);
@@ -2353,7 +2408,8 @@ namespace DTSC{
   void Meta::update(uint64_t packTime, int64_t packOffset, uint32_t packTrack, uint64_t packDataSize,
                     uint64_t packBytePos, bool isKeyframe, uint64_t packSendSize){
     ///\todo warning Re-Implement Ivec
-    if (getLive()){
+    bool isLive = getLive();
+    if (isLive){
       static std::map<size_t, jitterTimer> theJitters;
       setMinKeepAway(packTrack, theJitters[packTrack].addPack(packTime));
     }
@@ -2424,6 +2480,8 @@ namespace DTSC{
       t.keys.setInt(t.keyPartsField, 0, newKeyNum);
       t.keys.setInt(t.keyDurationField, 0, newKeyNum);
       t.keys.setInt(t.keySizeField, 0, newKeyNum);
+      // Live keys remember when they were buffered, so outputs can tell how long ago their packets came in
+      t.keys.setInt(t.keyIngestField, isLive ? Util::unixMS() : 0, newKeyNum);
       t.keys.setInt(t.keyNumberField, newKeyNum, newKeyNum);
       if (newKeyNum){
         t.keys.setInt(t.keyFirstPartField,
@@ -2772,6 +2830,224 @@ namespace DTSC{
     }
   }
 
+  /// Returns a checksum of the memory layout of a freshly initialized track page.
+  /// Images of track pages are only valid for binaries that share the same layout, and this value
+  /// changes whenever a field is added, removed or resized, or the byte order differs.
+  static uint32_t imageLayout(){
+    static uint32_t layout = 0;
+    if (layout){return layout;}
+    size_t pageSize = TRACK_TRACK_OFFSET + TRACK_TRACK_RECORDSIZE + TRACK_FRAGMENT_OFFSET +
+                      TRACK_FRAGMENT_RECORDSIZE + TRACK_KEY_OFFSET + TRACK_KEY_RECORDSIZE +
+                      TRACK_PART_OFFSET + TRACK_PART_RECORDSIZE + TRACK_PAGE_OFFSET + TRACK_PAGE_RECORDSIZE;
+    char *buf = (char *)calloc(pageSize, 1);
+    Meta tmpMeta;
+    Track t;
+    t.track = Util::RelAccX(buf, false);
+    tmpMeta.initializeTrack(t, 1, 1, 1, 1);
+    t.track.setReady();
+    layout = checksum::crc32(DTSH_VERSION, buf, pageSize);
+    free(buf);
+    return layout;
+  }
+
+  /// Returns true if the given data starts with a DTSH image, as written by toImage().
+  bool Meta::isImage(const char *data, size_t len){
+    return len >= DTSH_IMAGE_HEADER && !memcmp(data, Magic_Image, 4);
+  }
+
+  /// Writes the current Meta object to the given URI as a DTSH image.
+  /// Unlike toFile(), the track pages are written as a direct image of their memory layout, so that
+  /// fromImage() can copy them back into place without parsing. Runs of DTSH_IMAGE_CHUNK zero bytes
+  /// (mostly unused init data and unused record space) are left out of the file.
+  /// Layout, with all integers in network byte order:
+  ///     4 bytes magic "DTSI"
+  ///     4 bytes DTSH_VERSION
+  ///     4 bytes track page layout checksum
+  ///     1 byte vod flag, 1 byte live flag
+  ///     8 bytes unix time in milliseconds at stream time zero
+  ///     4 bytes track count
+  ///     4 bytes inputLocalVars length, followed by inputLocalVars as JSON string
+  ///     per track:
+  ///       4 bytes page size, 4 bytes chunk count
+  ///       per chunk: 4 bytes offset, 4 bytes length, followed by length bytes of page data
+  void Meta::toImage(const std::string &uri) const{
+    int outFd = -1;
+    if (!Util::externalWriter(uri, outFd, false)){return;}
+    Socket::Connection outFile(outFd, -1);
+    if (!outFile){return;}
+    std::set<size_t> validTracks = getValidTracks();
+    std::string lVars;
+    if (inputLocalVars.size()){lVars = inputLocalVars.toString();}
+
+    outFile.SendNow(Magic_Image, 4);
+    outFile.SendNow(c32(DTSH_VERSION), 4);
+    outFile.SendNow(c32(imageLayout()), 4);
+    outFile.SendNow(std::string(1, (char)(getVod() ? 1 : 0)));
+    outFile.SendNow(std::string(1, (char)(getLive() ? 1 : 0)));
+    outFile.SendNow(c64(Util::unixMS() - Util::bootMS() + getBootMsOffset()), 8);
+    outFile.SendNow(c32(validTracks.size()), 4);
+    outFile.SendNow(c32(lVars.size()), 4);
+    outFile.SendNow(lVars);
+
+    for (std::set<size_t>::iterator it = validTracks.begin(); it != validTracks.end(); ++it){
+      const char *page = 0;
+      size_t pageSize = 0;
+      if (isMemBuf){
+        page = tMemBuf.at(*it);
+        pageSize = sizeMemBuf.at(*it);
+      }else{
+        page = tM.at(*it).mapped;
+        pageSize = tM.at(*it).len;
+      }
+      // Find the non-zero chunks first, so we know how many there are
+      std::deque<std::pair<size_t, size_t> > chunks;
+      for (size_t pos = 0; pos < pageSize; pos += DTSH_IMAGE_CHUNK){
+        size_t len = pageSize - pos;
+        if (len > DTSH_IMAGE_CHUNK){len = DTSH_IMAGE_CHUNK;}
+        bool zero = true;
+        for (size_t i = 0; i < len && zero; ++i){
+          if (page[pos + i]){zero = false;}
+        }
+        if (zero){continue;}
+        if (chunks.size() && chunks.back().first + chunks.back().second == pos){
+          chunks.back().second += len;
+        }else{
+          chunks.push_back(std::pair<size_t, size_t>(pos, len));
+        }
+      }
+      outFile.SendNow(c32(pageSize), 4);
+      outFile.SendNow(c32(chunks.size()), 4);
+      for (std::deque<std::pair<size_t, size_t> >::iterator cIt = chunks.begin(); cIt != chunks.end(); ++cIt){
+        outFile.SendNow(c32(cIt->first), 4);
+        outFile.SendNow(c32(cIt->second), 4);
+        outFile.SendNow(page + cIt->first, cIt->second);
+      }
+    }
+    outFile.close();
+  }
+
+  /// Calls clear(), then initializes from the given DTSH image in master mode, copying each track
+  /// page into place as-is.
+  /// If stream name is set, uses shared memory backing.
+  /// If stream name is empty, uses non-shared memory backing.
+  /// Returns false if the image is invalid, truncated, or was written with a different version or
+  /// memory layout; the object is then cleared and the header needs to be regenerated.
+  bool Meta::fromImage(const std::string &_streamName, const char *data, size_t len){
+    clear();
+    if (!isImage(data, len)){return false;}
+    if (Bit::btohl(data + 4) != DTSH_VERSION || Bit::btohl(data + 8) != imageLayout()){
+      INFO_MSG("DTSH image was written with a different version or memory layout");
+      return false;
+    }
+    size_t trackCount = Bit::btohl(data + 22);
+    size_t lVarSize = Bit::btohl(data + 26);
+    if (DTSH_IMAGE_HEADER + lVarSize > len){return false;}
+
+    if (_streamName == ""){
+      sBufMem();
+    }else{
+      sBufShm(_streamName, DEFAULT_TRACK_COUNT, true);
+    }
+    streamInit();
+    version = DTSH_VERSION;
+    setVod(data[12]);
+    setLive(data[13]);
+    setBootMsOffset(Bit::btohll(data + 14) - Util::unixMS() + Util::bootMS());
+    if (lVarSize){inputLocalVars = JSON::fromString(data + DTSH_IMAGE_HEADER, lVarSize);}
+
+    size_t pos = DTSH_IMAGE_HEADER + lVarSize;
+    for (size_t i = 0; i < trackCount; ++i){
+      if (pos + 8 > len){
+        FAIL_MSG("DTSH image is truncated");
+        clear();
+        return false;
+      }
+      size_t pageSize = Bit::btohl(data + pos);
+      size_t chunkCount = Bit::btohl(data + pos + 4);
+      pos += 8;
+      // Verify all chunks before touching any memory
+      size_t chunkPos = pos;
+      size_t c = 0;
+      if (pageSize >= TRACK_TRACK_OFFSET && pageSize <= DTSH_IMAGE_MAX_PAGE){
+        for (; c < chunkCount; ++c){
+          if (chunkPos + 8 > len){break;}
+          size_t cOffset = Bit::btohl(data + chunkPos);
+          size_t cLen = Bit::btohl(data + chunkPos + 4);
+          if (cOffset + cLen > pageSize || chunkPos + 8 + cLen > len){break;}
+          chunkPos += 8 + cLen;
+        }
+      }
+      if (c != chunkCount || chunkPos > len || pageSize < TRACK_TRACK_OFFSET || pageSize > DTSH_IMAGE_MAX_PAGE){
+        FAIL_MSG("DTSH image is truncated or corrupt");
+        clear();
+        return false;
+      }
+
+      char pageName[NAME_BUFFER_SIZE];
+      IPC::semaphore trackLock;
+      if (!isMemBuf){
+        snprintf(pageName, NAME_BUFFER_SIZE, SEM_TRACKLIST, streamName.c_str());
+        trackLock.open(pageName, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+        if (!trackLock){
+          FAIL_MSG("Could not open semaphore to add track!");
+          clear();
+          return false;
+        }
+        trackLock.wait();
+      }
+      size_t tNumber = trackList.getPresent();
+      snprintf(pageName, NAME_BUFFER_SIZE, SHM_STREAM_TM, streamName.c_str(), getpid(), tNumber);
+      char *page = 0;
+      if (isMemBuf){
+        page = (char *)calloc(pageSize, 1);
+        tMemBuf[tNumber] = page;
+        sizeMemBuf[tNumber] = pageSize;
+      }else{
+        tM[tNumber].init(pageName, pageSize, true);
+        tM[tNumber].master = false;
+        page = tM[tNumber].mapped;
+      }
+      if (!page){
+        if (!isMemBuf){trackLock.post();}
+        FAIL_MSG("Could not allocate %zu bytes for track %zu", pageSize, tNumber);
+        clear();
+        return false;
+      }
+      for (c = 0; c < chunkCount; ++c){
+        size_t cOffset = Bit::btohl(data + pos);
+        size_t cLen = Bit::btohl(data + pos + 4);
+        if (pos + 8 + cLen > len || cOffset + cLen > pageSize){break;}
+        memcpy(page + cOffset, data + pos + 8, cLen);
+        pos += 8 + cLen;
+      }
+      if (c != chunkCount){
+        if (!isMemBuf){trackLock.post();}
+        FAIL_MSG("DTSH image is truncated or corrupt");
+        clear();
+        return false;
+      }
+      Track &t = tracks[tNumber];
+      t.track = Util::RelAccX(page, false);
+      initTrackFields(t);
+      // Data pages are specific to the running input; they are set up again by parseHeader
+      t.pages.setDeleted(0);
+      t.pages.setStartPos(0);
+      t.pages.setEndPos(0);
+      t.pages.setPresent(0);
+      // The track list mirrors a few track properties for quick access
+      trackList.setInt(trackIdField, t.track.getInt(t.trackIdField), tNumber);
+      trackList.setString(trackTypeField, t.track.getPointer(t.trackTypeField), tNumber);
+      trackList.setString(trackCodecField, t.track.getPointer(t.trackCodecField), tNumber);
+      trackList.setString(trackPageField, pageName, tNumber);
+      trackList.setInt(trackPidField, getpid(), tNumber);
+      trackList.setInt(trackSourceTidField, INVALID_TRACK_ID, tNumber);
+      trackList.addRecords(1);
+      validateTrack(tNumber, trackValidDefault);
+      if (!isMemBuf){trackLock.post();}
+    }
+    return true;
+  }
+
   /// Sends the current Meta object through a socket in DTSH format
   void Meta::send(Socket::Connection &conn, bool skipDynamic, std::set<size_t> selectedTracks, bool reID) const{
     std::string lVars;
@@ -3309,6 +3585,7 @@ namespace DTSC{
     partsField = cKeys.getFieldData("parts");
     timeField = cKeys.getFieldData("time");
     sizeField = cKeys.getFieldData("size");
+    ingestField = cKeys.getFieldData("ingest");
   }
 
   Keys::Keys(const Util::RelAccX &_keys) : isConst(true), keys(empty), cKeys(_keys){
@@ -3319,6 +3596,7 @@ namespace DTSC{
     partsField = cKeys.getFieldData("parts");
     timeField = cKeys.getFieldData("time");
     sizeField = cKeys.getFieldData("size");
+    ingestField = cKeys.getFieldData("ingest");
   }
 
   size_t Keys::getFirstValid() const{return cKeys.getDeleted();}
@@ -3336,6 +3614,7 @@ namespace DTSC{
     keys.setInt(sizeField, _size, idx);
   }
   size_t Keys::getSize(size_t idx) const{return cKeys.getInt(sizeField, idx);}
+  uint64_t Keys::getIngest(size_t idx) const{return cKeys.getInt(ingestField, idx);}
 
   Fragments::Fragments(const Util::RelAccX &_fragments) : fragments(_fragments){}
   size_t Fragments::getFirstValid() const{return fragments.getDeleted();}
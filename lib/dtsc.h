@@ -34,6 +34,13 @@
 //  Version 4: renamed bps to maxbps (peak bit rate) and added new value bps (average bit rate)
 #define DTSH_VERSION 4
 
+/// Size of the fixed part of a DTSH image header, see DTSC::Meta::toImage
+#define DTSH_IMAGE_HEADER 30
+/// Granularity at which zero runs are left out of DTSH images
+#define DTSH_IMAGE_CHUNK 4096
+/// Largest track page a DTSH image may hold; anything bigger is treated as corrupt
+#define DTSH_IMAGE_MAX_PAGE (1024ull * 1024 * 1024)
+
 namespace DTSC{
 
   extern uint64_t veryUglyJitterOverride;
@@ -54,6 +61,7 @@ namespace DTSC{
   extern char Magic_Packet[];  ///< The magic bytes for a DTSC packet
   extern char Magic_Packet2[]; ///< The magic bytes for a DTSC packet version 2
   extern char Magic_Command[]; ///< The magic bytes for a DTCM packet
+  extern char Magic_Image[];   ///< The magic bytes for a DTSH image
 
   enum packType{DTSC_INVALID, DTSC_HEAD, DTSC_V1, DTSC_V2, DTCM};
 
@@ -101,6 +109,7 @@ namespace DTSC{
     virtual ~Packet();
     void null();
     void operator=(const Packet &rhs);
+    void swap(Packet &rhs);
     operator bool() const;
     packType getVersion() const;
     void reInit(Socket::Connection &src);
@@ -190,6 +199,7 @@ namespace DTSC{
     uint64_t getTime(size_t idx) const;
     void setSize(size_t idx, size_t _size);
     size_t getSize(size_t idx) const;
+    uint64_t getIngest(size_t idx) const;
 
   private:
     bool isConst;
@@ -205,6 +215,7 @@ namespace DTSC{
     Util::RelAccXFieldData partsField;
     Util::RelAccXFieldData timeField;
     Util::RelAccXFieldData sizeField;
+    Util::RelAccXFieldData ingestField;
   };
 
   class Fragments{
@@ -261,6 +272,7 @@ namespace DTSC{
     Util::RelAccXFieldData keyPartsField;
     Util::RelAccXFieldData keyTimeField;
     Util::RelAccXFieldData keySizeField;
+    Util::RelAccXFieldData keyIngestField;
 
     Util::RelAccXFieldData fragmentDurationField;
     Util::RelAccXFieldData fragmentKeysField;
@@ -278,6 +290,8 @@ namespace DTSC{
     void reInit(const std::string &_streamName, bool master = true);
     void reInit(const std::string &_streamName, const std::string &fileName);
     void reInit(const std::string &_streamName, const DTSC::Scan &src);
+    bool fromImage(const std::string &_streamName, const char *data, size_t len);
+    static bool isImage(const char *data, size_t len);
     void addTrackFrom(const DTSC::Scan &src);
 
     void refresh();
@@ -426,6 +440,8 @@ namespace DTSC{
     void setUTCOffset(int64_t UTCOffset);
     int64_t getUTCOffset() const;
 
+    uint64_t getIngestTime(size_t trackIdx, uint64_t time) const;
+
     std::set<size_t> getValidTracks(bool skipEmpty = false) const;
     std::set<size_t> getMySourceTracks(size_t pid) const;
 
@@ -466,6 +482,7 @@ namespace DTSC{
 
     uint64_t getSendLen(bool skipDynamic = false, std::set<size_t> selectedTracks = std::set<size_t>()) const;
     void toFile(const std::string &uri) const;
+    void toImage(const std::string &uri) const;
     void send(Socket::Connection &conn, bool skypDynamic = false,
               std::set<size_t> selectedTracks = std::set<size_t>(), bool reID = false) const;
     void toJSON(JSON::Value &res, bool skipDynamic = true, bool tracksOnly = false) const;
@@ -499,6 +516,8 @@ namespace DTSC{
     std::map<size_t, size_t> sizeMemBuf;
 
   private:
+    void initTrackFields(Track &t);
+
     // Internal buffers so we don't always need to search for everything
     Util::RelAccXFieldData streamVodField;
     Util::RelAccXFieldData streamLiveField;
@@ -0,0 +1,235 @@
+#include "defines.h"
+#include "instrument.h"
+#include "tinythread.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+
+#define INSTRUMENT_MAGIC 0x4D534950 // "MSIP"
+
+namespace Instrument{
+
+  /// Start of the instrumentation page
+  struct pageHeader{
+    uint32_t magic;
+    volatile uint32_t closed; ///< Set by the controller right before removing the page, so writers reopen it
+    char padding[56];
+  };
+
+  /// Totals of a single binary
+  struct slotData{
+    volatile uint32_t inUse;
+    char name[INSTRUMENT_NAMELEN];
+    uint32_t padding;
+    Histogram points[POINT_COUNT];
+  };
+
+#define INSTRUMENT_PAGE_SIZE (sizeof(pageHeader) + INSTRUMENT_SLOTS * sizeof(slotData))
+
+  static inline pageHeader *header(const IPC::sharedPage &page){return (pageHeader *)page.mapped;}
+
+  static inline slotData *slot(const IPC::sharedPage &page, size_t idx){
+    return ((slotData *)(page.mapped + sizeof(pageHeader))) + idx;
+  }
+
+  static const char *pointNames[POINT_COUNT] ={"page_wait", "prepare", "send", "write", "sleep",
+                                               "glass_to_glass", "read", "buffer"};
+
+  /// Returns the name of the given point, as used in exports
+  const char *pointName(size_t point){return point < POINT_COUNT ? pointNames[point] : "unknown";}
+
+  /// Returns the bucket the given amount of microseconds is counted in
+  size_t bucketFor(uint64_t micros){
+    if (micros < 8){return micros;}
+    size_t exp = 63 - __builtin_clzll(micros);
+    size_t idx = (exp - 2) * 8 + ((micros >> (exp - 3)) & 7);
+    return idx < INSTRUMENT_BUCKETS ? idx : INSTRUMENT_BUCKETS - 1;
+  }
+
+  /// Returns the lowest amount of microseconds counted in the given bucket
+  uint64_t bucketStart(size_t bucket){
+    if (bucket < 8){return bucket;}
+    return (uint64_t)(8 + bucket % 8) << (bucket / 8 - 1);
+  }
+
+  /// Histograms of a single thread since its last flush
+  struct threadHistograms{
+    Histogram points[POINT_COUNT];
+    uint64_t count;
+    uint64_t lastFlush;
+  };
+
+  // Every thread records into its own histograms, so recording needs neither locks nor atomic operations
+  static __thread threadHistograms *local = 0;
+  static pthread_key_t localKey;
+  static pthread_once_t localKeyOnce = PTHREAD_ONCE_INIT;
+  // Guards writePage and writeSlot, which all threads of the process flush through
+  static tthread::mutex pageMutex;
+  static IPC::sharedPage writePage;
+  static size_t writeSlot = INSTRUMENT_SLOTS;
+
+  static void flushHistograms(threadHistograms &L);
+
+  /// Flushes and frees the histograms of a thread that exits
+  static void threadExit(void *L){
+    flushHistograms(*(threadHistograms *)L);
+    delete (threadHistograms *)L;
+  }
+
+  static void makeLocalKey(){pthread_key_create(&localKey, threadExit);}
+
+  /// Returns the histograms of the calling thread, creating them on first use
+  static threadHistograms &threadLocal(){
+    if (!local){
+      pthread_once(&localKeyOnce, makeLocalKey);
+      local = new threadHistograms;
+      memset(local, 0, sizeof(threadHistograms));
+      pthread_setspecific(localKey, local);
+    }
+    return *local;
+  }
+
+  /// Adds a single timing to the histograms of this thread, flushing them to the page about once per second.
+  void record(Point point, uint64_t micros, uint64_t bytes){
+    threadHistograms &L = threadLocal();
+    Histogram &H = L.points[point];
+    ++H.count;
+    H.sum += micros;
+    H.bytes += bytes;
+    if (micros > H.max){H.max = micros;}
+    ++H.buckets[bucketFor(micros)];
+    // Only look at the clock every 16 timings; points are hit many times per second in practice
+    if (++L.count % 16){return;}
+    uint64_t now = Util::bootSecs();
+    if (now != L.lastFlush){
+      L.lastFlush = now;
+      flushHistograms(L);
+    }
+  }
+
+  /// Adds the histograms of the calling thread to the totals of this binary on the page.
+  /// Other threads flush their own histograms as they record, and when they exit.
+  void flush(){
+    if (local){flushHistograms(*local);}
+  }
+
+  /// Adds the given histograms to the totals of this binary on the page.
+  /// If the page is not available, the histograms are kept until the next flush.
+  static void flushHistograms(threadHistograms &L){
+    if (!L.count){return;}
+    tthread::lock_guard<tthread::mutex> guard(pageMutex);
+    if (writePage.mapped && header(writePage)->closed){
+      writePage.close();
+      writeSlot = INSTRUMENT_SLOTS;
+    }
+    if (!writePage.mapped){
+      writePage.init(SHM_INSTRUMENT, 0, false, false);
+      if (writePage.mapped && (writePage.len < INSTRUMENT_PAGE_SIZE || header(writePage)->magic != INSTRUMENT_MAGIC)){
+        writePage.close();
+      }
+      if (!writePage.mapped){return;}
+    }
+    if (writeSlot == INSTRUMENT_SLOTS){
+      std::string name = program_invocation_short_name;
+      if (name.size() >= INSTRUMENT_NAMELEN){name.erase(INSTRUMENT_NAMELEN - 1);}
+      IPC::semaphore sem(SEM_INSTRUMENT, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+      if (!sem){return;}
+      IPC::semGuard G(&sem);
+      size_t firstFree = INSTRUMENT_SLOTS;
+      for (size_t i = 0; i < INSTRUMENT_SLOTS; ++i){
+        slotData *S = slot(writePage, i);
+        if (!S->inUse){
+          if (firstFree == INSTRUMENT_SLOTS){firstFree = i;}
+          continue;
+        }
+        if (!strncmp(S->name, name.c_str(), INSTRUMENT_NAMELEN)){
+          writeSlot = i;
+          break;
+        }
+      }
+      if (writeSlot == INSTRUMENT_SLOTS && firstFree != INSTRUMENT_SLOTS){
+        slotData *S = slot(writePage, firstFree);
+        memset((void *)S, 0, sizeof(slotData));
+        memcpy(S->name, name.data(), name.size());
+        __sync_synchronize();
+        S->inUse = 1;
+        writeSlot = firstFree;
+      }
+      if (writeSlot == INSTRUMENT_SLOTS){
+        WARN_MSG("Instrumentation page is full, dropping timings");
+        memset(L.points, 0, sizeof(L.points));
+        L.count = 0;
+        return;
+      }
+    }
+    slotData *S = slot(writePage, writeSlot);
+    for (size_t p = 0; p < POINT_COUNT; ++p){
+      Histogram &H = L.points[p];
+      if (!H.count){continue;}
+      Histogram &T = S->points[p];
+      __sync_fetch_and_add(&T.count, H.count);
+      __sync_fetch_and_add(&T.sum, H.sum);
+      if (H.bytes){__sync_fetch_and_add(&T.bytes, H.bytes);}
+      uint64_t prevMax = T.max;
+      while (H.max > prevMax){
+        uint64_t seen = __sync_val_compare_and_swap(&T.max, prevMax, H.max);
+        if (seen == prevMax){break;}
+        prevMax = seen;
+      }
+      for (size_t b = 0; b < INSTRUMENT_BUCKETS; ++b){
+        if (H.buckets[b]){__sync_fetch_and_add(&T.buckets[b], H.buckets[b]);}
+      }
+    }
+    memset(L.points, 0, sizeof(L.points));
+    L.count = 0;
+  }
+
+  /// Flushes whatever the main thread has left when the process exits normally
+  static class exitFlusher{
+  public:
+    ~exitFlusher(){flush();}
+  } flushOnExit;
+
+  /// Opens the page. The master (the controller) creates it if needed and removes it again when done, unless
+  /// setMaster(false) is called first.
+  void Page::reload(bool _master){
+    dataPage.init(SHM_INSTRUMENT, 0, false, false);
+    if (dataPage.mapped && (dataPage.len < INSTRUMENT_PAGE_SIZE || header(dataPage)->magic != INSTRUMENT_MAGIC ||
+                            header(dataPage)->closed)){
+      dataPage.close();
+    }
+    if (!dataPage.mapped && _master){
+      dataPage.init(SHM_INSTRUMENT, INSTRUMENT_PAGE_SIZE, true);
+      if (dataPage.mapped){
+        memset(dataPage.mapped, 0, INSTRUMENT_PAGE_SIZE);
+        header(dataPage)->magic = INSTRUMENT_MAGIC;
+      }
+    }
+    dataPage.master = _master;
+  }
+
+  /// Sets whether the page gets removed, after telling writers to reopen it, when this object is destroyed
+  void Page::setMaster(bool _master){dataPage.master = _master;}
+
+  Page::operator bool() const{return dataPage.mapped && !header(dataPage)->closed;}
+
+  Page::~Page(){
+    if (dataPage.master && dataPage.mapped){header(dataPage)->closed = 1;}
+  }
+
+  size_t Page::slotCount() const{return *this ? INSTRUMENT_SLOTS : 0;}
+
+  /// Returns the name of the binary reporting to the given slot, or an empty string if the slot is unused
+  std::string Page::getName(size_t idx) const{
+    if (idx >= slotCount() || !slot(dataPage, idx)->inUse){return "";}
+    const char *name = slot(dataPage, idx)->name;
+    return std::string(name, strnlen(name, INSTRUMENT_NAMELEN));
+  }
+
+  /// Returns the totals of the given binary slot and point, or null if the slot is unused
+  const Histogram *Page::get(size_t idx, size_t point) const{
+    if (idx >= slotCount() || point >= POINT_COUNT || !slot(dataPage, idx)->inUse){return 0;}
+    return slot(dataPage, idx)->points + point;
+  }
+}// namespace Instrument
@@ -0,0 +1,93 @@
+/// \file instrument.h
+/// Optional latency instrumentation of the media pipeline.
+/// Instrumentation points are only compiled in when WITH_INSTRUMENTATION is defined; otherwise the INSTRUMENT_*
+/// macros expand to nothing. The page holding the results can always be read, so the controller exports whatever
+/// instrumented binaries report.
+#pragma once
+#include "shared_memory.h"
+#include "timing.h"
+#include <stdint.h>
+#include <string>
+
+#define INSTRUMENT_BUCKETS 256 // 8 buckets per power of two, covering up to about 4.7 hours in microseconds
+#define INSTRUMENT_SLOTS 64    // Maximum amount of different binaries reporting to the instrumentation page
+#define INSTRUMENT_NAMELEN 32
+
+/// Holds the pipeline instrumentation tools.
+/// Every thread records into its own histograms without any locking, and adds them to the totals of its binary
+/// in shared memory at most once per second and when exiting. Keeping totals per binary instead of per process
+/// means the counts of processes that have exited are not lost, so they can be exported as Prometheus counters.
+namespace Instrument{
+
+  /// Points in the pipeline that are timed.
+  enum Point{
+    OUT_PAGE_WAIT, ///< prepareNext() calls that did not result in a packet: waiting for data, loading pages
+    OUT_PREPARE,   ///< prepareNext() calls that resulted in a packet
+    OUT_SEND,      ///< sendNext(): muxing, including socket writes
+    OUT_WRITE,     ///< Blocking socket writes
+    OUT_SLEEP,     ///< Sleeping to keep realtime playback speed
+    OUT_GLASS,     ///< From buffering a live packet on ingest until sending it, sampled once per second per track
+    IN_READ,       ///< Reading the next packet in the input main loops
+    IN_BUFFER,     ///< Buffering a live packet into a data page
+    POINT_COUNT
+  };
+
+  /// A log-linear latency histogram in microseconds, accurate to 1/8th of its value.
+  struct Histogram{
+    uint64_t count;
+    uint64_t sum;   ///< Total microseconds
+    uint64_t bytes; ///< Total bytes handled, for points that handle data
+    uint64_t max;
+    uint64_t buckets[INSTRUMENT_BUCKETS];
+  };
+
+  const char *pointName(size_t point);
+  size_t bucketFor(uint64_t micros);
+  uint64_t bucketStart(size_t bucket);
+
+  void record(Point point, uint64_t micros, uint64_t bytes = 0);
+  void flush();
+
+  /// Records the time between construction and destruction.
+  class Scope{
+  public:
+    Scope(Point _point, uint64_t _bytes = 0){
+      point = _point;
+      bytes = _bytes;
+      start = Util::getMicros();
+    }
+    ~Scope(){record(point, Util::getMicros(start), bytes);}
+
+  private:
+    Point point;
+    uint64_t bytes;
+    uint64_t start;
+  };
+
+  /// The page holding the totals of all instrumented binaries.
+  class Page{
+  public:
+    ~Page();
+    void reload(bool _master = false);
+    void setMaster(bool _master);
+    operator bool() const;
+    size_t slotCount() const;
+    std::string getName(size_t slot) const;
+    const Histogram *get(size_t slot, size_t point) const;
+
+  private:
+    IPC::sharedPage dataPage;
+  };
+}// namespace Instrument
+
+/// INSTRUMENT_SCOPE(point, bytes) times the rest of the current scope.
+/// INSTRUMENT_START(var) and INSTRUMENT_STOP(point, var) time the code in between them.
+#ifdef WITH_INSTRUMENTATION
+#define INSTRUMENT_SCOPE(point, bytes) Instrument::Scope instrumentScope(point, bytes)
+#define INSTRUMENT_START(var) uint64_t var = Util::getMicros()
+#define INSTRUMENT_STOP(point, var) Instrument::record(point, Util::getMicros(var))
+#else
+#define INSTRUMENT_SCOPE(point, bytes)
+#define INSTRUMENT_START(var)
+#define INSTRUMENT_STOP(point, var)
+#endif
@@ -644,20 +644,33 @@ namespace MP4{
   }
 
   Box containerBox::getChild(const char *boxName){
-    uint32_t count = getContentCount();
-    for (uint32_t i = 0; i < count; i++){
-      Box &thisChild = getContent(i);
-      if (thisChild.isType(boxName)){return Box(thisChild.asBox(), false);}
-    }
+    size_t pos = 0;
+    return getNextChild(boxName, pos);
+  }
+
+  /// Returns the first direct child of the given type at or after payload offset pos, and advances
+  /// pos past it, so repeated calls walk all matching children in a single pass.
+  /// The returned box points into this box and does not copy any data.
+  /// Returns an "erro" box once no more matching children are left.
+  Box containerBox::getNextChild(const char *boxName, size_t &pos){
+    while (pos + 8 <= payloadSize()){
+      const char *child = payload() + pos;
+      uint64_t childSize = calcBoxSize(child);
+      if (childSize < 8 || pos + childSize > payloadSize()){break;}
+      pos += childSize;
+      if (!memcmp(child + 4, boxName, 4)){return Box((char *)child, false);}
+    }
+    pos = payloadSize();
     return Box((char *)"\000\000\000\010erro", false);
   }
 
   std::deque<Box> containerBox::getChildren(const char *boxName){
     std::deque<Box> res;
-    uint32_t count = getContentCount();
-    for (uint32_t i = 0; i < count; i++){
-      Box &thisChild = getContent(i);
-      if (thisChild.isType(boxName)){res.push_back(Box(thisChild.asBox(), false));}
+    size_t pos = 0;
+    Box thisChild = getNextChild(boxName, pos);
+    while (thisChild){
+      res.push_back(thisChild);
+      thisChild = getNextChild(boxName, pos);
     }
     return res;
   }
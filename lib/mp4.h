@@ -101,6 +101,12 @@ namespace MP4{
       MP4::Box r = getChild(a.getType().c_str());
       return (T &)r;
     }
+    Box getNextChild(const char *boxName, size_t &pos);
+    template <typename T> T getNextChild(size_t &pos){
+      T a;
+      MP4::Box r = getNextChild(a.getType().c_str(), pos);
+      return (T &)r;
+    }
     std::deque<Box> getChildren(const char *boxName);
     template <typename T> std::deque<T> getChildren(){
       T a;
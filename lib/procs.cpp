@@ -21,6 +21,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#if !defined(SYS_pidfd_open) && defined(__NR_pidfd_open)
+#define SYS_pidfd_open __NR_pidfd_open
+#endif
+#endif
 
 std::set<pid_t> Util::Procs::plist;
 std::set<int> Util::Procs::socketList;
@@ -559,3 +567,147 @@ void Util::Procs::remember(pid_t pid){
   tthread::lock_guard<tthread::mutex> guard(plistMutex);
   plist.insert(pid);
 }
+
+volatile size_t Util::ProcWatcher::totalFds = 0;
+size_t Util::ProcWatcher::maxFds = (size_t)-1;
+volatile uint64_t Util::ProcWatcher::retryFds = 0;
+
+Util::ProcWatcher::ProcWatcher(){
+  epollFd = -1;
+  lastPid = 0;
+  lastRunning = false;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  usePidfd = true;
+#else
+  usePidfd = false;
+#endif
+}
+
+Util::ProcWatcher::ProcWatcher(const ProcWatcher &rhs){
+  epollFd = -1;
+  lastPid = 0;
+  lastRunning = false;
+  usePidfd = rhs.usePidfd;
+}
+
+Util::ProcWatcher &Util::ProcWatcher::operator=(const ProcWatcher &rhs){
+  if (this != &rhs){
+    clear();
+    usePidfd = rhs.usePidfd;
+  }
+  return *this;
+}
+
+Util::ProcWatcher::~ProcWatcher(){clear();}
+
+/// Closes all pidfds and the epoll set
+void Util::ProcWatcher::clear(){
+  for (std::map<pid_t, int>::iterator it = pidFds.begin(); it != pidFds.end(); ++it){closeFd(it->second);}
+  pidFds.clear();
+  exited.clear();
+  lastPid = 0;
+  if (epollFd != -1){
+    close(epollFd);
+    epollFd = -1;
+  }
+}
+
+/// Collects all watched processes that exited since the previous call.
+/// Should be called once before every pass over the processes of interest.
+void Util::ProcWatcher::update(){
+  exited.clear();
+  lastPid = 0;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  if (epollFd == -1 || !pidFds.size()){return;}
+  struct epoll_event events[64];
+  int n;
+  do{
+    n = epoll_wait(epollFd, events, 64, 0);
+    for (int i = 0; i < n; ++i){
+      pid_t pid = events[i].data.u32;
+      std::map<pid_t, int>::iterator it = pidFds.find(pid);
+      if (it == pidFds.end()){continue;}
+      closeFd(it->second);
+      pidFds.erase(it);
+      exited.insert(pid);
+    }
+  }while (n == 64);
+#endif
+}
+
+/// Closes a pidfd and hands its slot back to the process-wide budget
+void Util::ProcWatcher::closeFd(int fd){
+  close(fd);
+  __sync_fetch_and_sub(&totalFds, 1);
+}
+
+/// Claims a slot in the process-wide pidfd budget, returning false if it is used up or the process recently ran
+/// out of file descriptors. The budget is a share of the file descriptor limit, so watching processes never starves
+/// sockets and files.
+bool Util::ProcWatcher::reserveFd(){
+  if (retryFds){
+    if (Util::bootMS() < retryFds){return false;}
+    retryFds = 0;
+  }
+  if (maxFds == (size_t)-1){
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY){
+      maxFds = 1024 / PROCWATCH_FD_SHARE;
+    }else{
+      maxFds = limit.rlim_cur / PROCWATCH_FD_SHARE;
+    }
+  }
+  if (__sync_add_and_fetch(&totalFds, 1) <= maxFds){return true;}
+  __sync_fetch_and_sub(&totalFds, 1);
+  return false;
+}
+
+/// Returns true if the given process was running as of the last update() call.
+/// Processes seen for the first time are checked right away and watched from then on.
+bool Util::ProcWatcher::isRunning(pid_t pid){
+  if (!usePidfd){return Procs::isRunning(pid);}
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  if (pid == lastPid){return lastRunning;}
+  lastPid = pid;
+  lastRunning = false;
+  if (exited.count(pid)){return false;}
+  if (pidFds.count(pid)){return (lastRunning = true);}
+  if (epollFd == -1){
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollFd == -1){
+      usePidfd = false;
+      return (lastRunning = Procs::isRunning(pid));
+    }
+  }
+  if (!reserveFd()){return (lastRunning = Procs::isRunning(pid));}
+  int fd = syscall(SYS_pidfd_open, pid, 0);
+  if (fd < 0){
+    int err = errno;
+    __sync_fetch_and_sub(&totalFds, 1);
+    if (err == ESRCH){return false;}
+    if (err == ENOSYS){
+      HIGH_MSG("Kernel has no pidfd support; checking processes one by one");
+      usePidfd = false;
+    }
+    if (err == EMFILE || err == ENFILE){
+      // Other code will run into this as well and report it; back off for a while so this is not retried per process
+      HIGH_MSG("Out of file descriptors while watching %zu processes; checking new processes one by one for %d ms",
+               (size_t)totalFds, PROCWATCH_FD_BACKOFF);
+      retryFds = Util::bootMS() + PROCWATCH_FD_BACKOFF;
+    }
+    return (lastRunning = Procs::isRunning(pid));
+  }
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.u32 = pid;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev) == -1){
+    closeFd(fd);
+    return (lastRunning = Procs::isRunning(pid));
+  }
+  pidFds[pid] = fd;
+  return (lastRunning = true);
+#else
+  return Procs::isRunning(pid);
+#endif
+}
@@ -4,6 +4,7 @@
 #pragma once
 #include "tinythread.h"
 #include <deque>
+#include <map>
 #include <set>
 #include <string>
 #include <unistd.h>
@@ -46,4 +47,37 @@ namespace Util{
     static std::set<int> socketList; ///< Holds sockets that should be closed before forking
     static int kill_timeout;
   };
+
+  /// Tells whether processes are still running without a syscall per check.
+  /// On Linux every watched process gets a pidfd on an epoll set, so update() learns about all exited
+  /// processes at once. Elsewhere, or when no pidfd can be opened, this falls back to Procs::isRunning.
+  /// All watchers in a process together hold at most 1/PROCWATCH_FD_SHARE of the file descriptor limit in pidfds;
+  /// processes beyond that, or seen within PROCWATCH_FD_BACKOFF milliseconds after the process ran out of file
+  /// descriptors, are checked one by one.
+  /// Copies start out empty, so objects holding one can still be copied.
+  class ProcWatcher{
+  public:
+    ProcWatcher();
+    ProcWatcher(const ProcWatcher &rhs);
+    ProcWatcher &operator=(const ProcWatcher &rhs);
+    ~ProcWatcher();
+    void update();
+    bool isRunning(pid_t pid);
+    size_t watchCount() const{return pidFds.size();}
+    static size_t totalWatchCount(){return totalFds;}
+
+  private:
+    void clear();
+    void closeFd(int fd);
+    static bool reserveFd();
+    static volatile size_t totalFds; ///< pidfds held by all watchers in this process
+    static size_t maxFds; ///< Highest amount of pidfds all watchers together may hold, -1 if not known yet
+    static volatile uint64_t retryFds; ///< Boot time in ms before which no new pidfds are opened
+    int epollFd;
+    bool usePidfd;
+    pid_t lastPid; ///< Records of the same process tend to be next to each other, so remember the last answer
+    bool lastRunning;
+    std::map<pid_t, int> pidFds; ///< pidfd per watched process
+    std::set<pid_t> exited; ///< Processes that exited since the previous update()
+  };
 }// namespace Util
@@ -74,8 +74,9 @@ bool ValidateClientScheme(uint8_t *pBuffer, uint8_t scheme){
 std::string &RTMPStream::Chunk::Pack(){
   static std::string output;
   output.clear();
+  output.reserve(len + (len / RTMPStream::chunk_snd_max + 1) * 7 + 18);
   bool allow_short = lastsend.count(cs_id);
-  RTMPStream::Chunk prev = lastsend[cs_id];
+  RTMPStream::Chunk &prev = lastsend[cs_id];
   uint64_t tmpi;
   unsigned char chtype = 0x00;
   if (allow_short && (prev.cs_id == cs_id)){
@@ -177,7 +178,11 @@ std::string &RTMPStream::Chunk::Pack(){
       }
     }
   }
-  lastsend[cs_id] = *this;
+  // Store our header state for the next chunk on this chunk stream, without copying the data
+  std::string msgData;
+  msgData.swap(data);
+  prev = *this;
+  data.swap(msgData);
   RTMPStream::snd_cnt += output.size();
   return output;
 }// SendChunk
@@ -197,7 +202,7 @@ RTMPStream::Chunk::Chunk(){
 
 /// Packs up a chunk with the given arguments as properties.
 std::string &RTMPStream::SendChunk(unsigned int cs_id, unsigned char msg_type_id,
-                                   unsigned int msg_stream_id, std::string data){
+                                   unsigned int msg_stream_id, const std::string &data){
   static RTMPStream::Chunk ch;
   ch.cs_id = cs_id;
   ch.timestamp = 0;
@@ -224,7 +229,7 @@ std::string &RTMPStream::SendMedia(unsigned char msg_type_id, unsigned char *dat
   ch.len_left = 0;
   ch.msg_type_id = msg_type_id;
   ch.msg_stream_id = 1;
-  ch.data = std::string((char *)data, (size_t)len);
+  ch.data.assign((char *)data, (size_t)len);
   return ch.Pack();
 }// SendMedia
 
@@ -240,7 +245,7 @@ std::string &RTMPStream::SendMedia(FLV::Tag &tag){
   ch.len_left = 0;
   ch.msg_type_id = (unsigned char)tag.data[0];
   ch.msg_stream_id = 1;
-  ch.data = std::string(tag.data + 11, (size_t)(tag.len - 15));
+  ch.data.assign(tag.data + 11, (size_t)(tag.len - 15));
   ch.len = ch.data.size();
   ch.real_len = ch.len;
   return ch.Pack();
@@ -328,6 +333,9 @@ std::string &RTMPStream::SendUSR(unsigned char type, unsigned int data, unsigned
 /// If a single packet contains a partial chunk, it will remove the packet and
 /// call itself again. This has the effect of only causing a "true" reponse in
 /// the case a *whole* chunk is read, not just part of a chunk.
+/// Partial messages are reassembled in place in the buffer kept in lastrecv for their chunk
+/// stream, and handed over by swapping buffers once complete, so payload data is only copied
+/// once, straight out of the socket buffer. Buffers are recycled between messages.
 /// \param buffer The input to parse and update.
 /// \warning This function will destroy the current data in this chunk!
 /// \returns True if a whole chunk could be read, false otherwise.
@@ -349,7 +357,7 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer &buffer){
   }
 
   bool allow_short = lastrecv.count(cs_id);
-  RTMPStream::Chunk prev = lastrecv[cs_id];
+  RTMPStream::Chunk &prev = lastrecv[cs_id];
 
   // process the rest of the header, for each chunk type
   headertype = chunktype & 0xC0;
@@ -467,13 +475,25 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer &buffer){
       DONTEVEN_MSG("Cannot read all data yet");
       return false;
     }// can't read all data (yet)
-    buffer.remove(i);                                      // remove the header
+    buffer.remove(i); // remove the header
+    // Take over the partial message buffer of this chunk stream and append the data to it.
+    // When starting a new message, we re-use the buffer of our previous message instead.
+    std::string msgData;
     if (prev.len_left > 0){
-      data = prev.data + buffer.remove(real_len); // append the data and remove from buffer
+      msgData.swap(prev.data);
+    }else{
+      msgData.swap(data);
+      msgData.clear();
+    }
+    buffer.remove(msgData, real_len);
+    // Store our header state for the next chunk on this chunk stream, without copying the data
+    data.clear();
+    prev = *this;
+    if (len_left == 0){
+      data.swap(msgData);
     }else{
-      data = buffer.remove(real_len); // append the data and remove from buffer
+      prev.data.swap(msgData);
     }
-    lastrecv[cs_id] = *this;
     RTMPStream::rec_cnt += i + real_len;
     if (RTMPStream::rec_cnt >= 0xf0000000){
       INFO_MSG("Resetting receive window due to impending rollover");
@@ -487,9 +507,8 @@ bool RTMPStream::Chunk::Parse(Socket::Buffer &buffer){
     }
   }else{
     buffer.remove(i); // remove the header
-    data = "";
-    indata = indata.substr(i + real_len);
-    lastrecv[cs_id] = *this;
+    data.clear();
+    prev = *this;
     RTMPStream::rec_cnt += i + real_len;
     return true;
   }
@@ -71,7 +71,7 @@ namespace RTMPStream{
   extern std::map<unsigned int, Chunk> lastrecv;
 
   std::string &SendChunk(unsigned int cs_id, unsigned char msg_type_id, unsigned int msg_stream_id,
-                         std::string data);
+                         const std::string &data);
   std::string &SendMedia(unsigned char msg_type_id, unsigned char *data, int len, unsigned int ts);
   std::string &SendMedia(FLV::Tag &tag);
   std::string &SendCTL(unsigned char type, unsigned int data);
@@ -2,18 +2,26 @@
 /// A handy Socket wrapper library.
 /// Written by Jaron Vietor in 2010 for DDVTech
 
+#include "bitfields.h"
 #include "defines.h"
+#include "instrument.h"
+#include "shared_memory.h"
 #include "socket.h"
 #include "timing.h"
 #include "json.h"
+#include "tinythread.h"
+#include <cctype>
 #include <cstdlib>
+#include <climits>
 #include <ifaddrs.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <map>
 #include <sstream>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <vector>
 
 #define BUFFER_BLOCKSIZE 4096 // set buffer blocksize to 4KiB
 
@@ -23,6 +31,21 @@
 #define SOCKETSIZE 51200ul
 #endif
 
+/// Maximum amount of SSL sessions cached for resumption, per process
+#define SSL_SESSION_CACHE 64
+/// Space reserved per datagram in batched UDP receives
+#define UDP_BATCH_SLOT 2048
+
+uint64_t Socket::sslHandshakes = 0;
+uint64_t Socket::sslResumed = 0;
+
+#ifdef SSL
+/// Most recent SSL session per host:port, used to resume sessions on new outgoing connections
+static std::map<std::string, mbedtls_ssl_session *> sslSessions;
+/// Mutex for accesses to sslSessions and the handshake counters
+static tthread::mutex sslSessionMutex;
+#endif
+
 /// Local-scope only helper function that prints address families
 static const char *addrFam(int f){
   switch (f){
@@ -199,6 +222,166 @@ std::string Socket::getBinForms(std::string addr){
   return ret;
 }
 
+/// Seconds a resolved host name stays cached
+#define HOSTNAME_CACHE_TTL 300
+/// Seconds an address without host name stays cached
+#define HOSTNAME_NEGATIVE_TTL 60
+/// Seconds before a lookup another process started is retried, in case that process went away
+#define HOSTNAME_PENDING_TTL 30
+/// Amount of slots an address may be stored in, starting at its hash
+#define HOSTNAME_CACHE_PROBES 8
+/// Longest host name stored, including the terminating null byte
+#define HOSTNAME_MAXLEN 260
+
+/// Cached result of a reverse DNS lookup, in the SHM_HOST_NAMES page all processes share.
+/// Outputs are forked per connection, so a per-process cache would start out empty for every viewer.
+struct hostNameSlot{
+  char addr[16];             ///< Binary-form IPv6 address, all zeroes for an empty slot
+  uint64_t expires;          ///< Util::bootSecs() at which the entry (or pending lookup) expires
+  uint32_t pending;          ///< Set while some process is looking the address up
+  char name[HOSTNAME_MAXLEN]; ///< Host name, empty if the address has none
+};
+static IPC::sharedPage hostNamePage;
+/// Addresses this process still has to look up
+static std::deque<std::string> hostNameQueue;
+/// Locking for the queue; allocated per process, since a fork may copy it in locked state
+static tthread::mutex *hostNameMutex = 0;
+static tthread::condition_variable *hostNameCond = 0;
+/// Process that claimed starting the resolver thread, and the process it was started for
+static volatile pid_t hostNameInitPid = 0;
+static volatile pid_t hostNameReadyPid = 0;
+
+/// Returns the slot the given binary-form address is stored in, or the slot to store it in if it is not.
+/// The caller must hold the SEM_HOST_NAMES semaphore.
+static hostNameSlot *findHostSlot(const char *binAddr){
+  hostNameSlot *slots = (hostNameSlot *)hostNamePage.mapped;
+  size_t slotCount = hostNamePage.len / sizeof(hostNameSlot);
+  uint32_t hash = 2166136261ul;
+  for (size_t i = 0; i < 16; ++i){hash = (hash ^ (uint8_t)binAddr[i]) * 16777619ul;}
+  hostNameSlot *oldest = 0;
+  for (size_t i = 0; i < HOSTNAME_CACHE_PROBES; ++i){
+    hostNameSlot *S = slots + (hash + i) % slotCount;
+    if (!memcmp(S->addr, binAddr, 16)){return S;}
+    if (!oldest || S->expires < oldest->expires){oldest = S;}
+  }
+  return oldest;
+}
+
+/// Does a blocking reverse DNS lookup of the given binary-form IPv6 address.
+/// IPv4-mapped addresses are looked up as IPv4 address. Returns an empty string if there is no name.
+static std::string reverseLookup(const std::string &binAddr){
+  char hostName[NI_MAXHOST];
+  int ret;
+  if (!memcmp(binAddr.data(), "\000\000\000\000\000\000\000\000\000\000\377\377", 12)){
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    memcpy(&sa.sin_addr, binAddr.data() + 12, 4);
+    ret = getnameinfo((struct sockaddr *)&sa, sizeof(sa), hostName, sizeof(hostName), 0, 0, NI_NAMEREQD);
+  }else{
+    struct sockaddr_in6 sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin6_family = AF_INET6;
+    memcpy(&sa.sin6_addr, binAddr.data(), 16);
+    ret = getnameinfo((struct sockaddr *)&sa, sizeof(sa), hostName, sizeof(hostName), 0, 0, NI_NAMEREQD);
+  }
+  if (ret){return "";}
+  return hostName;
+}
+
+/// Background thread that works through the queue of addresses to look up, storing the results in the shared cache
+static void hostNameResolver(void *){
+  tthread::mutex &mut = *hostNameMutex;
+  tthread::condition_variable &cond = *hostNameCond;
+  mut.lock();
+  while (true){
+    while (!hostNameQueue.size()){cond.wait(mut);}
+    std::string binAddr = hostNameQueue.front();
+    hostNameQueue.pop_front();
+    mut.unlock();
+    std::string name = reverseLookup(binAddr);
+    HIGH_MSG("Reverse DNS: %s", name.size() ? name.c_str() : "(no name)");
+    if (name.size() >= HOSTNAME_MAXLEN){name.clear();}
+    IPC::semaphore sem(SEM_HOST_NAMES, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+    if (sem){
+      IPC::semGuard G(&sem);
+      hostNameSlot *S = findHostSlot(binAddr.data());
+      memcpy(S->addr, binAddr.data(), 16);
+      memcpy(S->name, name.c_str(), name.size() + 1);
+      S->expires = Util::bootSecs() + (name.size() ? HOSTNAME_CACHE_TTL : HOSTNAME_NEGATIVE_TTL);
+      S->pending = 0;
+    }
+    mut.lock();
+  }
+}
+
+/// Opens the shared cache, and starts the resolver thread of this process if it is not running.
+/// Safe to call from multiple threads at once; after a fork, the first call starts a new resolver thread.
+/// Returns false if the cache is not available.
+static bool startHostNameResolver(){
+  pid_t myPid = getpid();
+  if (hostNameReadyPid != myPid){
+    pid_t prevPid = hostNameInitPid;
+    if (prevPid != myPid && __sync_bool_compare_and_swap(&hostNameInitPid, prevPid, myPid)){
+      // Either nothing was looked up yet, or we were forked: the resolver thread did not come along
+      hostNameMutex = new tthread::mutex();
+      hostNameCond = new tthread::condition_variable();
+      hostNameQueue.clear();
+      if (!hostNamePage.mapped){
+        // The controller normally creates the page; when running without one, the first process to need it does
+        hostNamePage.init(SHM_HOST_NAMES, 0, false, false);
+        if (!hostNamePage.mapped){
+          hostNamePage.init(SHM_HOST_NAMES, SHM_HOST_NAMES_LEN, true, false);
+          hostNamePage.master = false;
+        }
+        if (hostNamePage.mapped && hostNamePage.len < sizeof(hostNameSlot) * HOSTNAME_CACHE_PROBES){
+          hostNamePage.close();
+        }
+        if (!hostNamePage.mapped){WARN_MSG("Reverse DNS cache not available; host names will not be looked up");}
+      }
+      tthread::thread *resolver = new tthread::thread(hostNameResolver, 0);
+      resolver->detach();
+      delete resolver;
+      __sync_synchronize();
+      hostNameReadyPid = myPid;
+    }else{
+      // Another thread is starting the resolver; it does not take long
+      while (hostNameReadyPid != myPid){Util::sleep(1);}
+    }
+  }
+  __sync_synchronize();
+  return hostNamePage.mapped;
+}
+
+/// Returns the host name for the given binary-form IPv6 address, from the cache shared by all processes.
+/// Addresses not in the cache are looked up by a background thread: until that lookup finishes, in this or any
+/// other process, an empty string is returned and pending is set. Addresses without host name return an empty
+/// string, with pending unset.
+std::string Socket::getHostName(const std::string &binAddr, bool &pending){
+  pending = false;
+  if (binAddr.size() < 16 || !startHostNameResolver()){return "";}
+  IPC::semaphore sem(SEM_HOST_NAMES, O_CREAT | O_RDWR, ACCESSPERMS, 1);
+  if (!sem){return "";}
+  {
+    IPC::semGuard G(&sem);
+    hostNameSlot *S = findHostSlot(binAddr.data());
+    if (!memcmp(S->addr, binAddr.data(), 16) && S->expires > Util::bootSecs()){
+      pending = S->pending;
+      return S->name;
+    }
+    // Claim the lookup, so other processes wait for ours instead of starting their own
+    memcpy(S->addr, binAddr.data(), 16);
+    S->name[0] = 0;
+    S->expires = Util::bootSecs() + HOSTNAME_PENDING_TTL;
+    S->pending = 1;
+  }
+  tthread::lock_guard<tthread::mutex> guard(*hostNameMutex);
+  hostNameQueue.push_back(binAddr.substr(0, 16));
+  hostNameCond->notify_one();
+  pending = true;
+  return "";
+}
+
 /// Checks bytes (length len) containing a binary-encoded IPv4 or IPv6 IP address, and writes it in
 /// human-readable notation to target. Writes "unknown" if it cannot decode to a sensible value.
 void Socket::hostBytesToStr(const char *bytes, size_t len, std::string &target){
@@ -492,6 +675,25 @@ void Socket::Buffer::remove(Util::ResizeablePointer & ptr, unsigned int count){
   }
 }
 
+/// Removes count bytes from the buffer, appending them to the given string.
+/// Does nothing if not all count bytes are available.
+void Socket::Buffer::remove(std::string & str, unsigned int count){
+  size();
+  if (!available(count)){return;}
+  unsigned int i = 0;
+  for (std::deque<std::string>::reverse_iterator it = data.rbegin(); it != data.rend(); ++it){
+    if (i + (*it).size() < count){
+      str.append(*it);
+      i += (*it).size();
+      (*it).clear();
+    }else{
+      str.append(*it, 0, count - i);
+      (*it).erase(0, count - i);
+      break;
+    }
+  }
+}
+
 /// Copies count bytes from the buffer, returning them by value.
 /// Returns an empty string if not all count bytes are available.
 std::string Socket::Buffer::copy(unsigned int count){
@@ -880,6 +1082,22 @@ void Socket::Connection::open(std::string host, int port, bool nonblock, bool wi
       return;
     }
     mbedtls_ssl_set_bio(ssl, server_fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+    // Offer the last session we had with this host, so the server can skip the full handshake
+    std::string sessionKey = host + ":" + JSON::Value(port).asString();
+    bool haveSession = false;
+#if defined(MBEDTLS_HAVE_TIME)
+    time_t sessionStart = 0;
+#endif
+    {
+      tthread::lock_guard<tthread::mutex> guard(sslSessionMutex);
+      std::map<std::string, mbedtls_ssl_session *>::iterator it = sslSessions.find(sessionKey);
+      if (it != sslSessions.end() && !mbedtls_ssl_set_session(ssl, it->second)){
+        haveSession = true;
+#if defined(MBEDTLS_HAVE_TIME)
+        sessionStart = it->second->start;
+#endif
+      }
+    }
     while ((ret = mbedtls_ssl_handshake(ssl)) != 0){
       if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE){
         char estr[200];
@@ -890,6 +1108,39 @@ void Socket::Connection::open(std::string host, int port, bool nonblock, bool wi
         return;
       }
     }
+    {
+      mbedtls_ssl_session *session = new mbedtls_ssl_session;
+      mbedtls_ssl_session_init(session);
+      bool resumed = false;
+      if (!mbedtls_ssl_get_session(ssl, session)){
+#if defined(MBEDTLS_HAVE_TIME)
+        // A resumed session keeps the start time of the session it resumed
+        resumed = haveSession && session->start == sessionStart;
+#endif
+      }else{
+        mbedtls_ssl_session_free(session);
+        delete session;
+        session = 0;
+      }
+      tthread::lock_guard<tthread::mutex> guard(sslSessionMutex);
+      if (resumed){
+        ++sslResumed;
+      }else{
+        ++sslHandshakes;
+      }
+      if (session){
+        if (sslSessions.count(sessionKey)){
+          mbedtls_ssl_session_free(sslSessions[sessionKey]);
+          delete sslSessions[sessionKey];
+        }else if (sslSessions.size() >= SSL_SESSION_CACHE){
+          mbedtls_ssl_session_free(sslSessions.begin()->second);
+          delete sslSessions.begin()->second;
+          sslSessions.erase(sslSessions.begin());
+        }
+        sslSessions[sessionKey] = session;
+      }
+      DONTEVEN_MSG("SSL handshake with %s %s", sessionKey.c_str(), resumed ? "resumed session" : "set up new session");
+    }
     sslConnected = true;
     isTrueSocket = true;
     setBoundAddr();
@@ -1009,6 +1260,7 @@ const Socket::Buffer &Socket::Connection::Received() const{
 /// Will not buffer anything but always send right away. Blocks.
 /// Any data that could not be send will block until it can be send or the connection is severed.
 void Socket::Connection::SendNow(const char *data, size_t len){
+  INSTRUMENT_SCOPE(Instrument::OUT_WRITE, len);
   bool bing = isBlocking();
   if (!bing){setBlocking(true);}
   unsigned int i = iwrite(data, std::min((long unsigned int)len, SOCKETSIZE));
@@ -1018,6 +1270,55 @@ void Socket::Connection::SendNow(const char *data, size_t len){
   if (!bing){setBlocking(false);}
 }
 
+/// Will not buffer anything but always send right away. Blocks.
+/// Sends the given parts in order as if they were a single buffer, gathering as many of them as possible
+/// into every system call, so callers need not copy them together first.
+/// Any data that could not be send will block until it can be send or the connection is severed.
+void Socket::Connection::SendNow(const struct iovec *parts, size_t count){
+  bool gather = !skipCount;
+#ifdef SSL
+  if (sslConnected){gather = false;}
+#endif
+  if (!gather){
+    for (size_t i = 0; i < count; ++i){SendNow((const char *)parts[i].iov_base, parts[i].iov_len);}
+    return;
+  }
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i){total += parts[i].iov_len;}
+  INSTRUMENT_SCOPE(Instrument::OUT_WRITE, total);
+  bool bing = isBlocking();
+  if (!bing){setBlocking(true);}
+  size_t i = 0;
+  while (i < count && connected()){
+    ssize_t r = writev(sSend, parts + i, std::min(count - i, (size_t)IOV_MAX));
+    if (r < 0){
+      if (errno == EINTR || errno == EWOULDBLOCK){continue;}
+      Error = true;
+      lastErr = strerror(errno);
+      INSANE_MSG("Could not write data! Error: %s", lastErr.c_str());
+      close();
+      break;
+    }
+    if (r == 0){
+      DONTEVEN_MSG("Socket closed by remote");
+      close();
+      break;
+    }
+    up += r;
+    // Skip the parts that were written completely, and finish a partially written one by itself
+    while (i < count && (size_t)r >= parts[i].iov_len){r -= parts[i++].iov_len;}
+    if (r){
+      const char *rest = (const char *)parts[i].iov_base;
+      size_t done = r;
+      while (done < parts[i].iov_len && connected()){
+        done += iwrite(rest + done, std::min(parts[i].iov_len - done, (size_t)SOCKETSIZE));
+      }
+      ++i;
+    }
+  }
+  if (!bing){setBlocking(false);}
+}
+
 /// Will not buffer anything but always send right away. Blocks.
 /// Any data that could not be send will block until it can be send or the connection is severed.
 void Socket::Connection::SendNow(const char *data){
@@ -1330,6 +1631,33 @@ Socket::Connection &Socket::Connection::operator=(const Socket::Connection &rhs)
   return *this;
 }
 
+/// Exchanges this connection with rhs, without duplicating or closing anything.
+/// Unlike copying, this also works for SSL connections.
+void Socket::Connection::swap(Connection &rhs){
+  std::swap(isTrueSocket, rhs.isTrueSocket);
+  std::swap(sSend, rhs.sSend);
+  std::swap(sRecv, rhs.sRecv);
+  std::swap(remotehost, rhs.remotehost);
+  std::swap(boundaddr, rhs.boundaddr);
+  std::swap(remoteaddr, rhs.remoteaddr);
+  std::swap(up, rhs.up);
+  std::swap(down, rhs.down);
+  std::swap(conntime, rhs.conntime);
+  std::swap(downbuffer, rhs.downbuffer);
+  std::swap(lastErr, rhs.lastErr);
+  std::swap(skipCount, rhs.skipCount);
+  std::swap(Error, rhs.Error);
+  std::swap(Blocking, rhs.Blocking);
+#ifdef SSL
+  std::swap(sslConnected, rhs.sslConnected);
+  std::swap(server_fd, rhs.server_fd);
+  std::swap(entropy, rhs.entropy);
+  std::swap(ctr_drbg, rhs.ctr_drbg);
+  std::swap(ssl, rhs.ssl);
+  std::swap(conf, rhs.conf);
+#endif
+}
+
 /// Returns true if the given address can be matched with the remote host.
 /// Can no longer return true after any socket error have occurred.
 bool Socket::Connection::isAddress(const std::string &addr){
@@ -1884,6 +2212,7 @@ void Socket::UDPConnection::SendNow(const char *sdata){
 /// Prints an DLVL_FAIL level debug message if sending failed.
 void Socket::UDPConnection::SendNow(const char *sdata, size_t len){
   if (len < 1){return;}
+  INSTRUMENT_SCOPE(Instrument::OUT_WRITE, len);
   int r = sendto(sock, sdata, len, 0, (sockaddr *)destAddr, destAddr_size);
   if (r > 0){
     up += r;
@@ -1892,6 +2221,38 @@ void Socket::UDPConnection::SendNow(const char *sdata, size_t len){
   }
 }
 
+/// Sends a batch of count UDP datagrams, one for each of the given buffers.
+/// On Linux all datagrams are handed to the kernel with as few sendmmsg calls as possible,
+/// elsewhere this falls back to one sendto call per datagram.
+/// Prints an DLVL_FAIL level debug message if sending failed.
+void Socket::UDPConnection::SendBatch(const struct iovec *packets, size_t count){
+  if (!count){return;}
+#ifdef __linux__
+  std::vector<struct mmsghdr> msgs(count);
+  for (size_t i = 0; i < count; ++i){
+    msgs[i].msg_hdr.msg_name = destAddr;
+    msgs[i].msg_hdr.msg_namelen = destAddr_size;
+    msgs[i].msg_hdr.msg_iov = (struct iovec *)(packets + i);
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  size_t sent = 0;
+  while (sent < count){
+    int r = sendmmsg(sock, &(msgs[sent]), count - sent, 0);
+    if (r < 1){
+      if (r < 0 && errno == EINTR){continue;}
+      FAIL_MSG("Could not send UDP data through %d: %s", sock, strerror(errno));
+      // Skip the datagram that failed and continue with the rest
+      ++sent;
+      continue;
+    }
+    for (int i = 0; i < r; ++i){up += msgs[sent + i].msg_len;}
+    sent += r;
+  }
+#else
+  for (size_t i = 0; i < count; ++i){SendNow((const char *)packets[i].iov_base, packets[i].iov_len);}
+#endif
+}
+
 std::string Socket::UDPConnection::getBoundAddress(){
   std::string boundaddr;
   uint32_t boundport;
@@ -2116,6 +2477,60 @@ bool Socket::UDPConnection::Receive(){
   return (r > 0);
 }
 
+/// Receives up to count datagrams at once, without blocking.
+/// On Linux this is a single recvmmsg call, elsewhere it falls back to one Receive call per datagram.
+/// The datagrams are stored back to back in data, and the size of each is written to sizes.
+/// Datagrams larger than UDP_BATCH_SLOT bytes are truncated.
+/// Returns the amount of datagrams received, which is zero if none were waiting.
+size_t Socket::UDPConnection::ReceiveBatch(size_t *sizes, size_t count){
+  if (sock == -1 || !count){return 0;}
+#ifdef __linux__
+  data.truncate(0);
+  if (!data.allocate(count * UDP_BATCH_SLOT)){return 0;}
+  std::vector<struct mmsghdr> msgs(count);
+  std::vector<struct iovec> iovs(count);
+  std::vector<sockaddr_in6> addrs(count);
+  for (size_t i = 0; i < count; ++i){
+    iovs[i].iov_base = (char *)data + i * UDP_BATCH_SLOT;
+    iovs[i].iov_len = UDP_BATCH_SLOT;
+    msgs[i].msg_hdr.msg_name = &(addrs[i]);
+    msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in6);
+    msgs[i].msg_hdr.msg_iov = &(iovs[i]);
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int r = recvmmsg(sock, &(msgs[0]), count, MSG_DONTWAIT, 0);
+  if (r < 1){
+    if (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK){INFO_MSG("UDP receive: %d (%s)", errno, strerror(errno));}
+    return 0;
+  }
+  // Compact the received datagrams so they are back to back
+  size_t total = 0;
+  for (int i = 0; i < r; ++i){
+    size_t len = msgs[i].msg_len;
+    if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC){
+      WARN_MSG("UDP datagram larger than %d bytes was truncated", UDP_BATCH_SLOT);
+    }
+    if (total != i * UDP_BATCH_SLOT){memmove((char *)data + total, (char *)data + i * UDP_BATCH_SLOT, len);}
+    sizes[i] = len;
+    total += len;
+  }
+  socklen_t destsize = msgs[r - 1].msg_hdr.msg_namelen;
+  if (destAddr && destsize && destAddr_size >= destsize){memcpy(destAddr, &(addrs[r - 1]), destsize);}
+  data.append(0, total);
+  down += total;
+  return r;
+#else
+  Util::ResizeablePointer batch;
+  size_t received = 0;
+  while (received < count && Receive()){
+    batch.append(data, data.size());
+    sizes[received++] = data.size();
+  }
+  data.assign(batch, batch.size());
+  return received;
+#endif
+}
+
 int Socket::UDPConnection::getSock(){
   return sock;
 }
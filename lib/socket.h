@@ -13,6 +13,7 @@
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include "util.h"
@@ -40,6 +41,7 @@ namespace Socket{
   bool isBinAddress(const std::string &binAddr, std::string matchTo);
   bool matchIPv6Addr(const std::string &A, const std::string &B, uint8_t prefix);
   std::string getBinForms(std::string addr);
+  std::string getHostName(const std::string &binAddr, bool &pending);
   /// Returns true if given human-readable address (address, not hostname) is a local address.
   bool isLocal(const std::string &host);
   /// Returns true if given human-readable hostname is a local address.
@@ -51,6 +53,9 @@ namespace Socket{
   bool getPeerName(int fd, std::string &host, uint32_t &port);
   bool getPeerName(int fd, std::string &host, uint32_t &port, sockaddr * tmpaddr, socklen_t * addrlen);
 
+  extern uint64_t sslHandshakes; ///< Outgoing SSL handshakes that set up a new session
+  extern uint64_t sslResumed;    ///< Outgoing SSL handshakes that resumed a cached session
+
   /// A buffer made out of std::string objects that can be efficiently read from and written to.
   class Buffer{
   private:
@@ -71,6 +76,7 @@ namespace Socket{
     bool available(unsigned int count) const;
     std::string remove(unsigned int count);
     void remove(Util::ResizeablePointer & ptr, unsigned int count);
+    void remove(std::string & str, unsigned int count);
     std::string copy(unsigned int count);
     void clear();
   };
@@ -122,6 +128,7 @@ namespace Socket{
     // copy/assignment constructors
     Connection(const Connection &rhs);
     Connection &operator=(const Connection &rhs);
+    void swap(Connection &rhs); ///< Exchanges the connections, including any SSL state, with rhs.
     // destructor
     ~Connection();
     // generic methods
@@ -152,6 +159,7 @@ namespace Socket{
     void SendNow(const char *data); ///< Will not buffer anything but always send right away. Blocks.
     void SendNow(const char *data,
                  size_t len); ///< Will not buffer anything but always send right away. Blocks.
+    void SendNow(const struct iovec *parts, size_t count); ///< Sends all parts in order right away. Blocks.
     void skipBytes(uint32_t byteCount);
     uint32_t skipCount;
     // unbuffered i/o methods
@@ -225,9 +233,11 @@ namespace Socket{
     std::string getBoundAddress();
     uint32_t getDestPort() const;
     bool Receive();
+    size_t ReceiveBatch(size_t *sizes, size_t count);
     void SendNow(const std::string &data);
     void SendNow(const char *data);
     void SendNow(const char *data, size_t len);
+    void SendBatch(const struct iovec *packets, size_t count);
     void setSocketFamily(int AF_TYPE);
   };
 }// namespace Socket
@@ -906,19 +906,104 @@ bool Util::checkException(const JSON::Value &ex, const std::string &useragent){
   return ret;
 }
 
+/// Writes packed DTSC data to the given page, for reading through DTSCShmReader.
+/// Versioned pages hold two data slots. If the page is already open and the data fits, it is written
+/// into the slot readers are not using and the version counter is bumped, so open readers switch over
+/// on their next read without reopening anything. Otherwise the page is replaced by a new one with
+/// room to grow, and the old page is flagged for reload. Returns false if the page could not be created.
+bool Util::writeDTSCPage(IPC::sharedPage &page, const std::string &pageName, const std::string &data){
+  if (page){
+    Util::RelAccX A(page.mapped, false);
+    Util::RelAccXFieldData verField = A.getFieldData("version");
+    Util::RelAccXFieldData altField = A.getFieldData("dtsc_alt");
+    if (A.isReady() && !A.isReload() && verField.type && altField.size >= data.size()){
+      uint64_t ver = A.getInt(verField);
+      char *slot = A.getPointer((ver & 1) ? A.getFieldData("dtsc_data") : altField);
+      memcpy(slot, data.data(), data.size());
+      memset(slot + data.size(), 0, altField.size - data.size());
+      // The slot must be complete before readers can see the new version
+      __sync_synchronize();
+      A.setInt(verField, ver + 1);
+      return true;
+    }
+    A.setReload();
+    page.master = true;
+    page.close();
+  }
+  // Flag any page left behind by a previous process, so its readers reopen
+  page.init(pageName, 0, false, false);
+  if (page){
+    Util::RelAccX tmpA(page.mapped, false);
+    if (tmpA.isReady()){tmpA.setReload();}
+    page.master = true;
+    page.close();
+  }
+  size_t slotSize = data.size() + data.size() / 2 + 256;
+  page.init(pageName, slotSize * 2 + 256, true, false);
+  if (!page){return false;}
+  Util::RelAccX A(page.mapped, false);
+  A.addField("dtsc_data", RAX_DTSC, slotSize);
+  A.addField("dtsc_alt", RAX_DTSC, slotSize);
+  A.addField("version", RAX_64UINT);
+  memcpy(A.getPointer("dtsc_data"), data.data(), data.size());
+  A.setInt("version", 0);
+  A.setRCount(1);
+  A.setEndPos(1);
+  A.setReady();
+  return true;
+}
+
 Util::DTSCShmReader::DTSCShmReader(const std::string &pageName){
+  copyValid = false;
+  copyVersion = 0;
+  if (pageName.size()){open(pageName);}
+}
+
+/// (Re)opens the given page for reading.
+void Util::DTSCShmReader::open(const std::string &pageName){
+  rPage.close();
+  rAcc = Util::RelAccX();
+  copyValid = false;
   rPage.init(pageName, 0, false, false);
-  if (rPage){rAcc = Util::RelAccX(rPage.mapped);}
+  if (!rPage){return;}
+  rAcc = Util::RelAccX(rPage.mapped);
+  dataField = rAcc.getFieldData("dtsc_data");
+  altField = rAcc.getFieldData("dtsc_alt");
+  versionField = rAcc.getFieldData("version");
+}
+
+/// Returns true if the page is not open, or was replaced or removed by its writer and must be reopened.
+bool Util::DTSCShmReader::isStale() const{return !rPage || rAcc.isReload();}
+
+/// Returns the version counter of the data, which changes on every update. Always 0 for unversioned pages.
+uint64_t Util::DTSCShmReader::getVersion() const{
+  if (!rPage || !versionField.type){return 0;}
+  return rAcc.getInt(versionField);
 }
 
 DTSC::Scan Util::DTSCShmReader::getMember(const std::string &indice){
-  if (!rPage){return DTSC::Scan();}
-  return DTSC::Scan(rAcc.getPointer("dtsc_data"), rAcc.getSize("dtsc_data")).getMember(indice.c_str());
+  return getScan().getMember(indice.c_str());
 }
 
+/// Returns the current data. Versioned pages are copied out of the page and the version is checked again
+/// afterwards, since two quick writes reuse the slot being read; the copy is retried until it is consistent.
+/// The returned scan stays valid until the next call that finds a new version.
 DTSC::Scan Util::DTSCShmReader::getScan(){
-  if (!rPage){return DTSC::Scan();}
-  return DTSC::Scan(rAcc.getPointer("dtsc_data"), rAcc.getSize("dtsc_data"));
+  if (!rPage || !dataField.type){return DTSC::Scan();}
+  if (!versionField.type){return DTSC::Scan(rAcc.getPointer(dataField), dataField.size);}
+  uint64_t ver = rAcc.getInt(versionField);
+  while (!copyValid || ver != copyVersion){
+    const Util::RelAccXFieldData &slot = (ver & 1) ? altField : dataField;
+    copy.assign(rAcc.getPointer(slot), slot.size);
+    __sync_synchronize();
+    uint64_t reVer = rAcc.getInt(versionField);
+    if (reVer == ver){
+      copyVersion = ver;
+      copyValid = true;
+    }
+    ver = reVer;
+  }
+  return DTSC::Scan((char *)copy.data(), copy.size());
 }
 
 /// Takes an existing track list, and selects tracks from it according to the given track type and selector
@@ -87,15 +87,29 @@ namespace Util{
   };
 
 
+  bool writeDTSCPage(IPC::sharedPage &page, const std::string &pageName, const std::string &data);
+
+  /// Reads DTSC data from a shared memory page written by the controller.
+  /// Pages written by writeDTSCPage carry a version counter, so a reader may be kept open and only
+  /// needs to check getVersion() to see if the data changed, and isStale() to see if it must reopen.
   class DTSCShmReader{
   public:
-    DTSCShmReader(const std::string &pageName);
+    DTSCShmReader(const std::string &pageName = "");
+    void open(const std::string &pageName);
+    bool isStale() const;
+    uint64_t getVersion() const;
     DTSC::Scan getMember(const std::string &indice);
     DTSC::Scan getScan();
 
   private:
     IPC::sharedPage rPage;
     Util::RelAccX rAcc;
+    Util::RelAccXFieldData dataField;
+    Util::RelAccXFieldData altField;
+    Util::RelAccXFieldData versionField;
+    std::string copy; ///< Consistent copy of the data of a versioned page
+    uint64_t copyVersion; ///< Version the copy was made of
+    bool copyValid;
   };
 
 }// namespace Util
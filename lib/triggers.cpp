@@ -15,6 +15,12 @@
 /// Currently, all triggers are handled asynchronously and responses (if any) are completely
 /// ignored. In the future this may change.
 ///
+/// URL handlers are contacted over keep-alive connections that each process keeps open per
+/// destination, so a busy process does not open a new (TLS) connection for every trigger.
+/// Responses to blocking triggers can optionally be cached: when the MIST_TRIGGER_CACHE environment
+/// variable is set to a number of milliseconds, a blocking trigger with the exact same name,
+/// destination and payload as one sent less than that long ago re-uses its response.
+///
 
 #include "bitfields.h"  //for strToBool
 #include "defines.h"    //for FAIL_MSG and INFO_MSG
@@ -25,18 +31,150 @@
 #include "triggers.h"
 #include "util.h"
 #include "json.h"
+#include "tinythread.h"
+#include <deque>
+#include <map>
 #include <string.h> //for strncmp
 
 namespace Triggers{
 
+  static tthread::mutex statMutex; ///< Guards the socket used to report trigger statistics
+  static tthread::mutex execMutex; ///< Guards the environment while starting trigger executables
+
   static void submitTriggerStat(const std::string trigger, uint64_t millis, bool ok){
+    static Socket::UDPConnection *uSock = 0;
+    static pid_t uSockPid = 0;
+    // Triggers may run from several threads at once, such as the workers of session tracker shards
+    tthread::lock_guard<tthread::mutex> guard(statMutex);
     JSON::Value j;
     j["trigger_stat"]["name"] = trigger;
     j["trigger_stat"]["ms"] = Util::bootMS() - millis;
     j["trigger_stat"]["ok"] = ok;
-    Socket::UDPConnection uSock;
-    uSock.SetDestination(UDP_API_HOST, UDP_API_PORT);
-    uSock.SendNow(j.toString());
+    // Re-use one socket per process for all trigger stats
+    if (!uSock || uSockPid != getpid()){
+      uSock = new Socket::UDPConnection();
+      uSock->SetDestination(UDP_API_HOST, UDP_API_PORT);
+      uSockPid = getpid();
+    }
+    uSock->SendNow(j.toString());
+  }
+
+  /// A keep-alive HTTP connection to a trigger destination.
+  struct pooledConn{
+    HTTP::Downloader *DL;
+    uint64_t pendingSince; ///< When an asynchronous trigger was sent without reading its response, or zero.
+  };
+
+  static tthread::mutex poolMutex;
+  static std::map<std::string, std::deque<pooledConn> > connPool; ///< Idle connections per destination
+  static pid_t poolPid = 0; ///< Process that opened the connections in connPool
+
+  /// Tries to read away the response to an earlier asynchronous trigger, without blocking.
+  /// Returns true if the connection can be used for a new request. Closes the connection if the
+  /// response takes too long or the server will not keep the connection open.
+  static bool drainConn(pooledConn &conn){
+    if (!conn.pendingSince){return true;}
+    Socket::Connection &s = conn.DL->getSocket();
+    HTTP::Parser &H = conn.DL->getHTTP();
+    if (s){s.spool();}
+    if (s && H.Read(s)){
+      if (H.protocol == "HTTP/1.0" || H.GetHeader("Connection") == "close"){s.close();}
+      H.Clean();
+      conn.pendingSince = 0;
+      return true;
+    }
+    if (s && Util::bootMS() < conn.pendingSince + TRIGGER_POOL_PENDING_MS){return false;}
+    s.close();
+    H.Clean();
+    conn.pendingSince = 0;
+    return true;
+  }
+
+  /// Takes an idle connection to the given destination out of the pool, or creates a new one.
+  /// Connections inherited from a parent process are abandoned without closing them, since the
+  /// parent may still be using them.
+  static pooledConn getConn(const std::string &dest){
+    pooledConn ret;
+    ret.DL = 0;
+    ret.pendingSince = 0;
+    {
+      tthread::lock_guard<tthread::mutex> guard(poolMutex);
+      if (poolPid != getpid()){
+        for (std::map<std::string, std::deque<pooledConn> >::iterator it = connPool.begin(); it != connPool.end(); ++it){
+          for (std::deque<pooledConn>::iterator jt = it->second.begin(); jt != it->second.end(); ++jt){
+            jt->DL->getSocket().drop();
+            delete jt->DL;
+          }
+        }
+        connPool.clear();
+        poolPid = getpid();
+      }
+      // Take the most recently used connection that is not still waiting for a response
+      std::deque<pooledConn> &idle = connPool[dest];
+      for (std::deque<pooledConn>::reverse_iterator it = idle.rbegin(); it != idle.rend(); ++it){
+        if (drainConn(*it)){
+          ret = *it;
+          idle.erase(--(it.base()));
+          break;
+        }
+      }
+    }
+    if (!ret.DL){
+      ret.DL = new HTTP::Downloader();
+      ret.DL->setHeader("Content-Type", "text/plain");
+    }
+    return ret;
+  }
+
+  /// Returns a connection to the pool of idle connections. Deletes it instead when it was closed,
+  /// or when the pool for this destination is full.
+  static void releaseConn(const std::string &dest, pooledConn &conn){
+    if (conn.DL->getSocket()){
+      tthread::lock_guard<tthread::mutex> guard(poolMutex);
+      std::deque<pooledConn> &idle = connPool[dest];
+      if (idle.size() < TRIGGER_POOL_SIZE){
+        idle.push_back(conn);
+        return;
+      }
+    }
+    delete conn.DL;
+  }
+
+  /// A cached response to a blocking trigger, and when it stops being valid.
+  struct cachedResponse{
+    std::string response;
+    uint64_t expires;
+  };
+
+  static tthread::mutex cacheMutex;
+  static std::map<std::string, cachedResponse> responseCache;
+
+  /// Returns the configured response cache duration in milliseconds, zero if disabled.
+  static uint64_t cacheTime(){
+    static int64_t ms = -1;
+    if (ms < 0){
+      const char *env = getenv("MIST_TRIGGER_CACHE");
+      ms = env ? atoll(env) : 0;
+      if (ms < 0){ms = 0;}
+    }
+    return ms;
+  }
+
+  /// Stores a response in the response cache, cleaning out expired entries while at it.
+  static void cacheResponse(const std::string &key, const std::string &response){
+    uint64_t now = Util::bootMS();
+    tthread::lock_guard<tthread::mutex> guard(cacheMutex);
+    std::map<std::string, cachedResponse>::iterator it = responseCache.begin();
+    while (it != responseCache.end()){
+      if (it->second.expires <= now){
+        responseCache.erase(it++);
+      }else{
+        ++it;
+      }
+    }
+    cachedResponse &c = responseCache[key];
+    c.response = response;
+    c.expires = now + cacheTime();
   }
 
   ///\brief Handles a trigger by sending a payload to a destination.
@@ -52,18 +190,38 @@ namespace Triggers{
       WARN_MSG("Trigger requested with empty destination");
       return "true";
     }
+    std::string cacheKey;
+    if (sync && cacheTime()){
+      cacheKey = trigger + "\n" + value + "\n" + payload;
+      tthread::lock_guard<tthread::mutex> guard(cacheMutex);
+      std::map<std::string, cachedResponse>::iterator it = responseCache.find(cacheKey);
+      if (it != responseCache.end()){
+        if (it->second.expires > tStartMs){
+          MEDIUM_MSG("Using cached %s trigger response from %s", trigger.c_str(), value.c_str());
+          return it->second.response;
+        }
+        responseCache.erase(it);
+      }
+    }
     INFO_MSG("Executing %s trigger: %s (%s)", trigger.c_str(), value.c_str(), sync ? "blocking" : "asynchronous");
     if (value.substr(0, 7) == "http://" || value.substr(0, 8) == "https://"){// interpret as url
-      HTTP::Downloader DL;
-      DL.setHeader("X-Trigger", trigger);
-      DL.setHeader("Content-Type", "text/plain");
       HTTP::URL url(value);
+      std::string dest = url.protocol + "://" + url.host + ":" + JSON::Value(url.getPort()).asString();
+      pooledConn conn = getConn(dest);
+      HTTP::Downloader &DL = *conn.DL;
+      DL.setHeader("X-Trigger", trigger);
       if (DL.post(url, payload, sync) && (!sync || DL.isOk())){
+        std::string ret = DL.data();
+        if (!sync){conn.pendingSince = Util::bootMS();}
+        releaseConn(dest, conn);
         submitTriggerStat(trigger, tStartMs, true);
-        return DL.data();
+        if (cacheKey.size()){cacheResponse(cacheKey, ret);}
+        return ret;
       }
       FAIL_MSG("Trigger failed to execute (%s), using default response: %s",
                DL.getStatusText().c_str(), defaultResponse.c_str());
+      DL.getSocket().close();
+      releaseConn(dest, conn);
       submitTriggerStat(trigger, tStartMs, false);
       return defaultResponse;
     }else{// send payload to stdin of newly forked process
@@ -75,11 +233,16 @@ namespace Triggers{
       argv[0] = (char *)value.c_str();
       argv[1] = (char *)trigger.c_str();
       argv[2] = NULL;
-      setenv("MIST_TRIGGER", trigger.c_str(), 1);
-      setenv("MIST_TRIG_DEF", defaultResponse.c_str(), 1);
-      pid_t myProc = Util::Procs::StartPiped(argv, &fdIn, &fdOut, &fdErr); // start new process and return stdin file desc.
-      unsetenv("MIST_TRIGGER");
-      unsetenv("MIST_TRIG_DEF");
+      pid_t myProc;
+      {
+        // The environment is shared between threads, so only one trigger process is started at a time
+        tthread::lock_guard<tthread::mutex> guard(execMutex);
+        setenv("MIST_TRIGGER", trigger.c_str(), 1);
+        setenv("MIST_TRIG_DEF", defaultResponse.c_str(), 1);
+        myProc = Util::Procs::StartPiped(argv, &fdIn, &fdOut, &fdErr); // start new process and return stdin file desc.
+        unsetenv("MIST_TRIGGER");
+        unsetenv("MIST_TRIG_DEF");
+      }
       if (fdIn == -1 || fdOut == -1 || myProc == -1){
         FAIL_MSG("Could not execute trigger executable: %s", strerror(errno));
         submitTriggerStat(trigger, tStartMs, false);
@@ -119,6 +282,7 @@ namespace Triggers{
           return defaultResponse;
         }
         submitTriggerStat(trigger, tStartMs, true);
+        if (cacheKey.size()){cacheResponse(cacheKey, ret);}
         return ret;
       }
       close(fdOut);
@@ -127,8 +291,6 @@ namespace Triggers{
     }
   }
 
-  static std::string usually_empty;
-
   ///\brief returns true if a trigger of the specified type should be handled for a specified stream
   ///(, or entire server) \param type Trigger event type. \param streamName the stream to be handled
   ///\return returns true if so
@@ -137,7 +299,7 @@ namespace Triggers{
   /// handled for a specified stream (, or entire server)
   bool shouldTrigger(const std::string &type, const std::string &streamName,
                      bool paramsCB(const char *, const void *), const void *extraParam){
-    usually_empty.clear();
+    std::string usually_empty;
     return doTrigger(type, empty, streamName, true, usually_empty, paramsCB, extraParam);
   }
 
@@ -147,7 +309,7 @@ namespace Triggers{
   /// processing should be aborted.
   /// calls doTrigger with dryRun set to false
   bool doTrigger(const std::string &type, const std::string &payload, const std::string &streamName){
-    usually_empty.clear();
+    std::string usually_empty;
     return doTrigger(type, payload, streamName, false, usually_empty);
   }
 
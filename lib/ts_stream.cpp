@@ -10,8 +10,6 @@
 #include "tinythread.h"
 #include "opus.h"
 
-tthread::recursive_mutex tMutex;
-
 
 namespace TS{
 
@@ -139,12 +137,64 @@ namespace TS{
   uint64_t ADTSRemainder::getTodo(){return len - now;}
   char *ADTSRemainder::getData(){return data;}
 
+  PIDState::PIDState(){
+    codec = 0;
+    isPMT = false;
+    hasPSI = false;
+    lastCC = -1;
+    rolloverCount = 0;
+    lastms = 0;
+  }
+
+  /// Clears all buffered data for this PID, keeping the codec information intact.
+  void PIDState::partialClear(){
+    hasPSI = false;
+    pesData.truncate(0);
+    pesStarts.clear();
+    pesPositions.clear();
+    lastCC = -1;
+    outPackets.clear();
+    buildPacket.null();
+    rolloverCount = 0;
+    lastms = 0;
+  }
+
   Stream::Stream(){
-    psCache = 0;
-    psCacheTid = 0;
+    lastPAT = 0;
+    memset(pids, 0, sizeof(pids));
   }
 
-  Stream::~Stream(){}
+  Stream::~Stream(){
+    for (std::set<size_t>::iterator it = usedPids.begin(); it != usedPids.end(); ++it){
+      delete pids[*it];
+    }
+  }
+
+  /// Returns the state for the given PID, or a null pointer if there is none.
+  PIDState *Stream::findPID(size_t tid) const{
+    if (tid >= TS_PID_COUNT){return 0;}
+    return pids[tid];
+  }
+
+  /// Returns the state for the given PID, allocating it if needed.
+  /// The PID must be below TS_PID_COUNT.
+  PIDState &Stream::getPID(size_t tid){
+    if (!pids[tid]){
+      pids[tid] = new PIDState();
+      usedPids.insert(tid);
+    }
+    return *pids[tid];
+  }
+
+  /// Sets the codec for the given PID, where a codec of 0 marks it as not carrying known data.
+  void Stream::setCodec(size_t tid, uint32_t codec){
+    getPID(tid).codec = codec;
+    if (codec){
+      dataPids.insert(tid);
+    }else{
+      dataPids.erase(tid);
+    }
+  }
 
   void Stream::parse(char *newPack, uint64_t bytePos){
     Packet newPacket;
@@ -154,42 +204,30 @@ namespace TS{
 
   void Stream::partialClear(){
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    pesStreams.clear();
-    psCacheTid = 0;
-    psCache = 0;
-    pesPositions.clear();
-    outPackets.clear();
-    buildPacket.clear();
-    seenUnitStart.clear();
-    lastms.clear();
-    rolloverCount.clear();
+    for (std::set<size_t>::iterator it = usedPids.begin(); it != usedPids.end(); ++it){
+      pids[*it]->partialClear();
+    }
   }
 
   void Stream::clear(){
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    partialClear();
-    pidToCodec.clear();
-    adtsInfo.clear();
-    spsInfo.clear();
-    ppsInfo.clear();
-    hevcInfo.clear();
-    metaInit.clear();
-    descriptors.clear();
+    for (std::set<size_t>::iterator it = usedPids.begin(); it != usedPids.end(); ++it){
+      delete pids[*it];
+      pids[*it] = 0;
+    }
+    usedPids.clear();
+    dataPids.clear();
     mappingTable.clear();
     lastPMT.clear();
     lastPAT = 0;
     pmtTracks.clear();
-    remainders.clear();
     associationTable = ProgramAssociationTable();
   }
 
   void Stream::finish(){
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    if (!pesStreams.size()){return;}
-
-    for (std::map<size_t, std::deque<Packet> >::const_iterator i = pesStreams.begin();
-         i != pesStreams.end(); i++){
-      parsePES(i->first, true);
+    for (std::set<size_t>::iterator it = dataPids.begin(); it != dataPids.end(); ++it){
+      parsePES(*it, true);
     }
   }
 
@@ -202,50 +240,67 @@ namespace TS{
   void Stream::add(Packet &newPack, uint64_t bytePos){
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
     uint32_t tid = newPack.getPID();
+    PIDState *st = pids[tid];
+    if (!st){
+      if (tid){return;}
+      st = &getPID(tid);
+    }
     bool unitStart = newPack.getUnitStart();
-    static uint32_t wantPrev = 0;
-    bool isData = pidToCodec.count(tid);
-    bool wantTrack = ((wantPrev == tid) || (tid == 0 || newPack.isPMT(pmtTracks) || isData));
-    if (!wantTrack){return;}
-    if (psCacheTid != tid || !psCache){
-      psCache = &(pesStreams[tid]);
-      psCacheTid = tid;
+
+    // PAT and PMT packets are parsed one at a time, so we only keep the last one
+    if (!tid || st->isPMT){
+      if (unitStart || st->hasPSI){
+        st->psiPacket = newPack;
+        st->hasPSI = true;
+      }
+      return;
     }
-    if (unitStart || !psCache->empty()){
-      wantPrev = tid;
-      psCache->push_back(newPack);
-      if (unitStart && isData){
-        pesPositions[tid].push_back(bytePos);
-        ++(seenUnitStart[tid]);
+    if (!st->codec){return;}
+
+    int cc = newPack.getContinuityCounter();
+    if (unitStart){
+      st->pesStarts.push_back(st->pesData.size());
+      st->pesPositions.push_back(bytePos);
+    }else{
+      // Nothing to append to if we never saw the start of this PES packet
+      if (!st->pesStarts.size()){return;}
+      // Skip duplicate packets
+      if (cc == st->lastCC){return;}
+      if (cc - st->lastCC != 1 && cc){
+        INFO_MSG("Parsing PES on track %" PRIu32 ", missed %d packets", tid, cc - st->lastCC - 1);
       }
     }
+    st->lastCC = cc;
+    if (newPack.getPayloadLength() > 0){
+      st->pesData.append(newPack.getPayload(), newPack.getPayloadLength());
+    }
   }
 
   bool Stream::isDataTrack(size_t tid) const{
     if (tid == 0){return false;}
     {
       tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-      return pidToCodec.count(tid);
+      PIDState *st = findPID(tid);
+      return st && st->codec;
     }
   }
 
   void Stream::parse(size_t tid){
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    if (!pesStreams.count(tid) || pesStreams[tid].size() == 0){return;}
-    if (psCacheTid != tid || !psCache){
-      psCache = &(pesStreams[tid]);
-      psCacheTid = tid;
-    }
+    PIDState *st = findPID(tid);
+    if (!st){return;}
 
     // Handle PAT packets
     if (tid == 0){
+      if (!st->hasPSI){return;}
       ///\todo Keep track of updates in PAT instead of keeping only the last PAT as a reference
-      associationTable = psCache->back();
+      associationTable = st->psiPacket;
+      st->hasPSI = false;
       lastPAT = Util::bootSecs();
       associationTable.parsePIDs(pmtTracks);
-      pesStreams.erase(0);
-      psCacheTid = 0;
-      psCache = 0;
+      for (std::set<unsigned int>::iterator it = pmtTracks.begin(); it != pmtTracks.end(); ++it){
+        if (*it < TS_PID_COUNT){getPID(*it).isPMT = true;}
+      }
       return;
     }
 
@@ -253,10 +308,12 @@ namespace TS{
     if (tid == 1){return;}
 
     // Handle PMT packets
-    if (pmtTracks.count(tid)){
+    if (st->isPMT){
+      if (!st->hasPSI){return;}
       ///\todo Keep track of updates in PMT instead of keeping only the last PMT per program as a
       /// reference
-      mappingTable[tid] = psCache->back();
+      mappingTable[tid] = st->psiPacket;
+      st->hasPSI = false;
       lastPMT[tid] = Util::bootSecs();
       ProgramMappingEntry entry = mappingTable[tid].getEntry(0);
       while (entry){
@@ -272,16 +329,16 @@ namespace TS{
         case MPEG2:
         case OPUS:
         case META:{
-          pidToCodec[pid] = sType;
-          std::string & init = metaInit[pid];
+          setCodec(pid, sType);
+          std::string & init = getPID(pid).metaInit;
           init.assign(entry.getESInfo(), entry.getESInfoLength());
           if (sType == META){
             TS::ProgramDescriptors desc(init.data(), init.size());
             std::string reg = desc.getRegistration();
             if (reg == "Opus"){
-              pidToCodec[pid] = OPUS;
+              setCodec(pid, OPUS);
             }else{
-              pidToCodec.erase(pid);
+              setCodec(pid, 0);
             }
           }
         } break;
@@ -289,23 +346,17 @@ namespace TS{
         }
         entry.advance();
       }
-
-      pesStreams.erase(tid);
-      psCacheTid = 0;
-      psCache = 0;
       return;
     }
 
-    if (!pidToCodec.count(tid)){
-      pesStreams.erase(tid);
-      pesPositions.erase(tid);
-      seenUnitStart.erase(tid);
-      psCacheTid = 0;
-      psCache = 0;
+    if (!st->codec){
+      st->pesData.truncate(0);
+      st->pesStarts.clear();
+      st->pesPositions.clear();
       return; // skip unknown codecs
     }
 
-    while (seenUnitStart[tid] > 1){parsePES(tid);}
+    while (st->pesStarts.size() > 1){parsePES(tid);}
   }
 
   void Stream::parse(Packet &newPack, uint64_t bytePos){
@@ -316,56 +367,41 @@ namespace TS{
 
   bool Stream::hasPacketOnEachTrack() const{
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    if (!pidToCodec.size()){
-      // INFO_MSG("no packet on each track 1, pidtocodec.size: %d, outpacket.size: %d",
-      // pidToCodec.size(), outPackets.size());
+    if (!dataPids.size()){
       return false;
     }
     size_t missing = 0;
     uint64_t firstTime = 0xffffffffffffffffull, lastTime = 0;
-    for (std::map<size_t, uint32_t>::const_iterator it = pidToCodec.begin(); it != pidToCodec.end(); it++){
-      if (!hasPacket(it->first) || !outPackets.count(it->first) || !outPackets.at(it->first).size()){
+    for (std::set<size_t>::const_iterator it = dataPids.begin(); it != dataPids.end(); it++){
+      const std::deque<DTSC::Packet> &out = pids[*it]->outPackets;
+      if (!hasPacket(*it) || !out.size()){
         missing++;
       }else{
-        if (outPackets.at(it->first).front().getTime() < firstTime){
-          firstTime = outPackets.at(it->first).front().getTime();
-        }
-        if (outPackets.at(it->first).back().getTime() > lastTime){
-          lastTime = outPackets.at(it->first).back().getTime();
-        }
+        if (out.front().getTime() < firstTime){firstTime = out.front().getTime();}
+        if (out.back().getTime() > lastTime){lastTime = out.back().getTime();}
       }
     }
 
-    return (!missing || (missing != pidToCodec.size() && lastTime - firstTime > 2000));
+    return (!missing || (missing != dataPids.size() && lastTime - firstTime > 2000));
   }
 
   bool Stream::hasPacket(size_t tid) const{
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    if (psCacheTid != tid && pesStreams.find(tid) == pesStreams.end()){return false;}
-    if (outPackets.count(tid) && outPackets.at(tid).size()){return true;}
-    if (pidToCodec.count(tid) && seenUnitStart.count(tid) && seenUnitStart.at(tid) > 1){
-      return true;
-    }
+    PIDState *st = findPID(tid);
+    if (!st){return false;}
+    if (st->outPackets.size()){return true;}
+    if (st->codec && st->pesStarts.size() > 1){return true;}
     return false;
   }
 
   bool Stream::hasPacket() const{
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    if (!pesStreams.size()){return false;}
-
-    if (outPackets.size()){
-      for (std::map<size_t, std::deque<DTSC::Packet> >::const_iterator i = outPackets.begin();
-           i != outPackets.end(); i++){
-        if (i->second.size()){return true;}
-      }
+    for (std::set<size_t>::const_iterator it = usedPids.begin(); it != usedPids.end(); it++){
+      if (pids[*it]->outPackets.size()){return true;}
     }
-
-    for (std::map<size_t, uint32_t>::const_iterator i = seenUnitStart.begin(); i != seenUnitStart.end(); i++){
-      if (pidToCodec.count(i->first) && i->second > 1){
-        return true;
-      }
+    for (std::set<size_t>::const_iterator it = dataPids.begin(); it != dataPids.end(); it++){
+      if (pids[*it]->pesStarts.size() > 1){return true;}
     }
-
     return false;
   }
 
@@ -381,89 +417,26 @@ namespace TS{
   }
 
   void Stream::parsePES(size_t tid, bool finished){
-    if (!pidToCodec.count(tid)){
+    PIDState *st = findPID(tid);
+    if (!st || !st->codec){
       return; // skip unknown codecs
     }
-    if (psCacheTid != tid || !psCache){
-      psCache = &(pesStreams[tid]);
-      psCacheTid = tid;
-    }
-    if (!psCache->size() || (!finished && psCache->size() <= 1)){
+    if (!st->pesStarts.size() || (!finished && st->pesStarts.size() < 2)){
       if (!finished){FAIL_MSG("No PES packets to parse");}
-      seenUnitStart[tid] = 0;
-      return;
-    }
-    // Find number of packets before unit Start
-    size_t packNum = 1;
-    std::deque<Packet>::iterator curPack = psCache->begin();
-
-    if (seenUnitStart[tid] == 2 && psCache->begin()->getUnitStart() && psCache->rbegin()->getUnitStart()){
-      packNum = psCache->size() - 1;
-      curPack = psCache->end();
-      curPack--;
-    }else{
-      curPack++;
-      while (curPack != psCache->end() && !curPack->getUnitStart()){
-        curPack++;
-        packNum++;
-      }
-    }
-    if (!finished && curPack == psCache->end()){
-      FAIL_MSG("No PES packets to parse (%" PRIu32 ")", seenUnitStart[tid]);
-      seenUnitStart[tid] = 0;
       return;
     }
 
-    // We now know we're deleting 1 UnitStart, so we can pop the pesPositions and lower the seenUnitStart counter.
-    --(seenUnitStart[tid]);
-    std::deque<uint64_t> &inPositions = pesPositions[tid];
-    uint64_t bPos = inPositions.front();
-    inPositions.pop_front();
-
-    // Create a buffer for the current PES, and remove it from the pesStreams buffer.
-    uint32_t paySize = 0;
-
-    // Loop over the packets we need, and calculate the total payload size
-    curPack = psCache->begin();
-    int lastCtr = curPack->getContinuityCounter() - 1;
-    for (size_t i = 0; i < packNum; i++){
-      if (curPack->getContinuityCounter() == lastCtr){
-        curPack++;
-        continue;
-      }
-      lastCtr = curPack->getContinuityCounter();
-      paySize += curPack->getPayloadLength();
-      curPack++;
-    }
-    VERYHIGH_MSG("Parsing PES for track %zu, length %" PRIu32, tid, paySize);
-    // allocate a buffer, do it all again, but this time also copy the data bytes over to char*
-    // payload
-    char *payload = (char *)malloc(paySize);
-    if (!payload){
-      FAIL_MSG("cannot allocate PES packet!");
-      return;
-    }
+    // The PES packet runs up to the start of the next one, or to the end of the buffer when finishing
+    size_t pesBegin = st->pesStarts.front();
+    size_t pesEnd = (st->pesStarts.size() > 1 ? st->pesStarts[1] : st->pesData.size());
+    uint64_t bPos = st->pesPositions.front();
+    st->pesStarts.pop_front();
+    st->pesPositions.pop_front();
 
-    paySize = 0;
-    curPack = psCache->begin();
-    lastCtr = curPack->getContinuityCounter() - 1;
-    for (int i = 0; i < packNum; i++){
-      if (curPack->getContinuityCounter() == lastCtr){
-        curPack++;
-        continue;
-      }
-      if (curPack->getContinuityCounter() - lastCtr != 1 && curPack->getContinuityCounter()){
-        INFO_MSG("Parsing PES on track %zu, missed %d packets", tid,
-                 curPack->getContinuityCounter() - lastCtr - 1);
-      }
-      lastCtr = curPack->getContinuityCounter();
-      memcpy(payload + paySize, curPack->getPayload(), curPack->getPayloadLength());
-      paySize += curPack->getPayloadLength();
-      curPack++;
-    }
-    psCache->erase(psCache->begin(), curPack);
-    // we now have the whole PES packet in char* payload, with a total size of paySize (including
-    // headers)
+    // We now have the whole PES packet (including headers) in our buffer, and parse it in place
+    const char *payload = (const char *)st->pesData + pesBegin;
+    uint32_t paySize = pesEnd - pesBegin;
+    VERYHIGH_MSG("Parsing PES for track %zu, length %" PRIu32, tid, paySize);
 
     // Parse the PES header
     uint32_t offset = 0;
@@ -474,7 +447,7 @@ namespace TS{
       // Check for large enough buffer
       if ((paySize - offset) < 9 || (paySize - offset) < 9 + pesHeader[8]){
         INFO_MSG("Not enough data (%d / %d) on track %zu (%" PRIu32 "), discarding remainder of data",
-                 paySize - offset, 9 + pesHeader[8], tid, pidToCodec[tid]);
+                 paySize - offset, 9 + pesHeader[8], tid, st->codec);
         break;
       }
 
@@ -519,11 +492,11 @@ namespace TS{
         }
       }
 
-      timeStamp += (rolloverCount[tid] * TS_PTS_ROLLOVER);
+      timeStamp += (st->rolloverCount * TS_PTS_ROLLOVER);
 
-      if ((timeStamp < lastms[tid]) && ((timeStamp % TS_PTS_ROLLOVER) < 0.1 * TS_PTS_ROLLOVER) &&
-          ((lastms[tid] % TS_PTS_ROLLOVER) > 0.9 * TS_PTS_ROLLOVER)){
-        ++rolloverCount[tid];
+      if ((timeStamp < st->lastms) && ((timeStamp % TS_PTS_ROLLOVER) < 0.1 * TS_PTS_ROLLOVER) &&
+          ((st->lastms % TS_PTS_ROLLOVER) > 0.9 * TS_PTS_ROLLOVER)){
+        ++st->rolloverCount;
         timeStamp += TS_PTS_ROLLOVER;
       }
 
@@ -550,63 +523,78 @@ namespace TS{
       }else{
         const char *pesPayload = pesHeader + pesOffset;
         parseBitstream(tid, pesPayload, realPayloadSize, timeStamp, timeOffset, bPos, pesHeader[6] & 0x04);
-        lastms[tid] = timeStamp;
+        st->lastms = timeStamp;
       }
 
       // Shift the offset by the payload size, the mandatory headers and the optional
       // headers/padding
       offset += realPayloadSize + (9 + pesHeader[8]);
     }
-    if (finished && (pidToCodec[tid] == H264 || pidToCodec[tid] == H265)){
-      if (buildPacket.count(tid) && buildPacket[tid].getDataStringLen()){
-        outPackets[tid].push_back(buildPacket[tid]);
-        buildPacket.erase(tid);
+    if (finished && (st->codec == H264 || st->codec == H265)){
+      if (st->buildPacket && st->buildPacket.getDataStringLen()){
+        st->outPackets.push_back(DTSC::Packet());
+        st->outPackets.back().swap(st->buildPacket);
+      }
+    }
+
+    // Drop parsed data from the front of the buffer, once it is at least as large as what remains.
+    // This keeps the cost of moving data linear when many PES packets are parsed in one go.
+    if (!st->pesStarts.size()){
+      st->pesData.truncate(0);
+    }else if (st->pesStarts.front() >= st->pesData.size() - st->pesStarts.front()){
+      size_t shiftBy = st->pesStarts.front();
+      st->pesData.shift(shiftBy);
+      for (std::deque<size_t>::iterator it = st->pesStarts.begin(); it != st->pesStarts.end(); ++it){
+        *it -= shiftBy;
       }
     }
-    free(payload);
   }
 
   void Stream::setLastms(size_t tid, uint64_t timestamp){
-    lastms[tid] = timestamp;
-    rolloverCount[tid] = timestamp / TS_PTS_ROLLOVER;
+    tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
+    if (tid >= TS_PID_COUNT){return;}
+    PIDState &st = getPID(tid);
+    st.lastms = timestamp;
+    st.rolloverCount = timestamp / TS_PTS_ROLLOVER;
   }
 
   void Stream::parseBitstream(size_t tid, const char *pesPayload, uint64_t realPayloadSize,
                               uint64_t timeStamp, int64_t timeOffset, uint64_t bPos, bool alignment){
 
     // Create a new (empty) DTSC Packet at the end of the buffer
-    unsigned long thisCodec = pidToCodec[tid];
-    std::deque<DTSC::Packet> &out = outPackets[tid];
+    PIDState &st = getPID(tid);
+    unsigned long thisCodec = st.codec;
+    std::deque<DTSC::Packet> &out = st.outPackets;
     if (thisCodec == AAC){
       // Parse all the ADTS packets
       uint64_t offsetInPes = 0;
       uint64_t msRead = 0;
 
-      if (remainders.count(tid) && remainders[tid].getLength()){
-        offsetInPes = std::min(remainders[tid].getTodo(), realPayloadSize);
-        remainders[tid].append(pesPayload, offsetInPes);
+      if (st.remainder.getLength()){
+        offsetInPes = std::min(st.remainder.getTodo(), realPayloadSize);
+        st.remainder.append(pesPayload, offsetInPes);
 
-        if (remainders[tid].isComplete()){
-          aac::adts adtsPack(remainders[tid].getData(), remainders[tid].getLength());
+        if (st.remainder.isComplete()){
+          aac::adts adtsPack(st.remainder.getData(), st.remainder.getLength());
           if (adtsPack){
-            if (!adtsInfo.count(tid) || !adtsInfo[tid].sameHeader(adtsPack)){
+            if (!st.adtsInfo.sameHeader(adtsPack)){
               MEDIUM_MSG("Setting new ADTS header: %s", adtsPack.toPrettyString().c_str());
-              adtsInfo[tid] = adtsPack;
+              st.adtsInfo = adtsPack;
             }
             out.push_back(DTSC::Packet());
             out.back().genericFill(
                 timeStamp - ((adtsPack.getSampleCount() * 1000) / adtsPack.getFrequency()), timeOffset,
-                tid, adtsPack.getPayload(), adtsPack.getPayloadSize(), remainders[tid].getBpos(), 0);
+                tid, adtsPack.getPayload(), adtsPack.getPayloadSize(), st.remainder.getBpos(), 0);
           }
-          remainders[tid].clear();
+          st.remainder.clear();
         }
       }
       while (offsetInPes < realPayloadSize){
         aac::adts adtsPack(pesPayload + offsetInPes, realPayloadSize - offsetInPes);
         if (adtsPack && adtsPack.getCompleteSize() + offsetInPes <= realPayloadSize){
-          if (!adtsInfo.count(tid) || !adtsInfo[tid].sameHeader(adtsPack)){
+          if (!st.adtsInfo.sameHeader(adtsPack)){
             DONTEVEN_MSG("Setting new ADTS header: %s", adtsPack.toPrettyString().c_str());
-            adtsInfo[tid] = adtsPack;
+            st.adtsInfo = adtsPack;
           }
           out.push_back(DTSC::Packet());
           if (adtsPack.getPayloadSize()){
@@ -623,7 +611,7 @@ namespace TS{
             offsetInPes++;
           }else{
             // remainder, keep it, use it next time
-            remainders[tid].setRemainder(adtsPack, pesPayload + offsetInPes, realPayloadSize - offsetInPes, bPos);
+            st.remainder.setRemainder(adtsPack, pesPayload + offsetInPes, realPayloadSize - offsetInPes, bPos);
             offsetInPes = realPayloadSize; // skip to end of PES
           }
         }
@@ -632,8 +620,8 @@ namespace TS{
     if (thisCodec == ID3 || thisCodec == AC3 || thisCodec == MP2 || thisCodec == META){
       out.push_back(DTSC::Packet());
       out.back().genericFill(timeStamp, timeOffset, tid, pesPayload, realPayloadSize, bPos, 0);
-      if (thisCodec == MP2 && !mp2Hdr.count(tid)){
-        mp2Hdr[tid] = std::string(pesPayload, realPayloadSize);
+      if (thisCodec == MP2 && !st.mp2Hdr.size()){
+        st.mp2Hdr.assign(pesPayload, realPayloadSize);
       }
     }
     if (thisCodec == OPUS){
@@ -676,28 +664,28 @@ namespace TS{
       if (!nextPtr){
         nextPtr = pesEnd;
         nalSize = realPayloadSize;
-        if (!alignment && timeStamp && buildPacket.count(tid) && timeStamp != buildPacket[tid].getTime()){
+        DTSC::Packet &bp = st.buildPacket;
+        if (!alignment && timeStamp && bp && timeStamp != bp.getTime()){
           FAIL_MSG("No startcode in packet @ %" PRIu64 " ms, and time is not equal to %" PRIu64
                    " ms so can't merge",
-                   timeStamp, buildPacket[tid].getTime());
+                   timeStamp, bp.getTime());
           return;
         }
-        DTSC::Packet &bp = buildPacket[tid];
         if (alignment){
           // If the timestamp differs from current PES timestamp, send the previous packet out and
           // fill a new one.
           if (bp.getTime() != timeStamp){
-            // Add the finished DTSC packet to our output buffer
-            out.push_back(bp);
-
             size_t size;
             char *tmp;
             bp.getString("data", tmp, size);
 
             INFO_MSG("buildpacket: size: %zu, timestamp: %" PRIu64, size, bp.getTime())
 
+            // Move the finished DTSC packet to our output buffer
+            out.push_back(DTSC::Packet());
+            out.back().swap(bp);
+
             // Create a new empty packet with the key frame bit set to true
-            bp.null();
             bp.genericFill(timeStamp, timeOffset, tid, 0, 0, bPos, true);
             bp.setKeyFrame(false);
           }
@@ -722,11 +710,11 @@ namespace TS{
 
         if (nalSize){
           // If we don't have a packet yet, init an empty packet with the key frame bit set to true
-          if (!buildPacket.count(tid)){
-            buildPacket[tid].genericFill(timeStamp, timeOffset, tid, 0, 0, bPos, true);
-            buildPacket[tid].setKeyFrame(false);
+          DTSC::Packet &bp = st.buildPacket;
+          if (!bp){
+            bp.genericFill(timeStamp, timeOffset, tid, 0, 0, bPos, true);
+            bp.setKeyFrame(false);
           }
-          DTSC::Packet &bp = buildPacket[tid];
 
           // Check if this is a keyframe
           parseNal(tid, pesPayload, pesPayload + nalSize, isKeyFrame);
@@ -736,9 +724,9 @@ namespace TS{
           // If the timestamp differs from current PES timestamp, send the previous packet out and
           // fill a new one.
           if (bp.getTime() != timeStamp){
-            // Add the finished DTSC packet to our output buffer
-            out.push_back(bp);
-            bp.null();
+            // Move the finished DTSC packet to our output buffer
+            out.push_back(DTSC::Packet());
+            out.back().swap(bp);
             bp.genericFill(timeStamp, timeOffset, tid, 0, 0, bPos, true);
             bp.setKeyFrame(false);
           }
@@ -797,40 +785,36 @@ namespace TS{
       return;
     }
 
-    bool packetReady = outPackets.count(tid) && outPackets[tid].size();
+    std::deque<DTSC::Packet> &out = pids[tid]->outPackets;
+    if (!out.size()){parse(tid);}
 
-    if (!packetReady){
-      parse(tid);
-      packetReady = outPackets.count(tid) && outPackets[tid].size();
-    }
-
-    if (!packetReady){
+    if (!out.size()){
       ERROR_MSG("Track %zu: PES without valid packets?", tid);
       return;
     }
 
-    pack = DTSC::Packet(outPackets[tid].front(), mappedAs);
-    outPackets[tid].pop_front();
-
-    if (!outPackets[tid].size()){outPackets.erase(tid);}
+    // Hand over the packet data without copying, unless we need to change the track ID
+    if (mappedAs == INVALID_TRACK_ID){
+      pack.swap(out.front());
+    }else{
+      pack = DTSC::Packet(out.front(), mappedAs);
+    }
+    out.pop_front();
   }
 
   void Stream::parseNal(size_t tid, const char *pesPayload, const char *nextPtr, bool &isKeyFrame){
     bool firstSlice = true;
     char typeNal;
+    PIDState &st = getPID(tid);
 
-    if (pidToCodec[tid] == MPEG2){
+    if (st.codec == MPEG2){
       typeNal = pesPayload[0];
       switch (typeNal){
       case 0xB3:
-        if (!mpeg2SeqHdr.count(tid)){
-          mpeg2SeqHdr[tid] = std::string(pesPayload, (nextPtr - pesPayload));
-        }
+        if (!st.mpeg2SeqHdr.size()){st.mpeg2SeqHdr.assign(pesPayload, nextPtr - pesPayload);}
         break;
       case 0xB5:
-        if (!mpeg2SeqExt.count(tid)){
-          mpeg2SeqExt[tid] = std::string(pesPayload, (nextPtr - pesPayload));
-        }
+        if (!st.mpeg2SeqExt.size()){st.mpeg2SeqExt.assign(pesPayload, nextPtr - pesPayload);}
         break;
       case 0xB8: isKeyFrame = true; break;
       }
@@ -838,7 +822,7 @@ namespace TS{
     }
 
     isKeyFrame = false;
-    if (pidToCodec[tid] == H264){
+    if (st.codec == H264){
       typeNal = pesPayload[0] & 0x1F;
       switch (typeNal){
       case 0x01:{
@@ -868,16 +852,16 @@ namespace TS{
         break;
       }
       case 0x07:{
-        spsInfo[tid] = std::string(pesPayload, (nextPtr - pesPayload));
+        st.spsInfo.assign(pesPayload, nextPtr - pesPayload);
         break;
       }
       case 0x08:{
-        ppsInfo[tid] = std::string(pesPayload, (nextPtr - pesPayload));
+        st.ppsInfo.assign(pesPayload, nextPtr - pesPayload);
         break;
       }
       default: break;
       }
-    }else if (pidToCodec[tid] == H265){
+    }else if (st.codec == H265){
       typeNal = (pesPayload[0] & 0x7E) >> 1;
       switch (typeNal){
       case 2:
@@ -904,7 +888,7 @@ namespace TS{
       case 33:
       case 34:{
         tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-        hevcInfo[tid].addUnit(std::string(pesPayload, nextPtr - pesPayload)); // may i convert to (char *)?
+        st.hevcInfo.addUnit(std::string(pesPayload, nextPtr - pesPayload)); // may i convert to (char *)?
         break;
       }
       default: break;
@@ -918,11 +902,11 @@ namespace TS{
     uint64_t packTime = 0xFFFFFFFFull;
     uint32_t packTrack = 0;
 
-    for (std::map<size_t, std::deque<DTSC::Packet> >::iterator it = outPackets.begin();
-         it != outPackets.end(); it++){
-      if (it->second.front().getTime() < packTime){
-        packTrack = it->first;
-        packTime = it->second.front().getTime();
+    for (std::set<size_t>::iterator it = usedPids.begin(); it != usedPids.end(); it++){
+      const std::deque<DTSC::Packet> &out = pids[*it]->outPackets;
+      if (out.size() && out.front().getTime() < packTime){
+        packTrack = *it;
+        packTime = out.front().getTime();
       }
     }
 
@@ -936,11 +920,11 @@ namespace TS{
     uint64_t packTime = 0xFFFFFFFFull;
     uint64_t packTrack = 0;
 
-    for (std::map<size_t, std::deque<DTSC::Packet> >::iterator it = outPackets.begin();
-         it != outPackets.end(); it++){
-      if (it->second.size() && it->second.front().getTime() < packTime){
-        packTrack = it->first;
-        packTime = it->second.front().getTime();
+    for (std::set<size_t>::iterator it = usedPids.begin(); it != usedPids.end(); it++){
+      const std::deque<DTSC::Packet> &out = pids[*it]->outPackets;
+      if (out.size() && out.front().getTime() < packTime){
+        packTrack = *it;
+        packTime = out.front().getTime();
       }
     }
 
@@ -950,11 +934,11 @@ namespace TS{
     }
 
     //Nothing yet...? Let's see if we can parse something.
-    for (std::map<size_t, uint32_t>::const_iterator i = seenUnitStart.begin(); i != seenUnitStart.end(); i++){
-      if (pidToCodec.count(i->first) && i->second > 1){
-        parse(i->first);
-        if (hasPacket(i->first)){
-          getPacket(packTrack, pack);
+    for (std::set<size_t>::iterator it = dataPids.begin(); it != dataPids.end(); it++){
+      if (pids[*it]->pesStarts.size() > 1){
+        parse(*it);
+        if (hasPacket(*it)){
+          getPacket(*it, pack);
           return;
         }
       }
@@ -964,10 +948,11 @@ namespace TS{
   void Stream::initializeMetadata(DTSC::Meta &meta, size_t tid, size_t mappingId){
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
 
-    for (std::map<size_t, uint32_t>::const_iterator it = pidToCodec.begin(); it != pidToCodec.end(); it++){
-      if (tid != INVALID_TRACK_ID && it->first != tid){continue;}
+    for (std::set<size_t>::const_iterator it = dataPids.begin(); it != dataPids.end(); it++){
+      if (tid != INVALID_TRACK_ID && *it != tid){continue;}
+      PIDState &st = *pids[*it];
 
-      size_t mId = (mappingId == INVALID_TRACK_ID ? it->first : mappingId);
+      size_t mId = (mappingId == INVALID_TRACK_ID ? *it : mappingId);
 
       size_t idx = meta.trackIDToIndex(mId, getpid());
       if (idx != INVALID_TRACK_ID && meta.getCodec(idx).size()){continue;}
@@ -977,26 +962,26 @@ namespace TS{
       std::string type, codec, init;
       uint64_t width = 0, height = 0, fpks = 0, size = 0, rate = 0, channels = 0;
 
-      switch (it->second){
+      switch (st.codec){
       case H264:{
-        if (!spsInfo.count(it->first) || !ppsInfo.count(it->first)){
-          MEDIUM_MSG("Aborted meta fill for h264 track %zu: no SPS/PPS", it->first);
+        if (!st.spsInfo.size() || !st.ppsInfo.size()){
+          MEDIUM_MSG("Aborted meta fill for h264 track %zu: no SPS/PPS", *it);
           continue;
         }
         // First generate needed data
-        std::string tmpBuffer = spsInfo[it->first];
+        std::string tmpBuffer = st.spsInfo;
         h264::sequenceParameterSet sps(tmpBuffer.data(), tmpBuffer.size());
         h264::SPSMeta spsChar = sps.getCharacteristics();
 
         MP4::AVCC avccBox;
         avccBox.setVersion(1);
-        avccBox.setProfile(spsInfo[it->first][1]);
-        avccBox.setCompatibleProfiles(spsInfo[it->first][2]);
-        avccBox.setLevel(spsInfo[it->first][3]);
+        avccBox.setProfile(st.spsInfo[1]);
+        avccBox.setCompatibleProfiles(st.spsInfo[2]);
+        avccBox.setLevel(st.spsInfo[3]);
         avccBox.setSPSCount(1);
-        avccBox.setSPS(spsInfo[it->first]);
+        avccBox.setSPS(st.spsInfo);
         avccBox.setPPSCount(1);
-        avccBox.setPPS(ppsInfo[it->first]);
+        avccBox.setPPS(st.ppsInfo);
 
         // Then set all data for track
         addNewTrack = true;
@@ -1008,15 +993,15 @@ namespace TS{
         init.assign(avccBox.payload(), avccBox.payloadSize());
       }break;
       case H265:{
-        if (!hevcInfo.count(it->first) || !hevcInfo[it->first].haveRequired()){
-          MEDIUM_MSG("Aborted meta fill for hevc track %zu: no info nal unit", it->first);
+        if (!st.hevcInfo.haveRequired()){
+          MEDIUM_MSG("Aborted meta fill for hevc track %zu: no info nal unit", *it);
           continue;
         }
         addNewTrack = true;
         type = "video";
         codec = "HEVC";
-        init = hevcInfo[it->first].generateHVCC();
-        h265::metaInfo metaInfo = hevcInfo[it->first].getMeta();
+        init = st.hevcInfo.generateHVCC();
+        h265::metaInfo metaInfo = st.hevcInfo.getMeta();
         width = metaInfo.width;
         height = metaInfo.height;
         fpks = metaInfo.fps * 1000;
@@ -1025,8 +1010,8 @@ namespace TS{
         addNewTrack = true;
         type = "video";
         codec = "MPEG2";
-        init = std::string("\000\000\001", 3) + mpeg2SeqHdr[it->first] +
-               std::string("\000\000\001", 3) + mpeg2SeqExt[it->first];
+        init = std::string("\000\000\001", 3) + st.mpeg2SeqHdr +
+               std::string("\000\000\001", 3) + st.mpeg2SeqExt;
         Mpeg::MPEG2Info info = Mpeg::parseMPEG2Header(init);
         width = info.width;
         height = info.height;
@@ -1036,13 +1021,13 @@ namespace TS{
         addNewTrack = true;
         type = "meta";
         codec = "ID3";
-        init = metaInit[it->first];
+        init = st.metaInit;
       }break;
       case META:{
         addNewTrack = true;
         type = "meta";
         codec = "RAW";
-        init = metaInit[it->first];
+        init = st.metaInit;
       }break;
       case AC3:{
         addNewTrack = true;
@@ -1057,7 +1042,7 @@ namespace TS{
         size = 16;
         init = std::string("OpusHead\001\002\170\000\200\273\000\000\000\000\001", 19);
         channels = 2;
-        std::string extData = TS::ProgramDescriptors(metaInit[it->first].data(), metaInit[it->first].size()).getExtension();
+        std::string extData = TS::ProgramDescriptors(st.metaInit.data(), st.metaInit.size()).getExtension();
         if (extData.size() > 1){
           channels = extData[1];
           uint8_t channel_map = extData[2];
@@ -1098,7 +1083,7 @@ namespace TS{
       }break;
       case MP2:{
         addNewTrack = true;
-        Mpeg::MP2Info info = Mpeg::parseMP2Header(mp2Hdr[it->first]);
+        Mpeg::MP2Info info = Mpeg::parseMP2Header(st.mp2Hdr);
         type = "audio";
         codec = (info.layer == 3 ? "MP3" : "MP2");
         rate = info.sampleRate;
@@ -1107,17 +1092,17 @@ namespace TS{
       case AAC:{
         addNewTrack = true;
         init.resize(2);
-        init[0] = ((adtsInfo[it->first].getAACProfile() & 0x1F) << 3) |
-                  ((adtsInfo[it->first].getFrequencyIndex() & 0x0E) >> 1);
-        init[1] = ((adtsInfo[it->first].getFrequencyIndex() & 0x01) << 7) |
-                  ((adtsInfo[it->first].getChannelConfig() & 0x0F) << 3);
+        init[0] = ((st.adtsInfo.getAACProfile() & 0x1F) << 3) |
+                  ((st.adtsInfo.getFrequencyIndex() & 0x0E) >> 1);
+        init[1] = ((st.adtsInfo.getFrequencyIndex() & 0x01) << 7) |
+                  ((st.adtsInfo.getChannelConfig() & 0x0F) << 3);
         // Wait with adding the track until we have init data
         if (init[0] == 0 && init[1] == 0){addNewTrack = false;}
         type = "audio";
         codec = "AAC";
         size = 16;
-        rate = adtsInfo[it->first].getFrequency();
-        channels = adtsInfo[it->first].getChannelCount();
+        rate = st.adtsInfo.getFrequency();
+        channels = st.adtsInfo.getChannelCount();
       }break;
       }
 
@@ -1153,8 +1138,8 @@ namespace TS{
     }
     if (tid != INVALID_TRACK_ID){
       WARN_MSG("Could not init track %zu!", tid);
-      for (std::map<size_t, uint32_t>::const_iterator it = pidToCodec.begin(); it != pidToCodec.end(); it++){
-        INFO_MSG("Track %zu (%" PRIu32 ") no match", it->first, it->second);
+      for (std::set<size_t>::const_iterator it = dataPids.begin(); it != dataPids.end(); it++){
+        INFO_MSG("Track %zu (%" PRIu32 ") no match", *it, pids[*it]->codec);
       }
     }
   }
@@ -1199,10 +1184,11 @@ namespace TS{
 
   void Stream::eraseTrack(size_t tid){
     tthread::lock_guard<tthread::recursive_mutex> guard(tMutex);
-    pesStreams.erase(tid);
-    psCacheTid = 0;
-    psCache = 0;
-    pesPositions.erase(tid);
-    outPackets.erase(tid);
+    PIDState *st = findPID(tid);
+    if (!st){return;}
+    st->pesData.truncate(0);
+    st->pesStarts.clear();
+    st->pesPositions.clear();
+    st->outPackets.clear();
   }
 }// namespace TS
@@ -6,7 +6,9 @@
 #include <set>
 
 #include "shared_memory.h"
+#include "tinythread.h"
 #define TS_PTS_ROLLOVER 95443718
+#define TS_PID_COUNT 8192
 
 namespace TS{
   enum codecType{
@@ -47,6 +49,42 @@ namespace TS{
 
   class Assembler;
 
+  /// Demuxing state kept for a single PID.
+  /// PES payloads are collected back to back in a single buffer as TS packets come in, so that
+  /// complete PES packets can be parsed straight from it without further copying.
+  class PIDState{
+  public:
+    PIDState();
+    void partialClear();
+
+    uint32_t codec; ///< Stream type from the PMT, or 0 if this PID does not carry known data
+    bool isPMT;     ///< True if the PAT lists this PID as a PMT
+
+    bool hasPSI; ///< True if psiPacket holds a PAT/PMT packet that was not parsed yet
+    Packet psiPacket;
+
+    Util::ResizeablePointer pesData;   ///< Payload bytes of all buffered PES packets
+    std::deque<size_t> pesStarts;      ///< Offsets into pesData where buffered PES packets begin
+    std::deque<uint64_t> pesPositions; ///< Byte positions of buffered PES packets in the source
+    int lastCC;                        ///< Continuity counter of the last buffered TS packet
+
+    std::deque<DTSC::Packet> outPackets;
+    DTSC::Packet buildPacket;
+
+    ADTSRemainder remainder;
+    aac::adts adtsInfo;
+    std::string spsInfo;
+    std::string ppsInfo;
+    h265::initData hevcInfo;
+    std::string metaInit;
+    std::string mpeg2SeqHdr;
+    std::string mpeg2SeqExt;
+    std::string mp2Hdr;
+
+    size_t rolloverCount;
+    uint64_t lastms;
+  };
+
   class Stream{
   friend class Assembler;
   public:
@@ -79,34 +117,20 @@ namespace TS{
   private:
     uint64_t lastPAT;
     ProgramAssociationTable associationTable;
-    std::map<size_t, ADTSRemainder> remainders;
 
     std::set<unsigned int> pmtTracks;
 
     std::map<size_t, uint64_t> lastPMT;
     std::map<size_t, ProgramMappingTable> mappingTable;
 
-    std::map<size_t, std::deque<Packet> > pesStreams;
-    std::deque<Packet> *psCache; /// Used only for internal speed optimizes.
-    uint32_t psCacheTid;         /// Used only for internal speed optimizes.
-    std::map<size_t, std::deque<uint64_t> > pesPositions;
-    std::map<size_t, std::deque<DTSC::Packet> > outPackets;
-    std::map<size_t, DTSC::Packet> buildPacket;
-    std::map<size_t, uint32_t> pidToCodec;
-    std::map<size_t, aac::adts> adtsInfo;
-    std::map<size_t, std::string> spsInfo;
-    std::map<size_t, std::string> ppsInfo;
-    std::map<size_t, h265::initData> hevcInfo;
-    std::map<size_t, std::string> metaInit;
-    std::map<size_t, std::string> descriptors;
-    std::map<size_t, uint32_t> seenUnitStart;
-    std::map<size_t, std::string> mpeg2SeqHdr;
-    std::map<size_t, std::string> mpeg2SeqExt;
-    std::map<size_t, std::string> mp2Hdr;
-
-    std::map<size_t, size_t> rolloverCount;
-    std::map<size_t, unsigned long long> lastms;
+    PIDState *pids[TS_PID_COUNT]; ///< Per-PID state, indexed by PID. Allocated on first use.
+    std::set<size_t> usedPids;    ///< All PIDs that have state allocated in pids, in order
+    std::set<size_t> dataPids;    ///< All PIDs that carry a known codec, in order
+    mutable tthread::recursive_mutex tMutex; ///< Guards this stream's state against concurrent access
 
+    PIDState *findPID(size_t tid) const;
+    PIDState &getPID(size_t tid);
+    void setCodec(size_t tid, uint32_t codec);
     void parsePES(size_t tid, bool finished = false);
   };
 
@@ -87,6 +87,8 @@ namespace HTTP{
     clearPointer = true;
     curPos = 0;
     bufPos = 0;
+    aheadSize = URI_READAHEAD;
+    aheadPos = 0;
   }
 
   URIReader::URIReader(){init();}
@@ -165,6 +167,7 @@ namespace HTTP{
           return false;
         }
         startPos = 0;
+        aheadPos = 0;
 
         stateType = HTTP::File;
         return true;
@@ -260,6 +263,7 @@ namespace HTTP{
     //Files always succeed because we use memmap
     if (stateType == HTTP::File){
       curPos = pos;
+      aheadPos = pos;
       return true;
     }
 
@@ -320,6 +324,11 @@ namespace HTTP{
     if (stateType == HTTP::File){
       // Simple bounds check, don't read beyond the end of the file
       uint64_t dataLen = ((wantedLen + curPos) > totalSize) ? totalSize - curPos : wantedLen;
+      // Keep the kernel fetching the data after this read while the callback processes it
+      if (aheadSize && curPos + dataLen + aheadSize / 2 > aheadPos){
+        readAhead(curPos + dataLen, aheadSize);
+        aheadPos = curPos + dataLen + aheadSize;
+      }
       cb.dataCallback(mapped + curPos, dataLen);
       curPos += dataLen;
       return;
@@ -373,6 +382,17 @@ namespace HTTP{
     bufPos = allData.size();
   }
 
+  void URIReader::readAhead(uint64_t pos, size_t len){
+    if (stateType != HTTP::File || !mapped || pos >= totalSize || !len){return;}
+    if (pos + len > totalSize){len = totalSize - pos;}
+    // madvise requires a page-aligned start address
+    static const uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t alignedPos = pos - (pos % pageSize);
+    if (madvise(mapped + alignedPos, len + (pos - alignedPos), MADV_WILLNEED)){
+      DONTEVEN_MSG("Could not read ahead %zu bytes at %" PRIu64 ": %s", len, pos, strerror(errno));
+    }
+  }
+
   void URIReader::close(){
     //Wipe internal state
     curPos = 0;
@@ -402,6 +422,8 @@ namespace HTTP{
     maxLen = newMaxLen;
   }
 
+  void URIReader::setReadAhead(size_t bytes){aheadSize = bytes;}
+
   bool URIReader::isSeekable() const{
     if (stateType == HTTP::HTTP){
       if (supportRangeRequest && totalSize != std::string::npos){return true;}
@@ -2,6 +2,9 @@
 #include "downloader.h"
 #include "util.h"
 #include <fstream>
+
+/// Default amount of bytes sequential file reads are read ahead of the current position.
+#define URI_READAHEAD (4 * 1024 * 1024)
 namespace HTTP{
 
   enum URIType{Closed = 0, File, Stream, HTTP};
@@ -43,6 +46,10 @@ namespace HTTP{
 
     void readSome(size_t wantedLen, Util::DataCallback &cb);
 
+    /// Hints that the given byte range will be read soon, so the data can be fetched in the background.
+    /// For files this starts asynchronous kernel readahead; a no-op for all other URI types.
+    void readAhead(uint64_t pos, size_t len);
+
     /// Closes the currently open URI. Does not change the internal URI value.
     void close();
 
@@ -52,6 +59,8 @@ namespace HTTP{
     void onProgress(bool (*progressCallback)(uint8_t));
     /// Sets minimum and maximum buffer size for read calls that use callbacks
     void setBounds(size_t minLen = 0, size_t maxLen = 0);
+    /// Sets how many bytes beyond the current position sequential file reads automatically read ahead.
+    void setReadAhead(size_t bytes);
 
     // Static getters
     bool isSeekable() const; ///< Returns true if seeking is possible in this URI.
@@ -81,6 +90,8 @@ namespace HTTP{
     size_t totalSize; ///< Total size in bytes of the current URI. May be incomplete before read finished.
     size_t curPos; ///< Current read position in source
     size_t bufPos; ///< Current read position in buffer
+    size_t aheadSize; ///< Amount of bytes to automatically read ahead of the current file position.
+    uint64_t aheadPos; ///< End of the most recently requested readahead range.
     int handle;    ///< Open file handle, if file-based.
     char *mapped;  ///< Memory-map of open file handle, if file-based.
     HTTP::URL originalUrl;
@@ -85,6 +85,7 @@ void statusMonitor(void *np){
       }
       // checks stream statuses, reports changes to status
       Controller::CheckAllStreams(Controller::Storage["streams"]);
+      Controller::publishConfig();
     }
     Util::sleep(3000); // wait at least 3 seconds
   }
@@ -185,6 +186,9 @@ int main_loop(int argc, char **argv){
                                     "\"default\":\"LOG\",\"help\":\"Where to write the access log. "
                                     "If set to 'LOG' (the default), writes to wherever the log is "
                                     "written to. If empty, access logging is turned off. "
+                                    "If set to 'binary:' followed by a directory, writes "
+                                    "compressed binary files to that directory, one per day, "
+                                    "to be queried with MistUtilAccessLog. "
                                     "Otherwise, writes to the given filename.\"}"));
   Controller::conf.addOption(
       "configFile", JSON::fromString("{\"long\":\"config\", \"short\":\"c\", \"arg\":\"string\" "
@@ -314,6 +314,106 @@ void Controller::handleWebSocket(HTTP::Parser &H, Socket::Connection &C){
   }
 }
 
+/// Adds the given configuration to an API response, along with the fields the interface expects in it
+static void addConfigResponse(const JSON::Value &config, JSON::Value &Response){
+  Response["config"] = config;
+  Response["config"]["iid"] = Controller::instanceId;
+  Response["config"]["version"] = PACKAGE_VERSION " " RELEASE;
+  // add required data to the current unix time to the config, for syncing reasons
+  Response["config"]["time"] = Util::epoch();
+  if (!Response["config"].isMember("serverid")){Response["config"]["serverid"] = "";}
+}
+
+/// Adds any available logs and statistics to an API response.
+/// None of these are part of the configuration, so this does not need configMutex.
+static void addStatusResponse(JSON::Value &Request, JSON::Value &Response){
+  ///
+  /// \api
+  /// `"log"` responses are always sent, and cannot be requested:
+  /// ~~~~~~~~~~~~~~~{.js}
+  /// [
+  ///   [
+  ///     1398978357, //unix timestamp of this log message
+  ///     "CONF", //shortcode indicating the type of log message
+  ///     "Starting connector:{\"connector\":\"HTTP\"}" //string containing the log message itself
+  ///   ],
+  ///   //the above structure repeated for all logs
+  /// ]
+  /// ~~~~~~~~~~~~~~~
+  /// It's possible to clear the stored logs by sending an empty `"clearstatlogs"` request.
+  ///
+  if (Request.isMember("clearstatlogs") || Request.isMember("log") || !Request.isMember("minimal")){
+    tthread::lock_guard<tthread::mutex> guard(Controller::logMutex);
+    if (!Request.isMember("minimal") || Request.isMember("log")){
+      Response["log"] = Controller::Storage["log"];
+    }
+    // clear log if requested
+    if (Request.isMember("clearstatlogs")){Controller::Storage["log"].null();}
+  }
+  if (Request.isMember("clients")){
+    if (Request["clients"].isArray()){
+      for (unsigned int i = 0; i < Request["clients"].size(); ++i){
+        Controller::fillClients(Request["clients"][i], Response["clients"][i]);
+      }
+    }else{
+      Controller::fillClients(Request["clients"], Response["clients"]);
+    }
+  }
+  if (Request.isMember("totals")){
+    if (Request["totals"].isArray()){
+      for (unsigned int i = 0; i < Request["totals"].size(); ++i){
+        Controller::fillTotals(Request["totals"][i], Response["totals"][i]);
+      }
+    }else{
+      Controller::fillTotals(Request["totals"], Response["totals"]);
+    }
+  }
+  if (Request.isMember("active_streams")){
+    Controller::fillActive(Request["active_streams"], Response["active_streams"]);
+  }
+  if (Request.isMember("stats_streams")){
+    Controller::fillHasStats(Request["stats_streams"], Response["stats_streams"]);
+  }
+
+  if (Request.isMember("api_endpoint")){
+    HTTP::URL url("http://localhost:4242");
+    url.host = Util::listenInterface;
+    if (url.host == "::"){url.host = "::1";}
+    if (url.host == "0.0.0.0"){url.host = "127.0.0.1";}
+    url.port = JSON::Value(Util::listenPort).asString();
+    Response["api_endpoint"] = url.getUrl();
+  }
+}
+
+/// Returns true if the request only reads, so that it can be answered from the current configuration
+/// snapshot by handleAPIReads. Any request containing a command not listed here is handled under configMutex.
+static bool isReadOnlyRequest(const JSON::Value &Request){
+  jsonForEachConst(Request, it){
+    const std::string &cmd = it.key();
+    if (cmd == "minimal" || cmd == "authorize" || cmd == "log" || cmd == "clients" || cmd == "totals" ||
+        cmd == "active_streams" || cmd == "stats_streams" || cmd == "api_endpoint" || cmd == "push_auto_list"){
+      continue;
+    }
+    if (cmd == "config" && !it->isObject()){continue;}
+    return false;
+  }
+  return true;
+}
+
+/// Answers a read-only API request from the given configuration snapshot, without locking configMutex.
+/// The response is identical to what handleAPICommands would give for the same request.
+static void handleAPIReads(JSON::Value &Request, JSON::Value &Response, const Controller::ConfigSnapshot &S){
+  if (!Request.isMember("minimal")){
+    Response["streams"] = JSON::fromString("{}");
+    for (Controller::StreamSnapshots::const_iterator it = S.streams->begin(); it != S.streams->end(); ++it){
+      Response["streams"][it->first] = *it->second;
+    }
+  }
+  if (!Request.isMember("minimal") || Request.isMember("config")){addConfigResponse(*S.config, Response);}
+  addStatusResponse(Request, Response);
+  if (Request.isMember("push_auto_list")){Response["push_auto_list"] = *S.autopushes;}
+}
+
 /// Handles a single incoming API connection.
 /// Assumes the connection is unauthorized and will allow for 4 requests without authorization before disconnecting.
 int Controller::handleAPIConnection(Socket::Connection &conn){
@@ -382,6 +482,11 @@ int Controller::handleAPIConnection(Socket::Connection &conn){
           H.Clean();
           continue;
         }
+        if (H.url.substr(0, Controller::prometheus.size() + 6) == "/" + Controller::prometheus + ".load"){
+          handlePrometheus(H, conn, PROMETHEUS_LOAD);
+          H.Clean();
+          continue;
+        }
       }
       JSON::Value Response;
       JSON::Value Request = JSON::fromString(H.GetVar("command"));
@@ -400,7 +505,13 @@ int Controller::handleAPIConnection(Socket::Connection &conn){
         break;
       }
       if (H.url == "/api2"){Request["minimal"] = true;}
-      {// lock the config mutex here - do not unlock until done processing
+      SharedConst<ConfigSnapshot> snap = getConfig();
+      if (authorized && snap->hasAccount && isReadOnlyRequest(Request)){
+        // Read-only requests, such as status polling, are answered without waiting for configuration changes
+        Response["authorize"]["status"] = "OK";
+        if (isLocal){Response["authorize"]["local"] = true;}
+        handleAPIReads(Request, Response, *snap);
+      }else{// lock the config mutex here - do not unlock until done processing
         tthread::lock_guard<tthread::mutex> guard(configMutex);
         // if already authorized, do not re-check for authorization
         if (authorized && Storage["account"]){
@@ -510,9 +621,21 @@ void Controller::handleAPICommands(JSON::Value &Request, JSON::Value &Response){
     JSON::Value &tStat = Request["trigger_stat"];
     if (tStat.isMember("name") && tStat.isMember("ms")){
       Controller::triggerLog &tLog = Controller::triggerStats[tStat["name"].asStringRef()];
+      uint64_t ms = tStat["ms"].asInt();
+      bool failed = (!tStat.isMember("ok") || !tStat["ok"].asBool());
       tLog.totalCount++;
-      tLog.ms += tStat["ms"].asInt();
-      if (!tStat.isMember("ok") || !tStat["ok"].asBool()){tLog.failCount++;}
+      tLog.ms += ms;
+      if (failed){
+        tLog.failCount++;
+        tLog.failMs += ms;
+      }
+      for (size_t i = 0; i < Controller::triggerBucketCount; ++i){
+        if (ms <= Controller::triggerBuckets[i]){
+          tLog.buckets[i]++;
+          if (failed){tLog.failBuckets[i]++;}
+          break;
+        }
+      }
     }
     return;
   }
@@ -550,6 +673,7 @@ void Controller::handleAPICommands(JSON::Value &Request, JSON::Value &Response){
     Controller::CheckStreams(Request["config_restore"]["streams"], Controller::Storage["streams"]);
     Request["config_restore"]["streams"] = Controller::Storage["streams"];
     Controller::Storage.assignFrom(Request["config_restore"], skip);
+    Controller::autoPushesChanged();
     removeDuplicateProtocols();
     Controller::accesslog = Controller::Storage["config"]["accesslog"].asStringRef();
     Controller::prometheus = Controller::Storage["config"]["prometheus"].asStringRef();
@@ -985,70 +1109,9 @@ void Controller::handleAPICommands(JSON::Value &Request, JSON::Value &Response){
   }
   // sent current configuration, if not minimal or was changed/requested
   if (!Request.isMember("minimal") || Request.isMember("config")){
-    Response["config"] = Controller::Storage["config"];
-    Response["config"]["iid"] = instanceId;
-    Response["config"]["version"] = PACKAGE_VERSION " " RELEASE;
-    // add required data to the current unix time to the config, for syncing reasons
-    Response["config"]["time"] = Util::epoch();
-    if (!Response["config"].isMember("serverid")){Response["config"]["serverid"] = "";}
-  }
-  // sent any available logs and statistics
-  ///
-  /// \api
-  /// `"log"` responses are always sent, and cannot be requested:
-  /// ~~~~~~~~~~~~~~~{.js}
-  /// [
-  ///   [
-  ///     1398978357, //unix timestamp of this log message
-  ///     "CONF", //shortcode indicating the type of log message
-  ///     "Starting connector:{\"connector\":\"HTTP\"}" //string containing the log message itself
-  ///   ],
-  ///   //the above structure repeated for all logs
-  /// ]
-  /// ~~~~~~~~~~~~~~~
-  /// It's possible to clear the stored logs by sending an empty `"clearstatlogs"` request.
-  ///
-  if (Request.isMember("clearstatlogs") || Request.isMember("log") || !Request.isMember("minimal")){
-    tthread::lock_guard<tthread::mutex> guard(logMutex);
-    if (!Request.isMember("minimal") || Request.isMember("log")){
-      Response["log"] = Controller::Storage["log"];
-    }
-    // clear log if requested
-    if (Request.isMember("clearstatlogs")){Controller::Storage["log"].null();}
-  }
-  if (Request.isMember("clients")){
-    if (Request["clients"].isArray()){
-      for (unsigned int i = 0; i < Request["clients"].size(); ++i){
-        Controller::fillClients(Request["clients"][i], Response["clients"][i]);
-      }
-    }else{
-      Controller::fillClients(Request["clients"], Response["clients"]);
-    }
-  }
-  if (Request.isMember("totals")){
-    if (Request["totals"].isArray()){
-      for (unsigned int i = 0; i < Request["totals"].size(); ++i){
-        Controller::fillTotals(Request["totals"][i], Response["totals"][i]);
-      }
-    }else{
-      Controller::fillTotals(Request["totals"], Response["totals"]);
-    }
-  }
-  if (Request.isMember("active_streams")){
-    Controller::fillActive(Request["active_streams"], Response["active_streams"]);
-  }
-  if (Request.isMember("stats_streams")){
-    Controller::fillHasStats(Request["stats_streams"], Response["stats_streams"]);
-  }
-
-  if (Request.isMember("api_endpoint")){
-    HTTP::URL url("http://localhost:4242");
-    url.host = Util::listenInterface;
-    if (url.host == "::"){url.host = "::1";}
-    if (url.host == "0.0.0.0"){url.host = "127.0.0.1";}
-    url.port = JSON::Value(Util::listenPort).asString();
-    Response["api_endpoint"] = url.getUrl();
+    addConfigResponse(Controller::Storage["config"], Response);
   }
+  addStatusResponse(Request, Response);
 
   if (Request.isMember("shutdown")){
     if (Response.isMember("authorize") && Response["authorize"].isMember("local")){
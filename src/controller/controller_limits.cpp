@@ -2,10 +2,10 @@
 #include "controller_statistics.h"
 #include "controller_storage.h"
 
-#include <arpa/inet.h>
-#include <iostream>
-#include <netdb.h>
-#include <sys/socket.h>
+#include <mist/defines.h>
+#include <mist/shared_memory.h>
+#include <mist/addr_list.h>
+#include <mist/socket.h>
 
 namespace Controller{
   void checkStreamLimits(std::string streamName, long long currentKbps, long long connectedUsers){
@@ -13,6 +13,7 @@ namespace Controller{
     if (!Storage["streams"][streamName].isMember("limits")){return;}
     if (!Storage["streams"][streamName]["limits"]){return;}
 
+    bool wasHardLimited = Storage["streams"][streamName].isMember("hardlimit_active");
     Storage["streams"][streamName].removeMember("hardlimit_active");
     if (Storage["streams"][streamName]["online"].asInt() != 1){
       jsonForEach(Storage["streams"][streamName]["limits"], limitIt){
@@ -27,6 +28,7 @@ namespace Controller{
           (*limitIt).removeMember("triggered");
         }
       }
+      if (wasHardLimited){writeStream(streamName, Storage["streams"][streamName]);}
       return;
     }
 
@@ -64,6 +66,9 @@ namespace Controller{
         (*limitIt).removeMember("triggered");
       }
     }
+    if (wasHardLimited != Storage["streams"][streamName].isMember("hardlimit_active")){
+      writeStream(streamName, Storage["streams"][streamName]);
+    }
   }
 
   void checkServerLimits(){
@@ -134,150 +139,92 @@ namespace Controller{
     }
   }
 
-  bool onList(std::string ip, std::string list){
-    if (list == ""){return false;}
-    std::string entry;
-    std::string lowerIpv6; // lower-case
-    std::string upperIpv6; // full-caps
-    do{
-      entry = list.substr(0, list.find(" ")); // make sure we have a single entry
-      lowerIpv6 = "::ffff:" + entry;
-      upperIpv6 = "::FFFF:" + entry;
-      if (entry == ip || lowerIpv6 == ip || upperIpv6 == ip){return true;}
-      long long unsigned int starPos = entry.find("*");
-      if (starPos == std::string::npos){
-        if (ip == entry){return true;}
-      }else{
-        if (starPos == 0){// beginning of the filter
-          if (ip.substr(ip.length() - entry.size() - 1) == entry.substr(1)){return true;}
-        }else{
-          if (starPos == entry.size() - 1){// end of the filter
-            if (ip.find(entry.substr(0, entry.size() - 1)) == 0){return true;}
-            if (ip.find(entry.substr(0, lowerIpv6.size() - 1)) == 0){return true;}
-            if (ip.find(entry.substr(0, upperIpv6.size() - 1)) == 0){return true;}
-          }else{
-            Log("CONF", "Invalid list entry detected: " + entry);
-          }
-        }
+  /// Compiles all host white- and blacklists in the server-wide and per-stream limits and writes them to
+  /// shared memory, where outputs match connecting hosts against them. Only recompiles when the lists changed.
+  void writeHostLimits(){
+    static std::string writtenLimits;
+    static IPC::sharedPage aclPage;
+    std::deque<std::string> streams, values;
+    std::deque<uint8_t> flags;
+    std::string newLimits = Storage["config"]["limit_timeout"].asString();
+    jsonForEach(Storage["config"]["limits"], limitIt){
+      if ((*limitIt)["name"].asStringRef() != "host"){continue;}
+      streams.push_back("");
+      values.push_back((*limitIt)["value"].asString());
+      flags.push_back((*limitIt)["type"].asStringRef() == "hard" ? HOST_ACL_HARD : 0);
+    }
+    jsonForEach(Storage["streams"], strmIt){
+      if (!strmIt->isMember("limits")){continue;}
+      jsonForEach((*strmIt)["limits"], limitIt){
+        if ((*limitIt)["name"].asStringRef() != "host"){continue;}
+        streams.push_back(strmIt.key());
+        values.push_back((*limitIt)["value"].asString());
+        flags.push_back((*limitIt)["type"].asStringRef() == "hard" ? HOST_ACL_HARD : 0);
       }
-      list.erase(0, entry.size() + 1);
-    }while (list != "");
-    return false;
-  }
-
-  std::string hostLookup(std::string ip){
-    struct sockaddr_in6 sa;
-    char hostName[1024];
-    char service[20];
-    if (inet_pton(AF_INET6, ip.c_str(), &(sa.sin6_addr)) != 1){return "\n";}
-    sa.sin6_family = AF_INET6;
-    sa.sin6_port = 0;
-    sa.sin6_flowinfo = 0;
-    sa.sin6_scope_id = 0;
-    int tmpRet = getnameinfo((struct sockaddr *)&sa, sizeof sa, hostName, sizeof hostName, service,
-                             sizeof service, NI_NAMEREQD);
-    if (tmpRet == 0){return hostName;}
-    return "";
-  }
+    }
+    for (size_t i = 0; i < values.size(); ++i){
+      newLimits += "\n" + streams[i] + "\n" + values[i] + (flags[i] & HOST_ACL_HARD ? "\nhard" : "\nsoft");
+    }
+    if (aclPage && newLimits == writtenLimits){return;}
+    writtenLimits = newLimits;
 
-  bool isBlacklisted(std::string host, std::string streamName, int timeConnected){
-    std::string myHostName = hostLookup(host);
-    if (myHostName == "\n"){return false;}
-    bool hasWhitelist = false;
-    bool hostOnWhitelist = false;
-    if (Storage["streams"].isMember(streamName)){
-      if (Storage["streams"][streamName].isMember("limits") &&
-          Storage["streams"][streamName]["limits"].size()){
-        jsonForEach(Storage["streams"][streamName]["limits"], limitIt){
-          if ((*limitIt)["name"].asString() == "host"){
-            if ((*limitIt)["value"].asString()[0] == '+'){
-              if (!onList(host, (*limitIt)["value"].asString().substr(1))){
-                if (myHostName == ""){
-                  if (timeConnected > Storage["config"]["limit_timeout"].asInt()){return true;}
-                }else{
-                  if (!onList(myHostName, (*limitIt)["value"].asString().substr(1))){
-                    if ((*limitIt)["type"].asString() == "hard"){
-                      Log("HLIM", "Host " + host + " not whitelisted for stream " + streamName);
-                      return true;
-                    }else{
-                      Log("SLIM", "Host " + host + " not whitelisted for stream " + streamName);
-                    }
-                  }
-                }
-              }
-            }else{
-              if ((*limitIt)["value"].asString()[0] == '-'){
-                if (onList(host, (*limitIt)["value"].asString().substr(1))){
-                  if ((*limitIt)["type"].asString() == "hard"){
-                    Log("HLIM", "Host " + host + " blacklisted for stream " + streamName);
-                    return true;
-                  }else{
-                    Log("SLIM", "Host " + host + " blacklisted for stream " + streamName);
-                  }
-                }
-                if (myHostName != "" && onList(myHostName, (*limitIt)["value"].asString().substr(1))){
-                  if ((*limitIt)["type"].asString() == "hard"){
-                    Log("HLIM", "Host " + myHostName + " blacklisted for stream " + streamName);
-                    return true;
-                  }else{
-                    Log("SLIM", "Host " + myHostName + " blacklisted for stream " + streamName);
-                  }
-                }
-              }
-            }
-          }
-        }
+    std::deque<std::string> lists;
+    size_t maxLen = 8;
+    for (size_t i = 0; i < values.size(); ++i){
+      if (values[i].size() && values[i][0] == '+'){
+        flags[i] |= HOST_ACL_WHITELIST;
+      }else if (!values[i].size() || values[i][0] != '-'){
+        Log("CONF", "Ignoring host limit not starting with + or -: " + values[i]);
+        lists.push_back("");
+        continue;
       }
-    }
-    if (Storage["config"]["limits"].size()){
-      jsonForEach(Storage["config"]["limits"], limitIt){
-        if ((*limitIt)["name"].asString() == "host"){
-          if ((*limitIt)["value"].asString()[0] == '+'){
-            if (!onList(host, (*limitIt)["value"].asString().substr(1))){
-              if (myHostName == ""){
-                if (timeConnected > Storage["config"]["limit_timeout"].asInt()){return true;}
-              }else{
-                if (!onList(myHostName, (*limitIt)["value"].asString().substr(1))){
-                  if ((*limitIt)["type"].asString() == "hard"){
-                    Log("HLIM", "Host " + host + " not whitelisted for stream " + streamName);
-                    return true;
-                  }else{
-                    Log("SLIM", "Host " + host + " not whitelisted for stream " + streamName);
-                  }
-                }
-              }
-            }
-          }else{
-            if ((*limitIt)["value"].asString()[0] == '-'){
-              if (onList(host, (*limitIt)["value"].asString().substr(1))){
-                if ((*limitIt)["type"].asString() == "hard"){
-                  Log("HLIM", "Host " + host + " blacklisted for stream " + streamName);
-                  return true;
-                }else{
-                  Log("SLIM", "Host " + host + " blacklisted for stream " + streamName);
-                }
-              }
-              if (myHostName != "" && onList(myHostName, (*limitIt)["value"].asString().substr(1))){
-                if ((*limitIt)["type"].asString() == "hard"){
-                  Log("HLIM", "Host " + myHostName + " blacklisted for stream " + streamName);
-                  return true;
-                }else{
-                  Log("SLIM", "Host " + myHostName + " blacklisted for stream " + streamName);
-                }
-              }
-            }
-          }
-        }
+      Socket::AddrList L;
+      if (!L.compile(values[i].substr(1))){
+        Log("CONF", "Invalid entries in host limit " + values[i] + (streams[i].size() ? " for stream " + streams[i] : ""));
       }
+      lists.push_back(L.packed());
+      if (lists.back().size() > maxLen){maxLen = lists.back().size();}
     }
-    if (hasWhitelist){
-      if (hostOnWhitelist || myHostName == ""){
-        return false;
-      }else{
-        return true;
-      }
+
+    // Replace the page, so outputs holding the previous one know to reload
+    if (aclPage){
+      Util::RelAccX tmpA(aclPage.mapped, false);
+      if (tmpA.isReady()){tmpA.setReload();}
+      aclPage.master = true;
+      aclPage.close();
+    }
+    size_t pageSize = 4096 + lists.size() * (maxLen + 160);
+    aclPage.init(SHM_HOST_ACL, pageSize, true, false);
+    if (!aclPage){
+      writtenLimits.clear();
+      return;
+    }
+    Util::RelAccX A(aclPage.mapped, false);
+    A.addField("stream", RAX_128STRING);
+    A.addField("flags", RAX_UINT);
+    A.addField("timeout", RAX_32UINT);
+    A.addField("acl", RAX_RAW, maxLen);
+    uint64_t timeout = Storage["config"]["limit_timeout"].asInt();
+    size_t rec = 0;
+    for (size_t i = 0; i < lists.size(); ++i){
+      if (!lists[i].size()){continue;}
+      A.setString("stream", streams[i], rec);
+      A.setInt("flags", flags[i], rec);
+      A.setInt("timeout", timeout, rec);
+      memcpy(A.getPointer("acl", rec), lists[i].data(), lists[i].size());
+      ++rec;
+    }
+    A.setRCount(rec);
+    A.setEndPos(rec);
+    A.setReady();
+
+    // Outputs share their reverse DNS lookups through this page; owning it removes it along with the controller
+    static IPC::sharedPage namePage;
+    if (!namePage){
+      namePage.init(SHM_HOST_NAMES, 0, false, false);
+      if (!namePage){namePage.init(SHM_HOST_NAMES, SHM_HOST_NAMES_LEN, true, false);}
+      namePage.master = true;
     }
-    return false;
   }
 
 }// namespace Controller
@@ -15,12 +15,76 @@ namespace Controller{
   /// Internal list of currently active pushes
   std::map<pid_t, JSON::Value> activePushes;
 
-  /// Internal list of waiting pushes
+  /// Active pushes by stream name, so checks for a single stream need not scan all pushes
+  static std::map<std::string, std::set<pid_t> > pushesByStream;
+
+  /// Internal list of waiting pushes: streams and targets to (re)start, with the seconds they have waited
   std::map<std::string, std::map<std::string, unsigned int> > waitingPushes;
 
   static bool mustWritePushList = false;
   static bool pushListRead = false;
 
+  /// Index over Storage["autopushes"], rebuilt by pushCheckLoop whenever autoPushesChanged() was called
+  static std::deque<JSON::Value> pushRules;
+  /// Auto push rule numbers by the (possibly wildcard) stream name they are configured for
+  static std::map<std::string, std::set<size_t> > rulesByStream;
+  /// Auto push rules with variable conditions; these can only be polled
+  static std::set<size_t> polledRules;
+  /// Start and end times of auto push rules, in epoch seconds, with the rule they belong to
+  static std::multimap<uint64_t, size_t> pushTimers;
+  static bool autoPushesDirty = true;
+  /// Set while code walks the index and may call into functions that look up auto pushes;
+  /// rebuilds wait until it is cleared, so the index cannot change underneath the walk.
+  static bool autoPushIndexHeld = false;
+
+  /// Marks the auto push list as changed, so the index over it is rebuilt.
+  /// Must be called after any change to Storage["autopushes"].
+  void autoPushesChanged(){autoPushesDirty = true;}
+
+  /// Rebuilds the auto push index from Storage["autopushes"]
+  static void indexAutoPushes(){
+    if (autoPushIndexHeld){return;}
+    pushRules.clear();
+    rulesByStream.clear();
+    polledRules.clear();
+    pushTimers.clear();
+    jsonForEach(Controller::Storage["autopushes"], it){
+      size_t idx = pushRules.size();
+      pushRules.push_back(*it);
+      JSON::Value &R = pushRules.back();
+      rulesByStream[R[0u].asString()].insert(idx);
+      if (R[4u].asString().size() || R[7u].asString().size()){polledRules.insert(idx);}
+      if (R[2u].asInt()){pushTimers.insert(std::pair<uint64_t, size_t>(R[2u].asInt(), idx));}
+      if (R[3u].asInt()){pushTimers.insert(std::pair<uint64_t, size_t>(R[3u].asInt(), idx));}
+    }
+    autoPushesDirty = false;
+    HIGH_MSG("Indexed %zu auto pushes: %zu polled, %zu timers", pushRules.size(), polledRules.size(), pushTimers.size());
+  }
+
+  /// Inserts the numbers of all auto push rules applying to the given stream name into rules:
+  /// those for the exact name, and wildcard rules for every `base+` prefix of it.
+  static void findAutoPushes(const std::string &streamname, std::set<size_t> &rules){
+    if (autoPushesDirty){indexAutoPushes();}
+    std::map<std::string, std::set<size_t> >::iterator it = rulesByStream.find(streamname);
+    if (it != rulesByStream.end()){rules.insert(it->second.begin(), it->second.end());}
+    size_t plus = streamname.find('+');
+    while (plus != std::string::npos && plus + 1 < streamname.size()){
+      it = rulesByStream.find(streamname.substr(0, plus + 1));
+      if (it != rulesByStream.end()){rules.insert(it->second.begin(), it->second.end());}
+      plus = streamname.find('+', plus + 1);
+    }
+  }
+
+  /// Returns true if an auto push rule for the given stream and target exists and its conditions are met
+  static bool autoPushAllowed(const std::string &streamname, const std::string &target){
+    std::set<size_t> rules;
+    findAutoPushes(streamname, rules);
+    for (std::set<size_t>::iterator it = rules.begin(); it != rules.end(); ++it){
+      if (pushRules[*it][1u].asStringRef() == target && checkPush(pushRules[*it])){return true;}
+    }
+    return false;
+  }
+
   /// Immediately starts a push for the given stream to the given target.
   /// Simply calls Util::startPush and stores the resulting PID in the local activePushes map.
   void startPush(const std::string &stream, std::string &target){
@@ -35,6 +99,7 @@ namespace Controller{
       push.append(originalTarget);
       push.append(target);
       activePushes[ret] = push;
+      pushesByStream[stream].insert(ret);
       mustWritePushList = true;
     }
   }
@@ -68,27 +133,36 @@ namespace Controller{
 
     //actually remove, make sure next pass the new list is written out too
     activePushes.erase(id);
+    std::map<std::string, std::set<pid_t> >::iterator it = pushesByStream.find(p[1u].asStringRef());
+    if (it != pushesByStream.end()){
+      it->second.erase(id);
+      if (!it->second.size()){pushesByStream.erase(it);}
+    }
     mustWritePushList = true;
+
+    // If an auto push still wants this push running, have pushCheckLoop restart it once the wait time passed.
+    // The stream may be reloading right now, so whether it is ready is only checked when the restart is due.
+    if (autoPushAllowed(p[1u].asStringRef(), p[2u].asStringRef())){
+      waitingPushes[p[1u].asStringRef()][p[2u].asStringRef()] = 0;
+    }
   }
 
   /// Returns true if the push is currently active, false otherwise.
   bool isPushActive(const std::string &streamname, const std::string &target){
     while (Controller::conf.is_active && !pushListRead){Util::sleep(100);}
+    std::map<std::string, std::set<pid_t> >::iterator strm = pushesByStream.find(streamname);
+    if (strm == pushesByStream.end()){return false;}
     std::set<pid_t> toWipe;
-    for (std::map<pid_t, JSON::Value>::iterator it = activePushes.begin(); it != activePushes.end(); ++it){
-      if (Util::Procs::isActive(it->first)){
+    for (std::set<pid_t>::iterator it = strm->second.begin(); it != strm->second.end(); ++it){
+      if (Util::Procs::isActive(*it)){
         // Apply variable substitution to make sure another push target does not resolve to the same target
-        if (it->second[1u].asStringRef() == streamname){
-          std::string activeTarget = it->second[2u].asStringRef();
-          std::string cmpTarget = target;
-          Util::streamVariables(activeTarget, streamname);
-          Util::streamVariables(cmpTarget, streamname);
-          if (activeTarget == cmpTarget){
-            return true;
-          }
-        }
+        std::string activeTarget = activePushes[*it][2u].asStringRef();
+        std::string cmpTarget = target;
+        Util::streamVariables(activeTarget, streamname);
+        Util::streamVariables(cmpTarget, streamname);
+        if (activeTarget == cmpTarget){return true;}
       }else{
-        toWipe.insert(it->first);
+        toWipe.insert(*it);
       }
     }
     while (toWipe.size()){
@@ -150,6 +224,7 @@ namespace Controller{
   /// Reads the list of pushes from a pointer, assumed to end in four zeroes
   static void readPushList(char *pwo){
     activePushes.clear();
+    pushesByStream.clear();
     pid_t p = Bit::btohl(pwo);
     HIGH_MSG("Recovering pushes: %" PRIu32, (uint32_t)p);
     while (p > 1){
@@ -165,6 +240,7 @@ namespace Controller{
       Util::Procs::remember(p);
       mustWritePushList = true;
       activePushes[p] = push;
+      pushesByStream[push[1u].asStringRef()].insert(p);
       p = Bit::btohl(pwo);
     }
   }
@@ -286,7 +362,22 @@ namespace Controller{
     return true;
   }
 
-  /// Loops, checking every second if any pushes need restarting.
+  /// Queues the given auto push rule for starting on all currently active streams it applies to
+  static void queueAutoPush(JSON::Value &rule){
+    const std::string &stream = rule[0u].asStringRef();
+    const std::string &target = rule[1u].asStringRef();
+    std::set<std::string> activeStreams = Controller::getActiveStreams(stream);
+    for (std::set<std::string>::iterator jt = activeStreams.begin(); jt != activeStreams.end(); ++jt){
+      if (stream == *jt || (*stream.rbegin() == '+' && jt->substr(0, stream.size()) == stream)){
+        if (!waitingPushes.count(*jt) || !waitingPushes[*jt].count(target)){waitingPushes[*jt][target] = 0;}
+      }
+    }
+  }
+
+  /// Loops, checking every second if any pushes need starting, restarting or stopping.
+  /// Stream starts are handled by doAutoPush, and pushes that exit are queued for a restart by
+  /// removeActivePush, so this loop only deals with queued pushes, start and end times that passed,
+  /// and the auto pushes with variable conditions, which can only be polled.
   void pushCheckLoop(void *np){
     {
       IPC::sharedPage pushReadPage("MstPush", 8 * 1024 * 1024, false, false);
@@ -304,55 +395,108 @@ namespace Controller{
         long long maxspeed = Controller::Storage["push_settings"]["maxspeed"].asInt();
         long long waittime = Controller::Storage["push_settings"]["wait"].asInt();
         long long curCount = 0;
-        jsonForEach(Controller::Storage["autopushes"], it){
-          std::string stream = (*it)[0u].asStringRef();
-          std::string target = (*it)[1u].asStringRef();
-          uint64_t startTime = (*it)[2u].asInt();
-          uint64_t endTime = (*it)[3u].asInt();
-          // Stop any auto pushes which have an elapsed end time
-          if (endTime && endTime < Util::epoch()){
+        if (autoPushesDirty){indexAutoPushes();}
+        // Stopping and removing pushes below marks the index dirty; rebuild it only after walking it
+        autoPushIndexHeld = true;
+
+        // Handle start and end times that have passed
+        uint64_t now = Util::epoch();
+        std::deque<JSON::Value> expired;
+        while (pushTimers.size() && pushTimers.begin()->first <= now){
+          JSON::Value &rule = pushRules[pushTimers.begin()->second];
+          pushTimers.erase(pushTimers.begin());
+          std::string stream = rule[0u].asStringRef();
+          std::string target = rule[1u].asStringRef();
+          uint64_t startTime = rule[2u].asInt();
+          uint64_t endTime = rule[3u].asInt();
+          if (endTime && endTime <= now){
             INFO_MSG("Deleting autopush from %s to %s because end time passed", stream.c_str(), target.c_str());
             stopActivePushes(stream, target);
-            removePush(*it);
-            break;
+            expired.push_back(rule);
+            continue;
+          }
+          if (!checkPush(rule)){continue;}
+          // If no end time is given but there is a start time, start right away and remove the push
+          if (startTime && !endTime){
+            std::set<std::string> activeStreams = Controller::getActiveStreams(stream);
+            for (std::set<std::string>::iterator jt = activeStreams.begin(); jt != activeStreams.end(); ++jt){
+              std::string streamname = *jt;
+              if (stream == streamname || (*stream.rbegin() == '+' && streamname.substr(0, stream.size()) == stream)){
+                MEDIUM_MSG("Start time of push `%s->%s` passed. Starting push...", stream.c_str(), target.c_str());
+                startPush(streamname, target);
+              }
+            }
+            expired.push_back(rule);
+            continue;
           }
-          // Stop any active push if conditions are not met
-          if (!checkPush(*it)){
+          queueAutoPush(rule);
+        }
+        while (expired.size()){
+          removePush(expired.front());
+          expired.pop_front();
+        }
+
+        // Poll auto pushes with variable conditions
+        for (std::set<size_t>::iterator it = polledRules.begin(); it != polledRules.end(); ++it){
+          JSON::Value &rule = pushRules[*it];
+          const std::string &stream = rule[0u].asStringRef();
+          const std::string &target = rule[1u].asStringRef();
+          if (!checkPush(rule)){
             if (isPushActive(stream, target)){
               MEDIUM_MSG("Conditions of push `%s->%s` evaluate to false. Stopping push...", stream.c_str(), target.c_str());
               stopActivePushes(stream, target);
             }
             continue;
           }
-          // We can continue if it is already running
-          if (isPushActive(stream, target)){continue;}
-          // Start the push if conditions are met
-          if (waittime || startTime){
-            std::set<std::string> activeStreams = Controller::getActiveStreams(stream);
-            if (activeStreams.size()){
-              for (std::set<std::string>::iterator jt = activeStreams.begin();
-                    jt != activeStreams.end(); ++jt){
-                std::string streamname = *jt;
-                if (stream == streamname || (*stream.rbegin() == '+' && streamname.substr(0, stream.size()) == stream)){
-                  if (!isPushActive(streamname, target)){
-                    if (waitingPushes[streamname][target]++ >= waittime && (curCount < maxspeed || !maxspeed)){
-                      waitingPushes[streamname].erase(target);
-                      if (!waitingPushes[streamname].size()){waitingPushes.erase(streamname);}
-                      MEDIUM_MSG("Conditions of push `%s->%s` evaluate to true. Starting push...", stream.c_str(), target.c_str());
-                      startPush(streamname, target);
-                      curCount++;
-                      // If no end time is given but there is a start time, remove the push after starting it
-                      if (startTime && !endTime){
-                        removePush(*it);
-                        break;
-                      }
-                    }
-                  }
-                }
-              }
+          if (!isPushActive(stream, target)){queueAutoPush(rule);}
+        }
+        autoPushIndexHeld = false;
+
+        // Start queued pushes once they waited long enough, at most maxspeed per second
+        std::map<std::string, std::map<std::string, unsigned int> >::iterator strm = waitingPushes.begin();
+        while (strm != waitingPushes.end()){
+          // Streams that are gone start their auto pushes again through doAutoPush when they come back
+          uint8_t streamStatus = Util::getStreamStatus(strm->first);
+          if (streamStatus == STRMSTAT_OFF || streamStatus == STRMSTAT_SHUTDOWN || streamStatus == STRMSTAT_INVALID){
+            waitingPushes.erase(strm++);
+            continue;
+          }
+          std::map<std::string, unsigned int>::iterator tgt = strm->second.begin();
+          while (tgt != strm->second.end()){
+            std::string target = tgt->first;
+            if (isPushActive(strm->first, target) || !autoPushAllowed(strm->first, target)){
+              strm->second.erase(tgt++);
+              continue;
+            }
+            if (tgt->second < waittime){
+              ++tgt->second;
+              ++tgt;
+              continue;
+            }
+            // Streams still booting keep their pushes queued until they are ready
+            if (streamStatus != STRMSTAT_READY || (maxspeed && curCount >= maxspeed)){
+              ++tgt;
+              continue;
+            }
+            MEDIUM_MSG("Conditions of push `%s->%s` evaluate to true. Starting push...", strm->first.c_str(), target.c_str());
+            std::string streamname = strm->first;
+            startPush(streamname, target);
+            curCount++;
+            if (isPushActive(strm->first, tgt->first)){
+              strm->second.erase(tgt++);
+            }else{
+              // Could not start; try again after waiting once more
+              tgt->second = 0;
+              ++tgt;
             }
           }
+          if (!strm->second.size()){
+            waitingPushes.erase(strm++);
+          }else{
+            ++strm;
+          }
         }
+
         //Check if any pushes have ended, clean them up
         std::set<pid_t> toWipe;
         for (std::map<pid_t, JSON::Value>::iterator it = activePushes.begin(); it != activePushes.end(); ++it){
@@ -517,6 +661,7 @@ namespace Controller{
         shouldSave = false;
       }
     }
+    if (!shouldSave){autoPushesChanged();}
     // If a newly added push only has a defined start time, immediately start it and never save it
     if (startTime && !endTime){
       INFO_MSG("Immediately starting push %s->%s as the added push only has a defined start time"
@@ -529,6 +674,7 @@ namespace Controller{
     // Save as a new variable if we have not edited an existing variable
     if (shouldSave){
       Controller::Storage["autopushes"].append(newPush);
+      autoPushesChanged();
     }
     // and start it immediately if conditions are met
     if (!checkPush(newPush)){return;}
@@ -572,6 +718,7 @@ namespace Controller{
       if ((*it) != delPush){newautopushes.append(*it);}
     }
     Controller::Storage["autopushes"] = newautopushes;
+    autoPushesChanged();
   }
 
   /// Removes all auto pushes of a given streamname
@@ -581,24 +728,34 @@ namespace Controller{
       if ((*it)[0u] != streamname){newautopushes.append(*it);}
     }
     Controller::Storage["autopushes"] = newautopushes;
+    autoPushesChanged();
   }
 
   /// Starts all configured auto pushes for the given stream.
+  /// Called when the stream becomes active; only looks at the auto pushes that apply to it.
   void doAutoPush(std::string &streamname){
-    jsonForEach(Controller::Storage["autopushes"], it){
-      if ((*it)[2u].asInt() && (*it)[2u].asInt() < Util::epoch()){continue;}
-      const std::string &pStr = (*it)[0u].asStringRef();
-      if (pStr == streamname || (*pStr.rbegin() == '+' && streamname.substr(0, pStr.size()) == pStr)){
-        std::string stream = streamname;
-        Util::sanitizeName(stream);
-        // Check variable condition if it exists
-        if((*it)[4u].asStringRef().size() && !checkPush(*it)){continue;}
-        std::string target = (*it)[1u];
-        startPush(stream, target);
-      }
+    std::set<size_t> rules;
+    findAutoPushes(streamname, rules);
+    bool wasHeld = autoPushIndexHeld;
+    autoPushIndexHeld = true;
+    for (std::set<size_t>::iterator it = rules.begin(); it != rules.end(); ++it){
+      JSON::Value &rule = pushRules[*it];
+      // Scheduled pushes are started by pushCheckLoop once their start time passes. Unlike before, pushes whose
+      // start time already passed are started here: the loop no longer polls every rule, so nothing else would.
+      if (rule[2u].asInt() && rule[2u].asInt() > Util::epoch()){continue;}
+      std::string stream = streamname;
+      Util::sanitizeName(stream);
+      // Check variable condition if it exists
+      if (rule[4u].asStringRef().size() && !checkPush(rule)){continue;}
+      std::string target = rule[1u];
+      startPush(stream, target);
     }
+    autoPushIndexHeld = wasHeld;
   }
 
+  /// Forgets about queued auto pushes for the given stream, which became inactive.
+  void cancelAutoPush(const std::string &streamname){waitingPushes.erase(streamname);}
+
   void pushSettings(const JSON::Value &request, JSON::Value &response){
     if (request.isObject()){
       if (request.isMember("wait")){
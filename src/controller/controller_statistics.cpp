@@ -7,8 +7,11 @@
 #include <fstream>
 #include <list>
 #include <mist/bitfields.h>
+#include <mist/checksum.h>
 #include <mist/config.h>
+#include <mist/downloader.h>
 #include <mist/dtsc.h>
+#include <mist/instrument.h>
 #include <mist/procs.h>
 #include <mist/shared_memory.h>
 #include <mist/stream.h>
@@ -21,6 +24,11 @@
 #define KILL_ON_EXIT false
 #endif
 
+// Longest time a load feed request may be held open waiting for a change, in milliseconds.
+#ifndef LOAD_FEED_MAX_WAIT
+#define LOAD_FEED_MAX_WAIT 30000
+#endif
+
 // These are used to store "clients" field requests in a bitfield for speedup.
 #define STAT_CLI_HOST 1
 #define STAT_CLI_STREAM 2
@@ -50,6 +58,10 @@
 std::map<std::string, Controller::statSession> sessions;
 
 std::map<std::string, Controller::triggerLog> Controller::triggerStats; ///< Holds prometheus stats for trigger executions
+/// Upper bounds (in milliseconds) of the trigger execution time histogram buckets.
+/// Executions slower than the last bound are only counted in the totals.
+const uint64_t Controller::triggerBuckets[Controller::triggerBucketCount] ={
+    1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
 bool Controller::killOnExit = KILL_ON_EXIT;
 tthread::mutex Controller::statsMutex;
 uint64_t Controller::statDropoff = 0;
@@ -85,6 +97,31 @@ struct streamTotals{
 
 Comms::Sessions statComm;
 bool statCommActive = false;
+// Per-stream totals kept up to date by the session trackers
+static Comms::StreamTotals strmTotals;
+/// Counters of a stream totals row as of the previous pass, to add only the increase to streamStats
+struct rowTotals{
+  std::string stream;
+  uint64_t up;
+  uint64_t down;
+  uint64_t pktCount;
+  uint64_t pktLost;
+  uint64_t pktRetrans;
+  uint64_t seconds;
+};
+static std::map<size_t, rowTotals> seenRows;
+// PIDs of the running session tracker shards; sessions of any other process are single-session processes
+static std::set<uint32_t> trackerPidSet;
+/// Current sessions per type (viewer, input, output, unspecified) of single-session processes in a stream
+struct singleSessions{
+  uint32_t count[4];
+  singleSessions(){memset(count, 0, sizeof(count));}
+};
+static std::map<std::string, singleSessions> singleCurrent;
+// Rows the single-session column was last filled in
+static std::set<size_t> singleRows;
+// Pipeline timings reported by instrumented binaries
+static Instrument::Page instrumentPage;
 // Global server wide statistics
 static uint64_t servUpBytes = 0;
 static uint64_t servDownBytes = 0;
@@ -103,6 +140,19 @@ static uint64_t viewSecondsTotal = 0;
 // Mapping of streamName -> summary of stream-wide statistics
 static std::map<std::string, struct streamTotals> streamStats;
 
+/// Version of the load balancer feed. Changes whenever something that influences balancing
+/// decisions changes; long-polling load feed requests wait for this value to change.
+static uint32_t loadVersion = 0;
+/// Guards loadVersion; loadVersionCond is notified on every recalculation and when the stats thread stops
+static tthread::mutex loadVersionMutex;
+static tthread::condition_variable loadVersionCond;
+
+/// Returns the current load feed version.
+static uint32_t getLoadVersion(){
+  tthread::lock_guard<tthread::mutex> guard(loadVersionMutex);
+  return loadVersion;
+}
+
 // If streamName does not exist yet in streamStats, create and init an entry for it
 static void createEmptyStatsIfNeeded(const std::string & streamName){
   if (streamStats.count(streamName)){return;}
@@ -167,6 +217,7 @@ void Controller::streamStarted(std::string stream){
 /// This function is ran whenever a stream becomes active.
 void Controller::streamStopped(std::string stream){
   INFO_MSG("Stream %s became inactive", stream.c_str());
+  Controller::cancelAutoPush(stream);
 }
 
 /// Invalidates all current sessions for the given streamname
@@ -183,7 +234,7 @@ void Controller::sessions_invalidate(const std::string &streamname){
     if (statComm.getStream(i) == streamname){
       sessCount++;
       // Re-trigger USER_NEW trigger for this session
-      kill(statComm.getPid(i), SIGUSR1);
+      statComm.setStatus(COMM_STATUS_RETRIGGER | statComm.getStatus(i), i);
     }
   }
   INFO_MSG("Invalidated %u session(s) for stream %s", sessCount, streamname.c_str());
@@ -264,18 +315,136 @@ void Controller::sessions_shutdown(const std::string &streamname, const std::str
     if (statComm.getStatus(i) == COMM_STATUS_INVALID || (statComm.getStatus(i) & COMM_STATUS_DISCONNECT)){continue;}
     if ((!streamname.size() || statComm.getStream(i) == streamname) &&
       (!protocol.size() || statComm.hasConnector(i, protocol))){
-      uint32_t pid = statComm.getPid(i);
       sessCount++;
-      if (pid > 1){
-        Util::Procs::Stop(pid);
-        INFO_MSG("Killing PID %" PRIu32, pid);
-      }
+      // The session shuts down all of its connections when it sees this flag
+      statComm.setStatus(COMM_STATUS_REQDISCONNECT | statComm.getStatus(i), i);
     }
   }
   INFO_MSG("Shut down %u sessions for stream %s/%s", sessCount,
            streamname.c_str(), protocol.c_str());
 }
 
+/// Recalculates loadVersion from the current statistics, and wakes up all waiting load feed requests.
+/// Waiting requests are woken up on every call even if the version stays the same, so they can check
+/// whether their time is up or their connection closed.
+/// Only coarse values are taken into account (CPU in 5% steps, upload in 5% of the bandwidth limit,
+/// per-stream viewer and input counts, configured streams, tags and location), so that the load feed
+/// only wakes up waiting balancers when their decisions might actually change.
+/// Must be called with both configMutex and statsMutex locked.
+static void updateLoadVersion(){
+  static uint64_t prevUp = 0, prevTime = 0;
+  uint64_t now = Util::bootMS();
+  uint64_t upRate = 0;
+  if (prevTime && now > prevTime && servUpBytes >= prevUp){
+    upRate = ((servUpBytes - prevUp) * 1000) / (now - prevTime);
+  }
+  prevUp = servUpBytes;
+  prevTime = now;
+
+  std::stringstream state;
+  state << cpu_use / 50 << ' ' << (bwLimit ? (upRate * 20) / bwLimit : 0);
+  for (std::map<std::string, struct streamTotals>::iterator it = streamStats.begin();
+       it != streamStats.end(); ++it){
+    state << ' ' << it->first << ':' << it->second.currViews << ':' << it->second.currIns;
+  }
+  const JSON::Value &S = Controller::Storage;
+  if (S.isMember("streams")){
+    jsonForEachConst(S["streams"], sIt){state << ' ' << sIt.key();}
+  }
+  if (S.isMember("tags")){state << ' ' << S["tags"].toString();}
+  if (S.isMember("config")){
+    if (S["config"].isMember("location")){state << ' ' << S["config"]["location"].toString();}
+    if (S["config"].isMember("protocols")){state << ' ' << S["config"]["protocols"].size();}
+  }
+  std::string st = state.str();
+  uint32_t newVersion = checksum::crc32(0, st.data(), st.size());
+  // Zero means "no version known" to balancers, so never use it
+  if (!newVersion){newVersion = 1;}
+  tthread::lock_guard<tthread::mutex> guard(loadVersionMutex);
+  loadVersion = newVersion;
+  loadVersionCond.notify_all();
+}
+
+/// Starts a MistSession tracker for every session shard that does not have one running yet.
+/// Trackers are not stopped along with the controller, so sessions survive a controller restart.
+void Controller::checkSessionTrackers(){
+  static std::map<size_t, pid_t> trackerPids;
+  trackerPidSet.clear();
+  for (size_t shard = 0; shard < SESSION_TRACKER_SHARDS; ++shard){
+    if (trackerPids.count(shard) && Util::Procs::isRunning(trackerPids[shard])){
+      trackerPidSet.insert(trackerPids[shard]);
+      continue;
+    }
+    uint32_t runningPid = Comms::sessionTrackerPid(shard);
+    if (runningPid){
+      trackerPidSet.insert(runningPid);
+      continue;
+    }
+    std::deque<std::string> args;
+    args.push_back(Util::getMyPath() + "MistSession");
+    args.push_back("--shard");
+    args.push_back(JSON::Value((uint64_t)shard).asString());
+    int err = fileno(stderr);
+    trackerPids[shard] = Util::Procs::StartPiped(args, 0, 0, &err);
+    Util::Procs::forget(trackerPids[shard]);
+    trackerPidSet.insert(trackerPids[shard]);
+  }
+}
+
+/// Adds the increase of the byte, packet and viewing time counters of all streams in the stream totals table to
+/// streamStats, and copies their current session counts. Rows that were already there when the controller
+/// started only count from then on, like the sessions do.
+static void readStreamTotals(){
+  static bool baseline = true;
+  for (size_t row = 0; row < strmTotals.rowCount(); ++row){
+    if (!strmTotals.isUsed(row)){continue;}
+    std::string streamName = strmTotals.getStream(row);
+    if (!streamName.size()){continue;}
+    rowTotals N;
+    N.stream = streamName;
+    N.up = strmTotals.getUp(row);
+    N.down = strmTotals.getDown(row);
+    N.pktCount = strmTotals.getPacketCount(row);
+    N.pktLost = strmTotals.getPacketLostCount(row);
+    N.pktRetrans = strmTotals.getPacketRetransmitCount(row);
+    N.seconds = strmTotals.getViewSeconds(row);
+    rowTotals P;
+    std::map<size_t, rowTotals>::iterator it = seenRows.find(row);
+    if (it != seenRows.end() && it->second.stream == streamName && N.up >= it->second.up &&
+        N.down >= it->second.down && N.pktCount >= it->second.pktCount && N.pktLost >= it->second.pktLost &&
+        N.pktRetrans >= it->second.pktRetrans && N.seconds >= it->second.seconds){
+      P = it->second;
+    }else if (baseline){
+      P = N;
+    }else{
+      // A row claimed since the previous pass, possibly one recycled from another stream: all of it is new
+      P.up = P.down = P.pktCount = P.pktLost = P.pktRetrans = P.seconds = 0;
+    }
+    seenRows[row] = N;
+    uint64_t current = strmTotals.getCurrent(row);
+    if (!current && N.up == P.up && N.down == P.down && N.pktCount == P.pktCount && N.pktLost == P.pktLost &&
+        N.pktRetrans == P.pktRetrans && N.seconds == P.seconds && !streamStats.count(streamName)){
+      continue;
+    }
+    createEmptyStatsIfNeeded(streamName);
+    streamTotals &sT = streamStats[streamName];
+    sT.upBytes += N.up - P.up;
+    sT.downBytes += N.down - P.down;
+    sT.packSent += N.pktCount - P.pktCount;
+    sT.packLoss += N.pktLost - P.pktLost;
+    sT.packRetrans += N.pktRetrans - P.pktRetrans;
+    sT.viewSeconds += N.seconds - P.seconds;
+    servSeconds += N.seconds - P.seconds;
+    if (current){
+      sT.currViews = strmTotals.getCurrent(row, 0);
+      sT.currIns = strmTotals.getCurrent(row, 1);
+      sT.currOuts = strmTotals.getCurrent(row, 2);
+      sT.currUnspecified = strmTotals.getCurrent(row, 3);
+    }
+  }
+  baseline = false;
+}
+
 /// This function runs as a thread and roughly once per second retrieves
 /// statistics from all connected clients, as well as wipes
 /// old statistics that have disconnected over 10 minutes ago.
@@ -283,11 +452,16 @@ void Controller::SharedMemStats(void *config){
   HIGH_MSG("Starting stats thread");
   statComm.reload(true);
   statCommActive = true;
+  strmTotals.reload(true);
+#ifdef WITH_INSTRUMENTATION
+  instrumentPage.reload(true);
+#endif
   std::set<std::string> inactiveStreams;
   Controller::initState();
   bool shiftWrites = true;
   bool firstRun = true;
   while (((Util::Config *)config)->is_active){
+    checkSessionTrackers();
     {
       std::ifstream cpustat("/proc/stat");
       if (cpustat){
@@ -348,8 +522,12 @@ void Controller::SharedMemStats(void *config){
           it->second.currUnspecified = 0;
         }
       }
-      // wipe old statistics and set session type counters
-      if (sessions.size()){
+      // wipe old statistics and set session type counters. With the stream totals table in place, only the wiping
+      // remains to be done, which need not happen every second.
+      static uint64_t lastWipe = 0;
+      bool mustWalk = !strmTotals || Util::bootSecs() - lastWipe >= STAT_WIPE_INTERVAL;
+      if (sessions.size() && mustWalk){
+        lastWipe = Util::bootSecs();
         std::list<std::string> mustWipe;
         // Ensure cutOffPoint is either time of boot or 10 minutes ago, whichever is closer.
         // Prevents wrapping around to high values close to system boot time.
@@ -362,11 +540,14 @@ void Controller::SharedMemStats(void *config){
         for (std::map<std::string, statSession>::iterator it = sessions.begin(); it != sessions.end(); it++){
           // This part handles ending sessions, keeping them in cache for now
           if (it->second.getEnd() < cutOffPoint){
-            viewSecondsTotal += it->second.getConnTime();
+            // The stream totals table already counted the viewing time of this session
+            if (!strmTotals){viewSecondsTotal += it->second.getConnTime();}
             mustWipe.push_back(it->first);
             // Don't count this session as a viewer
             continue;
           }
+          // The stream totals table already holds the current session counts and viewing time
+          if (strmTotals){continue;}
           // Recount input, output and viewer type sessions
           switch (it->second.getSessType()){
           case SESS_UNSET: break;
@@ -398,6 +579,11 @@ void Controller::SharedMemStats(void *config){
           mustWipe.pop_front();
         }
       }
+      // Read the traffic and current session counts of all streams from the stream totals table
+      if (strmTotals){
+        strmTotals.setNoBandwidth(noBWCountMatches);
+        readStreamTotals();
+      }
       Util::RelAccX *strmStats = streamsAccessor();
       if (!strmStats || !strmStats->isReady()){strmStats = 0;}
       uint64_t strmPos = 0;
@@ -452,6 +638,7 @@ void Controller::SharedMemStats(void *config){
         inactiveStreams.erase(inactiveStreams.begin());
         shiftWrites = true;
       }
+      updateLoadVersion();
       /*LTS-START*/
       Controller::checkServerLimits();
       /*LTS-END*/
@@ -459,9 +646,16 @@ void Controller::SharedMemStats(void *config){
     Util::wait(1000);
   }
   statCommActive = false;
+  {
+    // Release load feed requests still waiting for a new version
+    tthread::lock_guard<tthread::mutex> guard(loadVersionMutex);
+    loadVersionCond.notify_all();
+  }
   HIGH_MSG("Stopping stats thread");
   if (Util::Config::is_restarting){
     statComm.setMaster(false);
+    strmTotals.setMaster(false);
+    instrumentPage.setMaster(false);
   }else{/*LTS-START*/
     if (Controller::killOnExit){
       WARN_MSG("Killing all connected clients to force full shutdown");
@@ -501,11 +695,9 @@ void Controller::killConnections(std::string sessId){
     for (size_t i = 0; i < statComm.recordCount(); i++){
       if (statComm.getStatus(i) == COMM_STATUS_INVALID || (statComm.getStatus(i) & COMM_STATUS_DISCONNECT)){continue;}
       if (statComm.getSessId(i) == sessId){
-        uint32_t pid = statComm.getPid(i);
-        if (pid > 1){
-          Util::Procs::Stop(pid);
-          INFO_MSG("Killing PID %" PRIu32, pid);
-        }
+        // The session shuts down all of its connections when it sees this flag
+        statComm.setStatus(COMM_STATUS_REQDISCONNECT | statComm.getStatus(i), i);
+        INFO_MSG("Shutting down session %s", sessId.c_str());
       }
     }
   }
@@ -613,8 +805,9 @@ void Controller::statSession::update(uint64_t index, Comms::Sessions &statComm){
         break;
     }
   }
-  // Only count connections that are countable
-  if (noBWCount != 2){ 
+  // Only count connections that are countable. The session trackers add them to the stream totals table
+  // themselves, which readStreamTotals copies the per-stream totals from.
+  if (noBWCount != 2 && !strmTotals){
     createEmptyStatsIfNeeded(streamName);
     streamStats[streamName].upBytes += currUp - prevUp;
     streamStats[streamName].downBytes += currDown - prevDown;
@@ -653,7 +846,7 @@ void Controller::statSession::finish(){
                 << getUp() / duration / 1024 << "KB/s up " << getDown() / duration / 1024 << "KB/s down.";
       if (tags.size()){accessStr << " Tags: " << tagStream.str();}
       Controller::Log("ACCS", accessStr.str());
-    }else{
+    }else if (Controller::accesslog.compare(0, 7, "binary:")){
       static std::ofstream accLogFile;
       static std::string accLogFileName;
       if (accLogFileName != Controller::accesslog || !accLogFile.good()){
@@ -947,12 +1140,34 @@ void Controller::statStorage::update(Comms::Sessions &statComm, size_t index){
 
 void Controller::statLeadIn(){
   statDropoff = Util::bootSecs() - 3;
+  singleCurrent.clear();
 }
 
 void Controller::statOnActive(size_t id){
   if (statComm.getNow(id) >= statDropoff){
     // update the session with the latest data
-    sessions[statComm.getSessId(id)].update(id, statComm);
+    statSession &S = sessions[statComm.getSessId(id)];
+    S.update(id, statComm);
+    // Tracker shards count their own sessions in the stream totals table. Sessions of single-session processes
+    // are counted here instead, so one that gets killed stops being counted as soon as its record is gone.
+    if (strmTotals && !trackerPidSet.count(statComm.getPid(id)) && S.getStreamName().size()){
+      uint64_t now = Util::bootSecs();
+      switch (S.getSessType()){
+      case SESS_VIEWER:
+        if (S.hasDataFor(now - STATS_DELAY)){++singleCurrent[S.getStreamName()].count[0];}
+        break;
+      case SESS_INPUT:
+        if (S.hasDataFor(now - STATS_INPUT_DELAY)){++singleCurrent[S.getStreamName()].count[1];}
+        break;
+      case SESS_OUTPUT:
+        if (S.hasDataFor(now - STATS_DELAY)){++singleCurrent[S.getStreamName()].count[2];}
+        break;
+      case SESS_UNSPECIFIED:
+        if (S.hasDataFor(now - STATS_DELAY)){++singleCurrent[S.getStreamName()].count[3];}
+        break;
+      case SESS_UNSET: break;
+      }
+    }
   }
 }
 
@@ -984,10 +1199,25 @@ void Controller::statOnDisconnect(size_t id){
   }
 }
 
-void Controller::statLeadOut(){}
+/// Fills the stream totals column of single-session processes with the sessions counted in statOnActive
+void Controller::statLeadOut(){
+  if (!strmTotals){return;}
+  std::set<size_t> rows;
+  for (std::map<std::string, singleSessions>::iterator it = singleCurrent.begin(); it != singleCurrent.end(); ++it){
+    size_t row = strmTotals.find(it->first, true);
+    if (row == INVALID_RECORD_INDEX){continue;}
+    for (uint8_t t = 0; t < 4; ++t){strmTotals.setCurrent(row, STREAM_TOTALS_COLUMNS - 1, t, it->second.count[t]);}
+    rows.insert(row);
+  }
+  for (std::set<size_t>::iterator it = singleRows.begin(); it != singleRows.end(); ++it){
+    if (!rows.count(*it)){strmTotals.clearCurrent(*it, STREAM_TOTALS_COLUMNS - 1);}
+  }
+  singleRows.swap(rows);
+}
 
 /// Returns true if this stream has at least one connected client.
 bool Controller::hasViewers(std::string streamName){
+  if (strmTotals){return strmTotals.getCurrent(strmTotals.find(streamName));}
   if (sessions.size()){
     long long currTime = Util::bootSecs();
     for (std::map<std::string, statSession>::iterator it = sessions.begin(); it != sessions.end(); it++){
@@ -1560,6 +1790,7 @@ void Controller::fillTotals(JSON::Value &req, JSON::Value &rep){
 
 void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int mode){
   std::string jsonp;
+  SharedConst<ConfigSnapshot> snap = getConfig();
   switch (mode){
   case PROMETHEUS_TEXT: H.SetHeader("Content-Type", "text/plain; version=0.0.4"); break;
   case PROMETHEUS_JSON:
@@ -1568,6 +1799,20 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
     if (H.GetVar("callback") != ""){jsonp = H.GetVar("callback");}
     if (H.GetVar("jsonp") != ""){jsonp = H.GetVar("jsonp");}
     break;
+  case PROMETHEUS_LOAD:
+    H.SetHeader("Content-Type", "application/octet-stream");
+    if (H.GetVar("since").size()){
+      // Long-poll: hold the request until the load version differs from the one the balancer has
+      uint32_t since = strtoul(H.GetVar("since").c_str(), 0, 10);
+      uint64_t waitTime = strtoull(H.GetVar("wait").c_str(), 0, 10);
+      if (waitTime > LOAD_FEED_MAX_WAIT){waitTime = LOAD_FEED_MAX_WAIT;}
+      uint64_t waitUntil = Util::bootMS() + waitTime;
+      tthread::lock_guard<tthread::mutex> guard(loadVersionMutex);
+      while (loadVersion == since && Util::bootMS() < waitUntil && conn && Controller::conf.is_active && statCommActive){
+        loadVersionCond.wait(loadVersionMutex);
+      }
+    }
+    break;
   }
   H.SetHeader("Server", APPIDENT);
   H.StartResponse("200", "OK", H, conn, true);
@@ -1695,6 +1940,28 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
     response << "mist_packets_total{pkttype=\"lost\"}" << servPackLoss << "\n";
     response << "mist_packets_total{pkttype=\"retrans\"}" << servPackRetrans << "\n";
 
+    {
+      JSON::Value pool;
+      HTTP::connectionPool.getStats(pool);
+      response << "\n# HELP mist_http_pool_requests HTTP(S) requests made by the controller, by whether they reused a "
+                  "pooled connection.\n";
+      response << "# TYPE mist_http_pool_requests counter\n";
+      response << "mist_http_pool_requests{conn=\"reused\"}" << pool["reused"].asInt() << "\n";
+      response << "mist_http_pool_requests{conn=\"new\"}" << pool["connects"].asInt() << "\n";
+      response << "\n# HELP mist_http_pool_closed Pooled connections of the controller closed while idle, by reason.\n";
+      response << "# TYPE mist_http_pool_closed counter\n";
+      response << "mist_http_pool_closed{reason=\"expired\"}" << pool["expired"].asInt() << "\n";
+      response << "mist_http_pool_closed{reason=\"stale\"}" << pool["stale"].asInt() << "\n";
+      response << "\n# HELP mist_http_pool_idle Idle pooled connections the controller holds right now.\n";
+      response << "# TYPE mist_http_pool_idle gauge\n";
+      response << "mist_http_pool_idle " << pool["idle"].asInt() << "\n";
+      response << "\n# HELP mist_ssl_handshakes Outgoing SSL handshakes of the controller, by whether they resumed a "
+                  "session.\n";
+      response << "# TYPE mist_ssl_handshakes counter\n";
+      response << "mist_ssl_handshakes{type=\"full\"}" << pool["ssl_handshakes"].asInt() << "\n";
+      response << "mist_ssl_handshakes{type=\"resumed\"}" << pool["ssl_resumed"].asInt() << "\n";
+    }
+
     if (outputs.size()){
       response << "# HELP mist_outputs Number of viewers active right now, server-wide, by output type.\n";
       response << "# TYPE mist_outputs gauge\n";
@@ -1744,96 +2011,191 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
       }
 
       if (Controller::triggerStats.size()){
+        std::map<std::string, Controller::triggerLog>::iterator it;
         response << "\n# HELP mist_trigger_count Total executions for the given trigger\n";
-        response << "# HELP mist_trigger_time Total execution time in millis for the given trigger\n";
-        response << "# HELP mist_trigger_fails Total failed executions for the given trigger\n";
-        for (std::map<std::string, Controller::triggerLog>::iterator it = Controller::triggerStats.begin();
-            it != Controller::triggerStats.end(); it++){
+        response << "# TYPE mist_trigger_count counter\n";
+        for (it = Controller::triggerStats.begin(); it != Controller::triggerStats.end(); it++){
           response << "mist_trigger_count{trigger=\"" << it->first << "\"}" << it->second.totalCount << "\n";
+        }
+        response << "\n# HELP mist_trigger_time Total execution time in millis for the given trigger\n";
+        response << "# TYPE mist_trigger_time counter\n";
+        for (it = Controller::triggerStats.begin(); it != Controller::triggerStats.end(); it++){
           response << "mist_trigger_time{trigger=\"" << it->first << "\"}" << it->second.ms << "\n";
+        }
+        response << "\n# HELP mist_trigger_fails Total failed executions for the given trigger\n";
+        response << "# TYPE mist_trigger_fails counter\n";
+        for (it = Controller::triggerStats.begin(); it != Controller::triggerStats.end(); it++){
           response << "mist_trigger_fails{trigger=\"" << it->first << "\"}" << it->second.failCount << "\n";
         }
+        response << "\n# HELP mist_trigger_latency Executions for the given trigger by execution time in millis\n";
+        response << "# TYPE mist_trigger_latency histogram\n";
+        for (it = Controller::triggerStats.begin(); it != Controller::triggerStats.end(); it++){
+          uint64_t cumul = 0;
+          for (size_t i = 0; i < Controller::triggerBucketCount; ++i){
+            cumul += it->second.buckets[i];
+            response << "mist_trigger_latency_bucket{trigger=\"" << it->first << "\",le=\"" << Controller::triggerBuckets[i] << "\"}" << cumul << "\n";
+          }
+          response << "mist_trigger_latency_bucket{trigger=\"" << it->first << "\",le=\"+Inf\"}" << it->second.totalCount << "\n";
+          response << "mist_trigger_latency_sum{trigger=\"" << it->first << "\"}" << it->second.ms << "\n";
+          response << "mist_trigger_latency_count{trigger=\"" << it->first << "\"}" << it->second.totalCount << "\n";
+        }
+        response << "\n# HELP mist_trigger_fail_latency Failed executions for the given trigger by execution time in millis\n";
+        response << "# TYPE mist_trigger_fail_latency histogram\n";
+        for (it = Controller::triggerStats.begin(); it != Controller::triggerStats.end(); it++){
+          uint64_t failCumul = 0;
+          for (size_t i = 0; i < Controller::triggerBucketCount; ++i){
+            failCumul += it->second.failBuckets[i];
+            response << "mist_trigger_fail_latency_bucket{trigger=\"" << it->first << "\",le=\"" << Controller::triggerBuckets[i] << "\"}" << failCumul << "\n";
+          }
+          response << "mist_trigger_fail_latency_bucket{trigger=\"" << it->first << "\",le=\"+Inf\"}" << it->second.failCount << "\n";
+          response << "mist_trigger_fail_latency_sum{trigger=\"" << it->first << "\"}" << it->second.failMs << "\n";
+          response << "mist_trigger_fail_latency_count{trigger=\"" << it->first << "\"}" << it->second.failCount << "\n";
+        }
+        response << "\n";
+      }
+
+      if (instrumentPage){
+        // Copy the histograms first, so all three families describe the same moment
+        std::deque<std::string> labels;
+        std::deque<Instrument::Histogram> hists;
+        for (size_t slot = 0; slot < instrumentPage.slotCount(); ++slot){
+          std::string binary = instrumentPage.getName(slot);
+          if (!binary.size()){continue;}
+          for (size_t point = 0; point < Instrument::POINT_COUNT; ++point){
+            const Instrument::Histogram *H = instrumentPage.get(slot, point);
+            if (!H || !H->count){continue;}
+            labels.push_back("binary=\"" + binary + "\",point=\"" + Instrument::pointName(point) + "\"");
+            hists.push_back(*H);
+          }
+        }
+        response << "# HELP mist_pipeline_latency Time spent in instrumented points of the media pipeline by binary, in microseconds\n";
+        response << "# TYPE mist_pipeline_latency histogram\n";
+        for (size_t i = 0; i < hists.size(); ++i){
+          const Instrument::Histogram &H = hists[i];
+          // Export powers of two only; they fall exactly on bucket boundaries
+          uint64_t cumul = 0;
+          size_t bucket = 0;
+          for (uint64_t le = 1; le <= (1ull << 26); le *= 2){
+            while (bucket < INSTRUMENT_BUCKETS && Instrument::bucketStart(bucket) < le){cumul += H.buckets[bucket++];}
+            response << "mist_pipeline_latency_bucket{" << labels[i] << ",le=\"" << le << "\"} " << cumul << "\n";
+          }
+          response << "mist_pipeline_latency_bucket{" << labels[i] << ",le=\"+Inf\"} " << H.count << "\n";
+          response << "mist_pipeline_latency_sum{" << labels[i] << "} " << H.sum << "\n";
+          response << "mist_pipeline_latency_count{" << labels[i] << "} " << H.count << "\n";
+        }
+        response << "\n# HELP mist_pipeline_max Longest time spent in an instrumented point by binary, in microseconds\n";
+        response << "# TYPE mist_pipeline_max gauge\n";
+        for (size_t i = 0; i < hists.size(); ++i){
+          response << "mist_pipeline_max{" << labels[i] << "} " << hists[i].max << "\n";
+        }
+        response << "\n# HELP mist_pipeline_bytes Bytes handled by instrumented points by binary\n";
+        response << "# TYPE mist_pipeline_bytes counter\n";
+        for (size_t i = 0; i < hists.size(); ++i){
+          if (hists[i].bytes){response << "mist_pipeline_bytes{" << labels[i] << "} " << hists[i].bytes << "\n";}
+        }
         response << "\n";
       }
     }
     H.Chunkify(response.str(), conn);
   }
-  if (mode == PROMETHEUS_JSON){
+  if (mode == PROMETHEUS_JSON || mode == PROMETHEUS_LOAD){
+    // The load feed only carries what the load balancer needs
+    bool full = (mode == PROMETHEUS_JSON);
     JSON::Value resp;
     resp["cpu"] = cpu_use;
     resp["mem_total"] = mem_total;
     resp["mem_used"] = (mem_total - mem_free - mem_bufcache);
     resp["shm_total"] = shm_total;
     resp["shm_used"] = (shm_total - shm_free);
-    resp["logs"] = Controller::logCounter;
     resp["curr"].append(totViewers);
     resp["curr"].append(totInputs);
     resp["curr"].append(totOutputs);
     resp["curr"].append(totUnspecified);
-    resp["tot"].append(servViewers);
-    resp["tot"].append(servInputs);
-    resp["tot"].append(servOutputs);
-    resp["tot"].append(servUnspecified);
-    resp["st"].append(bw_up_total);
-    resp["st"].append(bw_down_total);
     resp["bw"].append(servUpBytes);
     resp["bw"].append(servDownBytes);
-    resp["pkts"].append(servPackSent);
-    resp["pkts"].append(servPackLoss);
-    resp["pkts"].append(servPackRetrans);
     resp["bwlimit"] = bwLimit;
+    if (full){
+      resp["logs"] = Controller::logCounter;
+      resp["tot"].append(servViewers);
+      resp["tot"].append(servInputs);
+      resp["tot"].append(servOutputs);
+      resp["tot"].append(servUnspecified);
+      resp["st"].append(bw_up_total);
+      resp["st"].append(bw_down_total);
+      resp["pkts"].append(servPackSent);
+      resp["pkts"].append(servPackLoss);
+      resp["pkts"].append(servPackRetrans);
+      HTTP::connectionPool.getStats(resp["http_pool"]);
+    }
     {// Scope for shortest possible blocking of statsMutex
       tthread::lock_guard<tthread::mutex> guard(statsMutex);
       resp["curr"].append((uint64_t)sessions.size());
 
-      if (Controller::triggerStats.size()){
+      if (full && Controller::triggerStats.size()){
         for (std::map<std::string, Controller::triggerLog>::iterator it = Controller::triggerStats.begin();
             it != Controller::triggerStats.end(); it++){
           JSON::Value &tVal = resp["triggers"][it->first];
           tVal["count"] = it->second.totalCount;
           tVal["ms"] = it->second.ms;
           tVal["fails"] = it->second.failCount;
+          tVal["fail_ms"] = it->second.failMs;
+          for (size_t i = 0; i < Controller::triggerBucketCount; ++i){
+            tVal["hist"].append(it->second.buckets[i]);
+            tVal["fail_hist"].append(it->second.failBuckets[i]);
+          }
         }
       }
-      if (Storage["config"].isMember("location") && Storage["config"]["location"].isMember("lat") && Storage["config"]["location"].isMember("lon")){
-        resp["loc"]["lat"] = Storage["config"]["location"]["lat"].asDouble();
-        resp["loc"]["lon"] = Storage["config"]["location"]["lon"].asDouble();
-        if (Storage["config"]["location"].isMember("name")){
-          resp["loc"]["name"] = Storage["config"]["location"]["name"].asStringRef();
-        }
+      const JSON::Value &C = *snap->config;
+      if (C.isMember("location") && C["location"].isMember("lat") && C["location"].isMember("lon")){
+        resp["loc"]["lat"] = C["location"]["lat"].asDouble();
+        resp["loc"]["lon"] = C["location"]["lon"].asDouble();
+        if (C["location"].isMember("name")){resp["loc"]["name"] = C["location"]["name"].asStringRef();}
+      }
+      if (full){
+        resp["obw"].append(servUpOtherBytes);
+        resp["obw"].append(servDownOtherBytes);
       }
-      resp["obw"].append(servUpOtherBytes);
-      resp["obw"].append(servDownOtherBytes);
 
       for (std::map<std::string, struct streamTotals>::iterator it = streamStats.begin();
            it != streamStats.end(); ++it){
-        resp["streams"][it->first]["tot"].append(it->second.viewers);
-        resp["streams"][it->first]["tot"].append(it->second.inputs);
-        resp["streams"][it->first]["tot"].append(it->second.outputs);
+        if (full){
+          resp["streams"][it->first]["tot"].append(it->second.viewers);
+          resp["streams"][it->first]["tot"].append(it->second.inputs);
+          resp["streams"][it->first]["tot"].append(it->second.outputs);
+        }
         resp["streams"][it->first]["bw"].append(it->second.upBytes);
         resp["streams"][it->first]["bw"].append(it->second.downBytes);
         resp["streams"][it->first]["curr"].append(it->second.currViews);
         resp["streams"][it->first]["curr"].append(it->second.currIns);
         resp["streams"][it->first]["curr"].append(it->second.currOuts);
         resp["streams"][it->first]["curr"].append(it->second.currUnspecified);
-        resp["streams"][it->first]["pkts"].append(it->second.packSent);
-        resp["streams"][it->first]["pkts"].append(it->second.packLoss);
-        resp["streams"][it->first]["pkts"].append(it->second.packRetrans);
+        if (full){
+          resp["streams"][it->first]["pkts"].append(it->second.packSent);
+          resp["streams"][it->first]["pkts"].append(it->second.packLoss);
+          resp["streams"][it->first]["pkts"].append(it->second.packRetrans);
+        }
       }
-      for (std::map<std::string, uint32_t>::iterator it = outputs.begin(); it != outputs.end(); ++it){
-        resp["output_counts"][it->first] = it->second;
+      if (full){
+        for (std::map<std::string, uint32_t>::iterator it = outputs.begin(); it != outputs.end(); ++it){
+          resp["output_counts"][it->first] = it->second;
+        }
       }
     }
 
-    jsonForEach(Storage["streams"], sIt){resp["conf_streams"].append(sIt.key());}
+    for (StreamSnapshots::const_iterator it = snap->streams->begin(); it != snap->streams->end(); ++it){
+      resp["conf_streams"].append(it->first);
+    }
 
     {
-      tthread::lock_guard<tthread::mutex> guard(Controller::configMutex);
       // add tags, if any
-      if (Storage.isMember("tags") && Storage["tags"].isArray() && Storage["tags"].size()){resp["tags"] = Storage["tags"];}
+      if (snap->tags->isArray() && snap->tags->size()){resp["tags"] = *snap->tags;}
       // Loop over connectors
-      const JSON::Value &caps = capabilities["connectors"];
-      jsonForEachConst(Storage["config"]["protocols"], prtcl){
+      static const JSON::Value empty;
+      const JSON::Value &C = *snap->config;
+      const JSON::Value &caps =
+          snap->capabilities->isMember("connectors") ? (*snap->capabilities)["connectors"] : empty;
+      const JSON::Value &protocols = C.isMember("protocols") ? C["protocols"] : empty;
+      jsonForEachConst(protocols, prtcl){
         if (!(*prtcl).isMember("connector")){continue;}
         const std::string &cName = (*prtcl)["connector"].asStringRef();
         if (!(*prtcl).isMember("online") || (*prtcl)["online"].asInt() != 1){continue;}
@@ -1872,7 +2234,7 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
         // if this connector can be depended upon by other connectors, loop over the rest
         if (capa.isMember("provides")){
           const std::string &cProv = capa["provides"].asStringRef();
-          jsonForEachConst(Storage["config"]["protocols"], chld){
+          jsonForEachConst(protocols, chld){
             const std::string &child = (*chld)["connector"].asStringRef();
             if (!caps.isMember(child) || !caps[child].isMember("deps")){continue;}
             if (caps[child].isMember("deps") && caps[child]["deps"].asStringRef() == cProv &&
@@ -1884,9 +2246,17 @@ void Controller::handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int
       }
     }
 
-    if (jsonp.size()){H.Chunkify(jsonp + "(", conn);}
-    H.Chunkify(resp.toString(), conn);
-    if (jsonp.size()){H.Chunkify(");\n", conn);}
+    if (!full){
+      // Version to pass back as "since" on the next request, and the time this record was
+      // generated so the balancer can measure how stale its data is.
+      resp["ver"] = (uint64_t)getLoadVersion();
+      resp["time"] = Util::unixMS();
+      H.Chunkify(resp.toPacked(), conn);
+    }else{
+      if (jsonp.size()){H.Chunkify(jsonp + "(", conn);}
+      H.Chunkify(resp.toString(), conn);
+      if (jsonp.size()){H.Chunkify(");\n", conn);}
+    }
   }
 
   H.Chunkify("", conn);
@@ -15,6 +15,12 @@
 #define STAT_CUTOFF 600
 #endif
 
+/// The STAT_WIPE_INTERVAL define sets how many seconds pass between removing sessions older than STAT_CUTOFF,
+/// while the stream totals table provides the per-stream counts and the sessions need not be gone through otherwise.
+#ifndef STAT_WIPE_INTERVAL
+#define STAT_WIPE_INTERVAL 60
+#endif
+
 namespace Controller{
 
   extern bool killOnExit;
@@ -100,10 +106,16 @@ namespace Controller{
   extern tthread::mutex statsMutex;
   extern uint64_t statDropoff;
 
+  const size_t triggerBucketCount = 12;
+  extern const uint64_t triggerBuckets[triggerBucketCount];
+
   struct triggerLog{
     uint64_t totalCount;
     uint64_t failCount;
     uint64_t ms;
+    uint64_t failMs; ///< Total execution time in millis of the failed executions
+    uint64_t buckets[triggerBucketCount]; ///< Executions per execution time bucket, not cumulative
+    uint64_t failBuckets[triggerBucketCount]; ///< Failed executions per execution time bucket, not cumulative
   };
 
   extern std::map<std::string, triggerLog> triggerStats;
@@ -120,6 +132,7 @@ namespace Controller{
   void fillHasStats(JSON::Value &req, JSON::Value &rep);
   void fillTotals(JSON::Value &req, JSON::Value &rep);
   void SharedMemStats(void *config);
+  void checkSessionTrackers();
   void sessions_invalidate(const std::string &streamname);
   void sessions_shutdown(JSON::Iter &i);
   void sessId_shutdown(const std::string &sessId);
@@ -132,5 +145,6 @@ namespace Controller{
 
 #define PROMETHEUS_TEXT 0
 #define PROMETHEUS_JSON 1
+#define PROMETHEUS_LOAD 2
   void handlePrometheus(HTTP::Parser &H, Socket::Connection &conn, int mode);
 }// namespace Controller
@@ -1,12 +1,15 @@
 #include "controller_capabilities.h"
+#include "controller_limits.h"
 #include "controller_storage.h"
 #include "controller_push.h" //LTS
 #include "controller_streams.h" //LTS
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <mist/accesslog.h>
 #include <mist/defines.h>
 #include <mist/shared_memory.h>
+#include <mist/stream.h>
 #include <mist/timing.h>
 #include <mist/triggers.h> //LTS
 #include <sys/stat.h>
@@ -33,7 +36,15 @@ namespace Controller{
   Util::RelAccX *rlxAccs = 0;
   IPC::sharedPage *shmStrm = 0;
   Util::RelAccX *rlxStrm = 0;
+  AccessLog::Writer binAccessLog; ///< Binary access log, written when accesslog is set to "binary:DIRECTORY"
+  std::string binAccessLogFailed; ///< Directory the binary access log last failed to open, to not retry per session
   uint64_t systemBoot = Util::unixMS() - Util::bootMS();
+  /// Guards currentSnapshot; only held while swapping or copying the reference itself
+  static tthread::mutex snapshotMutex;
+  static SharedConst<ConfigSnapshot> currentSnapshot; ///< Snapshot returned by getConfig()
+  /// What changed in Storage since the last published snapshot; only touched with configMutex locked
+  static std::set<std::string> changedStreams;
+  static bool configPartsChanged = true; ///< Anything besides the streams changed
 
   Util::RelAccX *logAccessor(){return rlxLogs;}
 
@@ -91,6 +102,30 @@ namespace Controller{
       rlxAccs->setString("tags", tags, newEndPos);
       rlxAccs->setEndPos(newEndPos + 1);
     }
+    if (accesslog.size() > 7 && !accesslog.compare(0, 7, "binary:")){
+      std::string dir = accesslog.substr(7);
+      if (binAccessLog.getDirectory() != dir || !binAccessLog.isOpen()){
+        if (dir == binAccessLogFailed){return;}
+        if (!binAccessLog.open(dir)){
+          binAccessLogFailed = dir;
+          return;
+        }
+        binAccessLogFailed.clear();
+      }
+      AccessLog::Record R;
+      R.time = Util::epoch();
+      R.session = sessId;
+      R.stream = strm;
+      R.connector = conn;
+      R.host = host;
+      R.duration = duration;
+      R.up = up;
+      R.down = down;
+      R.tags = tags;
+      binAccessLog.add(R);
+    }else if (binAccessLog.isOpen()){
+      binAccessLog.close();
+    }
   }
 
   void normalizeTrustedProxies(JSON::Value &tp){
@@ -231,6 +266,7 @@ namespace Controller{
     delete tmp;
     delete shmStrm;
     shmStrm = 0;
+    binAccessLog.close();
   }
 
   void handleMsg(void *err){
@@ -271,6 +307,7 @@ namespace Controller{
   }
 
   void writeCapabilities(){
+    configPartsChanged = true;
     std::string temp = capabilities.toPacked();
     static IPC::sharedPage mistCapaOut(SHM_CAPA, temp.size() + 100, false, false);
     if (mistCapaOut){
@@ -295,6 +332,7 @@ namespace Controller{
   }
 
   void writeProtocols(){
+    configPartsChanged = true;
     static std::string proxy_written;
     std::string tmpProxy;
     if (Storage["config"]["trustedproxy"].isArray()){
@@ -366,9 +404,15 @@ namespace Controller{
     }
   }
 
+  /// Stream configs as last written to shared memory, and the pages they were written to
+  static std::map<std::string, JSON::Value> writtenStrms;
+  static std::map<std::string, IPC::sharedPage> strmPages;
+
+  /// Writes the config of a single stream to its shared memory page, if it changed since the last write.
+  /// A null config removes the page. Pages are versioned: changes that fit are written in place, so
+  /// inputs and outputs holding the page open see them by checking a single version counter.
   void writeStream(const std::string &sName, const JSON::Value &sConf){
-    static std::map<std::string, JSON::Value> writtenStrms;
-    static std::map<std::string, IPC::sharedPage> pages;
+    streamChanged(sName);
     static std::set<std::string> skip;
     if (!skip.size()){
       skip.insert("online");
@@ -377,36 +421,20 @@ namespace Controller{
     }
     if (sConf.isNull()){
       writtenStrms.erase(sName);
-      pages.erase(sName);
+      if (strmPages.count(sName) && strmPages[sName]){
+        Util::RelAccX(strmPages[sName].mapped, false).setReload();
+      }
+      strmPages.erase(sName);
       return;
     }
     if (!writtenStrms.count(sName) || !writtenStrms[sName].compareExcept(sConf, skip)){
       writtenStrms[sName].assignFrom(sConf, skip);
-      IPC::sharedPage &P = pages[sName];
-      std::string temp = writtenStrms[sName].toPacked();
-      P.close();
       char tmpBuf[NAME_BUFFER_SIZE];
       snprintf(tmpBuf, NAME_BUFFER_SIZE, SHM_STREAM_CONF, sName.c_str());
-      P.init(tmpBuf, temp.size() + 100, false, false);
-      if (P){
-        Util::RelAccX tmpA(P.mapped, false);
-        if (tmpA.isReady()){tmpA.setReload();}
-        P.master = true;
-        P.close();
-      }
-      P.init(tmpBuf, temp.size() + 100, true, false);
-      if (!P){
+      if (!Util::writeDTSCPage(strmPages[sName], tmpBuf, writtenStrms[sName].toPacked())){
         writtenStrms.erase(sName);
-        pages.erase(sName);
-        return;
+        strmPages.erase(sName);
       }
-      Util::RelAccX A(P.mapped, false);
-      A.addField("dtsc_data", RAX_DTSC, temp.size());
-      // write config
-      memcpy(A.getPointer("dtsc_data"), temp.data(), temp.size());
-      A.setRCount(1);
-      A.setEndPos(1);
-      A.setReady();
     }
   }
 
@@ -418,10 +446,27 @@ namespace Controller{
   /// The `"SYSTEM_CONFIG"` trigger is global, and is ran every time the server configuration is updated. Its payload is the new configuration in
   /// JSON format. This trigger cannot be cancelled.
   void writeConfig(){
-    writeProtocols();
-    jsonForEach(Storage["streams"], it){
-      it->removeNullMembers();
-      writeStream(it.key(), *it);
+    writeProtocols(); // Marks the configuration changed, so it gets published
+    writeHostLimits();
+    // Stream edits write their own stream as they happen (see AddStreams and deleteStream), so all
+    // streams only need to be compared when the written set is out of sync, such as at startup.
+    // A stream removed without writeStream may hide behind one added the same way, so look for those too.
+    bool outOfSync = (writtenStrms.size() != Storage["streams"].size());
+    for (std::map<std::string, JSON::Value>::iterator it = writtenStrms.begin(); !outOfSync && it != writtenStrms.end(); ++it){
+      if (!Storage["streams"].isMember(it->first)){outOfSync = true;}
+    }
+    if (outOfSync){
+      jsonForEach(Storage["streams"], it){
+        it->removeNullMembers();
+        writeStream(it.key(), *it);
+      }
+      std::set<std::string> gone;
+      for (std::map<std::string, JSON::Value>::iterator it = writtenStrms.begin(); it != writtenStrms.end(); ++it){
+        if (!Storage["streams"].isMember(it->first)){gone.insert(it->first);}
+      }
+      for (std::set<std::string>::iterator it = gone.begin(); it != gone.end(); ++it){
+        writeStream(*it, JSON::Value());
+      }
     }
 
     {
@@ -574,6 +619,8 @@ namespace Controller{
       }
     }
 
+    publishConfig();
+
     static bool serverStartTriggered;
     if (!serverStartTriggered){
       if (Triggers::shouldTrigger("SYSTEM_START")){
@@ -586,4 +633,68 @@ namespace Controller{
     }
     /*LTS-END*/
   }
+
+  /// Returns the given member of V, or a null value if V has no such member
+  static const JSON::Value &memberOrNull(const JSON::Value &V, const char *name){
+    static const JSON::Value empty;
+    return V.isMember(name) ? V[name] : empty;
+  }
+
+  /// Marks the given stream as changed (or removed), so the next publishConfig() copies it.
+  /// Must be called with configMutex locked.
+  void streamChanged(const std::string &sName){changedStreams.insert(sName);}
+
+  /// Publishes a new snapshot holding copies of the parts of Storage marked as changed since the last one.
+  /// All other parts are shared with the previous snapshot, so nothing is compared and unchanged streams
+  /// cost nothing. Must be called with configMutex locked, after changing Storage.
+  void publishConfig(){
+    if (!configPartsChanged && !changedStreams.size()){return;}
+    SharedConst<ConfigSnapshot> prev = getConfig();
+    const JSON::Value &S = Storage;
+    ConfigSnapshot *next = new ConfigSnapshot(*prev);
+    next->version = prev->version + 1;
+    if (configPartsChanged){
+      next->hasAccount = S.isMember("account") && S["account"];
+      next->config = SharedConst<JSON::Value>(new JSON::Value(memberOrNull(S, "config")));
+      next->autopushes = SharedConst<JSON::Value>(new JSON::Value(memberOrNull(S, "autopushes")));
+      next->tags = SharedConst<JSON::Value>(new JSON::Value(memberOrNull(S, "tags")));
+      next->capabilities = SharedConst<JSON::Value>(new JSON::Value(capabilities));
+      configPartsChanged = false;
+    }
+    if (changedStreams.size()){
+      const JSON::Value &streams = memberOrNull(S, "streams");
+      StreamSnapshots *strms = new StreamSnapshots(*prev->streams);
+      for (std::set<std::string>::iterator it = changedStreams.begin(); it != changedStreams.end(); ++it){
+        if (streams.isMember(*it)){
+          (*strms)[*it] = SharedConst<JSON::Value>(new JSON::Value(streams[*it]));
+        }else{
+          strms->erase(*it);
+        }
+      }
+      next->streams = SharedConst<StreamSnapshots>(strms);
+      changedStreams.clear();
+    }
+    SharedConst<ConfigSnapshot> nextRef(next);
+    tthread::lock_guard<tthread::mutex> guard(snapshotMutex);
+    currentSnapshot = nextRef;
+  }
+
+  /// Returns the most recently published configuration snapshot, which stays valid for as long as the
+  /// returned reference exists. Does not lock configMutex, so may be called at any time by any thread.
+  SharedConst<ConfigSnapshot> getConfig(){
+    tthread::lock_guard<tthread::mutex> guard(snapshotMutex);
+    if (!currentSnapshot){
+      // Nothing was published yet: hand out an empty configuration
+      ConfigSnapshot *empty = new ConfigSnapshot();
+      empty->version = 0;
+      empty->hasAccount = false;
+      empty->config = SharedConst<JSON::Value>(new JSON::Value());
+      empty->autopushes = empty->config;
+      empty->tags = empty->config;
+      empty->capabilities = empty->config;
+      empty->streams = SharedConst<StreamSnapshots>(new StreamSnapshots());
+      currentSnapshot = SharedConst<ConfigSnapshot>(empty);
+    }
+    return currentSnapshot;
+  }
 }// namespace Controller
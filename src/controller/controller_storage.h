@@ -2,9 +2,62 @@
 #include <mist/json.h>
 #include <mist/tinythread.h>
 #include <mist/util.h>
+#include <map>
 #include <string>
 
 namespace Controller{
+  /// Reference-counted pointer to an object that is never changed after being shared.
+  /// Copies share the object, which is deleted along with the last copy. The count is updated
+  /// atomically, so copies may be made and dropped by any thread without further locking.
+  template <class T> class SharedConst{
+  public:
+    SharedConst() : ptr(0), refs(0){}
+    explicit SharedConst(T *obj) : ptr(obj), refs(new int(1)){}
+    SharedConst(const SharedConst &rhs) : ptr(rhs.ptr), refs(rhs.refs){
+      if (refs){__sync_add_and_fetch(refs, 1);}
+    }
+    SharedConst &operator=(const SharedConst &rhs){
+      if (rhs.refs){__sync_add_and_fetch(rhs.refs, 1);}
+      release();
+      ptr = rhs.ptr;
+      refs = rhs.refs;
+      return *this;
+    }
+    ~SharedConst(){release();}
+    const T &operator*() const{return *ptr;}
+    const T *operator->() const{return ptr;}
+    operator bool() const{return ptr;}
+    bool operator==(const SharedConst &rhs) const{return ptr == rhs.ptr;}
+
+  private:
+    T *ptr;
+    int *refs;
+    void release(){
+      if (refs && !__sync_sub_and_fetch(refs, 1)){
+        delete ptr;
+        delete refs;
+      }
+      ptr = 0;
+      refs = 0;
+    }
+  };
+
+  /// Stream configs of a snapshot, by stream name
+  typedef std::map<std::string, SharedConst<JSON::Value> > StreamSnapshots;
+
+  /// Immutable copy of the parts of Storage that are read without changing anything, such as by read-only
+  /// API requests. The places that change Storage mark what they changed; publishConfig() then copies only
+  /// those parts, and shares all others with the previous snapshot.
+  struct ConfigSnapshot{
+    uint64_t version;
+    bool hasAccount; ///< True if at least one API account exists
+    SharedConst<JSON::Value> config;
+    SharedConst<StreamSnapshots> streams;
+    SharedConst<JSON::Value> autopushes;
+    SharedConst<JSON::Value> tags;
+    SharedConst<JSON::Value> capabilities;
+  };
+
   extern std::string instanceId; ///< global storage of instanceId (previously uniqID) is set in controller.cpp
   extern std::string prometheus;     ///< Prometheus access string
   extern std::string accesslog;      ///< Where to write the access log
@@ -43,4 +96,8 @@ namespace Controller{
   void writeCapabilities();
   void writeProtocols();
 
+  void streamChanged(const std::string &sName);
+  void publishConfig();
+  SharedConst<ConfigSnapshot> getConfig();
+
 }// namespace Controller
@@ -189,19 +189,19 @@ namespace Controller{
   }
 
   ///\brief Checks all streams, restoring if needed.
+  /// Streams whose status changed are marked for the next published config snapshot.
   ///\param data The stream configuration for the server.
-  ///\returns True if the server status changed
-  bool CheckAllStreams(JSON::Value &data){
-    jsonForEach(data, jit){checkStream(jit.key(), (*jit));}
-
-    // check for changes in config or streams
-    static JSON::Value strlist;
-    if (strlist["config"] != Storage["config"] || strlist["streams"] != Storage["streams"]){
-      strlist["config"] = Storage["config"];
-      strlist["streams"] = Storage["streams"];
-      return true;
+  void CheckAllStreams(JSON::Value &data){
+    jsonForEach(data, jit){
+      const JSON::Value &strm = *jit;
+      JSON::Value prevOnline = strm.isMember("online") ? strm["online"] : JSON::Value();
+      JSON::Value prevError = strm.isMember("error") ? strm["error"] : JSON::Value();
+      checkStream(jit.key(), (*jit));
+      if ((strm.isMember("online") ? strm["online"] : JSON::Value()) != prevOnline ||
+          (strm.isMember("error") ? strm["error"] : JSON::Value()) != prevError){
+        Controller::streamChanged(jit.key());
+      }
     }
-    return false;
   }
 
   ///
@@ -395,8 +395,9 @@ namespace Controller{
           }else{
             ++ret;
             Log("STRM", "Deleting source file for stream " + cleaned + ": " + strmSource);
-            // Delete dtsh, ignore failures
+            // Delete dtsh and its image, ignore failures
             if (!unlink((strmSource + ".dtsh").c_str())){++ret;}
+            unlink((strmSource + ".dtsi").c_str());
           }
         }
       }
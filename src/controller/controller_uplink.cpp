@@ -73,14 +73,19 @@ void Controller::uplinkConnection(void *np){
               // if string, delete just the one
               if (curVal.isString()){
                 Controller::Storage["streams"].removeMember(curVal.asStringRef());
+                Controller::writeStream(curVal.asStringRef(), JSON::Value());
               }
               if (curVal.isArray()){
                 jsonForEach(curVal, it){
                   Controller::Storage["streams"].removeMember(it->asString());
+                  Controller::writeStream(it->asString(), JSON::Value());
                 }
               }
               if (curVal.isObject()){
-                jsonForEach(curVal, it){Controller::Storage["streams"].removeMember(it.key());}
+                jsonForEach(curVal, it){
+                  Controller::Storage["streams"].removeMember(it.key());
+                  Controller::writeStream(it.key(), JSON::Value());
+                }
               }
             }
           }
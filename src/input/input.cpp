@@ -9,6 +9,7 @@
 #include <mist/auth.h>
 #include <mist/defines.h>
 #include <mist/encode.h>
+#include <mist/instrument.h>
 #include <mist/procs.h>
 #include <mist/stream.h>
 #include <mist/triggers.h>
@@ -42,6 +43,7 @@ namespace Mist{
     if (endKey == key){++endKey;}
     if (endKey > key + 1000){endKey = key + 1000;}
     DONTEVEN_MSG("User with ID:%zu is on %zu:%zu -> %zu (timestamp %" PRIu64 ")", id, track, key, endKey, time);
+    bool preloadNext = false;
     for (size_t i = key; i <= endKey; ){
 
 
@@ -56,12 +58,25 @@ namespace Mist{
       }
       uint32_t pageNumber = tPages.getInt("firstkey", pageIdx);
       uint64_t pageTime = M.getTimeForKeyIndex(track, pageNumber);
+      uint64_t cnt = tPages.getInt("keycount", pageIdx);
+      if (i == key){
+        // The page the viewer is in: count it towards the page's popularity, and note a stall if
+        // the viewer is waiting for it to be loaded.
+        ++pageHits[track][pageNumber];
+        if (M.getVod() && !isBuffered(track, pageNumber, meta)){
+          if (stalledPages.insert(trackKey(track, pageNumber)).second){++pageStalls;}
+        }
+        preloadNext = ((key - pageNumber) * 100 >= cnt * PAGE_PRELOAD_PERCENT);
+      }
       if (pageTime < time){
         keyLoadPriority[trackKey(track, pageNumber)] += 10000;
+      }else if (preloadNext && i != key){
+        // The viewer is well into the previous page; this one is needed next
+        keyLoadPriority[trackKey(track, pageNumber)] += 5000;
+        preloadNext = false;
       }else{
         keyLoadPriority[trackKey(track, pageNumber)] += 600 - (pageTime - time) / 1000;
       }
-      uint64_t cnt = tPages.getInt("keycount", pageIdx);
       if (pageNumber + cnt <= i){return;}
       i = pageNumber + cnt;
     }
@@ -225,6 +240,9 @@ namespace Mist{
     isBuffer = false;
     startTime = Util::bootSecs();
     lastStats = 0;
+    pageStalls = 0;
+    pageLoads = 0;
+    lastPageDecay = 0;
   }
 
   void Input::checkHeaderTimes(std::string streamFile){
@@ -243,21 +261,19 @@ namespace Mist{
       INSANE_MSG("Source is not a file - ignoring header check");
       return;
     }
-    std::string headerFile = streamFile + ".dtsh";
-    if (stat(headerFile.c_str(), &bufHeader) != 0){
-      INSANE_MSG("No header exists to compare - ignoring header check");
-      return;
-    }
-    // the same second is not enough - add a 15 second window where we consider it too old
-    if (bufHeader.st_mtime < bufStream.st_mtime + 15){
-      INFO_MSG("Overwriting outdated DTSH header file: %s ", headerFile.c_str());
-      remove(headerFile.c_str());
-    }
-
-    // the same second is not enough - add a 15 second window where we consider it too old
-    if (hasSrt && bufHeader.st_mtime < srtStream.st_mtime + 15){
-      INFO_MSG("Overwriting outdated DTSH header file: %s ", headerFile.c_str());
-      remove(headerFile.c_str());
+    // Both the serialized header and the header image are checked
+    const char *suffixes[] ={".dtsh", ".dtsi"};
+    for (size_t i = 0; i < 2; ++i){
+      std::string headerFile = streamFile + suffixes[i];
+      if (stat(headerFile.c_str(), &bufHeader) != 0){
+        INSANE_MSG("No header %s exists to compare - ignoring header check", headerFile.c_str());
+        continue;
+      }
+      // the same second is not enough - add a 15 second window where we consider it too old
+      if (bufHeader.st_mtime < bufStream.st_mtime + 15 || (hasSrt && bufHeader.st_mtime < srtStream.st_mtime + 15)){
+        INFO_MSG("Overwriting outdated DTSH header file: %s ", headerFile.c_str());
+        remove(headerFile.c_str());
+      }
     }
   }
 
@@ -596,8 +612,9 @@ namespace Mist{
       }
       timer = Util::getMicros(timer);
       INFO_MSG("Created header in %.3f ms (%zu tracks)", (double)timer/1000.0, M?M.trackCount():(size_t)0);
-      //Write header to file for caching purposes
+      //Write header to file for caching purposes: the serialized header for other tools, the image for fast loading
       M.toFile(config->getString("input") + ".dtsh");
+      M.toImage(config->getString("input") + ".dtsi");
     }
     postHeader();
     if (config->getBool("headeronly")){return 0;}
@@ -676,17 +693,27 @@ namespace Mist{
     outMeta.toFile(fileName + ".dtsh");
   }
 
+  /// Returns the configuration of this stream, as published by the controller.
+  /// The page is kept open and only reopened when the controller replaced it, so repeated calls
+  /// are cheap; strmConf.getVersion() tells whether the configuration changed in between.
+  DTSC::Scan Input::getStreamConf(){
+    if (strmConf.isStale()){
+      std::string strName = streamName;
+      Util::sanitizeName(strName);
+      strName = strName.substr(0, (strName.find_first_of("+ ")));
+      char tmpBuf[NAME_BUFFER_SIZE];
+      snprintf(tmpBuf, NAME_BUFFER_SIZE, SHM_STREAM_CONF, strName.c_str());
+      strmConf.open(tmpBuf);
+    }
+    return strmConf.getScan();
+  }
+
   /// Checks in the server configuration if this stream is set to always on or not.
   /// Returns true if it is, or if the stream could not be found in the configuration.
   /// If the compiled default debug level is < INFO, instead returns false if the stream is not found.
   bool Input::isAlwaysOn(){
     bool ret = true;
-    std::string strName = streamName.substr(0, (streamName.find_first_of("+ ")));
-
-    char tmpBuf[NAME_BUFFER_SIZE];
-    snprintf(tmpBuf, NAME_BUFFER_SIZE, SHM_STREAM_CONF, strName.c_str());
-    Util::DTSCShmReader rStrmConf(tmpBuf);
-    DTSC::Scan streamCfg = rStrmConf.getScan();
+    DTSC::Scan streamCfg = getStreamConf();
     if (streamCfg){
       if (!streamCfg.getMember("always_on") || !streamCfg.getMember("always_on").asBool()){
         ret = false;
@@ -771,6 +798,7 @@ namespace Mist{
       config->is_active = false;
     }
     finish();
+    reportStalls(true);
     INFO_MSG("Input closing clean, reason: %s", Util::exitReason);
     userSelect.clear();
     if (!isThread()){
@@ -923,7 +951,9 @@ namespace Mist{
         return;
       }
       bufferLivePacket(thisPacket);
+      INSTRUMENT_START(readStart);
       getNext();
+      INSTRUMENT_STOP(Instrument::IN_READ, readStart);
       if (!thisPacket){
         Util::logExitReason("no more data");
         break;
@@ -1065,7 +1095,9 @@ namespace Mist{
 
     seek(0);/// \TODO Is this actually needed?
     while (config->is_active){
+      INSTRUMENT_START(readStart);
       getNext();
+      INSTRUMENT_STOP(Instrument::IN_READ, readStart);
       if (!thisPacket){
         Util::logExitReason("no more data");
         break;
@@ -1129,11 +1161,43 @@ namespace Mist{
         it2->second = 1;
       }
     }
+    pageHits.clear();
     removeUnused();
   }
 
+  /// Logs how many page loads viewers had to wait for, if that changed since the last report.
+  void Input::reportStalls(bool force){
+    static uint64_t lastReport = 0;
+    static uint64_t lastStalls = 0;
+    if (!pageLoads || (!force && (pageStalls == lastStalls || Util::bootSecs() < lastReport + 60))){return;}
+    INFO_MSG("Viewers waited for %" PRIu64 " of %" PRIu64 " page loads (%.1f%% stall rate)", pageStalls,
+             pageLoads, pageStalls * 100.0 / pageLoads);
+    lastReport = Util::bootSecs();
+    lastStalls = pageStalls;
+  }
+
+  /// Unloads pages that have not been requested for a while.
+  /// For VoD, pages that many viewers watched stay loaded for longer: the allowed idle time is the
+  /// page timeout multiplied by the page's decaying popularity, up to PAGE_TIMEOUT_MAX_FACTOR.
   void Input::removeUnused(){
     uint64_t cTime = Util::bootSecs();
+    // Halve the popularity of all pages once per timeout period, so popularity tracks recent viewers
+    if (cTime >= lastPageDecay + DEFAULT_PAGE_TIMEOUT){
+      lastPageDecay = cTime;
+      for (std::map<size_t, std::map<uint32_t, uint64_t> >::iterator it = pageHits.begin(); it != pageHits.end(); ++it){
+        std::map<uint32_t, uint64_t>::iterator it2 = it->second.begin();
+        while (it2 != it->second.end()){
+          it2->second /= 2;
+          if (!it2->second){
+            it->second.erase(it2++);
+          }else{
+            ++it2;
+          }
+        }
+      }
+    }
+    // One viewer watching a page for a full timeout period earns it one extra timeout period
+    static const uint64_t hitsPerTimeout = DEFAULT_PAGE_TIMEOUT * 1000 / INPUT_USER_INTERVAL;
     std::set<size_t> validTracks = M.getValidTracks();
     std::map<size_t, std::set<uint32_t> > checkedPages;
     for (std::set<size_t>::iterator it = validTracks.begin(); it != validTracks.end(); ++it){
@@ -1147,7 +1211,13 @@ namespace Mist{
             pageCounter[*it][pageNum] = cTime;
             continue;
           }
-          if (cTime > pageCounter[*it][pageNum] + DEFAULT_PAGE_TIMEOUT){
+          uint64_t timeout = DEFAULT_PAGE_TIMEOUT;
+          if (M.getVod() && pageHits.count(*it) && pageHits[*it].count(pageNum)){
+            uint64_t factor = 1 + pageHits[*it][pageNum] / hitsPerTimeout;
+            if (factor > PAGE_TIMEOUT_MAX_FACTOR){factor = PAGE_TIMEOUT_MAX_FACTOR;}
+            timeout *= factor;
+          }
+          if (cTime > pageCounter[*it][pageNum] + timeout){
             pageCounter[*it].erase(pageNum);
             bufferRemove(*it, pageNum);
           }
@@ -1450,6 +1520,18 @@ namespace Mist{
       stopTime = keys.getTime(pageNumber + tPages.getInt("keycount", pageIdx));
     }
     HIGH_MSG("Playing from %" PRIu64 " to %" PRIu64, keyTime, stopTime);
+    if (!isSrt){
+      // Let the source fetch this page and the next one in the background, so disk I/O for the
+      // next page overlaps with filling this one.
+      for (uint64_t i = pageIdx; i < tPages.getEndPos() && i < pageIdx + 2; ++i){
+        uint32_t firstKey = tPages.getInt("firstkey", i);
+        uint32_t lastKey = firstKey + tPages.getInt("keycount", i) - 1;
+        if (lastKey >= keys.getEndValid() || lastKey < firstKey){continue;}
+        uint64_t firstBpos = keys.getBpos(firstKey);
+        uint64_t endBpos = keys.getBpos(lastKey) + keys.getSize(lastKey);
+        if (endBpos > firstBpos){readAhead(sourceIdx, firstBpos, endBpos - firstBpos);}
+      }
+    }
     if (isSrt){
       getNextSrt();
       // in case earlier seeking was imprecise, seek to the exact point
@@ -1581,6 +1663,9 @@ namespace Mist{
       INFO_MSG("  (%" PRIu32 "/%" PRIu64 " parts, %" PRIu64 " bytes)", packCounter,
                tPages.getInt("parts", pageIdx), byteCounter);
       pageCounter[idx][pageNumber] = Util::bootSecs();
+      ++pageLoads;
+      stalledPages.erase(trackKey(idx, pageNumber));
+      reportStalls();
       return true;
     }
   }
@@ -1611,6 +1696,19 @@ namespace Mist{
         }
       }
     }
+    std::string metaName = config->getBool("realtime") ? "" : streamName;
+    // Try the header image first: it is copied into place as-is
+    std::string imageName = config->getString("input") + ".dtsi";
+    {
+      char *imageBuf;
+      size_t imageSize = 0;
+      HTTP::URIReader imageFile(imageName);
+      if (imageFile){imageFile.readAll(imageBuf, imageSize);}
+      if (imageSize){
+        if (DTSC::Meta::isImage(imageBuf, imageSize) && meta.fromImage(metaName, imageBuf, imageSize)){return meta;}
+        INFO_MSG("Regenerating outdated header image %s", imageName.c_str());
+      }
+    }
     // Try to read any existing DTSH file
     std::string fileName = config->getString("input") + ".dtsh";
     HIGH_MSG("Loading metadata for stream '%s' from file '%s'", streamName.c_str(), fileName.c_str());
@@ -1621,14 +1719,26 @@ namespace Mist{
     inFile.readAll(scanBuf, fileSize);
     inFile.close();
     if (!fileSize){return false;}
-    DTSC::Packet pkt(scanBuf, fileSize, true);
     HIGH_MSG("Retrieved header of %zu bytes", fileSize);
-    meta.reInit(config->getBool("realtime") ? "" : streamName, pkt.getScan());
+    if (DTSC::Meta::isImage(scanBuf, fileSize)){
+      if (!meta.fromImage(metaName, scanBuf, fileSize)){
+        INFO_MSG("Regenerating outdated header image %s", fileName.c_str());
+        return false;
+      }
+      return meta;
+    }
+    DTSC::Packet pkt(scanBuf, fileSize, true);
+    meta.reInit(metaName, pkt.getScan());
 
     if (meta.version != DTSH_VERSION){
       INFO_MSG("Updating wrong version header file from version %u to %u", meta.version, DTSH_VERSION);
       return false;
     }
+    // The serialized header is left alone, other tools may read it; the image is written next to it
+    if (meta){
+      INFO_MSG("Writing header image %s", imageName.c_str());
+      meta.toImage(imageName);
+    }
     return meta;
   }
 
@@ -8,6 +8,7 @@
 #include <mist/encryption.h>
 #include <mist/json.h>
 #include <mist/shared_memory.h>
+#include <mist/stream.h>
 #include <mist/timing.h>
 #include <set>
 
@@ -68,6 +69,7 @@ namespace Mist{
     virtual bool atKeyFrame();
     virtual void getNext(size_t idx = INVALID_TRACK_ID){}
     virtual void seek(uint64_t seekTime, size_t idx = INVALID_TRACK_ID){}
+    virtual void readAhead(size_t idx, uint64_t bpos, size_t len){}
     virtual void finish();
     virtual bool keepRunning();
     virtual bool openStreamSource(){return readHeader();}
@@ -86,6 +88,8 @@ namespace Mist{
     virtual void streamMainLoop();
     virtual void realtimeMainLoop();
     bool isAlwaysOn();
+    DTSC::Scan getStreamConf();
+    Util::DTSCShmReader strmConf; ///< This stream's configuration page, kept open between reads
 
     virtual void userLeadIn();
     virtual void userOnActive(size_t id);
@@ -111,6 +115,12 @@ namespace Mist{
     IPC::sharedPage streamStatus;
 
     std::map<size_t, std::map<uint32_t, uint64_t> > pageCounter;
+    std::map<size_t, std::map<uint32_t, uint64_t> > pageHits; ///< Decaying viewer counts per page
+    std::set<trackKey> stalledPages; ///< Pages viewers are currently waiting for
+    uint64_t pageStalls;
+    uint64_t pageLoads;
+    uint64_t lastPageDecay;
+    void reportStalls(bool force = false);
 
     static Input *singleton;
 
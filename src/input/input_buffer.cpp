@@ -434,13 +434,7 @@ namespace Mist{
     }
     if (Util::bootMS() - lastProcTime > procInterval){
       lastProcTime = Util::bootMS();
-      std::string strName = config->getString("streamname");
-      Util::sanitizeName(strName);
-      strName = strName.substr(0, (strName.find_first_of("+ ")));
-      char tmpBuf[NAME_BUFFER_SIZE];
-      snprintf(tmpBuf, NAME_BUFFER_SIZE, SHM_STREAM_CONF, strName.c_str());
-      Util::DTSCShmReader rStrmConf(tmpBuf);
-      DTSC::Scan streamCfg = rStrmConf.getScan();
+      DTSC::Scan streamCfg = getStreamConf();
       if (streamCfg){
         JSON::Value configuredProcesses = streamCfg.getMember("processes").asJSON();
         checkProcesses(configuredProcesses);
@@ -525,13 +519,7 @@ namespace Mist{
   bool inputBuffer::preRun(){
     // This function gets run periodically to make sure runtime updates of the config get parsed.
     Util::Procs::kill_timeout = 5;
-    std::string strName = config->getString("streamname");
-    Util::sanitizeName(strName);
-    strName = strName.substr(0, (strName.find_first_of("+ ")));
-    char tmpBuf[NAME_BUFFER_SIZE];
-    snprintf(tmpBuf, NAME_BUFFER_SIZE, SHM_STREAM_CONF, strName.c_str());
-    Util::DTSCShmReader rStrmConf(tmpBuf);
-    DTSC::Scan streamCfg = rStrmConf.getScan();
+    DTSC::Scan streamCfg = getStreamConf();
 
     //Check if bufferTime setting is correct
     uint64_t tmpNum = retrieveSetting(streamCfg, "DVR", "bufferTime");
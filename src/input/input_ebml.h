@@ -150,6 +150,7 @@ namespace Mist{
     bool readElement();
     void getNext(size_t idx = INVALID_TRACK_ID);
     void seek(uint64_t seekTime, size_t idx = INVALID_TRACK_ID);
+    void readAhead(size_t idx, uint64_t bpos, size_t len){inFile.readAhead(bpos, len);}
     void clearPredictors();
     bool readingMinimal;
     uint64_t lastClusterBPos;
@@ -22,6 +22,8 @@
 #include <vector>
 
 #define SEM_TS_CLAIM "/MstTSIN%s"
+/// Size in bytes above which the local RAM buffer of segments starts dropping segments
+#define HLS_SEGMENT_CACHE 16 * 1024 * 1024
 
 static uint64_t ISO8601toUnixmillis(const std::string &ts){
   // Format examples:
@@ -109,10 +111,30 @@ namespace Mist{
   /// Order of adding/accessing for local RAM buffer of segments
   std::deque<std::string> segBufAccs;
 
-  /// Order of adding/accessing sizes for local RAM buffer of segments
-  std::deque<size_t> segBufSize;
-
-  size_t segBufTotalSize = 0;
+  /// Mutex for accesses to segBufs, segBufAccs, segBufActive and prefetchWindows.
+  /// The contents of a buffer are only ever written by the thread that added it, while holding this mutex;
+  /// that thread may read its own buffer without it.
+  tthread::mutex segBufMutex;
+
+  /// Segment currently being read from the local RAM buffer, which is never dropped
+  std::string segBufActive;
+
+  /// Amount of upcoming segments to download ahead of playback, zero to disable
+  static size_t prefetchDepth = 0;
+  /// Amount of threads downloading upcoming segments
+  static size_t prefetchThreads = 0;
+  /// Upcoming segments per playlist, which are not dropped from the local RAM buffer
+  std::map<uint64_t, std::set<std::string> > prefetchWindows;
+  /// Upcoming segments per playlist not yet buffered, in playback order
+  std::map<uint64_t, std::deque<std::string> > prefetchQueues;
+  /// Segments currently being downloaded by a prefetch thread
+  std::set<std::string> prefetchBusy;
+  /// Mutex for accesses to prefetchQueues and prefetchBusy
+  tthread::mutex prefetchMutex;
+  /// Running prefetch threads, joined by the destructor
+  static std::deque<tthread::thread *> prefetchers;
+  /// Tells the prefetch threads to stop
+  static volatile bool prefetchStop = false;
 
   /// Track which segment numbers have been parsed
   std::map<uint64_t, uint64_t> parsedSegments;
@@ -145,6 +167,126 @@ namespace Mist{
     if (s.length() > 0 && s.at(s.length() - 1) == '\r'){s.erase(s.size() - 1);}
   }
 
+  /// Returns true if the given segment is upcoming in any of the playlists.
+  /// segBufMutex must be locked when calling this.
+  static bool inPrefetchWindow(const std::string &name){
+    for (std::map<uint64_t, std::set<std::string> >::iterator it = prefetchWindows.begin();
+         it != prefetchWindows.end(); ++it){
+      if (it->second.count(name)){return true;}
+    }
+    return false;
+  }
+
+  /// Drops the least recently added segments from the local RAM buffer while it holds more than
+  /// HLS_SEGMENT_CACHE bytes. The active segment and the upcoming ones of all playlists are always kept.
+  /// segBufMutex must be locked when calling this.
+  static void trimSegmentCache(){
+    size_t total = 0;
+    for (std::map<std::string, Util::ResizeablePointer>::iterator it = segBufs.begin(); it != segBufs.end(); ++it){
+      if (it->first != segBufActive){total += it->second.size();}
+    }
+    size_t i = segBufAccs.size();
+    while (total > HLS_SEGMENT_CACHE && segBufs.size() > 1 && i){
+      --i;
+      const std::string &name = segBufAccs[i];
+      if (name == segBufActive || inPrefetchWindow(name)){continue;}
+      HIGH_MSG("Dropping from segment cache: %s", name.c_str());
+      total -= segBufs[name].size();
+      segBufs.erase(name);
+      segBufAccs.erase(segBufAccs.begin() + i);
+    }
+  }
+
+  /// Returns true if a prefetch thread is currently downloading the given segment
+  static bool isPrefetching(const std::string &name){
+    tthread::lock_guard<tthread::mutex> guard(prefetchMutex);
+    return prefetchBusy.count(name);
+  }
+
+  /// Runs as a thread, downloading upcoming segments into the local RAM buffer.
+  /// Each thread keeps its own connection alive between segments.
+  void prefetchRunner(void *){
+    Util::setStreamName(self->getStreamName());
+    HTTP::Downloader DL;
+    DL.retryCount = 2;
+    uint64_t lastPlaylist = 0;
+    while (self->config->is_active && !prefetchStop){
+      std::string name;
+      {
+        // Take turns between the playlists, so every rendition gets its upcoming segments
+        tthread::lock_guard<tthread::mutex> guard(prefetchMutex);
+        std::map<uint64_t, std::deque<std::string> >::iterator it = prefetchQueues.upper_bound(lastPlaylist);
+        for (size_t i = 0; i < prefetchQueues.size() && !name.size(); ++i, ++it){
+          if (it == prefetchQueues.end()){it = prefetchQueues.begin();}
+          if (!it->second.size()){continue;}
+          name = it->second.front();
+          it->second.pop_front();
+          prefetchBusy.insert(name);
+          lastPlaylist = it->first;
+        }
+      }
+      if (!name.size()){
+        Util::sleep(10);
+        continue;
+      }
+      uint64_t startTime = Util::bootMS();
+      if (DL.get(HTTP::URL(name)) && DL.isOk()){
+        HIGH_MSG("Prefetched %s (%zu bytes) in %" PRIu64 "ms", name.c_str(), DL.const_data().size(),
+                 Util::bootMS() - startTime);
+        tthread::lock_guard<tthread::mutex> guard(segBufMutex);
+        if (!segBufs.count(name)){
+          segBufs[name].assign(DL.const_data().data(), DL.const_data().size());
+          segBufAccs.push_front(name);
+          trimSegmentCache();
+        }
+      }else{
+        // Not fatal: the segment will be downloaded when it is needed instead
+        WARN_MSG("Could not prefetch segment %s", name.c_str());
+      }
+      DL.data().clear();
+      tthread::lock_guard<tthread::mutex> guard(prefetchMutex);
+      prefetchBusy.erase(name);
+    }
+  }
+
+  /// Sets the segments of the given playlist that will be needed next, in playback order, and queues the ones
+  /// not yet buffered for prefetching. Only HTTP(S) segments are prefetched.
+  static void prefetchSegments(uint64_t playlist, const std::deque<std::string> &upcoming){
+    if (!prefetchDepth || !prefetchThreads){return;}
+    if (!prefetchers.size()){
+      INFO_MSG("Prefetching up to %zu segments ahead using %zu threads", prefetchDepth, prefetchThreads);
+      for (size_t i = 0; i < prefetchThreads; ++i){prefetchers.push_back(new tthread::thread(prefetchRunner, 0));}
+    }
+    std::deque<std::string> wanted;
+    {
+      tthread::lock_guard<tthread::mutex> guard(segBufMutex);
+      std::set<std::string> &window = prefetchWindows[playlist];
+      window.clear();
+      for (std::deque<std::string>::const_iterator it = upcoming.begin(); it != upcoming.end(); ++it){
+        const std::string protocol = HTTP::URL(*it).protocol;
+        if (protocol != "http" && protocol != "https"){continue;}
+        window.insert(*it);
+        if (!segBufs.count(*it)){wanted.push_back(*it);}
+      }
+    }
+    tthread::lock_guard<tthread::mutex> guard(prefetchMutex);
+    std::deque<std::string> &queue = prefetchQueues[playlist];
+    queue.clear();
+    for (std::deque<std::string>::iterator it = wanted.begin(); it != wanted.end(); ++it){
+      if (!prefetchBusy.count(*it)){queue.push_back(*it);}
+    }
+  }
+
+  /// Stops the prefetch threads and waits for them to finish their current download
+  static void stopPrefetching(){
+    prefetchStop = true;
+    while (prefetchers.size()){
+      prefetchers.front()->join();
+      delete prefetchers.front();
+      prefetchers.pop_front();
+    }
+  }
+
   /// Helper function that is used to run the playlist downloaders
   /// Expects character array with playlist URL as argument, sets the first byte of the pointer to zero when loaded.
   void playlistRunner(void *ptr){
@@ -253,6 +395,7 @@ namespace Mist{
   /// Returns true if packetPtr is at the end of the current segment.
   bool SegmentDownloader::atEnd() const{
     if (!isOpen || !currBuf){return true;}
+    if (encrypted && buffered){return offset >= currBuf->size() && encOffset + 188 > outData.size();}
     if (buffered){return currBuf->size() <= offset + 188;}
     return !segDL && currBuf->size() <= offset + 188;
     // return (packetPtr - segDL.const_data().data() + 188) > segDL.const_data().size();
@@ -280,9 +423,18 @@ namespace Mist{
         return true;
       }
       // Alright, we need to read some more data.
-      // We read 192 bytes at a time: a single TS packet is 188 bytes but AES-128-CBC encryption works in 16-byte blocks.
       size_t len = 0;
-      segDL.readSome(packetPtr, len, 192);
+      if (buffered){
+        // Decrypt buffered segments 16 TS packets at a time: a multiple of both the TS packet size and
+        // the 16-byte AES-128-CBC block size.
+        len = currBuf->size() - offset;
+        if (len > 16 * 188){len = 16 * 188;}
+        packetPtr = *currBuf + offset;
+        offset += len;
+      }else{
+        // We read 192 bytes at a time: a single TS packet is 188 bytes but AES-128-CBC encryption works in 16-byte blocks.
+        segDL.readSome(packetPtr, len, 192);
+      }
       if (!len){return false;}
       if (len % 16 != 0){
         FAIL_MSG("Read a non-16-multiple of bytes (%zu), cannot decode!", len);
@@ -293,7 +445,7 @@ namespace Mist{
                             ((unsigned char *)(char *)outData) + outData.size());
       outData.append(0, len);
       // End of the segment? Remove padding data.
-      if (segDL.isEOF()){
+      if (buffered ? offset >= currBuf->size() : segDL.isEOF()){
         // The padding consists of X bytes of padding, all containing the raw value X.
         // Since padding is mandatory, we can simply read the last byte and remove X bytes from the length.
         if (outData.size() <= outData[outData.size() - 1]){
@@ -370,11 +522,8 @@ namespace Mist{
   }
 
   void SegmentDownloader::dataCallback(const char *ptr, size_t size){
+    tthread::lock_guard<tthread::mutex> guard(segBufMutex);
     currBuf->append(ptr, size);
-    //Overwrite the current segment size
-    segBufTotalSize -= segBufSize.front();
-    segBufSize.front() = currBuf->size();
-    segBufTotalSize += segBufSize.front();
   }
 
   size_t SegmentDownloader::getDataCallbackPos() const{return currBuf->size();}
@@ -396,7 +545,17 @@ namespace Mist{
 
     offset = 0;
     firstPacket = true;
-    buffered = segBufs.count(entry.filename);
+    // If a prefetch thread is downloading this segment right now, wait for it instead of downloading it twice
+    while (isPrefetching(entry.filename)){
+      if (!callbackFunc(0)){return false;}
+      Util::sleep(5);
+    }
+    {
+      tthread::lock_guard<tthread::mutex> guard(segBufMutex);
+      segBufActive = entry.filename;
+      buffered = segBufs.count(entry.filename);
+      if (buffered){currBuf = &(segBufs[entry.filename]);}
+    }
     if (!buffered){
       HIGH_MSG("Reading non-cache: %s", entry.filename.c_str());
       if (!segDL.open(entry.filename)){
@@ -404,20 +563,12 @@ namespace Mist{
         return false;
       }
       if (!segDL){return false;}
-      //Remove cache entries while above 16MiB in total size, unless we only have 1 entry (we keep two at least at all times)
-      while (segBufTotalSize > 16 * 1024 * 1024 && segBufs.size() > 1){
-        HIGH_MSG("Dropping from segment cache: %s", segBufAccs.back().c_str());
-        segBufs.erase(segBufAccs.back());
-        segBufTotalSize -= segBufSize.back();
-        segBufAccs.pop_back();
-        segBufSize.pop_back();
-      }
+      tthread::lock_guard<tthread::mutex> guard(segBufMutex);
       segBufAccs.push_front(entry.filename);
-      segBufSize.push_front(0);
       currBuf = &(segBufs[entry.filename]);
+      trimSegmentCache();
     }else{
       HIGH_MSG("Reading from segment cache: %s", entry.filename.c_str());
-      currBuf = &(segBufs[entry.filename]);
       if (currBuf->rsize() != currBuf->size()){
         MEDIUM_MSG("Cache was incomplete (%zu/%" PRIu32 "), resuming", currBuf->size(), currBuf->rsize());
         buffered = false;
@@ -431,7 +582,10 @@ namespace Mist{
           }
           if (!segDL){return false;}
           //Seek to current position in segment for resuming
-          currBuf->truncate(currBuf->size() / 188 * 188);
+          {
+            tthread::lock_guard<tthread::mutex> guard(segBufMutex);
+            currBuf->truncate(currBuf->size() / 188 * 188);
+          }
           MEDIUM_MSG("Seeking to %zu", currBuf->size());
           segDL.seek(currBuf->size());
         }
@@ -439,7 +593,10 @@ namespace Mist{
     }
     if (!buffered){
       // Allocate full size if known
-      if (segDL.getSize() != std::string::npos){currBuf->allocate(segDL.getSize());}
+      if (segDL.getSize() != std::string::npos){
+        tthread::lock_guard<tthread::mutex> guard(segBufMutex);
+        currBuf->allocate(segDL.getSize());
+      }
       // Download full segment if not seekable, pretend it was cached all along
       if (!segDL.isSeekable()){
         segDL.readAll(*this);
@@ -449,6 +606,7 @@ namespace Mist{
 
     encrypted = false;
     outData.truncate(0);
+    encOffset = 0;
     // If we have a non-null key, decrypt
     if (entry.keyAES[0] != 0 || entry.keyAES[1] != 0 || entry.keyAES[2] != 0 || entry.keyAES[3] != 0 ||
         entry.keyAES[4] != 0 || entry.keyAES[5] != 0 || entry.keyAES[6] != 0 || entry.keyAES[7] != 0 ||
@@ -727,10 +885,38 @@ namespace Mist{
     capa["codecs"]["audio"].append("AC3");
     capa["codecs"]["audio"].append("MP3");
 
+    JSON::Value option;
+    option["arg"] = "integer";
+    option["long"] = "prefetch";
+    option["help"] = "Amount of upcoming HTTP(S) segments to download ahead of playback (0 to disable)";
+    option["value"].append(3);
+    config->addOption("prefetch", option);
+    capa["optional"]["prefetch"]["name"] = "Segment prefetch";
+    capa["optional"]["prefetch"]["help"] =
+        "Amount of upcoming HTTP(S) segments to download ahead of playback, in parallel. Set to 0 "
+        "to only download segments when they are needed.";
+    capa["optional"]["prefetch"]["option"] = "--prefetch";
+    capa["optional"]["prefetch"]["type"] = "uint";
+    capa["optional"]["prefetch"]["default"] = 3;
+
+    option.null();
+    option["arg"] = "integer";
+    option["long"] = "prefetch_threads";
+    option["help"] = "Amount of parallel connections used for segment prefetching";
+    option["value"].append(2);
+    config->addOption("prefetch_threads", option);
+    capa["optional"]["prefetch_threads"]["name"] = "Prefetch connections";
+    capa["optional"]["prefetch_threads"]["help"] =
+        "Amount of parallel connections used to download upcoming segments.";
+    capa["optional"]["prefetch_threads"]["option"] = "--prefetch_threads";
+    capa["optional"]["prefetch_threads"]["type"] = "uint";
+    capa["optional"]["prefetch_threads"]["default"] = 2;
+
     inFile = NULL;
   }
 
   inputHLS::~inputHLS(){
+    stopPrefetching();
     if (inFile){fclose(inFile);}
   }
 
@@ -740,6 +926,9 @@ namespace Mist{
       return false;
     }
 
+    prefetchDepth = config->getInteger("prefetch");
+    prefetchThreads = config->getInteger("prefetch_threads");
+
     if (!initPlaylist(config->getString("input"), false)){return false;}
 
     // If the playlist is of event type, init the amount of segments in the playlist
@@ -1651,6 +1840,7 @@ namespace Mist{
     tsStream.clear();
 
     playListEntries ntry;
+    std::deque<std::string> upcoming;
     // This scope limiter prevents the recursion down below from deadlocking us
     {
       tthread::lock_guard<tthread::mutex> guard(entryMutex);
@@ -1670,11 +1860,17 @@ namespace Mist{
           return false;
         }
         ntry = curList[currentIndex];
+        for (size_t i = currentIndex + 1; i < curList.size() && upcoming.size() < prefetchDepth; ++i){
+          upcoming.push_back(curList[i].filename);
+        }
       }else{
         // Live does not use the currentIndex, but simply takes the first segment
         // That segment is then removed from the playlist so we don't read it again - live streams can't seek anyway
         ntry = *curList.begin();
         curList.pop_front();
+        for (size_t i = 0; i < curList.size() && upcoming.size() < prefetchDepth; ++i){
+          upcoming.push_back(curList[i].filename);
+        }
 
         if (Util::bootSecs() < ntry.timestamp){
           VERYHIGH_MSG("Slowing down to realtime...");
@@ -1686,6 +1882,7 @@ namespace Mist{
       }
     }
 
+    prefetchSegments(currentPlaylist, upcoming);
     if (!segDowner.loadSegment(ntry)){
       ERROR_MSG("Could not download segment: %s", ntry.filename.c_str());
       return readNextFile(); // Attempt to read another, if possible.
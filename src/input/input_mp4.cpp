@@ -33,14 +33,16 @@ namespace Mist{
     co64Box.clear();
     stco64 = false;
     trackId = 0;
+    trakData = 0;
+    indexed = false;
   }
 
   uint64_t mp4TrackHeader::size(){return (stszBox.asBox() ? stszBox.getSampleCount() : 0);}
 
+  /// Indexes the sample tables of the given trak box.
+  /// The tables are referenced in place rather than copied, so the trak box must stay in memory.
   void mp4TrackHeader::read(MP4::TRAK &trakBox){
     initialised = false;
-    std::string tmp; // temporary string for copying box data
-    MP4::Box trakLoopPeek;
     timeScale = 1;
 
     MP4::MDIA mdiaBox = trakBox.getChild<MP4::MDIA>();
@@ -50,14 +52,15 @@ namespace Mist{
 
     MP4::STBL stblBox = mdiaBox.getChild<MP4::MINF>().getChild<MP4::STBL>();
 
-    sttsBox.copyFrom(stblBox.getChild<MP4::STTS>());
-    cttsBox.copyFrom(stblBox.getChild<MP4::CTTS>());
-    stszBox.copyFrom(stblBox.getChild<MP4::STSZ>());
-    stcoBox.copyFrom(stblBox.getChild<MP4::STCO>());
-    co64Box.copyFrom(stblBox.getChild<MP4::CO64>());
-    stscBox.copyFrom(stblBox.getChild<MP4::STSC>());
+    sttsBox = stblBox.getChild<MP4::STTS>();
+    cttsBox = stblBox.getChild<MP4::CTTS>();
+    stszBox = stblBox.getChild<MP4::STSZ>();
+    stcoBox = stblBox.getChild<MP4::STCO>();
+    co64Box = stblBox.getChild<MP4::CO64>();
+    stscBox = stblBox.getChild<MP4::STSC>();
     stco64 = co64Box.isType("co64");
     hasCTTS = cttsBox.isType("ctts");
+    indexed = true;
   }
 
   void mp4TrackHeader::getPart(uint64_t index, uint64_t &offset){
@@ -96,10 +99,21 @@ namespace Mist{
     initialised = true;
   }
 
+  /// Returns the sample table index for the given MP4 track ID.
+  /// Tracks are only indexed the first time they are needed, so tracks that are never selected
+  /// for playback never have their sample tables touched.
   mp4TrackHeader &inputMP4::headerData(size_t trackID){
     static mp4TrackHeader none;
     for (std::deque<mp4TrackHeader>::iterator it = trackHeaders.begin(); it != trackHeaders.end(); it++){
-      if (it->trackId == trackID){return *it;}
+      if (it->trackId != trackID){continue;}
+      if (!it->isRead()){
+        uint64_t indexTime = Util::getMicros();
+        MP4::Box trakBox(it->trakData, false);
+        it->read((MP4::TRAK &)trakBox);
+        HIGH_MSG("Indexed track %zu with %" PRIu64 " samples in %" PRIu64 "us", trackID, it->size(),
+                 Util::getMicros(indexTime));
+      }
+      return *it;
     }
     return none;
   }
@@ -122,6 +136,8 @@ namespace Mist{
     capa["codecs"]["audio"].append("AC3");
     capa["codecs"]["audio"].append("MP3");
     readPos = 0;
+    openTime = 0;
+    firstPacket = true;
   }
 
   bool inputMP4::checkArguments(){
@@ -145,6 +161,7 @@ namespace Mist{
   }
 
   bool inputMP4::preRun(){
+    openTime = Util::getMicros();
     // open File
     inFile.open(config->getString("input"));
     if (!inFile){return false;}
@@ -173,6 +190,7 @@ namespace Mist{
     bool hasMoov = false;
     readBuffer.truncate(0);
     readPos = 0;
+    trackHeaders.clear();
 
     // first we get the necessary header parts
     size_t tNumber = 0;
@@ -194,13 +212,16 @@ namespace Mist{
           FAIL_MSG("Could not read entire MOOV box into memory");
           break;
         }
-        MP4::Box moovBox(readBuffer, false);
-
-        // for all box in moov
-        std::deque<MP4::TRAK> trak = ((MP4::MOOV*)&moovBox)->getChildren<MP4::TRAK>();
-        for (std::deque<MP4::TRAK>::iterator trakIt = trak.begin(); trakIt != trak.end(); trakIt++){
+        // Keep the moov box around; the sample tables of each track are indexed when first needed
+        moovBuffer.assign(readBuffer, boxSize);
+        MP4::Box moovBox(moovBuffer, false);
+        size_t trakPos = 0;
+        MP4::TRAK trakBox = ((MP4::MOOV*)&moovBox)->getNextChild<MP4::TRAK>(trakPos);
+        while (trakBox){
           trackHeaders.push_back(mp4TrackHeader());
-          trackHeaders.rbegin()->read(*trakIt);
+          trackHeaders.rbegin()->trackId = trakBox.getChild<MP4::TKHD>().getTrackID();
+          trackHeaders.rbegin()->trakData = trakBox.asBox();
+          trakBox = ((MP4::MOOV*)&moovBox)->getNextChild<MP4::TRAK>(trakPos);
         }
         hasMoov = true;
         break;
@@ -237,13 +258,13 @@ namespace Mist{
     meta.reInit(isSingular() ? streamName : "");
     tNumber = 0;
     // Create header file from MP4 data
-    MP4::Box moovBox(readBuffer, false);
-
-    std::deque<MP4::TRAK> trak = ((MP4::MOOV*)&moovBox)->getChildren<MP4::TRAK>();
-    HIGH_MSG("Obtained %zu trak Boxes", trak.size());
+    MP4::Box moovBox(moovBuffer, false);
+    HIGH_MSG("Obtained %zu trak Boxes", trackHeaders.size());
 
-    for (std::deque<MP4::TRAK>::iterator trakIt = trak.begin(); trakIt != trak.end(); trakIt++){
-      MP4::MDIA mdiaBox = trakIt->getChild<MP4::MDIA>();
+    size_t trakPos = 0;
+    for (MP4::TRAK trakBox = ((MP4::MOOV*)&moovBox)->getNextChild<MP4::TRAK>(trakPos); trakBox;
+         trakBox = ((MP4::MOOV*)&moovBox)->getNextChild<MP4::TRAK>(trakPos)){
+      MP4::MDIA mdiaBox = trakBox.getChild<MP4::MDIA>();
 
       std::string hdlrType = mdiaBox.getChild<MP4::HDLR>().getHandlerType();
       if (hdlrType != "vide" && hdlrType != "soun" && hdlrType != "sbtl"){
@@ -264,7 +285,7 @@ namespace Mist{
 
       tNumber = meta.addTrack();
 
-      MP4::TKHD tkhdBox = trakIt->getChild<MP4::TKHD>();
+      MP4::TKHD tkhdBox = trakBox.getChild<MP4::TKHD>();
       if (tkhdBox.getWidth() > 0){
         meta.setWidth(tNumber, tkhdBox.getWidth());
         meta.setHeight(tNumber, tkhdBox.getHeight());
@@ -554,6 +575,10 @@ namespace Mist{
     }
     thisTime = curPart.time;
     thisIdx = curPart.trackID;
+    if (firstPacket){
+      firstPacket = false;
+      MEDIUM_MSG("First packet ready %" PRIu64 "ms after opening the input", Util::getMicros(openTime) / 1000);
+    }
 
     // get the next part for this track
     curPart.index++;
@@ -589,7 +614,13 @@ namespace Mist{
     size_t headerDataSize = thisHeader.size();
     DTSC::Keys keys(M.keys(idx));
     DTSC::Parts parts(M.parts(idx));
-    for (size_t i = 0; i < headerDataSize; i++){
+    // Start walking the sample tables at the last keyframe before the seek point
+    size_t startPart = 0;
+    for (size_t k = keys.getFirstValid(); k < keys.getEndValid() && keys.getTime(k) <= seekTime; ++k){
+      startPart = keys.getFirstPart(k);
+      nextKeyframe[idx] = k;
+    }
+    for (size_t i = startPart; i < headerDataSize; i++){
 
       thisHeader.getPart(i, addPart.bpos);
       addPart.size = parts.getSize(i);
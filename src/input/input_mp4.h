@@ -42,7 +42,9 @@ namespace Mist{
   public:
     mp4TrackHeader();
     size_t trackId;
+    char *trakData; ///< Points to this track's trak box inside the kept moov box
     void read(MP4::TRAK &trakBox);
+    bool isRead() const{return indexed;}
     MP4::STCO stcoBox;
     MP4::CO64 co64Box;
     MP4::STSZ stszBox;
@@ -56,6 +58,7 @@ namespace Mist{
 
   private:
     bool initialised;
+    bool indexed;
     // next variables are needed for the stsc/stco loop
     uint64_t stscStart;
     uint64_t sampleIndex;
@@ -84,10 +87,14 @@ namespace Mist{
     bool needHeader();
     void getNext(size_t idx = INVALID_TRACK_ID);
     void seek(uint64_t seekTime, size_t idx = INVALID_TRACK_ID);
+    void readAhead(size_t idx, uint64_t bpos, size_t len){inFile.readAhead(bpos, len);}
     void handleSeek(uint64_t seekTime, size_t idx);
 
     HTTP::URIReader inFile;
     Util::ResizeablePointer readBuffer;
+    Util::ResizeablePointer moovBuffer; ///< Copy of the moov box, indexed per track on first use
+    uint64_t openTime;
+    bool firstPacket;
     uint64_t readPos;
     uint64_t bps;
 
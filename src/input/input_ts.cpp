@@ -14,11 +14,14 @@
 #include <mist/timing.h>
 #include <mist/ts_packet.h>
 #include <mist/util.h>
+#include <sstream>
 #include <string>
 
 #include <mist/procs.h>
 #include <mist/tinythread.h>
+#include <poll.h>
 #include <sys/stat.h>
+#include <time.h>
 
 tthread::mutex threadClaimMutex;
 std::string globalStreamName;
@@ -156,13 +159,238 @@ void parseThread(void *mistIn){
   if (dataTrack && userConn){userConn.setStatus(COMM_STATUS_DISCONNECT | userConn.getStatus());}
 }
 
+/// Amount of datagrams received per system call in channel list mode
+#define CHANNEL_BATCH 32
+/// Seconds between channel statistics reports
+#define CHANNEL_REPORT 10
+
+/// Returns the CPU time used by the calling thread, in microseconds
+static uint64_t threadMicros(){
+  struct timespec t;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return (uint64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+/// Receives, demuxes and buffers all channels owned by a single worker thread.
+/// All sockets of the worker are waited on with a single poll call.
+void channelWorker(void *arg){
+  std::deque<Mist::tsChannel *> &owned = *reinterpret_cast<std::deque<Mist::tsChannel *> *>(arg);
+  std::vector<struct pollfd> fds(owned.size());
+  while (cfgPointer->is_active){
+    for (size_t i = 0; i < owned.size(); ++i){
+      fds[i].fd = owned[i]->isActive() ? owned[i]->getSock() : -1;
+      fds[i].events = POLLIN;
+      fds[i].revents = 0;
+    }
+    if (poll(&(fds[0]), fds.size(), 250) < 0 && errno != EINTR){
+      FAIL_MSG("Could not poll channel sockets: %s", strerror(errno));
+      Util::sleep(100);
+    }
+    uint64_t now = Util::bootSecs();
+    for (size_t i = 0; i < owned.size(); ++i){
+      if (fds[i].revents & POLLIN){owned[i]->receive();}
+      owned[i]->check(now);
+    }
+  }
+  for (size_t i = 0; i < owned.size(); ++i){owned[i]->close("input shutting down");}
+}
+
 namespace Mist{
 
+  tsChannel::tsChannel(const std::string &name, const std::string &src){
+    streamName = name;
+    source = src;
+    standAlone = false;
+    active = false;
+    timeStampOffset = 0;
+    startTime = Util::bootSecs();
+    bytes = 0;
+    noDataSince = startTime;
+    gettingData = false;
+    lastReport = startTime;
+    cpuMicros = 0;
+    lastArrival = 0;
+    avgInterval = 0;
+    jitter = 0;
+    maxJitter = 0;
+  }
+
+  /// Binds the UDP socket for this channel's tsudp:// source
+  bool tsChannel::open(){
+    HTTP::URL url(source);
+    udpCon.setBlocking(false);
+    udpCon.bind(url.getPort(), url.host, url.path);
+    udpCon.allocateDestination();
+    active = (udpCon.getSock() != -1);
+    if (!active){FAIL_MSG("Could not bind %s for stream %s", source.c_str(), streamName.c_str());}
+    return active;
+  }
+
+  /// Drains the socket in batches and pushes all complete packets into the stream buffer
+  void tsChannel::receive(){
+    uint64_t cpuStart = threadMicros();
+    uint64_t arrival = Util::getMicros();
+    if (lastArrival){
+      // Inter-arrival jitter, smoothed the same way as RFC 3550 does for RTP
+      uint64_t interval = arrival - lastArrival;
+      if (!avgInterval){avgInterval = interval;}
+      uint64_t deviation = (interval > avgInterval) ? interval - avgInterval : avgInterval - interval;
+      avgInterval = (avgInterval * 15 + interval) / 16;
+      jitter = (jitter * 15 + deviation) / 16;
+      if (jitter > maxJitter){maxJitter = jitter;}
+    }
+    lastArrival = arrival;
+    size_t sizes[CHANNEL_BATCH];
+    size_t count = udpCon.ReceiveBatch(sizes, CHANNEL_BATCH);
+    while (count){
+      if (!gettingData){
+        gettingData = true;
+        INFO_MSG("Now receiving UDP data for stream %s", streamName.c_str());
+      }
+      size_t offset = 0;
+      for (size_t i = 0; i < count; ++i){
+        assembler.assemble(tsStream, udpCon.data + offset, sizes[i], true, bytes);
+        offset += sizes[i];
+        bytes += sizes[i];
+      }
+      bufferPackets();
+      if (count < CHANNEL_BATCH){break;}
+      count = udpCon.ReceiveBatch(sizes, CHANNEL_BATCH);
+    }
+    noDataSince = Util::bootSecs();
+    cpuMicros += threadMicros() - cpuStart;
+  }
+
+  /// Starts the buffer for this channel's stream if needed, and registers the given TS track with it
+  bool tsChannel::initTrack(size_t tid){
+    if (!meta){
+      {
+        // Only one channel at a time gets to fork off a buffer process
+        tthread::lock_guard<tthread::mutex> guard(threadClaimMutex);
+        std::map<std::string, std::string> overrides;
+        overrides["singular"] = "";
+        if (!Util::streamAlive(streamName) &&
+            !Util::startInput(streamName, "push://INTERNAL_ONLY:" + source, true, true, overrides)){
+          FAIL_MSG("Could not start buffer for %s", streamName.c_str());
+          return false;
+        }
+      }
+      meta.reInit(streamName, false);
+      if (!meta){return false;}
+    }
+    tsStream.initializeMetadata(meta, tid);
+    size_t idx = meta.trackIDToIndex(tid, getpid());
+    if (idx == INVALID_TRACK_ID || !meta.trackValid(idx)){return false;}
+    userSelect[idx].reload(streamName, idx, COMM_STATUS_ACTIVE | COMM_STATUS_SOURCE | COMM_STATUS_DONOTTRACK);
+    trackIdx[tid] = idx;
+    return true;
+  }
+
+  void tsChannel::bufferPackets(){
+    while (tsStream.hasPacket()){
+      tsStream.getEarliestPacket(pack);
+      if (!pack){break;}
+      size_t tid = pack.getTrackId();
+      if (!tsStream.isDataTrack(tid)){continue;}
+      if (!trackIdx.count(tid) && !initTrack(tid)){continue;}
+      size_t idx = trackIdx[tid];
+      if (!userSelect[idx]){
+        // The buffer went away; start over with the next packet
+        WARN_MSG("Buffer for stream %s disconnected, reconnecting", streamName.c_str());
+        for (std::map<size_t, size_t>::iterator it = trackIdx.begin(); it != trackIdx.end(); ++it){
+          liveFinalize(it->second);
+        }
+        trackIdx.clear();
+        userSelect.clear();
+        meta.clear();
+        return;
+      }
+      char *data;
+      size_t dataLen;
+      pack.getString("data", data, dataLen);
+      uint64_t adjustTime = pack.getTime() + timeStampOffset;
+      uint64_t &lastTime = lastTimeStamp[tid];
+      if (lastTime || timeStampOffset){
+        if (lastTime + 5000 < adjustTime || lastTime > adjustTime + 5000){
+          INFO_MSG("Timestamp jump " PRETTY_PRINT_MSTIME " -> " PRETTY_PRINT_MSTIME " on %s, compensating.",
+                   PRETTY_ARG_MSTIME(lastTime), PRETTY_ARG_MSTIME(adjustTime), streamName.c_str());
+          timeStampOffset += (lastTime - adjustTime);
+          adjustTime = pack.getTime() + timeStampOffset;
+        }
+      }
+      lastTime = adjustTime;
+      if (!meta.getBootMsOffset()){meta.setBootMsOffset(Util::bootMS() - adjustTime);}
+      bufferLivePacket(adjustTime, pack.getInt("offset"), idx, data, dataLen, pack.getInt("bpos"),
+                       pack.getFlag("keyframe"));
+    }
+  }
+
+  /// Takes care of statistics, controller requests and data timeouts. Called about once per poll.
+  void tsChannel::check(uint64_t now){
+    if (!active){return;}
+    if (gettingData && now - noDataSince > 1){
+      gettingData = false;
+      INFO_MSG("No longer receiving data for stream %s", streamName.c_str());
+    }
+    if (now - noDataSince > 20 && trackIdx.size()){
+      // Release the buffer, so it can time out like it would for a single-stream input
+      for (std::map<size_t, size_t>::iterator it = trackIdx.begin(); it != trackIdx.end(); ++it){
+        liveFinalize(it->second);
+        userSelect[it->second].setStatus(COMM_STATUS_DISCONNECT | userSelect[it->second].getStatus());
+      }
+      trackIdx.clear();
+      userSelect.clear();
+      meta.clear();
+      tsStream.clear();
+      assembler.clear();
+      lastTimeStamp.clear();
+      INFO_MSG("No packets received for 20 seconds on stream %s", streamName.c_str());
+    }
+    if (!statComm && gettingData){
+      statComm.reload(streamName, udpCon.getBinDestination(), JSON::Value(getpid()).asString() + ":" + streamName,
+                      "INPUT:TS", "");
+    }
+    if (statComm){
+      if (statComm.getStatus() & COMM_STATUS_REQDISCONNECT){
+        close("received shutdown request from controller");
+        return;
+      }
+      statComm.setNow(now);
+      statComm.setStream(streamName);
+      statComm.setConnector("INPUT:TS");
+      statComm.setUp(0);
+      statComm.setDown(bytes);
+      statComm.setTime(now - startTime);
+      statComm.setLastSecond(0);
+    }
+    if (now - lastReport >= CHANNEL_REPORT){
+      MEDIUM_MSG("Stream %s: %.2f%% CPU, %" PRIu64 "us arrival jitter (max %" PRIu64 "us), %" PRIu64 " bytes total",
+                 streamName.c_str(), cpuMicros / (10000.0 * (now - lastReport)), jitter, maxJitter, bytes);
+      lastReport = now;
+      cpuMicros = 0;
+      maxJitter = jitter;
+    }
+  }
+
+  void tsChannel::close(const std::string &reason){
+    if (!active){return;}
+    INFO_MSG("Closing stream %s because %s", streamName.c_str(), reason.c_str());
+    for (std::map<size_t, size_t>::iterator it = trackIdx.begin(); it != trackIdx.end(); ++it){
+      liveFinalize(it->second);
+      userSelect[it->second].setStatus(COMM_STATUS_DISCONNECT | userSelect[it->second].getStatus());
+    }
+    trackIdx.clear();
+    if (statComm){statComm.setStatus(COMM_STATUS_DISCONNECT | statComm.getStatus());}
+    udpCon.close();
+    active = false;
+  }
+
   /// Constructor of TS Input
   /// \arg cfg Util::Config that contains all current configurations.
   inputTS::inputTS(Util::Config *cfg) : Input(cfg){
     rawMode = false;
     udpMode = false;
+    channelMode = false;
     rawIdx = INVALID_TRACK_ID;
     lastRawPacket = 0;
     readPos = 0;
@@ -258,6 +486,13 @@ namespace Mist{
     option["short"] = "R";
     option["help"] = "Enable raw MPEG-TS passthrough mode";
     config->addOption("raw", option);
+
+    option.null();
+    option["arg"] = "integer";
+    option["long"] = "workers";
+    option["help"] = "Amount of worker threads used in channel list mode (tsudp-list:FILE); 0 for one per CPU";
+    option["value"].append(0);
+    config->addOption("workers", option);
   }
 
   inputTS::~inputTS(){
@@ -295,6 +530,12 @@ namespace Mist{
     rawMode = config->getBool("raw");
     if (rawMode){INFO_MSG("Entering raw mode");}
 
+    // Channel list input (tsudp-list:FILE), where every line of FILE is a "streamname tsudp://..." pair
+    if (inCfg.substr(0, 11) == "tsudp-list:"){
+      standAlone = false;
+      channelMode = true;
+      return true;
+    }
     // UDP input (tsudp://[host:]port[/iface[,iface[,...]]])
     if (inCfg.substr(0, 8) == "tsudp://"){
       standAlone = false;
@@ -695,6 +936,73 @@ namespace Mist{
     }
   }
 
+  int inputTS::run(){
+    if (channelMode){return channelMainLoop();}
+    return Input::run();
+  }
+
+  /// Ingests all channels from the channel list in this single process.
+  /// Channels are spread over a fixed pool of worker threads; each worker polls its own sockets,
+  /// receives in batches and demuxes inline, feeding the buffer of every channel's stream directly.
+  int inputTS::channelMainLoop(){
+    std::string listFile = config->getString("input").substr(11);
+    std::ifstream list(listFile.c_str());
+    if (!list){
+      FAIL_MSG("Could not open channel list %s", listFile.c_str());
+      return 1;
+    }
+    cfgPointer = config;
+    std::deque<tsChannel *> channels;
+    std::string line;
+    while (std::getline(list, line)){
+      std::stringstream lineStream(line);
+      std::string name, source;
+      lineStream >> name >> source;
+      if (!name.size() || name[0] == '#'){continue;}
+      if (source.substr(0, 8) != "tsudp://"){
+        WARN_MSG("Ignoring channel %s: only tsudp:// sources are supported, not '%s'", name.c_str(), source.c_str());
+        continue;
+      }
+      Util::sanitizeName(name);
+      tsChannel *chan = new tsChannel(name, source);
+      if (!chan->open()){
+        delete chan;
+        continue;
+      }
+      channels.push_back(chan);
+    }
+    if (!channels.size()){
+      FAIL_MSG("No usable channels in %s", listFile.c_str());
+      return 1;
+    }
+
+    size_t workerCount = config->getInteger("workers");
+    if (!workerCount){workerCount = sysconf(_SC_NPROCESSORS_ONLN);}
+    if (workerCount < 1){workerCount = 1;}
+    if (workerCount > channels.size()){workerCount = channels.size();}
+    std::deque<std::deque<tsChannel *> > owned(workerCount);
+    for (size_t i = 0; i < channels.size(); ++i){owned[i % workerCount].push_back(channels[i]);}
+    INFO_MSG("Ingesting %zu channels on %zu worker threads", channels.size(), workerCount);
+    std::deque<tthread::thread *> workers;
+    for (size_t i = 0; i < workerCount; ++i){workers.push_back(new tthread::thread(channelWorker, &(owned[i])));}
+
+    while (config->is_active){
+      Util::sleep(1000);
+      bool anyActive = false;
+      for (size_t i = 0; i < channels.size() && !anyActive; ++i){anyActive = channels[i]->isActive();}
+      if (!anyActive){
+        Util::logExitReason("all channels were closed");
+        config->is_active = false;
+      }
+    }
+    for (size_t i = 0; i < workers.size(); ++i){
+      workers[i]->join();
+      delete workers[i];
+    }
+    for (size_t i = 0; i < channels.size(); ++i){delete channels[i];}
+    return 0;
+  }
+
   void inputTS::finish(){
     if (standAlone){
       Input::finish();
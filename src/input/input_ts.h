@@ -8,6 +8,44 @@
 #include <string>
 
 namespace Mist{
+  /// A single TS-over-UDP source feeding a single stream, used when ingesting a channel list.
+  /// Channels are demuxed inline by the worker thread that owns them, without per-track threads.
+  class tsChannel : public InOutBase{
+  public:
+    tsChannel(const std::string &name, const std::string &src);
+    bool open();
+    void receive();
+    void check(uint64_t now);
+    void close(const std::string &reason);
+    bool isActive() const{return active;}
+    int getSock(){return udpCon.getSock();}
+
+  private:
+    bool initTrack(size_t tid);
+    void bufferPackets();
+    std::string source;
+    bool active;
+    Socket::UDPConnection udpCon;
+    TS::Stream tsStream;
+    TS::Assembler assembler;
+    DTSC::Packet pack;
+    Comms::Connections statComm;
+    std::map<size_t, size_t> trackIdx; ///< Track index in the stream's metadata, per TS PID
+    std::map<size_t, uint64_t> lastTimeStamp;
+    int64_t timeStampOffset;
+    uint64_t startTime;
+    uint64_t bytes;
+    uint64_t noDataSince;
+    bool gettingData;
+    // Statistics, reset after every report
+    uint64_t lastReport;
+    uint64_t cpuMicros;   ///< Thread CPU time spent receiving, demuxing and buffering
+    uint64_t lastArrival; ///< Arrival time of the last datagram batch, in microseconds
+    uint64_t avgInterval; ///< Smoothed inter-arrival time, in microseconds
+    uint64_t jitter;      ///< Smoothed deviation from the average inter-arrival time, in microseconds
+    uint64_t maxJitter;
+  };
+
   /// This class contains all functions needed to implement TS Input
   class inputTS : public Input, public Util::DataCallback{
   public:
@@ -25,6 +63,7 @@ namespace Mist{
     virtual bool publishesTracks(){return false;}
     virtual void dataCallback(const char *ptr, size_t size);
     virtual size_t getDataCallbackPos() const;
+    virtual int run();
   protected:
     // Private Functions
     bool checkArguments();
@@ -38,6 +77,7 @@ namespace Mist{
     bool openStreamSource();
     void streamMainLoop();
     void finish();
+    int channelMainLoop();
     TS::Assembler assembler;
     Util::ResizeablePointer liveReadBuffer;
     TS::Stream tsStream; ///< Used for parsing the incoming ts stream
@@ -49,6 +89,7 @@ namespace Mist{
 
     bool udpMode;
     bool rawMode;
+    bool channelMode;
     size_t rawIdx;
     uint64_t lastRawPacket;
     uint64_t readPos;
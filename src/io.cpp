@@ -4,6 +4,7 @@
 #include <mist/bitfields.h>
 #include <mist/encode.h>
 #include <mist/http_parser.h>
+#include <mist/instrument.h>
 #include <mist/json.h>
 #include <mist/langcodes.h> //LTS
 #include <mist/stream.h>
@@ -356,6 +357,7 @@ namespace Mist{
   ///These member variables are not (and should not, in the future) be accessed anywhere else.
   void InOutBase::bufferLivePacket(uint64_t packTime, int64_t packOffset, uint32_t packTrack, const char *packData,
                                    size_t packDataSize, uint64_t packBytePos, bool isKeyframe, DTSC::Meta &aMeta){
+    INSTRUMENT_SCOPE(Instrument::IN_BUFFER, packDataSize);
     aMeta.reloadReplacedPagesIfNeeded();
     aMeta.setLive(true);
 
@@ -10,10 +10,12 @@
 #include <fstream>
 
 #include "output.h" 
+#include <mist/addr_list.h>
 #include <mist/bitfields.h>
 #include <mist/defines.h>
 #include <mist/h264.h>
 #include <mist/http_parser.h>
+#include <mist/instrument.h>
 #include <mist/stream.h>
 #include <mist/timing.h>
 #include <mist/util.h>
@@ -227,6 +229,76 @@ namespace Mist{
     return prevHost;
   }
 
+  /// Checks the connected host against the compiled host white- and blacklists the controller publishes,
+  /// for this stream and server-wide. Address lists are matched in shared memory directly; host name
+  /// patterns use the asynchronous reverse DNS cache, so an unknown name never blocks this check.
+  /// Hosts on a whitelist by name only are allowed while their name is unknown, until the configured
+  /// limit timeout passes. Returns true if the host should be disconnected.
+  bool Output::isBlacklisted(std::string host, std::string streamName, int timeConnected){
+    static IPC::sharedPage aclPage;
+    static Util::RelAccX aclAccX;
+    static std::set<size_t> softLogged;
+    if (!aclPage || aclAccX.isReload()){
+      aclPage.close();
+      aclPage.init(SHM_HOST_ACL, 0, false, false);
+      if (!aclPage){return false;}
+      aclAccX = Util::RelAccX(aclPage.mapped, false);
+      softLogged.clear();
+    }
+    if (!aclAccX.isReady() || !aclAccX.getEndPos()){return false;}
+    std::string binHost = getConnectedBinHost();
+    Util::RelAccXFieldData streamField = aclAccX.getFieldData("stream");
+    Util::RelAccXFieldData flagsField = aclAccX.getFieldData("flags");
+    Util::RelAccXFieldData timeoutField = aclAccX.getFieldData("timeout");
+    Util::RelAccXFieldData aclField = aclAccX.getFieldData("acl");
+    for (size_t i = 0; i < aclAccX.getEndPos(); ++i){
+      const char *recStream = aclAccX.getPointer(streamField, i);
+      if (*recStream && streamName != recStream){continue;}
+      const char *acl = aclAccX.getPointer(aclField, i);
+      uint8_t flags = aclAccX.getInt(flagsField, i);
+      bool onList = Socket::AddrList::match(acl, aclField.size, binHost) ||
+                    Socket::AddrList::matchHost(acl, aclField.size, host);
+      std::string hostName;
+      bool pending = false;
+      if (!onList && Socket::AddrList::hasHostNames(acl, aclField.size)){
+        hostName = Socket::getHostName(binHost, pending);
+        onList = Socket::AddrList::matchHost(acl, aclField.size, hostName);
+      }
+      if (flags & HOST_ACL_WHITELIST){
+        if (onList){continue;}
+        if (Socket::AddrList::hasHostNames(acl, aclField.size) && !hostName.size()){
+          // Cannot tell yet, or ever, whether the host name is listed: give up after the limit timeout
+          if (timeConnected > (int)aclAccX.getInt(timeoutField, i)){
+            WARN_MSG("Host %s has no known name to check against the whitelist for stream %s", host.c_str(), streamName.c_str());
+            return true;
+          }
+          continue;
+        }
+        if (flags & HOST_ACL_HARD){
+          WARN_MSG("Host %s not whitelisted for stream %s", host.c_str(), streamName.c_str());
+          return true;
+        }
+        if (!softLogged.count(i)){
+          INFO_MSG("Host %s not whitelisted for stream %s (soft limit)", host.c_str(), streamName.c_str());
+          softLogged.insert(i);
+        }
+        continue;
+      }
+      if (!onList){continue;}
+      if (flags & HOST_ACL_HARD){
+        WARN_MSG("Host %s%s%s blacklisted for stream %s", host.c_str(), hostName.size() ? " / " : "",
+                 hostName.c_str(), streamName.c_str());
+        return true;
+      }
+      if (!softLogged.count(i)){
+        INFO_MSG("Host %s%s%s blacklisted for stream %s (soft limit)", host.c_str(), hostName.size() ? " / " : "",
+                 hostName.c_str(), streamName.c_str());
+        softLogged.insert(i);
+      }
+    }
+    return false;
+  }
+
   bool Output::isReadyForPlay(){
     // If a protocol does not support any codecs, we assume you know what you're doing
     if (!capa.isMember("codecs") || !capa["codecs"].size() || !capa["codecs"].isArray() || !capa["codecs"][0u].size()){return true;}
@@ -1293,12 +1365,27 @@ namespace Mist{
   /// Waits for the given amount of millis, increasing the realtime playback
   /// related times as needed to keep smooth playback intact.
   void Output::playbackSleep(uint64_t millis){
+    INSTRUMENT_SCOPE(Instrument::OUT_SLEEP, 0);
     if (realTime && M.getLive() && buffer.getSyncMode()){
       firstTime += millis;
     }
     Util::wait(millis);
   }
 
+  /// Records how long ago the input buffered the current packet, once per second of media time per track, so
+  /// the glass-to-glass latency of live streams is exported per output binary.
+  void Output::sampleIngestDelay(){
+    if (!M.getLive()){return;}
+    uint64_t time = thisPacket.getTime();
+    uint64_t &sampled = ingestSampled[thisIdx];
+    if (sampled == time / 1000 + 1){return;}
+    sampled = time / 1000 + 1;
+    uint64_t ingest = M.getIngestTime(thisIdx, time);
+    uint64_t now = Util::unixMS();
+    if (!ingest || ingest > now){return;}
+    Instrument::record(Instrument::OUT_GLASS, (now - ingest) * 1000, thisPacket.getDataLen());
+  }
+
   /// Called right before sendNext(). Should return true if this is a stopping point.
   bool Output::reachedPlannedStop(){
     // If we're recording to file and reached the target position, stop
@@ -1593,7 +1680,11 @@ namespace Mist{
           sendHeader();
         }
         if (!sought){initialSeek();}
-        if (prepareNext()){
+        INSTRUMENT_START(prepareStart);
+        bool prepared = prepareNext();
+        // Calls that do not result in a packet are waiting for data, or loading the next page
+        INSTRUMENT_STOP(prepared && thisPacket ? Instrument::OUT_PREPARE : Instrument::OUT_PAGE_WAIT, prepareStart);
+        if (prepared){
           if (thisPacket){
             lastPacketTime = thisTime;
             if (firstPacketTime == 0xFFFFFFFFFFFFFFFFull){
@@ -1607,7 +1698,9 @@ namespace Mist{
                      keepGoing()){
                 uint64_t amount = thisPacket.getTime() - (((Util::bootMS() - firstTime) * 1000) / realTime + maxSkipAhead);
                 if (amount > 1000){amount = 1000;}
+                INSTRUMENT_START(sleepStart);
                 Util::sleep(amount);
+                INSTRUMENT_STOP(Instrument::OUT_SLEEP, sleepStart);
                 //Make sure we stay responsive to requests and stats while waiting
                 if (wantRequest){
                   requestHandler();
@@ -1764,7 +1857,12 @@ namespace Mist{
                 }
               }
             }
+#ifdef WITH_INSTRUMENTATION
+            sampleIngestDelay();
+#endif
+            INSTRUMENT_START(sendStart);
             sendNext();
+            INSTRUMENT_STOP(Instrument::OUT_SEND, sendStart);
           }else{
             parseData = false;
             /*LTS-START*/
@@ -2231,6 +2329,11 @@ namespace Mist{
       statComm.unload();
       return;
     }
+    if (!isPushing() && !isRecording() && isBlacklisted(getConnectedHost(), streamName, now - myConn.connTime())){
+      onFail("Shutting down since this host is not allowed to view this stream");
+      statComm.unload();
+      return;
+    }
     /*LTS-END*/
     statComm.setNow(now);
     connStats(now, statComm);
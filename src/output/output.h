@@ -82,11 +82,10 @@ namespace Mist{
     void Log(std::string type, std::string message);
     bool checkLimits();
     bool isBlacklisted(std::string host, std::string streamName, int timeConnected);
-    std::string hostLookup(std::string ip);
-    bool onList(std::string ip, std::string list);
     std::string getCountry(std::string ip);
     /*LTS-END*/
     std::map<size_t, uint32_t> currentPage;
+    std::map<size_t, uint64_t> ingestSampled; ///< Per track, the second of media time last sampled, plus one.
     void loadPageForKey(size_t trackId, size_t keyNum);
     uint64_t pageNumForKey(size_t trackId, size_t keyNum);
     uint64_t pageNumMax(size_t trackId);
@@ -132,6 +131,7 @@ namespace Mist{
     bool isBlocking; ///< If true, indicates that myConn is blocking.
     std::string tkn;    ///< Random identifier used to split connections into sessions
     uint64_t nextKeyTime();
+    void sampleIngestDelay();
 
     // stream delaying variables
     uint64_t maxSkipAhead;   ///< Maximum ms that we will go ahead of the intended timestamps.
@@ -731,43 +731,49 @@ namespace Mist{
       rtmpheader[3] = timestamp & 0xff;
     }
 
-    // send the header
-    myConn.setBlocking(true);
-    myConn.SendNow(rtmpheader, header_len);
-    RTMPStream::snd_cnt += header_len; // update the sent data counter
-    // set the header's first byte to the "continue" type chunk, for later use
-    rtmpheader[0] = 0xC4;
+    // Gather the header, FLV data header and all chunks of media data, so the complete message is sent with as
+    // few writes as possible without copying the media data.
+    size_t cont_len = (timestamp >= 0x00ffffff) ? 5 : 1;
+    sendParts.clear();
+    struct iovec part;
+    part.iov_base = rtmpheader;
+    part.iov_len = header_len;
+    sendParts.push_back(part);
+    // the header of every continuation chunk is the same; keep it apart from the first one, which is being sent too
+    contHeader[0] = 0xC4;
     if (timestamp >= 0x00ffffff){
-      rtmpheader[1] = (timestamp >> 24) & 0xff;
-      rtmpheader[2] = (timestamp >> 16) & 0xff;
-      rtmpheader[3] = (timestamp >> 8) & 0xff;
-      rtmpheader[4] = timestamp & 0xff;
+      contHeader[1] = (timestamp >> 24) & 0xff;
+      contHeader[2] = (timestamp >> 16) & 0xff;
+      contHeader[3] = (timestamp >> 8) & 0xff;
+      contHeader[4] = timestamp & 0xff;
     }
 
-    // sent actual data - never send more than chunk_snd_max at a time
+    // never put more than chunk_snd_max bytes of data in a chunk
     // interleave blocks of max chunk_snd_max bytes with 0xC4 bytes to indicate continue
     size_t len_sent = 0;
     while (len_sent < data_len){
       size_t to_send = std::min(data_len - len_sent, RTMPStream::chunk_snd_max);
       if (!len_sent){
-        myConn.SendNow(dataheader, dheader_len);
-        RTMPStream::snd_cnt += dheader_len; // update the sent data counter
+        part.iov_base = dataheader;
+        part.iov_len = dheader_len;
+        sendParts.push_back(part);
         to_send -= dheader_len;
         len_sent += dheader_len;
       }
-      myConn.SendNow(tmpData + len_sent - dheader_len, to_send);
+      part.iov_base = (void *)(tmpData + len_sent - dheader_len);
+      part.iov_len = to_send;
+      sendParts.push_back(part);
       len_sent += to_send;
       if (len_sent < data_len){
-        if (timestamp >= 0x00ffffff){
-          myConn.SendNow(rtmpheader, 5);
-          RTMPStream::snd_cnt += 5; // update the sent data counter
-        }else{
-          myConn.SendNow(rtmpheader, 1);
-          RTMPStream::snd_cnt += 1; // update the sent data counter
-        }
+        part.iov_base = contHeader;
+        part.iov_len = cont_len;
+        sendParts.push_back(part);
       }
     }
-    myConn.setBlocking(false);
+
+    myConn.SendNow(&sendParts[0], sendParts.size());
+    // update the sent data counter
+    for (size_t i = 0; i < sendParts.size(); ++i){RTMPStream::snd_cnt += sendParts[i].iov_len;}
   }
 
   void OutRTMP::sendHeader(){
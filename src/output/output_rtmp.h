@@ -52,6 +52,8 @@ namespace Mist{
     void sendLoopedAudio(uint64_t untilTimestamp);
     // Gets the next ADTS frame in AAC file. Loops if EOF reached
     void calcNextFrameInfo();
+    std::vector<struct iovec> sendParts; ///< Pieces of the media message being sent, reused between messages
+    char contHeader[5]; ///< Header of the continuation chunks of the media message being sent
   };
 }// namespace Mist
 
@@ -55,6 +55,7 @@ namespace Mist{
     totalPkts = 0;
     totalLoss = 0;
     totalRetrans = 0;
+    unbufferedPkts = 0;
     setPacketOffset = false;
     packetOffset = 0;
     lastRecv = Util::bootMS();
@@ -1607,28 +1608,54 @@ namespace Mist{
   // This function will be called when we're sending data
   // to the browser (other peer).
   void OutWebRTC::onRTPPacketizerHasRTPPacket(const char *data, size_t nbytes){
+    uint32_t pSSRC = Bit::btohl(data + 8);
+    uint16_t seq = Bit::btohs(data + 2);
+    nackBuffer &nb = outBuffers[pSSRC];
+    // Never let the ring wrap around onto packets that are still waiting to be sent
+    if (rtpBatch.size() >= NACK_BUFFER_SIZE / 2){flushRTPBatch();}
 
-    rtpOutBuffer.allocate(nbytes + 256);
-    rtpOutBuffer.assign(data, nbytes);
+    // Protect the packet in place in its NACK buffer slot, where it is sent and retransmitted from.
+    // Packets too big for a slot are sent on their own, and cannot be retransmitted.
+    char *pkt = nb.prepare(seq, nbytes);
+    if (!pkt){
+      ++unbufferedPkts;
+      // Log the first time and then ever less often, since this may happen for every packet of a track
+      if (!(unbufferedPkts & (unbufferedPkts - 1))){
+        WARN_MSG("Packet of %zu bytes does not fit a retransmission slot; %" PRIu64
+                 " packets could not be kept for retransmission so far", nbytes, unbufferedPkts);
+      }
+      rtpOutBuffer.allocate(nbytes + NACK_SLOT_HEADROOM);
+      pkt = rtpOutBuffer;
+    }
+    memcpy(pkt, data, nbytes);
 
     int protectedSize = nbytes;
 
     if (doDTLS){
-      if (srtpWriter.protectRtp((uint8_t *)(void *)rtpOutBuffer, &protectedSize) != 0){
+      if (srtpWriter.protectRtp((uint8_t *)pkt, &protectedSize) != 0){
         ERROR_MSG("Failed to protect the RTP message.");
         return;
       }
     }
-    udp.SendNow(rtpOutBuffer, (size_t)protectedSize);
-
-    RTP::Packet tmpPkt(rtpOutBuffer, protectedSize);
-    uint32_t pSSRC = tmpPkt.getSSRC();
-    uint16_t seq = tmpPkt.getSequence();
-    outBuffers[pSSRC].assign(seq, rtpOutBuffer, protectedSize);
+    if (pkt == (char *)rtpOutBuffer){
+      flushRTPBatch();
+      udp.SendNow(pkt, (size_t)protectedSize);
+    }else{
+      nb.setSize(seq, protectedSize);
+      struct iovec packet;
+      packet.iov_base = pkt;
+      packet.iov_len = protectedSize;
+      rtpBatch.push_back(packet);
+    }
     myConn.addUp(protectedSize);
     totalPkts++;
 
     if (volkswagenMode){
+      // Protect a copy, so the packet in the slot is left untouched
+      if (pkt != (char *)rtpOutBuffer){
+        rtpOutBuffer.allocate(protectedSize + 256);
+        rtpOutBuffer.assign(pkt, protectedSize);
+      }
       if (srtpWriter.protectRtp((uint8_t *)(void *)rtpOutBuffer, &protectedSize) != 0){
         ERROR_MSG("Failed to protect the RTP message.");
         return;
@@ -1636,6 +1663,13 @@ namespace Mist{
     }
   }
 
+  /// Sends all RTP packets collected by onRTPPacketizerHasRTPPacket since the last call, in one go.
+  void OutWebRTC::flushRTPBatch(){
+    if (!rtpBatch.size()){return;}
+    udp.SendBatch(&(rtpBatch[0]), rtpBatch.size());
+    rtpBatch.clear();
+  }
+
   void OutWebRTC::onRTPPacketizerHasRTCPPacket(const char *data, uint32_t nbytes){
 
     if (nbytes > 2048){
@@ -1787,6 +1821,7 @@ namespace Mist{
 
     rtcTrack.rtpPacketizer.sendData(&udp, onRTPPacketizerHasDataCallback, dataPointer, dataLen,
                                     rtcTrack.payloadType, M.getCodec(thisIdx));
+    flushRTPBatch();
 
     //Trigger a re-send of the Sender Report for every track every ~250ms
     if (lastSR+250 < Util::bootMS()){
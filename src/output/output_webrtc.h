@@ -70,6 +70,7 @@
 #include "output_webrtc_srtp.h"
 
 #define NACK_BUFFER_SIZE 1024
+#define NACK_SLOT_HEADROOM 256 // Room in every NACK buffer slot for RTP headers and SRTP protection
 
 #if defined(WEBRTC_PCAP)
 #include <mist/pcap.h>
@@ -79,21 +80,69 @@ namespace Mist{
 
   /* ------------------------------------------------ */
 
+  /// Ring of NACK_BUFFER_SIZE fixed-size, cache-aligned packet slots, indexed by sequence number.
+  /// Outgoing packets are protected in place inside their slot and both sent and retransmitted
+  /// straight from it, so no per-packet allocations or copies are needed.
+  /// Slots hold RTP::MAX_SEND bytes plus NACK_SLOT_HEADROOM; their memory is allocated on first use.
   class nackBuffer{
   public:
+    nackBuffer(){
+      slots = 0;
+      slotSize = 0;
+      memset(sizes, 0, sizeof(sizes));
+    }
+    nackBuffer(const nackBuffer &rhs){
+      slots = 0;
+      slotSize = 0;
+      memset(sizes, 0, sizeof(sizes));
+      *this = rhs;
+    }
+    nackBuffer &operator=(const nackBuffer &rhs){
+      if (this == &rhs){return *this;}
+      if (slots){free(slots);}
+      slots = 0;
+      slotSize = 0;
+      memset(sizes, 0, sizeof(sizes));
+      if (rhs.slots && !posix_memalign((void **)&slots, 64, NACK_BUFFER_SIZE * rhs.slotSize)){
+        slotSize = rhs.slotSize;
+        memcpy(slots, rhs.slots, NACK_BUFFER_SIZE * slotSize);
+        memcpy(sizes, rhs.sizes, sizeof(sizes));
+      }else{
+        slots = 0;
+      }
+      return *this;
+    }
+    ~nackBuffer(){
+      if (slots){free(slots);}
+    }
     bool isBuffered(uint16_t seq){
-      if (!bufs[seq % NACK_BUFFER_SIZE].size()){return false;}
-      RTP::Packet tmpPkt(bufs[seq % NACK_BUFFER_SIZE], bufs[seq % NACK_BUFFER_SIZE].size());
-      return (tmpPkt.getSequence() == seq);
+      if (!slots || !sizes[seq % NACK_BUFFER_SIZE]){return false;}
+      return (Bit::btohs(getData(seq) + 2) == seq);
     }
-    const char *getData(uint16_t seq){return bufs[seq % NACK_BUFFER_SIZE];}
-    size_t getSize(uint16_t seq){return bufs[seq % NACK_BUFFER_SIZE].size();}
-    void assign(uint16_t seq, const char *p, size_t s){
-      bufs[seq % NACK_BUFFER_SIZE].assign(p, s);
+    char *getData(uint16_t seq){return slots + (seq % NACK_BUFFER_SIZE) * slotSize;}
+    size_t getSize(uint16_t seq){return sizes[seq % NACK_BUFFER_SIZE];}
+    /// Empties the slot for the given sequence number and returns it for writing a packet of the given size plus
+    /// its protection to, or null if the packet does not fit or the slots could not be allocated.
+    /// Call setSize once filled.
+    char *prepare(uint16_t seq, size_t len){
+      if (!slots){
+        size_t wanted = (RTP::MAX_SEND + NACK_SLOT_HEADROOM + 63) / 64 * 64;
+        if (posix_memalign((void **)&slots, 64, NACK_BUFFER_SIZE * wanted)){
+          slots = 0;
+          return 0;
+        }
+        slotSize = wanted;
+      }
+      if (len + NACK_SLOT_HEADROOM > slotSize){return 0;}
+      sizes[seq % NACK_BUFFER_SIZE] = 0;
+      return getData(seq);
     }
+    void setSize(uint16_t seq, size_t s){sizes[seq % NACK_BUFFER_SIZE] = s;}
 
   private:
-    Util::ResizeablePointer bufs[NACK_BUFFER_SIZE];
+    char *slots;
+    size_t slotSize; ///< Bytes per slot, fixed once the slots are allocated
+    uint16_t sizes[NACK_BUFFER_SIZE];
   };
 
   class WebRTCTrack{
@@ -144,6 +193,7 @@ namespace Mist{
     void onDTSCConverterHasPacket(const DTSC::Packet &pkt);
     void onDTSCConverterHasInitData(const size_t trackID, const std::string &initData);
     void onRTPPacketizerHasRTPPacket(const char *data, size_t nbytes);
+    void flushRTPBatch();
     void onRTPPacketizerHasRTCPPacket(const char *data, uint32_t nbytes);
     virtual void connStats(uint64_t now, Comms::Connections &statComm);
     inline virtual bool keepGoing(){return config->is_active && (noSignalling || myConn);}
@@ -155,6 +205,7 @@ namespace Mist{
     uint64_t totalPkts;
     uint64_t totalLoss;
     uint64_t totalRetrans;
+    uint64_t unbufferedPkts; ///< Packets too big for a NACK buffer slot, which cannot be retransmitted
     std::ofstream jitterLog;
     std::ofstream packetLog;
     std::string externalAddr;
@@ -209,6 +260,7 @@ namespace Mist{
     uint64_t rtcpKeyFrameDelayInMillis;
     Util::ResizeablePointer rtpOutBuffer; ///< Buffer into which we copy (unprotected) RTP data that we need to deliver
                                           ///< to the other peer. This gets protected.
+    std::vector<struct iovec> rtpBatch; ///< Protected RTP packets of the current frame, waiting to be sent.
     uint32_t videoBitrate; ///< The bitrate to use for incoming video streams. Can be configured via
                            ///< the signaling channel. Defaults to 6mbit.
     uint32_t videoConstraint;
@@ -4,36 +4,15 @@
 #include <mist/config.h>
 #include <mist/auth.h>
 #include <mist/comms.h>
+#include <mist/tinythread.h>
 #include <mist/triggers.h>
+#include <deque>
+#include <set>
 #include <signal.h>
 #include <stdio.h>
+#include <unistd.h>
 
-// Global counters
-uint64_t thisType = 0;
-uint64_t now = Util::bootSecs();
-uint64_t currentConnections = 0;
-uint64_t lastSecond = 0;
-uint64_t globalTime = 0;
-uint64_t globalDown = 0;
-uint64_t globalUp = 0;
-uint64_t globalPktcount = 0;
-uint64_t globalPktloss = 0;
-uint64_t globalPktretrans = 0;
-// Stores last values of each connection
-std::map<size_t, uint64_t> connTime;
-std::map<size_t, uint64_t> connDown;
-std::map<size_t, uint64_t> connUp;
-std::map<size_t, uint64_t> connPktcount;
-std::map<size_t, uint64_t> connPktloss;
-std::map<size_t, uint64_t> connPktretrans;
-// Counts the duration a connector has been active
-std::map<std::string, uint64_t> connectorCount;
-std::map<std::string, uint64_t> connectorLastActive;
-std::map<std::string, uint64_t> hostCount;
-std::map<std::string, uint64_t> hostLastActive;
-std::map<std::string, uint64_t> streamCount;
-std::map<std::string, uint64_t> streamLastActive;
-// Set to True when a session gets invalidated, so that we know to run a new USER_NEW trigger
+// Set when SIGUSR1 is received, so that we know to run a new USER_NEW trigger for every session we track
 bool forceTrigger = false;
 void handleSignal(int signum){
   if (signum == SIGUSR1){
@@ -43,158 +22,148 @@ void handleSignal(int signum){
 
 const char nullAddress[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 
-void userOnActive(Comms::Connections &connections, size_t idx){
-  uint64_t lastUpdate = connections.getNow(idx);
-  if (lastUpdate < now - 10 && thisType != 1){return;}
-  ++currentConnections;
-  std::string thisConnector = connections.getConnector(idx);
-  std::string thisStreamName = connections.getStream(idx);
-  const std::string& thisHost = connections.getHost(idx);
-
-  if (connections.getLastSecond(idx) > lastSecond){lastSecond = connections.getLastSecond(idx);}
-  // Save info on the latest active stream, protocol and host separately
-  if (thisConnector.size() && thisConnector != "HTTP"){
-    connectorCount[thisConnector]++;
-    if (connectorLastActive[thisConnector] < lastUpdate){connectorLastActive[thisConnector] = lastUpdate;}
-  }
-  if (thisStreamName.size()){
-    streamCount[thisStreamName]++;
-    if (streamLastActive[thisStreamName] < lastUpdate){streamLastActive[thisStreamName] = lastUpdate;}
-  }
-  if (memcmp(thisHost.data(), nullAddress, 16)){
-    hostCount[thisHost]++;
-    if (!hostLastActive.count(thisHost) || hostLastActive[thisHost] < lastUpdate){hostLastActive[thisHost] = lastUpdate;}
-  }
-  // Sanity checks
-  if (connections.getDown(idx) < connDown[idx]){
-    WARN_MSG("Connection downloaded bytes should be a counter, but has decreased in value");
-    connDown[idx] = connections.getDown(idx);
-  }
-  if (connections.getUp(idx) < connUp[idx]){
-    WARN_MSG("Connection uploaded bytes should be a counter, but has decreased in value");
-    connUp[idx] = connections.getUp(idx);
+// Per-stream totals, shared with the controller. Reopened once per second while unavailable.
+Comms::StreamTotals streamTotals;
+
+/// Keeps the statistics of a single session and runs its USER_NEW and USER_END triggers.
+/// A MistSession process either runs a single one of these, or all sessions belonging to a tracker shard.
+class sessionTracker{
+public:
+  sessionTracker(const std::string &sessId, const std::string &streamName, const std::string &ip,
+                 const std::string &tkn, const std::string &protocol, const std::string &reqUrl);
+  ~sessionTracker();
+  bool init();
+  bool update();
+  bool needsRetrigger() const{return !thisType && reTrigger;}
+  bool runRetrigger();
+  void finish();
+  bool linger();
+  void retrigger(){reTrigger = true;}
+  bool isFinished() const{return finished;}
+  bool isCurrent() const{return !finishing && !finished && currentConnections;}
+  uint8_t getType() const{return thisType;}
+  size_t getTotalsRow() const{return totalsRow;}
+  // Used by tracker shards, which run init(), runRetrigger() and finish() on a worker thread
+  void runJob(uint8_t job);
+  bool isBusy() const{return busy;}
+  bool isStarted() const{return started;}
+  void setBusy(bool finishJob){
+    busy = true;
+    if (finishJob){finishing = true;}
   }
-  if (connections.getPacketCount(idx) < connPktcount[idx]){
-    WARN_MSG("Connection packet count should be a counter, but has decreased in value");
-    connPktcount[idx] = connections.getPacketCount(idx);
-  }
-  if (connections.getPacketLostCount(idx) < connPktloss[idx]){
-    WARN_MSG("Connection packet loss count should be a counter, but has decreased in value");
-    connPktloss[idx] = connections.getPacketLostCount(idx);
-  }
-  if (connections.getPacketRetransmitCount(idx) < connPktretrans[idx]){
-    WARN_MSG("Connection packets retransmitted should be a counter, but has decreased in value");
-    connPktretrans[idx] = connections.getPacketRetransmitCount(idx);
-  }
-  // Add increase in stats to global stats
-  globalDown += connections.getDown(idx) - connDown[idx];
-  globalUp += connections.getUp(idx) - connUp[idx];
-  globalPktcount += connections.getPacketCount(idx) - connPktcount[idx];
-  globalPktloss += connections.getPacketLostCount(idx) - connPktloss[idx];
-  globalPktretrans += connections.getPacketRetransmitCount(idx) - connPktretrans[idx];
-  // Set last values of this connection
-  connTime[idx]++;
-  connDown[idx] = connections.getDown(idx);
-  connUp[idx] = connections.getUp(idx);
-  connPktcount[idx] = connections.getPacketCount(idx);
-  connPktloss[idx] = connections.getPacketLostCount(idx);
-  connPktretrans[idx] = connections.getPacketRetransmitCount(idx);
-}
-
-/// \brief Remove mappings of inactive connections
-void userOnDisconnect(Comms::Connections & connections, size_t idx){
-  connTime.erase(idx);
-  connDown.erase(idx);
-  connUp.erase(idx);
-  connPktcount.erase(idx);
-  connPktloss.erase(idx);
-  connPktretrans.erase(idx);
-}
 
-int main(int argc, char **argv){
+private:
+  void onActive(size_t idx);
+  void onDisconnect(size_t idx);
+  void updateTotals(uint64_t up, uint64_t down, uint64_t pktCount, uint64_t pktLoss, uint64_t pktRetrans,
+                    uint64_t seconds);
+  // Variables used as payload for the USER_NEW and USER_END triggers
+  std::string thisSessionId;
+  std::string thisStreamName;
+  std::string thisIp;
+  std::string thisToken;
+  std::string thisProtocol;
+  std::string thisReqUrl;
+  std::string thisHost;
+  uint64_t thisType;
+  // Counters
+  uint64_t bootTime;
+  uint64_t now;
+  uint64_t lastSeen;
+  uint64_t currentConnections;
+  uint64_t lastSecond;
+  uint64_t globalTime;
+  uint64_t globalDown;
+  uint64_t globalUp;
+  uint64_t globalPktcount;
+  uint64_t globalPktloss;
+  uint64_t globalPktretrans;
+  // Stores last values of each connection
+  std::map<size_t, uint64_t> connTime;
+  std::map<size_t, uint64_t> connDown;
+  std::map<size_t, uint64_t> connUp;
+  std::map<size_t, uint64_t> connPktcount;
+  std::map<size_t, uint64_t> connPktloss;
+  std::map<size_t, uint64_t> connPktretrans;
+  // Counts the duration a connector has been active
+  std::map<std::string, uint64_t> connectorCount;
+  std::map<std::string, uint64_t> connectorLastActive;
+  std::map<std::string, uint64_t> hostCount;
+  std::map<std::string, uint64_t> hostLastActive;
+  std::map<std::string, uint64_t> streamCount;
+  std::map<std::string, uint64_t> streamLastActive;
+  // Row of the stream totals this session adds to
+  size_t totalsRow;
+  // Whether the traffic of this session counts towards the stream totals: 0 if not known yet, 1 if so, 2 if not
+  uint8_t countBandwidth;
+  // Set to true when the session gets invalidated, so that we know to run a new USER_NEW trigger
+  bool reTrigger;
+  // Set to true when the session got rejected by USER_NEW, so that it stays invalidated for a while
+  bool rejected;
+  bool finished;
+  // Set while a worker thread runs a job for this session; the shard loop leaves it alone until cleared
+  volatile bool busy;
+  // Set when finish() has been handed to a worker thread
+  bool finishing;
+  // Set when init() succeeded
+  bool started;
+  uint64_t sleepStart;
+  std::string exitReason;
   Comms::Sessions sessions;
-  uint64_t lastSeen = Util::bootSecs();
-  Util::redirectLogsIfNeeded();
-  signal(SIGUSR1, handleSignal);
-  // Init config and parse arguments
-  Util::Config config = Util::Config("MistSession");
-  JSON::Value option;
-  char * tmpStr = 0;
-
-  option.null();
-  option["arg_num"] = 1;
-  option["arg"] = "string";
-  option["help"] = "Session identifier of the entire session";
-  config.addOption("sessionid", option);
-
-  option.null();
-  option["long"] = "streamname";
-  option["short"] = "s";
-  option["arg"] = "string";
-  option["help"] = "Stream name initial value. May also be passed as SESSION_STREAM";
-  tmpStr = getenv("SESSION_STREAM");
-  option["default"] = tmpStr?tmpStr:"";
-  config.addOption("streamname", option);
-
-  option.null();
-  option["long"] = "ip";
-  option["short"] = "i";
-  option["arg"] = "string";
-  option["help"] = "IP address initial value. May also be passed as SESSION_IP";
-  tmpStr = getenv("SESSION_IP");
-  option["default"] = tmpStr?tmpStr:"";
-  config.addOption("ip", option);
-
-  option.null();
-  option["long"] = "tkn";
-  option["short"] = "t";
-  option["arg"] = "string";
-  option["help"] = "Client-side session ID initial value. May also be passed as SESSION_TKN";
-  tmpStr = getenv("SESSION_TKN");
-  option["default"] = tmpStr?tmpStr:"";
-  config.addOption("tkn", option);
-
-  option.null();
-  option["long"] = "protocol";
-  option["short"] = "p";
-  option["arg"] = "string";
-  option["help"] = "Protocol initial value. May also be passed as SESSION_PROTOCOL";
-  tmpStr = getenv("SESSION_PROTOCOL");
-  option["default"] = tmpStr?tmpStr:"";
-  config.addOption("protocol", option);
-
-  option.null();
-  option["long"] = "requrl";
-  option["short"] = "r";
-  option["arg"] = "string";
-  option["help"] = "Request URL initial value. May also be passed as SESSION_REQURL";
-  tmpStr = getenv("SESSION_REQURL");
-  option["default"] = tmpStr?tmpStr:"";
-  config.addOption("requrl", option);
+  Comms::Connections *connections;
+};
+
+sessionTracker::sessionTracker(const std::string &sessId, const std::string &streamName, const std::string &ip,
+                               const std::string &tkn, const std::string &protocol, const std::string &reqUrl){
+  thisSessionId = sessId;
+  thisStreamName = streamName;
+  thisIp = ip;
+  thisToken = tkn;
+  thisProtocol = protocol;
+  thisReqUrl = reqUrl;
+  thisHost = Socket::getBinForms(ip);
+  if (thisHost.size() > 16){thisHost = thisHost.substr(0, 16);}
+  thisType = 0;
+  bootTime = Util::getMicros();
+  now = Util::bootSecs();
+  lastSeen = now;
+  currentConnections = 0;
+  lastSecond = 0;
+  globalTime = 0;
+  globalDown = 0;
+  globalUp = 0;
+  globalPktcount = 0;
+  globalPktloss = 0;
+  globalPktretrans = 0;
+  reTrigger = false;
+  rejected = false;
+  finished = false;
+  busy = false;
+  finishing = false;
+  started = false;
+  sleepStart = 0;
+  connections = 0;
+  totalsRow = INVALID_RECORD_INDEX;
+  countBandwidth = 0;
+}
 
-  config.activate();
-  if (!(config.parseArgs(argc, argv))){
-    config.printHelp(std::cout);
-    FAIL_MSG("Cannot start a new session due to invalid arguments");
-    return 1;
+sessionTracker::~sessionTracker(){
+  if (connections){delete connections;}
+  if (finished){
+    INFO_MSG("Shutting down session %s: %s", thisSessionId.c_str(),
+             exitReason.size() ? exitReason.c_str() : Util::exitReason);
   }
+}
 
-  const uint64_t bootTime = Util::getMicros();
-  // Get session ID, session mode and other variables used as payload for the USER_NEW and USER_END triggers
-  const std::string thisStreamName = config.getString("streamname");
-  const std::string thisToken = config.getString("tkn");
-  const std::string thisProtocol = config.getString("protocol");
-  const std::string thisReqUrl = config.getString("requrl");
-  const std::string thisSessionId = config.getString("sessionid");
-  std::string thisHost = Socket::getBinForms(config.getString("ip"));
-  if (thisHost.size() > 16){thisHost = thisHost.substr(0, 16);}
-
+/// Claims the session record and connections page and runs the initial USER_NEW trigger.
+/// Returns false if this session could not be started, or is already being tracked elsewhere.
+bool sessionTracker::init(){
   std::string ipHex;
   Socket::hostBytesToStr(thisHost.c_str(), thisHost.size(), ipHex);
   VERYHIGH_MSG("Starting a new session. Passed variables are stream name '%s', session token '%s', protocol '%s', requested URL '%s', IP '%s' and session id '%s'",
   thisStreamName.c_str(), thisToken.c_str(), thisProtocol.c_str(), thisReqUrl.c_str(), ipHex.c_str(), thisSessionId.c_str());
 
-  // Try to lock to ensure we are the only process initialising this session
+  // Try to lock to ensure we are the only one initialising this session
   IPC::semaphore sessionLock;
   char semName[NAME_BUFFER_SIZE];
   snprintf(semName, NAME_BUFFER_SIZE, SEM_SESSION, thisSessionId.c_str());
@@ -203,7 +172,7 @@ int main(int argc, char **argv){
   // It's the Controller's task to clean everything up. When the lock fails, this cleanup hasn't happened yet
   if (!sessionLock.tryWaitOneSecond()){
     FAIL_MSG("Session '%s' already locked", thisSessionId.c_str());
-    return 1;
+    return false;
   }
 
   // Check if a page already exists for this session ID. If so, quit
@@ -215,16 +184,16 @@ int main(int argc, char **argv){
     if (dataPage){
       INFO_MSG("Session '%s' already has a running process", thisSessionId.c_str());
       sessionLock.post();
-      return 0;
+      return false;
     }
   }
-  
+
   // Claim a spot in shared memory for this session on the global statistics page
   sessions.reload();
   if (!sessions){
     FAIL_MSG("Unable to register entry for session '%s' on the stats page", thisSessionId.c_str());
     sessionLock.post();
-    return 1;
+    return false;
   }
 
   // Initialise global session data
@@ -238,142 +207,264 @@ int main(int argc, char **argv){
   // Determine session type, since triggers only get run for viewer type sessions
   if (thisSessionId[0] == 'I'){
     thisType = 1;
-  } else if (thisSessionId[0] == 'O'){
+  }else if (thisSessionId[0] == 'O'){
     thisType = 2;
-  } else if (thisSessionId[0] == 'U'){
+  }else if (thisSessionId[0] == 'U'){
     thisType = 3;
   }
-  bool shouldSleep = false;
 
-  //Scope to ensure the connections page is deleted before other cleanup happens
-  {
-    // Open the shared memory page containing statistics for each individual connection in this session
-    Comms::Connections connections;
-    connections.reload(thisSessionId, true);
-
-    // Do a USER_NEW trigger if it is defined for this stream
-    if (!thisType && Triggers::shouldTrigger("USER_NEW", thisStreamName)){
-      std::string payload = thisStreamName + "\n" + config.getString("ip") + "\n" +
-                            thisToken + "\n" + thisProtocol +
-                            "\n" + thisReqUrl + "\n" + thisSessionId;
-      if (!Triggers::doTrigger("USER_NEW", payload, thisStreamName)){
-        // Mark all connections of this session as finished, since this viewer is not allowed to view this stream
-        Util::logExitReason("Session rejected by USER_NEW");
-        connections.setExit();
-        connections.finishAll();
-      }
+  // Open the shared memory page containing statistics for each individual connection in this session
+  connections = new Comms::Connections;
+  connections->reload(thisSessionId, true);
+
+  // Do a USER_NEW trigger if it is defined for this stream
+  if (!thisType && Triggers::shouldTrigger("USER_NEW", thisStreamName)){
+    std::string payload = thisStreamName + "\n" + thisIp + "\n" +
+                          thisToken + "\n" + thisProtocol +
+                          "\n" + thisReqUrl + "\n" + thisSessionId;
+    if (!Triggers::doTrigger("USER_NEW", payload, thisStreamName)){
+      // Mark all connections of this session as finished, since this viewer is not allowed to view this stream
+      exitReason = "Session rejected by USER_NEW";
+      connections->setExit();
+      connections->finishAll();
     }
+  }
 
-    //start allowing viewers
-    sessionLock.post();
+  // start allowing viewers
+  sessionLock.post();
+
+  INFO_MSG("Started new session %s in %.3f ms", thisSessionId.c_str(), (double)Util::getMicros(bootTime) / 1000.0);
+  started = true;
+  return true;
+}
 
-    INFO_MSG("Started new session %s in %.3f ms", thisSessionId.c_str(), (double)Util::getMicros(bootTime)/1000.0);
+void sessionTracker::onActive(size_t idx){
+  uint64_t lastUpdate = connections->getNow(idx);
+  if (lastUpdate < now - 10 && thisType != 1){return;}
+  ++currentConnections;
+  std::string thisConnector = connections->getConnector(idx);
+  std::string thisStreamName = connections->getStream(idx);
+  const std::string& thisHost = connections->getHost(idx);
 
-    // Stay active until Mist exits or we no longer have an active connection
-    while (config.is_active && (currentConnections || now - lastSeen <= STATS_DELAY) && !connections.getExit()){
-      currentConnections = 0;
-      lastSecond = 0;
-      now = Util::bootSecs();
+  if (connections->getLastSecond(idx) > lastSecond){lastSecond = connections->getLastSecond(idx);}
+  // Save info on the latest active stream, protocol and host separately
+  if (thisConnector.size() && thisConnector != "HTTP"){
+    connectorCount[thisConnector]++;
+    if (connectorLastActive[thisConnector] < lastUpdate){connectorLastActive[thisConnector] = lastUpdate;}
+  }
+  if (thisStreamName.size()){
+    streamCount[thisStreamName]++;
+    if (streamLastActive[thisStreamName] < lastUpdate){streamLastActive[thisStreamName] = lastUpdate;}
+  }
+  if (memcmp(thisHost.data(), nullAddress, 16)){
+    hostCount[thisHost]++;
+    if (!hostLastActive.count(thisHost) || hostLastActive[thisHost] < lastUpdate){hostLastActive[thisHost] = lastUpdate;}
+  }
+  // Sanity checks
+  if (connections->getDown(idx) < connDown[idx]){
+    WARN_MSG("Connection downloaded bytes should be a counter, but has decreased in value");
+    connDown[idx] = connections->getDown(idx);
+  }
+  if (connections->getUp(idx) < connUp[idx]){
+    WARN_MSG("Connection uploaded bytes should be a counter, but has decreased in value");
+    connUp[idx] = connections->getUp(idx);
+  }
+  if (connections->getPacketCount(idx) < connPktcount[idx]){
+    WARN_MSG("Connection packet count should be a counter, but has decreased in value");
+    connPktcount[idx] = connections->getPacketCount(idx);
+  }
+  if (connections->getPacketLostCount(idx) < connPktloss[idx]){
+    WARN_MSG("Connection packet loss count should be a counter, but has decreased in value");
+    connPktloss[idx] = connections->getPacketLostCount(idx);
+  }
+  if (connections->getPacketRetransmitCount(idx) < connPktretrans[idx]){
+    WARN_MSG("Connection packets retransmitted should be a counter, but has decreased in value");
+    connPktretrans[idx] = connections->getPacketRetransmitCount(idx);
+  }
+  // Add increase in stats to global stats
+  globalDown += connections->getDown(idx) - connDown[idx];
+  globalUp += connections->getUp(idx) - connUp[idx];
+  globalPktcount += connections->getPacketCount(idx) - connPktcount[idx];
+  globalPktloss += connections->getPacketLostCount(idx) - connPktloss[idx];
+  globalPktretrans += connections->getPacketRetransmitCount(idx) - connPktretrans[idx];
+  // Set last values of this connection
+  connTime[idx]++;
+  connDown[idx] = connections->getDown(idx);
+  connUp[idx] = connections->getUp(idx);
+  connPktcount[idx] = connections->getPacketCount(idx);
+  connPktloss[idx] = connections->getPacketLostCount(idx);
+  connPktretrans[idx] = connections->getPacketRetransmitCount(idx);
+}
 
-      // Loop through all connection entries to get a summary of statistics
-      COMM_LOOP(connections, userOnActive(connections, id), userOnDisconnect(connections, id));
-      if (currentConnections){
-        globalTime++;
-        lastSeen = now;
-      }
+/// \brief Remove mappings of inactive connections
+void sessionTracker::onDisconnect(size_t idx){
+  connTime.erase(idx);
+  connDown.erase(idx);
+  connUp.erase(idx);
+  connPktcount.erase(idx);
+  connPktloss.erase(idx);
+  connPktretrans.erase(idx);
+}
 
+/// Summarizes all connections of this session into its statistics record. Should be called once per second.
+/// Returns false once the session has ended, after which finish() should be called.
+bool sessionTracker::update(){
+  if (!connections || connections->getExit()){return false;}
+  // The controller flags the session record to shut down or invalidate this session
+  if (sessions.getStatus() & COMM_STATUS_REQDISCONNECT){
+    exitReason = "Session shut down by controller";
+    return false;
+  }
+  if (sessions.getStatus() & COMM_STATUS_RETRIGGER){
+    sessions.setStatus(sessions.getStatus() & ~COMM_STATUS_RETRIGGER);
+    reTrigger = true;
+  }
 
-      sessions.setTime(globalTime);
-      sessions.setDown(globalDown);
-      sessions.setUp(globalUp);
-      sessions.setPacketCount(globalPktcount);
-      sessions.setPacketLostCount(globalPktloss);
-      sessions.setPacketRetransmitCount(globalPktretrans);
-      sessions.setLastSecond(lastSecond);
-      sessions.setNow(now);
-
-      if (currentConnections){
-        {
-          // Convert active protocols to string
-          std::stringstream connectorSummary;
-          for (std::map<std::string, uint64_t>::iterator it = connectorLastActive.begin();
-                it != connectorLastActive.end(); ++it){
-            if (now - it->second < STATS_DELAY){
-              connectorSummary << (connectorSummary.str().size() ? "," : "") << it->first;
-            }
-          }
-          sessions.setConnector(connectorSummary.str());
+  uint64_t prevNow = now;
+  uint64_t prevDown = globalDown, prevUp = globalUp, prevPktcount = globalPktcount;
+  uint64_t prevPktloss = globalPktloss, prevPktretrans = globalPktretrans, prevTime = globalTime;
+  currentConnections = 0;
+  lastSecond = 0;
+  now = Util::bootSecs();
+
+  // Loop through all connection entries to get a summary of statistics
+  COMM_LOOP((*connections), onActive(id), onDisconnect(id));
+  if (currentConnections){
+    // Count every second since the previous update, in case we were held up
+    globalTime += (now > prevNow ? now - prevNow : 1);
+    lastSeen = now;
+  }
+
+  sessions.setTime(globalTime);
+  sessions.setDown(globalDown);
+  sessions.setUp(globalUp);
+  sessions.setPacketCount(globalPktcount);
+  sessions.setPacketLostCount(globalPktloss);
+  sessions.setPacketRetransmitCount(globalPktretrans);
+  sessions.setLastSecond(lastSecond);
+  sessions.setNow(now);
+
+  if (currentConnections){
+    {
+      // Convert active protocols to string
+      std::stringstream connectorSummary;
+      for (std::map<std::string, uint64_t>::iterator it = connectorLastActive.begin();
+            it != connectorLastActive.end(); ++it){
+        if (now - it->second < STATS_DELAY){
+          connectorSummary << (connectorSummary.str().size() ? "," : "") << it->first;
         }
+      }
+      sessions.setConnector(connectorSummary.str());
+    }
 
-        {
-          // Set active host to last active or 0 if there were various hosts active recently
-          std::string thisHost;
-          for (std::map<std::string, uint64_t>::iterator it = hostLastActive.begin();
-                it != hostLastActive.end(); ++it){
-            if (now - it->second < STATS_DELAY){
-              if (!thisHost.size()){
-                thisHost = it->first;
-              }else if (thisHost != it->first){
-                thisHost = nullAddress;
-                break;
-              }
-            }
-          }
+    {
+      // Set active host to last active or 0 if there were various hosts active recently
+      std::string thisHost;
+      for (std::map<std::string, uint64_t>::iterator it = hostLastActive.begin();
+            it != hostLastActive.end(); ++it){
+        if (now - it->second < STATS_DELAY){
           if (!thisHost.size()){
+            thisHost = it->first;
+          }else if (thisHost != it->first){
             thisHost = nullAddress;
+            break;
           }
-          sessions.setHost(thisHost);
-        }
-
-        {
-          // Set active stream name to last active or "" if there were multiple streams active recently
-          std::string thisStream = "";
-          for (std::map<std::string, uint64_t>::iterator it = streamLastActive.begin();
-                it != streamLastActive.end(); ++it){
-            if (now - it->second < STATS_DELAY){
-              if (!thisStream.size()){
-                thisStream = it->first;
-              }else if (thisStream != it->first){
-                thisStream = "";
-                break;
-              }
-            }
-          }
-          sessions.setStream(thisStream);
         }
       }
+      if (!thisHost.size()){
+        thisHost = nullAddress;
+      }
+      sessions.setHost(thisHost);
+    }
 
-      // Retrigger USER_NEW if a re-sync was requested
-      if (!thisType && forceTrigger){
-        forceTrigger = false;
-        std::string host;
-        Socket::hostBytesToStr(thisHost.data(), 16, host);
-        if (Triggers::shouldTrigger("USER_NEW", thisStreamName)){
-          INFO_MSG("Triggering USER_NEW for stream %s", thisStreamName.c_str());
-          std::string payload = thisStreamName + "\n" + host + "\n" +
-                                thisToken + "\n" + thisProtocol +
-                                "\n" + thisReqUrl + "\n" + thisSessionId;
-          if (!Triggers::doTrigger("USER_NEW", payload, thisStreamName)){
-            INFO_MSG("USER_NEW rejected stream %s", thisStreamName.c_str());
-            Util::logExitReason("Session rejected by USER_NEW");
-            connections.setExit();
-            connections.finishAll();
+    {
+      // Set active stream name to last active or "" if there were multiple streams active recently
+      std::string thisStream = "";
+      for (std::map<std::string, uint64_t>::iterator it = streamLastActive.begin();
+            it != streamLastActive.end(); ++it){
+        if (now - it->second < STATS_DELAY){
+          if (!thisStream.size()){
+            thisStream = it->first;
+          }else if (thisStream != it->first){
+            thisStream = "";
             break;
-          }else{
-            INFO_MSG("USER_NEW accepted stream %s", thisStreamName.c_str());
           }
         }
       }
-
-      // Remember latest activity so we know when this session ends
-      if (currentConnections){
-      }
-      Util::wait(1000);
+      sessions.setStream(thisStream);
     }
-    shouldSleep = connections.getExit();
-  }//connections scope end
-  if (Util::bootSecs() - lastSeen > STATS_DELAY){
-    Util::logExitReason("Session inactive for %d seconds", STATS_DELAY);
+  }
+  updateTotals(globalUp - prevUp, globalDown - prevDown, globalPktcount - prevPktcount, globalPktloss - prevPktloss,
+               globalPktretrans - prevPktretrans, thisType ? 0 : globalTime - prevTime);
+
+  // Stay active until we no longer have an active connection
+  if (!currentConnections && now - lastSeen > STATS_DELAY){
+    exitReason = "Session inactive for " + JSON::Value(STATS_DELAY).asString() + " seconds";
+    return false;
+  }
+  return true;
+}
+
+/// Runs USER_NEW again after a re-sync was requested. Returns false if the session got rejected, in which case
+/// all its connections are told to stop and the next update() returns false.
+bool sessionTracker::runRetrigger(){
+  reTrigger = false;
+  if (!connections || !Triggers::shouldTrigger("USER_NEW", thisStreamName)){return true;}
+  std::string host;
+  Socket::hostBytesToStr(thisHost.data(), 16, host);
+  INFO_MSG("Triggering USER_NEW for stream %s", thisStreamName.c_str());
+  std::string payload = thisStreamName + "\n" + host + "\n" + thisToken + "\n" + thisProtocol + "\n" + thisReqUrl +
+                        "\n" + thisSessionId;
+  if (!Triggers::doTrigger("USER_NEW", payload, thisStreamName)){
+    INFO_MSG("USER_NEW rejected stream %s", thisStreamName.c_str());
+    exitReason = "Session rejected by USER_NEW";
+    connections->setExit();
+    connections->finishAll();
+    return false;
+  }
+  INFO_MSG("USER_NEW accepted stream %s", thisStreamName.c_str());
+  return true;
+}
+
+/// Jobs tracker shards hand to their worker threads, since triggers and stopping connections may block
+#define JOB_INIT 0
+#define JOB_RETRIGGER 1
+#define JOB_FINISH 2
+
+/// Runs the given job and marks the session as no longer busy
+void sessionTracker::runJob(uint8_t job){
+  switch (job){
+  case JOB_INIT: init(); break;
+  case JOB_RETRIGGER: runRetrigger(); break;
+  case JOB_FINISH: finish(); break;
+  }
+  __sync_synchronize();
+  busy = false;
+}
+
+/// Adds the increase in statistics since the previous update to the totals of the stream this session is active on
+void sessionTracker::updateTotals(uint64_t up, uint64_t down, uint64_t pktCount, uint64_t pktLoss,
+                                  uint64_t pktRetrans, uint64_t seconds){
+  if (!streamTotals){return;}
+  // Traffic from hosts the controller excepts from bandwidth counting is left out, as the controller does
+  if (!countBandwidth){countBandwidth = streamTotals.countsBandwidth(thisHost) ? 1 : 2;}
+  if (countBandwidth == 2){up = down = pktCount = pktLoss = pktRetrans = seconds = 0;}
+  std::string stream = sessions.getStream();
+  if (!stream.size()){stream = thisStreamName;}
+  // Rows may be handed to other streams, or the page recreated, so check ours is still the right one
+  if (!streamTotals.isStream(totalsRow, stream)){totalsRow = streamTotals.find(stream, true);}
+  streamTotals.add(totalsRow, up, down, pktCount, pktLoss, pktRetrans, seconds);
+}
+
+/// Removes the connections page of this session and runs the USER_END trigger
+void sessionTracker::finish(){
+  if (finished){return;}
+  finished = true;
+  rejected = connections && connections->getExit();
+  // Delete the connections page before other cleanup happens
+  if (connections){
+    delete connections;
+    connections = 0;
   }
 
   // Trigger USER_END
@@ -416,15 +507,335 @@ int main(int argc, char **argv){
           << thisSessionId;
     Triggers::doTrigger("USER_END", summary.str(), thisStreamName);
   }
+  sleepStart = Util::bootSecs();
+}
+
+/// Returns true while a finished session should stay around.
+/// Rejected sessions stay invalidated for 10 minutes, or until they are re-triggered or shut down.
+bool sessionTracker::linger(){
+  if (thisType || !rejected || reTrigger){return false;}
+  if (sessions.getStatus() & (COMM_STATUS_RETRIGGER | COMM_STATUS_REQDISCONNECT)){return false;}
+  return Util::bootSecs() - sleepStart < SESS_TIMEOUT;
+}
+
+/// A job for the worker threads of a tracker shard
+struct shardJob{
+  sessionTracker *session;
+  uint8_t job;
+};
+
+/// Jobs waiting for a worker thread, in order
+std::deque<shardJob> shardJobs;
+/// Mutex for accesses to shardJobs
+tthread::mutex shardJobMutex;
+/// Tells the worker threads to stop once no jobs are left
+volatile bool shardJobsStop = false;
+
+/// Hands a job for the given session to the worker threads. The session is busy until the job is done.
+void queueJob(sessionTracker *S, uint8_t job){
+  S->setBusy(job == JOB_FINISH);
+  tthread::lock_guard<tthread::mutex> guard(shardJobMutex);
+  shardJob J;
+  J.session = S;
+  J.job = job;
+  shardJobs.push_back(J);
+}
+
+/// Runs as a thread, running the jobs of a tracker shard that may block: claiming the session, the USER_NEW
+/// and USER_END triggers, and telling connections to stop. Keeps these from holding up the shard loop, which
+/// updates the statistics of all other sessions in the shard.
+void shardWorker(void *){
+  while (true){
+    shardJob J;
+    {
+      tthread::lock_guard<tthread::mutex> guard(shardJobMutex);
+      if (!shardJobs.size()){
+        if (shardJobsStop){return;}
+        J.session = 0;
+      }else{
+        J = shardJobs.front();
+        shardJobs.pop_front();
+      }
+    }
+    if (!J.session){
+      Util::sleep(10);
+      continue;
+    }
+    J.session->runJob(J.job);
+  }
+}
+
+/// Starts tracking the session requested in the given record of the request page
+void onRequest(Comms::SessionRequests &requests, size_t idx, std::map<std::string, sessionTracker *> &tracked){
+  // Record 0 is our own
+  if (!idx){return;}
+  std::string sessId = requests.getSessId(idx);
+  if (!sessId.size()){return;}
+  std::map<std::string, sessionTracker *>::iterator it = tracked.find(sessId);
+  if (it != tracked.end()){
+    // Duplicate requests are normal while the first connections of a session come in
+    if (it->second->isBusy() || !it->second->isFinished()){return;}
+    // An invalidated session that reconnects starts over
+    delete it->second;
+    tracked.erase(it);
+  }
+  sessionTracker *S = new sessionTracker(sessId, requests.getStream(idx), requests.getIp(idx), requests.getTkn(idx),
+                                         requests.getProtocol(idx), requests.getReqUrl(idx));
+  tracked[sessId] = S;
+  queueJob(S, JOB_INIT);
+}
+
+/// Hands the session requested in the given record of the request page to a dedicated MistSession process
+void onLateRequest(Comms::SessionRequests &requests, size_t idx){
+  if (!idx || !requests.getSessId(idx).size()){return;}
+  Comms::spawnSession(requests.getSessId(idx), requests.getStream(idx), requests.getIp(idx), requests.getTkn(idx),
+                      requests.getProtocol(idx), requests.getReqUrl(idx), requests.getSessMode(idx));
+}
+
+/// Current amount of sessions per type in a single stream totals row
+struct currentSessions{
+  uint32_t count[4];
+  currentSessions(){memset(count, 0, sizeof(count));}
+};
+
+/// Writes the current amount of sessions per stream and type of all sessions in this shard to the shard's
+/// own column of the stream totals, and clears the rows it no longer has sessions in.
+void publishCurrent(size_t shard, std::map<std::string, sessionTracker *> &tracked, std::set<size_t> &counted){
+  std::map<size_t, currentSessions> current;
+  if (streamTotals){
+    for (std::map<std::string, sessionTracker *>::iterator it = tracked.begin(); it != tracked.end(); ++it){
+      if (!it->second->isCurrent() || it->second->getTotalsRow() == INVALID_RECORD_INDEX){continue;}
+      ++current[it->second->getTotalsRow()].count[it->second->getType()];
+    }
+  }
+  for (std::set<size_t>::iterator it = counted.begin(); it != counted.end(); ++it){
+    if (!current.count(*it)){streamTotals.clearCurrent(*it, shard);}
+  }
+  counted.clear();
+  for (std::map<size_t, currentSessions>::iterator it = current.begin(); it != current.end(); ++it){
+    for (uint8_t t = 0; t < 4; ++t){streamTotals.setCurrent(it->first, shard, t, it->second.count[t]);}
+    counted.insert(it->first);
+  }
+}
+
+/// Tracks all sessions belonging to the given shard, as requested by inputs and outputs on the request page.
+/// Runs until Mist shuts down, or until the controller that started it is gone and no sessions remain.
+int trackShard(Util::Config &config, size_t shard){
+  if (Comms::sessionTrackerRunning(shard)){
+    INFO_MSG("Session tracker for shard %zu is already running", shard);
+    return 0;
+  }
+  Comms::SessionRequests requests;
+  requests.reload(shard, true);
+  if (!requests){
+    FAIL_MSG("Unable to open session request page for shard %zu", shard);
+    return 1;
+  }
+  // Claim record 0 to let everyone know this shard is being tracked
+  requests.setPid(getpid(), 0);
+  requests.setStatus(COMM_STATUS_ACTIVE | COMM_STATUS_SOURCE, 0);
+  INFO_MSG("Tracking sessions for shard %zu", shard);
+
+  std::deque<tthread::thread *> workers;
+  for (size_t i = 0; i < SESSION_SHARD_WORKERS; ++i){workers.push_back(new tthread::thread(shardWorker, 0));}
+
+  pid_t parentPid = getppid();
+  std::map<std::string, sessionTracker *> tracked;
+  std::set<size_t> counted;
+  uint64_t lastUpdate = 0;
+  while (config.is_active){
+    // New requests are handed over by releasing their record
+    COMM_LOOP(requests, (void)0, onRequest(requests, id, tracked));
+
+    uint64_t now = Util::bootSecs();
+    if (now != lastUpdate){
+      lastUpdate = now;
+      if (!streamTotals){streamTotals.reload();}
+      if (forceTrigger){
+        forceTrigger = false;
+        // Sessions a worker thread is busy with are either running USER_NEW right now or ending anyway
+        for (std::map<std::string, sessionTracker *>::iterator it = tracked.begin(); it != tracked.end(); ++it){
+          if (!it->second->isBusy()){it->second->retrigger();}
+        }
+      }
+      std::map<std::string, sessionTracker *>::iterator it = tracked.begin();
+      while (it != tracked.end()){
+        sessionTracker *S = it->second;
+        // Sessions a worker thread is busy with are picked up again in a later pass
+        if (S->isBusy()){
+          ++it;
+          continue;
+        }
+        if (!S->isStarted() || (S->isFinished() && !S->linger())){
+          delete S;
+          tracked.erase(it++);
+          continue;
+        }
+        if (!S->isFinished()){
+          if (!S->update()){
+            queueJob(S, JOB_FINISH);
+          }else if (S->needsRetrigger()){
+            queueJob(S, JOB_RETRIGGER);
+          }
+        }
+        ++it;
+      }
+      publishCurrent(shard, tracked, counted);
+      if (!tracked.size() && getppid() != parentPid){
+        Util::logExitReason("controller gone and no sessions left");
+        break;
+      }
+    }
+    Util::sleep(20);
+  }
+
+  // Stop accepting requests. Any that were placed in the meantime get their own process.
+  requests.setExit();
+  if (config.is_active){
+    Util::wait(100);
+    COMM_LOOP(requests, (void)0, onLateRequest(requests, id));
+  }
+  requests.setStatus(COMM_STATUS_INVALID, 0);
+
+  // Let the workers finish what they are doing, then end all remaining sessions in parallel
+  bool anyBusy = true;
+  while (anyBusy){
+    anyBusy = false;
+    for (std::map<std::string, sessionTracker *>::iterator it = tracked.begin(); it != tracked.end(); ++it){
+      if (it->second->isBusy()){anyBusy = true;}
+    }
+    if (anyBusy){Util::sleep(10);}
+  }
+  for (std::map<std::string, sessionTracker *>::iterator it = tracked.begin(); it != tracked.end(); ++it){
+    if (it->second->isStarted() && !it->second->isFinished()){queueJob(it->second, JOB_FINISH);}
+  }
+  shardJobsStop = true;
+  for (size_t i = 0; i < workers.size(); ++i){
+    workers[i]->join();
+    delete workers[i];
+  }
+  for (std::map<std::string, sessionTracker *>::iterator it = tracked.begin(); it != tracked.end(); ++it){
+    delete it->second;
+  }
+  tracked.clear();
+  publishCurrent(shard, tracked, counted);
+  INFO_MSG("Stopped tracking sessions for shard %zu: %s", shard, Util::exitReason);
+  return 0;
+}
 
-  if (!thisType && shouldSleep){
-    uint64_t sleepStart = Util::bootSecs();
-    // Keep session invalidated for 10 minutes, or until the session stops
-    while (config.is_active && Util::bootSecs() - sleepStart < SESS_TIMEOUT){
-      Util::sleep(1000);
-      if (forceTrigger){break;}
+int main(int argc, char **argv){
+  Util::redirectLogsIfNeeded();
+  signal(SIGUSR1, handleSignal);
+  // Init config and parse arguments
+  Util::Config config = Util::Config("MistSession");
+  JSON::Value option;
+  char * tmpStr = 0;
+
+  option.null();
+  option["arg_num"] = 1;
+  option["arg"] = "string";
+  option["default"] = "";
+  option["help"] = "Session identifier of the entire session. Required unless --shard is given";
+  config.addOption("sessionid", option);
+
+  option.null();
+  option["long"] = "shard";
+  option["short"] = "S";
+  option["arg"] = "integer";
+  option["default"] = -1;
+  option["help"] = "Track all sessions of the given shard (0-" + JSON::Value(SESSION_TRACKER_SHARDS - 1).asString() + ") instead of a single session";
+  config.addOption("shard", option);
+
+  option.null();
+  option["long"] = "streamname";
+  option["short"] = "s";
+  option["arg"] = "string";
+  option["help"] = "Stream name initial value. May also be passed as SESSION_STREAM";
+  tmpStr = getenv("SESSION_STREAM");
+  option["default"] = tmpStr?tmpStr:"";
+  config.addOption("streamname", option);
+
+  option.null();
+  option["long"] = "ip";
+  option["short"] = "i";
+  option["arg"] = "string";
+  option["help"] = "IP address initial value. May also be passed as SESSION_IP";
+  tmpStr = getenv("SESSION_IP");
+  option["default"] = tmpStr?tmpStr:"";
+  config.addOption("ip", option);
+
+  option.null();
+  option["long"] = "tkn";
+  option["short"] = "t";
+  option["arg"] = "string";
+  option["help"] = "Client-side session ID initial value. May also be passed as SESSION_TKN";
+  tmpStr = getenv("SESSION_TKN");
+  option["default"] = tmpStr?tmpStr:"";
+  config.addOption("tkn", option);
+
+  option.null();
+  option["long"] = "protocol";
+  option["short"] = "p";
+  option["arg"] = "string";
+  option["help"] = "Protocol initial value. May also be passed as SESSION_PROTOCOL";
+  tmpStr = getenv("SESSION_PROTOCOL");
+  option["default"] = tmpStr?tmpStr:"";
+  config.addOption("protocol", option);
+
+  option.null();
+  option["long"] = "requrl";
+  option["short"] = "r";
+  option["arg"] = "string";
+  option["help"] = "Request URL initial value. May also be passed as SESSION_REQURL";
+  tmpStr = getenv("SESSION_REQURL");
+  option["default"] = tmpStr?tmpStr:"";
+  config.addOption("requrl", option);
+
+  config.activate();
+  if (!(config.parseArgs(argc, argv))){
+    config.printHelp(std::cout);
+    FAIL_MSG("Cannot start a new session due to invalid arguments");
+    return 1;
+  }
+
+  int64_t shard = config.getInteger("shard");
+  if (shard >= 0){
+    if (shard >= SESSION_TRACKER_SHARDS){
+      FAIL_MSG("Shard %" PRId64 " is out of range", shard);
+      return 1;
+    }
+    return trackShard(config, shard);
+  }
+
+  if (!config.getString("sessionid").size()){
+    config.printHelp(std::cout);
+    FAIL_MSG("Cannot start a new session without a session identifier");
+    return 1;
+  }
+
+  sessionTracker session(config.getString("sessionid"), config.getString("streamname"), config.getString("ip"),
+                         config.getString("tkn"), config.getString("protocol"), config.getString("requrl"));
+  if (!session.init()){return 1;}
+  streamTotals.reload();
+
+  // Stay active until Mist exits or we no longer have an active connection
+  while (config.is_active && session.update() && (!session.needsRetrigger() || session.runRetrigger())){
+    Util::wait(1000);
+    if (!streamTotals){streamTotals.reload();}
+    if (forceTrigger){
+      forceTrigger = false;
+      session.retrigger();
+    }
+  }
+  session.finish();
+
+  // Keep a rejected session invalidated for 10 minutes, or until the session stops
+  while (config.is_active && session.linger()){
+    Util::sleep(1000);
+    if (forceTrigger){
+      forceTrigger = false;
+      session.retrigger();
     }
   }
-  INFO_MSG("Shutting down session %s: %s", thisSessionId.c_str(), Util::exitReason);
   return 0;
 }
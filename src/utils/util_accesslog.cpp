@@ -0,0 +1,211 @@
+/// \file util_accesslog.cpp
+/// Queries binary access logs, as written by the controller when its accesslog is set to "binary:DIRECTORY".
+
+#include <iostream>
+#include <map>
+#include <mist/accesslog.h>
+#include <mist/config.h>
+#include <mist/defines.h>
+#include <mist/json.h>
+#include <mist/timing.h>
+#include <mist/util.h>
+#include <set>
+#include <string.h>
+#include <time.h>
+
+/// Totals for one group of records
+struct accessTotals{
+  uint64_t sessions;
+  uint64_t seconds;
+  uint64_t up;
+  uint64_t down;
+  std::set<std::string> hosts;
+  accessTotals(){
+    sessions = 0;
+    seconds = 0;
+    up = 0;
+    down = 0;
+  }
+};
+
+/// Parses a unix time, a "YYYY-MM-DD[ HH:MM:SS]" UTC date, or a time relative to now such as "-7d" or "-12h".
+/// Returns def if the string is empty.
+uint64_t parseTime(const std::string &str, uint64_t def){
+  if (!str.size()){return def;}
+  if (str[0] == '-'){
+    uint64_t amount = strtoull(str.c_str() + 1, 0, 10);
+    switch (str[str.size() - 1]){
+    case 'd': amount *= 86400; break;
+    case 'h': amount *= 3600; break;
+    case 'm': amount *= 60; break;
+    }
+    return Util::epoch() - amount;
+  }
+  struct tm tmpTime;
+  memset(&tmpTime, 0, sizeof(tmpTime));
+  if (strptime(str.c_str(), "%Y-%m-%d %H:%M:%S", &tmpTime) || strptime(str.c_str(), "%Y-%m-%d", &tmpTime)){
+    return timegm(&tmpTime);
+  }
+  return strtoull(str.c_str(), 0, 10);
+}
+
+/// Returns the given unix time formatted as UTC date/time using the given strftime format
+std::string formatTime(uint64_t t, const char *format){
+  time_t rawTime = t;
+  struct tm tmpTime;
+  char buffer[32];
+  strftime(buffer, sizeof(buffer), format, gmtime_r(&rawTime, &tmpTime));
+  return buffer;
+}
+
+/// Returns the value of record i of the block for the given grouping field
+std::string groupValue(const AccessLog::Block &B, size_t i, const std::string &field){
+  if (field == "stream"){return B.stream[i];}
+  if (field == "connector"){return B.connector[i];}
+  if (field == "host"){return B.host[i];}
+  if (field == "tags"){return B.tags[i];}
+  if (field == "day"){return formatTime(B.time[i], "%Y-%m-%d");}
+  if (field == "hour"){return formatTime(B.time[i], "%Y-%m-%d %H:00");}
+  return "";
+}
+
+/// Returns true if the value matches the filter: empty filters match everything, filters ending in a
+/// plus sign match all wildcard streams of that base name as well.
+bool matches(const std::string &filter, const std::string &value){
+  if (!filter.size() || filter == value){return true;}
+  if (filter[filter.size() - 1] == '+'){
+    return !value.compare(0, filter.size() - 1, filter, 0, filter.size() - 1) &&
+           (value.size() == filter.size() - 1 || value[filter.size() - 1] == '+');
+  }
+  return false;
+}
+
+int main(int argc, char **argv){
+  Util::redirectLogsIfNeeded();
+  Util::Config conf(argv[0]);
+  conf.addOption("location", JSON::fromString("{\"arg_num\":1, \"arg\":\"string\", \"help\":\"Access log "
+                                              "directory, or a single access log file.\"}"));
+  conf.addOption("from", JSON::fromString("{\"arg\":\"string\", \"short\":\"f\", \"long\":\"from\", "
+                                          "\"default\":\"\", \"help\":\"Only include sessions that ended "
+                                          "at or after this time: unix time, YYYY-MM-DD[ HH:MM:SS] (UTC), "
+                                          "or relative to now such as -7d or -12h.\"}"));
+  conf.addOption("to", JSON::fromString("{\"arg\":\"string\", \"short\":\"t\", \"long\":\"to\", "
+                                        "\"default\":\"\", \"help\":\"Only include sessions that ended at "
+                                        "or before this time, in the same format as --from.\"}"));
+  conf.addOption("group", JSON::fromString("{\"arg\":\"string\", \"short\":\"G\", \"long\":\"group\", "
+                                           "\"default\":\"stream\", \"help\":\"Comma-separated fields to "
+                                           "aggregate by: stream, connector, host, tags, day, hour. "
+                                           "Empty to aggregate everything together.\"}"));
+  conf.addOption("stream", JSON::fromString("{\"arg\":\"string\", \"short\":\"s\", \"long\":\"stream\", "
+                                            "\"default\":\"\", \"help\":\"Only include this stream. "
+                                            "End with a plus sign to include its wildcard streams.\"}"));
+  conf.addOption("connector", JSON::fromString("{\"arg\":\"string\", \"short\":\"c\", \"long\":\"connector\", "
+                                               "\"default\":\"\", \"help\":\"Only include this connector.\"}"));
+  conf.addOption("host", JSON::fromString("{\"arg\":\"string\", \"short\":\"H\", \"long\":\"host\", "
+                                          "\"default\":\"\", \"help\":\"Only include this host.\"}"));
+  conf.addOption("json", JSON::fromString("{\"short\":\"j\", \"long\":\"json\", \"help\":\"Print the "
+                                          "totals as JSON.\"}"));
+  conf.addOption("records", JSON::fromString("{\"short\":\"r\", \"long\":\"records\", \"help\":\"Print "
+                                             "the matching records in the text access log format instead "
+                                             "of aggregating them.\"}"));
+  if (!conf.parseArgs(argc, argv)){return 1;}
+
+  uint64_t from = parseTime(conf.getString("from"), 0);
+  uint64_t to = parseTime(conf.getString("to"), 0xFFFFFFFFFFFFFFFFull);
+  std::string fStream = conf.getString("stream");
+  std::string fConnector = conf.getString("connector");
+  std::string fHost = conf.getString("host");
+  bool printRecords = conf.getBool("records");
+  std::deque<std::string> fields;
+  std::string groupStr = conf.getString("group");
+  Util::splitString(groupStr, ',', fields);
+  for (std::deque<std::string>::iterator it = fields.begin(); it != fields.end();){
+    if (!it->size()){
+      it = fields.erase(it);
+      continue;
+    }
+    if (*it != "stream" && *it != "connector" && *it != "host" && *it != "tags" && *it != "day" && *it != "hour"){
+      FAIL_MSG("Cannot group by '%s'", it->c_str());
+      return 1;
+    }
+    ++it;
+  }
+
+  std::string location = conf.getString("location");
+  std::deque<std::string> files;
+  if (Util::isDirectory(location)){
+    AccessLog::listFiles(location, from, to, files);
+  }else{
+    files.push_back(location);
+  }
+
+  std::map<std::string, accessTotals> totals;
+  uint64_t blocks = 0, skipped = 0;
+  uint64_t startTime = Util::getMS();
+  AccessLog::Block B;
+  for (std::deque<std::string>::iterator it = files.begin(); it != files.end(); ++it){
+    AccessLog::Reader R;
+    if (!R.open(*it)){continue;}
+    while (R.next(B, from, to)){
+      ++blocks;
+      for (size_t i = 0; i < B.size(); ++i){
+        if (B.time[i] < from || B.time[i] > to){continue;}
+        if (!matches(fStream, B.stream[i]) || (fConnector.size() && fConnector != B.connector[i]) ||
+            (fHost.size() && fHost != B.host[i])){
+          continue;
+        }
+        if (printRecords){
+          uint64_t dur = B.duration[i] ? B.duration[i] : 1;
+          std::cout << formatTime(B.time[i], "%F %H:%M:%S") << ", " << B.session[i] << ", " << B.stream[i]
+                    << ", " << B.connector[i] << ", " << B.host[i] << ", " << B.duration[i] << ", "
+                    << B.up[i] / dur / 1024 << ", " << B.down[i] / dur / 1024 << ", " << B.tags[i] << "\n";
+          continue;
+        }
+        std::string key;
+        for (size_t f = 0; f < fields.size(); ++f){
+          if (f){key += '\t';}
+          key += groupValue(B, i, fields[f]);
+        }
+        accessTotals &T = totals[key];
+        ++T.sessions;
+        T.seconds += B.duration[i];
+        T.up += B.up[i];
+        T.down += B.down[i];
+        T.hosts.insert(B.host[i]);
+      }
+    }
+    skipped += R.skipped();
+  }
+  INFO_MSG("Read %zu files, %" PRIu64 " blocks (%" PRIu64 " outside the time range skipped) in %" PRIu64 " ms",
+           files.size(), blocks, skipped, Util::getMS() - startTime);
+  if (printRecords){return 0;}
+
+  if (conf.getBool("json")){
+    JSON::Value out = JSON::fromString("[]");
+    for (std::map<std::string, accessTotals>::iterator it = totals.begin(); it != totals.end(); ++it){
+      JSON::Value row;
+      std::deque<std::string> keys;
+      std::string keyStr = it->first;
+      Util::splitString(keyStr, '\t', keys);
+      for (size_t f = 0; f < fields.size() && f < keys.size(); ++f){row[fields[f]] = keys[f];}
+      row["sessions"] = it->second.sessions;
+      row["seconds"] = it->second.seconds;
+      row["up"] = it->second.up;
+      row["down"] = it->second.down;
+      row["hosts"] = (uint64_t)it->second.hosts.size();
+      out.append(row);
+    }
+    std::cout << out.toString() << std::endl;
+    return 0;
+  }
+
+  for (size_t f = 0; f < fields.size(); ++f){std::cout << fields[f] << "\t";}
+  std::cout << "sessions\tseconds\tavg_seconds\tup_bytes\tdown_bytes\tunique_hosts" << std::endl;
+  for (std::map<std::string, accessTotals>::iterator it = totals.begin(); it != totals.end(); ++it){
+    if (fields.size()){std::cout << it->first << "\t";}
+    std::cout << it->second.sessions << "\t" << it->second.seconds << "\t"
+              << it->second.seconds / it->second.sessions << "\t" << it->second.up << "\t" << it->second.down
+              << "\t" << it->second.hosts.size() << std::endl;
+  }
+  return 0;
+}
@@ -1,5 +1,8 @@
+#include "util_load.h"
+#include <algorithm>
 #include <cmath>
 #include <cstdlib>
+#include <deque>
 #include <fstream>
 #include <iostream>
 #include <mist/config.h>
@@ -8,9 +11,12 @@
 #include <mist/timing.h>
 #include <mist/tinythread.h>
 #include <mist/util.h>
+#include <poll.h>
 #include <set>
+#include <sstream>
 #include <stdint.h>
 #include <string>
+#include <vector>
 
 Util::Config *cfg = 0;
 std::string passphrase;
@@ -18,432 +24,36 @@ std::string fallback;
 bool localMode = false;
 tthread::mutex globalMutex;
 
-size_t weight_cpu = 500;
-size_t weight_ram = 500;
-size_t weight_bw = 1000;
-size_t weight_geo = 1000;
-size_t weight_bonus = 50;
-std::map<std::string, int32_t> blankTags;
-unsigned long hostsCounter = 0; // This is a pointer to guarantee atomic accesses.
-#define HOSTLOOP                                                                                   \
-  unsigned long i = 0;                                                                             \
-  i < hostsCounter;                                                                                \
-  ++i
-#define HOST(no) (hosts[no])
-#define HOSTCHECK                                                                                  \
-  if (hosts[i].state != STATE_ONLINE){continue;}
-
-#define STATE_OFF 0
-#define STATE_BOOT 1
-#define STATE_ERROR 2
-#define STATE_ONLINE 3
-#define STATE_GODOWN 4
-#define STATE_REQCLEAN 5
 const char *stateLookup[] ={"Offline",           "Starting monitoring",
                              "Monitored (error)", "Monitored (online)",
                              "Requesting stop",   "Requesting clean"};
-#define HOSTNAMELEN 1024
-#define MAXHOSTS 1000
-
-struct streamDetails{
-  uint64_t total;
-  uint32_t inputs;
-  uint32_t bandwidth;
-  uint64_t prevTotal;
-  uint64_t bytesUp;
-  uint64_t bytesDown;
-};
-
-class outUrl{
-public:
-  std::string pre, post;
-  outUrl(){};
-  outUrl(const std::string &u, const std::string &host){
-    std::string tmp = u;
-    if (u.find("HOST") != std::string::npos){
-      tmp = u.substr(0, u.find("HOST")) + host + u.substr(u.find("HOST") + 4);
-    }
-    size_t dolsign = tmp.find('$');
-    pre = tmp.substr(0, dolsign);
-    if (dolsign != std::string::npos){post = tmp.substr(dolsign + 1);}
-  }
-};
-
-inline double toRad(double degree){
-  return degree / 57.29577951308232087684;
-}
-
-double geoDist(double lat1, double long1, double lat2, double long2){
-  double dist;
-  dist = sin(toRad(lat1)) * sin(toRad(lat2)) + cos(toRad(lat1)) * cos(toRad(lat2)) * cos(toRad(long1 - long2));
-  return .31830988618379067153 * acos(dist);
-}
-
-int32_t applyAdjustment(const std::set<std::string> & tags, const std::string & match, int32_t adj){
-  if (!match.size()){return 0;}
-  bool invert = false;
-  bool haveOne = false;
-  size_t prevPos = 0;
-  if (match[0] == '-'){
-    invert = true;
-    prevPos = 1;
-  }
-  //Check if any matches inside tags
-  size_t currPos = match.find(',', prevPos);
-  while (currPos != std::string::npos){
-    if (tags.count(match.substr(prevPos, currPos-prevPos))){haveOne = true;}
-    prevPos = currPos + 1;
-    currPos = match.find(',', prevPos);
-  }
-  if (tags.count(match.substr(prevPos))){haveOne = true;}
-  //If we have any match, apply adj, unless we're doing an inverted search, then return adj on zero matches
-  if (haveOne == !invert){return adj;}
-  return 0;
-}
-
-class hostDetails{
-private:
-  tthread::mutex *hostMutex;
-  std::map<std::string, struct streamDetails> streams;
-  std::set<std::string> conf_streams;
-  std::set<std::string> tags;
-  std::map<std::string, outUrl> outputs;
-  uint64_t cpu;
-  uint64_t ramMax;
-  uint64_t ramCurr;
-  uint64_t upSpeed;
-  uint64_t downSpeed;
-  uint64_t total;
-  uint64_t upPrev;
-  uint64_t downPrev;
-  uint64_t prevTime;
-  uint64_t addBandwidth;
-
-public:
-  std::string host;
-  char binHost[16];
-  uint64_t availBandwidth;
-  JSON::Value geoDetails;
-  double servLati, servLongi;
-  std::string servLoc;
-  hostDetails(){
-    hostMutex = 0;
-    cpu = 1000;
-    ramMax = 0;
-    ramCurr = 0;
-    upSpeed = 0;
-    downSpeed = 0;
-    upPrev = 0;
-    downPrev = 0;
-    prevTime = 0;
-    total = 0;
-    addBandwidth = 0;
-    servLati = 0;
-    servLongi = 0;
-    availBandwidth = 128 * 1024 * 1024; // assume 1G connections
-  }
-  ~hostDetails(){
-    if (hostMutex){
-      delete hostMutex;
-      hostMutex = 0;
-    }
-  }
-  void badNess(){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    addBandwidth += 1 * 1024 * 1024;
-    addBandwidth *= 1.2;
-  }
-  /// Returns the count of viewers for a given stream s.
-  size_t count(std::string &s){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    if (streams.count(s)){return streams[s].total;}
-    return 0;
-  }
-  /// Fills out a by reference given JSON::Value with current state.
-  void fillState(JSON::Value &r){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    r["cpu"] = (uint64_t)(cpu / 10);
-    if (ramMax){r["ram"] = (uint64_t)((ramCurr * 100) / ramMax);}
-    r["up"] = upSpeed;
-    r["up_add"] = addBandwidth;
-    r["down"] = downSpeed;
-    r["streams"] = streams.size();
-    r["viewers"] = total;
-    r["bwlimit"] = availBandwidth;
-    if (servLati || servLongi){
-      r["geo"]["lat"] = servLati;
-      r["geo"]["lon"] = servLongi;
-      r["geo"]["loc"] = servLoc;
-    }
-    if (tags.size()){
-      for (std::set<std::string>::iterator it = tags.begin(); it != tags.end(); ++it){
-        r["tags"].append(*it);
-      }
-    }
-    if (ramMax && availBandwidth){
-      r["score"]["cpu"] = (uint64_t)(weight_cpu - (cpu * weight_cpu) / 1000);
-      r["score"]["ram"] = (uint64_t)(weight_ram - ((ramCurr * weight_ram) / ramMax));
-      r["score"]["bw"] = (uint64_t)(weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
-    }
-  }
-  /// Fills out a by reference given JSON::Value with current streams viewer count.
-  void fillStreams(JSON::Value &r){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    for (std::map<std::string, struct streamDetails>::iterator jt = streams.begin();
-         jt != streams.end(); ++jt){
-      r[jt->first] = r[jt->first].asInt() + jt->second.total;
-    }
-  }
-  /// Fills out a by reference given JSON::Value with current stream statistics.
-  void fillStreamStats(const std::string & s, JSON::Value &r){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    for (std::map<std::string, struct streamDetails>::iterator jt = streams.begin();
-         jt != streams.end(); ++jt){
-      const std::string & n = jt->first;
-      if (s != "*" && n != s && n.substr(0, s.size()+1) != s+"+"){continue;}
-      if (!r.isMember(n)){
-        r[n].append(jt->second.total);//viewers
-        r[n].append(jt->second.bandwidth);//bandwidth usage
-        r[n].append(jt->second.bytesUp);//total bytes up
-        r[n].append(jt->second.bytesDown);//total bytes down
-      }else{
-        r[n][0u] = r[n][0u].asInt() + jt->second.total;
-        r[n][2u] = r[n][2u].asInt() + jt->second.bytesUp;
-        r[n][3u] = r[n][3u].asInt() + jt->second.bytesDown;
-      }
-    }
-  }
-  /// Returns viewcount for the given stream
-  long long getViewers(const std::string &strm){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    if (!streams.count(strm)){return 0;}
-    return streams[strm].total;
-  }
-  /// Scores a potential new connection to this server
-  /// 0 means not possible, the higher the better.
-  uint64_t rate(std::string &s, double lati = 0, double longi = 0, const std::map<std::string, int32_t> &tagAdjust = blankTags){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    if (!ramMax || !availBandwidth){
-      WARN_MSG("Host %s invalid: RAM %" PRIu64 ", BW %" PRIu64, host.c_str(), ramMax, availBandwidth);
-      return 0;
-    }
-    if (upSpeed >= availBandwidth || (upSpeed + addBandwidth) >= availBandwidth){
-      INFO_MSG("Host %s over bandwidth: %" PRIu64 "+%" PRIu64 " >= %" PRIu64, host.c_str(), upSpeed,
-               addBandwidth, availBandwidth);
-      return 0;
-    }
-    if (conf_streams.size() && !conf_streams.count(s) &&
-        !conf_streams.count(s.substr(0, s.find_first_of("+ ")))){
-      MEDIUM_MSG("Stream %s not available from %s", s.c_str(), host.c_str());
-      return 0;
-    }
-    // Calculate score
-    uint64_t cpu_score = (weight_cpu - (cpu * weight_cpu) / 1000);
-    uint64_t ram_score = (weight_ram - ((ramCurr * weight_ram) / ramMax));
-    uint64_t bw_score = (weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
-    uint64_t geo_score = 0;
-    if (servLati && servLongi && lati && longi){
-      geo_score = weight_geo - weight_geo * geoDist(servLati, servLongi, lati, longi);
-    }
-    uint64_t score = cpu_score + ram_score + bw_score + geo_score + (streams.count(s) ? weight_bonus : 0);
-    int64_t adjustment = 0;
-    if (tagAdjust.size()){
-      for (std::map<std::string, int32_t>::const_iterator it = tagAdjust.begin(); it != tagAdjust.end(); ++it){
-        adjustment += applyAdjustment(tags, it->first, it->second);
-      }
-    }
-    if (adjustment >= 0 || -adjustment < score){
-      score += adjustment;
-    }else{
-      score = 0;
-    }
-    // Print info on host
-    MEDIUM_MSG("%s: CPU %" PRIu64 ", RAM %" PRIu64 ", Stream %" PRIu64 ", BW %" PRIu64
-               " (max %" PRIu64 " MB/s), Geo %" PRIu64 ", tag adjustment %" PRId64 " -> %" PRIu64,
-               host.c_str(), cpu_score, ram_score, streams.count(s) ? weight_bonus : 0, bw_score,
-               availBandwidth / 1024 / 1024, geo_score, adjustment, score);
-    return score;
-  }
-  /// Scores this server as a source
-  /// 0 means not possible, the higher the better.
-  uint64_t source(const std::string &s, double lati, double longi, const std::map<std::string, int32_t> &tagAdjust, uint32_t minCpu){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    if (s.size() && (!streams.count(s) || !streams[s].inputs)){return 0;}
-    if (!ramMax || !availBandwidth){
-      WARN_MSG("Host %s invalid: RAM %" PRIu64 ", BW %" PRIu64, host.c_str(), ramMax, availBandwidth);
-      return 1;
-    }
-    if (upSpeed >= availBandwidth || (upSpeed + addBandwidth) >= availBandwidth){
-      INFO_MSG("Host %s over bandwidth: %" PRIu64 "+%" PRIu64 " >= %" PRIu64, host.c_str(), upSpeed,
-               addBandwidth, availBandwidth);
-      return 1;
-    }
-    // Calculate score
-    if (minCpu && cpu + minCpu >= 1000){return 0;}
-    uint64_t cpu_score = (weight_cpu - (cpu * weight_cpu) / 1000);
-    uint64_t ram_score = (weight_ram - ((ramCurr * weight_ram) / ramMax));
-    uint64_t bw_score = (weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
-    uint64_t geo_score = 0;
-    if (servLati && servLongi && lati && longi){
-      geo_score = weight_geo - weight_geo * geoDist(servLati, servLongi, lati, longi);
-    }
-    uint64_t score = cpu_score + ram_score + bw_score + geo_score + 1;
-    int64_t adjustment = 0;
-    if (tagAdjust.size()){
-      for (std::map<std::string, int32_t>::const_iterator it = tagAdjust.begin(); it != tagAdjust.end(); ++it){
-        adjustment += applyAdjustment(tags, it->first, it->second);
-      }
-    }
-    if (adjustment >= 0 || -adjustment < score){
-      score += adjustment;
-    }else{
-      score = 0;
-    }
-    // Print info on host
-    MEDIUM_MSG("SOURCE %s: CPU %" PRIu64 ", RAM %" PRIu64 ", Stream %" PRIu64 ", BW %" PRIu64
-               " (max %" PRIu64 " MB/s), Geo %" PRIu64 ", tag adjustment %" PRId64 " -> %" PRIu64,
-               host.c_str(), cpu_score, ram_score, streams.count(s) ? weight_bonus : 0, bw_score,
-               availBandwidth / 1024 / 1024, geo_score, adjustment, score);
-    return score;
-  }
-  std::string getUrl(std::string &s, std::string &proto){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    if (!outputs.count(proto)){return "";}
-    const outUrl &o = outputs[proto];
-    return o.pre + s + o.post;
-  }
-  void addViewer(std::string &s){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    uint64_t toAdd = 0;
-    if (streams.count(s)){
-      toAdd = streams[s].bandwidth;
-    }else{
-      if (total){
-        toAdd = (upSpeed + downSpeed) / total;
-      }else{
-        toAdd = 131072; // assume 1mbps
-      }
-    }
-    // ensure reasonable limits of bandwidth guesses
-    if (toAdd < 64 * 1024){toAdd = 64 * 1024;}// minimum of 0.5 mbps
-    if (toAdd > 1024 * 1024){toAdd = 1024 * 1024;}// maximum of 8 mbps
-    addBandwidth += toAdd;
-  }
-  void update(JSON::Value &d){
-    if (!hostMutex){hostMutex = new tthread::mutex();}
-    tthread::lock_guard<tthread::mutex> guard(*hostMutex);
-    cpu = d["cpu"].asInt();
-    if (d.isMember("bwlimit") && d["bwlimit"].asInt()){availBandwidth = d["bwlimit"].asInt();}
-    if (d.isMember("loc")){
-      if (d["loc"]["lat"].asDouble() != servLati){servLati = d["loc"]["lat"].asDouble();}
-      if (d["loc"]["lon"].asDouble() != servLongi){servLongi = d["loc"]["lon"].asDouble();}
-      if (d["loc"]["name"].asStringRef() != servLoc){servLoc = d["loc"]["name"].asStringRef();}
-    }
-    int64_t nRamMax = d["mem_total"].asInt();
-    int64_t nRamCur = d["mem_used"].asInt();
-    int64_t nShmMax = d["shm_total"].asInt();
-    int64_t nShmCur = d["shm_used"].asInt();
-    if (d.isMember("tags") && d["tags"].isArray()){
-      std::set<std::string> newTags;
-      jsonForEach(d["tags"], tag){
-        std::string t = tag->asString();
-        if (t.size()){newTags.insert(t);}
-      }
-      if (newTags != tags){tags = newTags;}
-    }
-    if (!nRamMax){nRamMax = 1;}
-    if (!nShmMax){nShmMax = 1;}
-    if (((nRamCur + nShmCur) * 1000) / nRamMax > (nShmCur * 1000) / nShmMax){
-      ramMax = nRamMax;
-      ramCurr = nRamCur + nShmCur;
-    }else{
-      ramMax = nShmMax;
-      ramCurr = nShmCur;
-    }
-    total = d["curr"][0u].asInt();
-    uint64_t currUp = d["bw"][0u].asInt(), currDown = d["bw"][1u].asInt();
-    uint64_t timeDiff = 0;
-    if (prevTime){
-      timeDiff = time(0) - prevTime;
-      if (timeDiff){
-        upSpeed = (currUp - upPrev) / timeDiff;
-        downSpeed = (currDown - downPrev) / timeDiff;
-      }
-    }
-    prevTime = time(0);
-    upPrev = currUp;
-    downPrev = currDown;
-
-    if (d.isMember("streams") && d["streams"].size()){
-      jsonForEach(d["streams"], it){
-        uint64_t count = (*it)["curr"][0u].asInt() + (*it)["curr"][1u].asInt() + (*it)["curr"][2u].asInt();
-        if (!count){
-          if (streams.count(it.key())){streams.erase(it.key());}
-          continue;
-        }
-        struct streamDetails &strm = streams[it.key()];
-        strm.total = (*it)["curr"][0u].asInt();
-        strm.inputs = (*it)["curr"][1u].asInt();
-        strm.bytesUp = (*it)["bw"][0u].asInt();
-        strm.bytesDown = (*it)["bw"][1u].asInt();
-        uint64_t currTotal = strm.bytesUp + strm.bytesDown;
-        if (timeDiff && count){
-          strm.bandwidth = ((currTotal - strm.prevTotal) / timeDiff) / count;
-        }else{
-          if (total){
-            strm.bandwidth = (upSpeed + downSpeed) / total;
-          }else{
-            strm.bandwidth = (upSpeed + downSpeed) + 100000;
-          }
-        }
-        strm.prevTotal = currTotal;
-      }
-      if (streams.size()){
-        std::set<std::string> eraseList;
-        for (std::map<std::string, struct streamDetails>::iterator it = streams.begin();
-             it != streams.end(); ++it){
-          if (!d["streams"].isMember(it->first)){eraseList.insert(it->first);}
-        }
-        for (std::set<std::string>::iterator it = eraseList.begin(); it != eraseList.end(); ++it){
-          streams.erase(*it);
-        }
-      }
-    }else{
-      streams.clear();
-    }
-    conf_streams.clear();
-    if (d.isMember("conf_streams") && d["conf_streams"].size()){
-      jsonForEach(d["conf_streams"], it){conf_streams.insert(it->asStringRef());}
-    }
-    outputs.clear();
-    if (d.isMember("outputs") && d["outputs"].size()){
-      jsonForEach(d["outputs"], op){outputs[op.key()] = outUrl(op->asStringRef(), host);}
-    }
-    addBandwidth *= 0.75;
-  }
-};
-
-/// Fixed-size struct for holding a host's name and details pointer
-struct hostEntry{
-  uint8_t state; // 0 = off, 1 = booting, 2 = running, 3 = requesting shutdown, 4 = requesting clean
-  char name[HOSTNAMELEN];          // host+port for server
-  hostDetails *details;    /// hostDetails pointer
-  tthread::thread *thread; /// thread pointer
+#define POLL_INTERVAL 5000 ///< Milliseconds between polls of hosts without a load feed
+#define FEED_WAIT 5000 ///< Milliseconds a load feed request may wait for changes on the host
+#define FEED_MIN_GAP 250 ///< Minimum milliseconds between two load feed requests to the same host
+#define RANKING_INTERVAL 100 ///< Minimum milliseconds between two updates of the host ranking
+
+/// Monitoring state of a single host, owned by the monitoring thread.
+/// While connecting is set, the connecting thread owns the downloader instead; busy, connecting and
+/// nextPoll are only accessed with mutex locked, which also hands the downloader back and forth.
+struct hostMonitor{
+  tthread::mutex mutex;
+  HTTP::Downloader DL;
+  HTTP::URL url;      ///< Base URL of the host's API
+  bool down;          ///< True if the last request failed or none was done yet
+  bool retried;       ///< True if the current request is a retry on a fresh connection
+  bool busy;          ///< True while a request is in progress
+  bool connecting;    ///< True while queued for or being handled by the connecting thread
+  bool feed;          ///< True as long as the host answers load feed requests
+  uint32_t version;   ///< Last load feed version seen, zero if none
+  uint64_t nextPoll;  ///< bootMS() time at which the next request may start
 };
 
-hostEntry hosts[MAXHOSTS]; /// Fixed-size array holding all hosts
+/// Guards host state changes the monitoring thread and cleanupHost hand hosts over with;
+/// stateCond is notified whenever a host reaches STATE_REQCLEAN and when the monitoring thread stops.
+tthread::mutex stateMutex;
+tthread::condition_variable stateCond;
+bool monitorActive = false; ///< True while the monitoring thread runs; only accessed with stateMutex locked
 
-void initHost(hostEntry &H, const std::string &N);
 void cleanupHost(hostEntry &H);
 
 ///Fills the given map with the given JSON string of tag adjustments
@@ -532,6 +142,8 @@ int handleRequest(Socket::Connection &conn){
         // Add server to list
         if (addserver.size()){
           tthread::lock_guard<tthread::mutex> globGuard(globalMutex);
+          // The monitoring thread picks up new hosts as soon as it sees their state change
+          tthread::lock_guard<tthread::mutex> stateGuard(stateMutex);
           if (addserver.size() >= HOSTNAMELEN){
             H.SetBody("Host length too long for monitoring");
             H.setCORSHeaders();
@@ -748,6 +360,7 @@ int handleRequest(Socket::Connection &conn){
       }
       if (H.hasHeader("X-Latitude")){lat = atof(H.GetHeader("X-Latitude").c_str());}
       if (H.hasHeader("X-Longitude")){lon = atof(H.GetHeader("X-Longitude").c_str());}
+      geoPoint loc(lat, lon);
       std::string vars = H.allVars();
       if (stream == "favicon.ico"){
         H.Clean();
@@ -759,16 +372,8 @@ int handleRequest(Socket::Connection &conn){
       H.Clean();
       H.SetHeader("Content-Type", "text/plain");
       H.setCORSHeaders();
-      hostEntry *bestHost = 0;
       uint64_t bestScore = 0;
-      for (HOSTLOOP){
-        HOSTCHECK;
-        uint64_t score = HOST(i).details->rate(stream, lat, lon, tagAdjust);
-        if (score > bestScore){
-          bestHost = &HOST(i);
-          bestScore = score;
-        }
-      }
+      hostEntry *bestHost = findBestHost(stream, loc, tagAdjust, bestScore);
       if (!bestScore || !bestHost){
         H.SetBody(fallback);
         FAIL_MSG("All servers seem to be out of bandwidth!");
@@ -794,59 +399,231 @@ int handleRequest(Socket::Connection &conn){
   return 0;
 }
 
-void handleServer(void *hostEntryPointer){
-  hostEntry *entry = (hostEntry *)hostEntryPointer;
-  JSON::Value bandwidth = 128 * 1024 * 1024u; // assume 1G connection
-  HTTP::URL url(entry->name);
-  if (!url.protocol.size()){url.protocol = "http";}
-  if (!url.port.size()){url.port = "4242";}
-  if (url.path.size()){
-    bandwidth = url.path;
-    bandwidth = bandwidth.asInt() * 1024 * 1024;
-    url.path.clear();
+tthread::mutex connectMutex;
+tthread::condition_variable connectCond; ///< Notified when a host is queued, and on shutdown
+std::deque<hostEntry *> connectQueue; ///< Hosts waiting for a new connection to be set up
+
+/// Builds the URL for the next request to the given host.
+HTTP::URL requestUrl(hostMonitor &M){
+  HTTP::URL url = M.url;
+  if (M.feed){
+    url.path = passphrase + ".load";
+    if (M.version){
+      url.args = "since=" + JSON::Value((uint64_t)M.version).asString() + "&wait=" + JSON::Value((uint64_t)FEED_WAIT).asString();
+    }
+  }else{
+    url.path = passphrase + ".json";
   }
-  url.path = passphrase + ".json";
+  return url;
+}
 
-  INFO_MSG("Monitoring %s", url.getUrl().c_str());
-  entry->details->availBandwidth = bandwidth.asInt();
-  entry->details->host = url.host;
-  entry->state = STATE_BOOT;
-  bool down = true;
+/// Runs as a thread, setting up connections for the monitoring thread.
+/// Connecting blocks, so this is kept out of the monitoring loop: an unreachable host then only
+/// delays reconnects of other hosts, not the updates of all hosts that are connected.
+void connectHosts(void *){
+  connectMutex.lock();
+  while (cfg->is_active){
+    if (!connectQueue.size()){
+      connectCond.wait(connectMutex);
+      continue;
+    }
+    hostEntry *H = connectQueue.front();
+    connectQueue.pop_front();
+    connectMutex.unlock();
+    hostMonitor &M = *H->monitor;
+    bool busy = M.DL.getNonBlocking(requestUrl(M));
+    {
+      tthread::lock_guard<tthread::mutex> guard(M.mutex);
+      M.busy = busy;
+      if (!busy){M.nextPoll = Util::bootMS() + POLL_INTERVAL;}
+      M.connecting = false;
+    }
+    connectMutex.lock();
+  }
+  connectMutex.unlock();
+}
 
-  HTTP::Downloader DL;
+/// Sets the state of a host from the monitoring thread, unless cleanupHost is stopping its monitoring.
+void setHostState(hostEntry &H, uint8_t state){
+  tthread::lock_guard<tthread::mutex> guard(stateMutex);
+  if (H.state == STATE_GODOWN || H.state == state){return;}
+  H.state = state;
+  rankingDirty = true;
+}
 
-  while (cfg->is_active && (entry->state != STATE_GODOWN)){
-    if (DL.get(url) && DL.isOk()){
-      JSON::Value servData = JSON::fromString(DL.data());
-      if (!servData){
-        FAIL_MSG("Can't decode server %s load information", url.host.c_str());
-        entry->details->badNess();
-        DL.getSocket().close();
-        down = true;
-        entry->state = STATE_ERROR;
-      }else{
-        if (down){
-          std::string ipStr;
-          Socket::hostBytesToStr(DL.getSocket().getBinHost().data(), 16, ipStr);
-          WARN_MSG("Connection established with %s (%s)", url.host.c_str(), ipStr.c_str());
-          memcpy(entry->details->binHost, DL.getSocket().getBinHost().data(), 16);
-          entry->state = STATE_ONLINE;
-          down = false;
+/// Marks the given host as failed and schedules a new attempt.
+void hostFailed(hostEntry &H){
+  hostMonitor &M = *H.monitor;
+  H.details->badNess();
+  M.DL.getSocket().close();
+  M.down = true;
+  M.retried = false;
+  M.version = 0;
+  M.nextPoll = Util::bootMS() + POLL_INTERVAL;
+  setHostState(H, STATE_ERROR);
+}
+
+/// Advances the monitoring of a single host as far as possible without blocking.
+/// Must be called with the host's monitor mutex locked.
+void checkHost(hostEntry &H){
+  hostMonitor &M = *H.monitor;
+  if (M.connecting){return;}
+  if (!M.busy){
+    if (Util::bootMS() < M.nextPoll){return;}
+    if (!M.DL.getSocket()){
+      M.connecting = true;
+      tthread::lock_guard<tthread::mutex> guard(connectMutex);
+      connectQueue.push_back(&H);
+      connectCond.notify_one();
+      return;
+    }
+    M.busy = M.DL.getNonBlocking(requestUrl(M));
+    if (!M.busy){
+      hostFailed(H);
+      return;
+    }
+  }
+  if (!M.DL.continueNonBlocking(Util::defaultDataCallback)){return;}
+  M.busy = false;
+  // Older versions answer with the web interface instead of a load feed
+  if (M.feed && M.DL.completed() &&
+      (M.DL.getStatusCode() == 404 || (M.DL.isOk() && M.DL.getHeader("Content-Type") != "application/octet-stream"))){
+    INFO_MSG("Server %s has no load feed, polling its full statistics instead", M.url.host.c_str());
+    M.feed = false;
+    M.nextPoll = 0;
+    return;
+  }
+  if (!M.DL.completed() || !M.DL.isOk()){
+    if (!M.down && !M.retried){
+      // Likely a kept-alive connection the host closed in the meantime; retry once on a new one
+      M.retried = true;
+      M.DL.getSocket().close();
+      M.nextPoll = 0;
+      return;
+    }
+    FAIL_MSG("Can't retrieve server %s load information", M.url.host.c_str());
+    hostFailed(H);
+    return;
+  }
+  JSON::Value servData;
+  if (M.feed){
+    servData = JSON::fromDTMI(M.DL.const_data());
+  }else{
+    servData = JSON::fromString(M.DL.const_data());
+  }
+  if (!servData){
+    FAIL_MSG("Can't decode server %s load information", M.url.host.c_str());
+    hostFailed(H);
+    return;
+  }
+  M.retried = false;
+  if (M.down){
+    std::string ipStr;
+    Socket::hostBytesToStr(M.DL.getSocket().getBinHost().data(), 16, ipStr);
+    WARN_MSG("Connection established with %s (%s)", M.url.host.c_str(), ipStr.c_str());
+    memcpy(H.details->binHost, M.DL.getSocket().getBinHost().data(), 16);
+    setHostState(H, STATE_ONLINE);
+    M.down = false;
+  }
+  H.details->update(servData);
+  if (M.feed){
+    // The host holds the next request until something changes, so ask again right away
+    M.version = servData["ver"].asInt();
+    M.nextPoll = Util::bootMS() + FEED_MIN_GAP;
+  }else{
+    M.nextPoll = Util::bootMS() + POLL_INTERVAL;
+  }
+}
+
+/// Runs as a thread, monitoring all hosts from a single event loop.
+/// Hosts are asked for their compact load feed, which they hold until their load changes
+/// (or FEED_WAIT passes); hosts that don't support it are polled for their full JSON statistics
+/// every POLL_INTERVAL instead.
+void monitorHosts(void *){
+  std::vector<struct pollfd> fds;
+  uint64_t nextRanking = 0;
+  while (cfg->is_active){
+    fds.clear();
+    uint64_t now = Util::bootMS();
+    uint64_t nextPoll = now + 100;
+    for (HOSTLOOP){
+      hostEntry &H = HOST(i);
+      uint8_t state;
+      {
+        tthread::lock_guard<tthread::mutex> guard(stateMutex);
+        state = H.state;
+      }
+      if (state == STATE_OFF || state == STATE_REQCLEAN){continue;}
+      if (!H.monitor){
+        H.monitor = new hostMonitor();
+        hostMonitor &M = *H.monitor;
+        JSON::Value bandwidth = 128 * 1024 * 1024u; // assume 1G connection
+        M.url = HTTP::URL(H.name);
+        if (!M.url.protocol.size()){M.url.protocol = "http";}
+        if (!M.url.port.size()){M.url.port = "4242";}
+        if (M.url.path.size()){
+          bandwidth = M.url.path;
+          bandwidth = bandwidth.asInt() * 1024 * 1024;
+          M.url.path.clear();
         }
-        entry->details->update(servData);
+        M.DL.retryCount = 0;
+        M.DL.dataTimeout = FEED_WAIT / 1000 + 5;
+        M.down = true;
+        M.retried = false;
+        M.busy = false;
+        M.connecting = false;
+        M.feed = true;
+        M.version = 0;
+        M.nextPoll = 0;
+        INFO_MSG("Monitoring %s", M.url.getUrl().c_str());
+        H.details->availBandwidth = bandwidth.asInt();
+        H.details->host = M.url.host;
       }
-    }else{
-      FAIL_MSG("Can't retrieve server %s load information", url.host.c_str());
-      entry->details->badNess();
-      DL.getSocket().close();
-      down = true;
-      entry->state = STATE_ERROR;
+      hostMonitor &M = *H.monitor;
+      tthread::lock_guard<tthread::mutex> monGuard(M.mutex);
+      if (state == STATE_GODOWN){
+        if (M.connecting){continue;}
+        WARN_MSG("Monitoring of %s stopping", M.url.host.c_str());
+        M.DL.getSocket().close();
+        tthread::lock_guard<tthread::mutex> guard(stateMutex);
+        H.state = STATE_REQCLEAN;
+        rankingDirty = true;
+        stateCond.notify_all();
+        continue;
+      }
+      checkHost(H);
+      if (M.busy && M.DL.getSocket()){
+        struct pollfd pfd;
+        pfd.fd = M.DL.getSocket().getSocket();
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (pfd.fd >= 0){fds.push_back(pfd);}
+      }else if (!M.busy && !M.connecting && M.nextPoll < nextPoll){
+        nextPoll = M.nextPoll;
+      }
+    }
+    now = Util::bootMS();
+    if (rankingDirty && now >= nextRanking){
+      updateRanking();
+      nextRanking = now + RANKING_INTERVAL;
     }
-    Util::wait(5000);
+    int timeout = (nextPoll > now) ? (nextPoll - now) : 0;
+    if (fds.size()){
+      poll(&fds[0], fds.size(), timeout);
+    }else if (timeout){
+      Util::sleep(timeout);
+    }
+  }
+  for (HOSTLOOP){
+    if (!HOST(i).monitor){continue;}
+    hostMonitor &M = *HOST(i).monitor;
+    tthread::lock_guard<tthread::mutex> guard(M.mutex);
+    if (!M.connecting){M.DL.getSocket().close();}
   }
-  WARN_MSG("Monitoring thread for %s stopping", url.host.c_str());
-  DL.getSocket().close();
-  entry->state = STATE_REQCLEAN;
+  // Hosts still waiting in cleanupHost can be cleaned up right away now
+  tthread::lock_guard<tthread::mutex> guard(stateMutex);
+  monitorActive = false;
+  stateCond.notify_all();
 }
 
 int main(int argc, char **argv){
@@ -953,7 +730,6 @@ int main(int argc, char **argv){
   JSON::Value &nodes = conf.getOption("server", true);
   conf.activate();
 
-  std::map<std::string, tthread::thread *> threads;
   jsonForEach(nodes, it){
     if (it->asStringRef().size() > 199){
       FAIL_MSG("Host length too long for monitoring, skipped: %s", it->asStringRef().c_str());
@@ -962,6 +738,9 @@ int main(int argc, char **argv){
     initHost(HOST(hostsCounter), it->asStringRef());
     ++hostsCounter; // up the hosts counter
   }
+  monitorActive = true;
+  tthread::thread monitorThread(monitorHosts, 0);
+  tthread::thread connectThread(connectHosts, 0);
   WARN_MSG("Load balancer activating. Balancing between %lu nodes.", hostsCounter);
 
   conf.serveThreadedSocket(handleRequest);
@@ -972,35 +751,32 @@ int main(int argc, char **argv){
   }
   conf.is_active = false;
 
-  // Join all threads
-  for (HOSTLOOP){
-    if (!HOST(i).name[0]){continue;}
-    HOST(i).state = STATE_GODOWN;
+  // Wake up the connecting thread so it notices the shutdown, join both threads, then clean up all hosts
+  {
+    tthread::lock_guard<tthread::mutex> guard(connectMutex);
+    connectCond.notify_all();
   }
+  monitorThread.join();
+  connectThread.join();
   for (HOSTLOOP){cleanupHost(HOST(i));}
 }
 
-void initHost(hostEntry &H, const std::string &N){
-  // Cancel if this host has no name set
-  if (!N.size()){return;}
-  H.state = STATE_BOOT;
-  H.details = new hostDetails();
-  memset(H.name, 0, HOSTNAMELEN);
-  memcpy(H.name, N.data(), N.size());
-  H.thread = new tthread::thread(handleServer, (void *)&H);
-  INFO_MSG("Starting monitoring %s", H.name);
-}
-
 void cleanupHost(hostEntry &H){
   // Cancel if this host has no name set
   if (!H.name[0]){return;}
-  H.state = STATE_GODOWN;
   INFO_MSG("Stopping monitoring %s", H.name);
-  // Clean up thread
-  H.thread->join();
-  delete H.thread;
-  H.thread = 0;
-  // Clean up details
+  // Wait for the monitoring thread to let go of this host, if it is still running
+  {
+    tthread::lock_guard<tthread::mutex> guard(stateMutex);
+    if (monitorActive){
+      H.state = STATE_GODOWN;
+      while (H.state != STATE_REQCLEAN && monitorActive){stateCond.wait(stateMutex);}
+    }
+    H.state = STATE_REQCLEAN;
+  }
+  // Clean up monitor and details
+  delete H.monitor;
+  H.monitor = 0;
   delete H.details;
   H.details = 0;
   memset(H.name, 0, HOSTNAMELEN);
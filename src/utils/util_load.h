@@ -0,0 +1,151 @@
+/// \file util_load.h
+/// Host details and the host ranking of the load balancer, shared by MistUtilLoad and its tests.
+
+#pragma once
+#include <cmath>
+#include <map>
+#include <mist/json.h>
+#include <mist/tinythread.h>
+#include <set>
+#include <stdint.h>
+#include <string>
+
+#define HOSTLOOP                                                                                   \
+  unsigned long i = 0;                                                                             \
+  i < hostsCounter;                                                                                \
+  ++i
+#define HOST(no) (hosts[no])
+#define HOSTCHECK                                                                                  \
+  if (hosts[i].state != STATE_ONLINE){continue;}
+
+#define STATE_OFF 0
+#define STATE_BOOT 1
+#define STATE_ERROR 2
+#define STATE_ONLINE 3
+#define STATE_GODOWN 4
+#define STATE_REQCLEAN 5
+#define HOSTNAMELEN 1024
+#define MAXHOSTS 1000
+
+extern size_t weight_cpu;
+extern size_t weight_ram;
+extern size_t weight_bw;
+extern size_t weight_geo;
+extern size_t weight_bonus;
+extern std::map<std::string, int32_t> blankTags;
+extern unsigned long hostsCounter;
+extern volatile bool rankingDirty; ///< Set when the ranking needs to be updated
+
+struct streamDetails{
+  uint64_t total;
+  uint32_t inputs;
+  uint32_t bandwidth;
+  uint64_t prevTotal;
+  uint64_t bytesUp;
+  uint64_t bytesDown;
+};
+
+class outUrl{
+public:
+  std::string pre, post;
+  outUrl(){};
+  outUrl(const std::string &u, const std::string &host){
+    std::string tmp = u;
+    if (u.find("HOST") != std::string::npos){
+      tmp = u.substr(0, u.find("HOST")) + host + u.substr(u.find("HOST") + 4);
+    }
+    size_t dolsign = tmp.find('$');
+    pre = tmp.substr(0, dolsign);
+    if (dolsign != std::string::npos){post = tmp.substr(dolsign + 1);}
+  }
+};
+
+inline double toRad(double degree){
+  return degree / 57.29577951308232087684;
+}
+
+/// Geographical location with its trigonometry precalculated, so repeated distance
+/// calculations against it only need a single cos() and acos().
+struct geoPoint{
+  double lat, lon;
+  double sinLat, cosLat, lonRad;
+  geoPoint(double la = 0, double lo = 0){set(la, lo);}
+  void set(double la, double lo){
+    lat = la;
+    lon = lo;
+    sinLat = sin(toRad(la));
+    cosLat = cos(toRad(la));
+    lonRad = toRad(lo);
+  }
+  bool valid() const{return lat && lon;}
+};
+
+double geoDist(const geoPoint &a, const geoPoint &b);
+int32_t applyAdjustment(const std::set<std::string> &tags, const std::string &match, int32_t adj);
+
+class hostDetails{
+private:
+  tthread::mutex *hostMutex;
+  std::map<std::string, struct streamDetails> streams;
+  std::set<std::string> conf_streams;
+  std::set<std::string> tags;
+  std::map<std::string, outUrl> outputs;
+  uint64_t cpu;
+  uint64_t ramMax;
+  uint64_t ramCurr;
+  uint64_t upSpeed;
+  uint64_t downSpeed;
+  uint64_t total;
+  uint64_t upPrev;
+  uint64_t downPrev;
+  uint64_t prevTime;
+  uint64_t addBandwidth;
+  uint64_t lastUpdate; ///< bootMS() time of the last successful update
+  int64_t feedLag;     ///< Milliseconds between the host generating its last update and us receiving it
+  uint64_t updates;    ///< Count of successful updates
+  geoPoint servGeo;
+
+  void rescore();
+
+public:
+  const geoPoint &geo() const{return servGeo;}
+  /// CPU, RAM and bandwidth score plus one, or zero if the host can't take viewers.
+  /// Kept up to date on every change, so it can be read without locking.
+  volatile uint64_t baseScore;
+  std::string host;
+  char binHost[16];
+  uint64_t availBandwidth;
+  JSON::Value geoDetails;
+  double servLati, servLongi;
+  std::string servLoc;
+  hostDetails();
+  ~hostDetails();
+  void badNess();
+  size_t count(std::string &s);
+  void fillState(JSON::Value &r);
+  void fillStreams(JSON::Value &r);
+  void fillStreamStats(const std::string & s, JSON::Value &r);
+  long long getViewers(const std::string &strm);
+  uint64_t rate(std::string &s, const geoPoint &loc, const std::map<std::string, int32_t> &tagAdjust = blankTags);
+  uint64_t source(const std::string &s, double lati, double longi, const std::map<std::string, int32_t> &tagAdjust, uint32_t minCpu);
+  std::string getUrl(std::string &s, std::string &proto);
+  void addViewer(std::string &s);
+  void update(JSON::Value &d);
+};
+
+struct hostMonitor;
+
+/// Fixed-size struct for holding a host's name and details pointer
+struct hostEntry{
+  uint8_t state; // 0 = off, 1 = booting, 2 = running, 3 = requesting shutdown, 4 = requesting clean
+  char name[HOSTNAMELEN];          // host+port for server
+  hostDetails *details;    /// hostDetails pointer
+  hostMonitor *monitor;    /// hostMonitor pointer
+};
+
+extern hostEntry hosts[MAXHOSTS]; /// Fixed-size array holding all hosts
+
+void initHost(hostEntry &H, const std::string &N);
+void updateRanking();
+hostEntry *findBestHost(std::string &stream, const geoPoint &loc,
+                        const std::map<std::string, int32_t> &tagAdjust, uint64_t &bestScore);
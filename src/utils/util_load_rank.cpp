@@ -0,0 +1,602 @@
+/// \file util_load_rank.cpp
+/// Host details and the host ranking of the load balancer.
+
+#include "util_load.h"
+#include <algorithm>
+#include <cstring>
+#include <mist/defines.h>
+#include <mist/timing.h>
+#include <vector>
+
+size_t weight_cpu = 500;
+size_t weight_ram = 500;
+size_t weight_bw = 1000;
+size_t weight_geo = 1000;
+size_t weight_bonus = 50;
+std::map<std::string, int32_t> blankTags;
+unsigned long hostsCounter = 0; // This is a pointer to guarantee atomic accesses.
+volatile bool rankingDirty = true;
+
+hostEntry hosts[MAXHOSTS];
+
+double geoDist(const geoPoint &a, const geoPoint &b){
+  double dist = a.sinLat * b.sinLat + a.cosLat * b.cosLat * cos(a.lonRad - b.lonRad);
+  return .31830988618379067153 * acos(dist);
+}
+
+int32_t applyAdjustment(const std::set<std::string> & tags, const std::string & match, int32_t adj){
+  if (!match.size()){return 0;}
+  bool invert = false;
+  bool haveOne = false;
+  size_t prevPos = 0;
+  if (match[0] == '-'){
+    invert = true;
+    prevPos = 1;
+  }
+  //Check if any matches inside tags
+  size_t currPos = match.find(',', prevPos);
+  while (currPos != std::string::npos){
+    if (tags.count(match.substr(prevPos, currPos-prevPos))){haveOne = true;}
+    prevPos = currPos + 1;
+    currPos = match.find(',', prevPos);
+  }
+  if (tags.count(match.substr(prevPos))){haveOne = true;}
+  //If we have any match, apply adj, unless we're doing an inverted search, then return adj on zero matches
+  if (haveOne == !invert){return adj;}
+  return 0;
+}
+
+/// Recalculates baseScore; must be called with hostMutex locked.
+void hostDetails::rescore(){
+  uint64_t newScore = 0;
+  if (ramMax && availBandwidth && upSpeed < availBandwidth && (upSpeed + addBandwidth) < availBandwidth){
+    newScore = (weight_cpu - (cpu * weight_cpu) / 1000) + (weight_ram - ((ramCurr * weight_ram) / ramMax)) +
+               (weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth)) + 1;
+  }
+  if (newScore != baseScore){
+    baseScore = newScore;
+    rankingDirty = true;
+  }
+}
+
+hostDetails::hostDetails(){
+  hostMutex = 0;
+  cpu = 1000;
+  ramMax = 0;
+  ramCurr = 0;
+  upSpeed = 0;
+  downSpeed = 0;
+  upPrev = 0;
+  downPrev = 0;
+  prevTime = 0;
+  total = 0;
+  addBandwidth = 0;
+  lastUpdate = 0;
+  feedLag = -1;
+  updates = 0;
+  baseScore = 0;
+  servLati = 0;
+  servLongi = 0;
+  availBandwidth = 128 * 1024 * 1024; // assume 1G connections
+}
+
+hostDetails::~hostDetails(){
+  if (hostMutex){
+    delete hostMutex;
+    hostMutex = 0;
+  }
+}
+
+void hostDetails::badNess(){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  addBandwidth += 1 * 1024 * 1024;
+  addBandwidth *= 1.2;
+  rescore();
+}
+
+/// Returns the count of viewers for a given stream s.
+size_t hostDetails::count(std::string &s){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  if (streams.count(s)){return streams[s].total;}
+  return 0;
+}
+
+/// Fills out a by reference given JSON::Value with current state.
+void hostDetails::fillState(JSON::Value &r){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  r["cpu"] = (uint64_t)(cpu / 10);
+  if (ramMax){r["ram"] = (uint64_t)((ramCurr * 100) / ramMax);}
+  r["up"] = upSpeed;
+  r["up_add"] = addBandwidth;
+  r["down"] = downSpeed;
+  r["streams"] = streams.size();
+  r["viewers"] = total;
+  r["bwlimit"] = availBandwidth;
+  r["updates"] = updates;
+  if (lastUpdate){r["age"] = Util::bootMS() - lastUpdate;}
+  if (feedLag >= 0){r["lag"] = feedLag;}
+  if (servLati || servLongi){
+    r["geo"]["lat"] = servLati;
+    r["geo"]["lon"] = servLongi;
+    r["geo"]["loc"] = servLoc;
+  }
+  if (tags.size()){
+    for (std::set<std::string>::iterator it = tags.begin(); it != tags.end(); ++it){
+      r["tags"].append(*it);
+    }
+  }
+  if (ramMax && availBandwidth){
+    r["score"]["cpu"] = (uint64_t)(weight_cpu - (cpu * weight_cpu) / 1000);
+    r["score"]["ram"] = (uint64_t)(weight_ram - ((ramCurr * weight_ram) / ramMax));
+    r["score"]["bw"] = (uint64_t)(weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
+  }
+}
+
+/// Fills out a by reference given JSON::Value with current streams viewer count.
+void hostDetails::fillStreams(JSON::Value &r){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  for (std::map<std::string, struct streamDetails>::iterator jt = streams.begin();
+       jt != streams.end(); ++jt){
+    r[jt->first] = r[jt->first].asInt() + jt->second.total;
+  }
+}
+
+/// Fills out a by reference given JSON::Value with current stream statistics.
+void hostDetails::fillStreamStats(const std::string & s, JSON::Value &r){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  for (std::map<std::string, struct streamDetails>::iterator jt = streams.begin();
+       jt != streams.end(); ++jt){
+    const std::string & n = jt->first;
+    if (s != "*" && n != s && n.substr(0, s.size()+1) != s+"+"){continue;}
+    if (!r.isMember(n)){
+      r[n].append(jt->second.total);//viewers
+      r[n].append(jt->second.bandwidth);//bandwidth usage
+      r[n].append(jt->second.bytesUp);//total bytes up
+      r[n].append(jt->second.bytesDown);//total bytes down
+    }else{
+      r[n][0u] = r[n][0u].asInt() + jt->second.total;
+      r[n][2u] = r[n][2u].asInt() + jt->second.bytesUp;
+      r[n][3u] = r[n][3u].asInt() + jt->second.bytesDown;
+    }
+  }
+}
+
+/// Returns viewcount for the given stream
+long long hostDetails::getViewers(const std::string &strm){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  if (!streams.count(strm)){return 0;}
+  return streams[strm].total;
+}
+
+/// Scores a potential new connection to this server
+/// 0 means not possible, the higher the better.
+uint64_t hostDetails::rate(std::string &s, const geoPoint &loc, const std::map<std::string, int32_t> &tagAdjust){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  if (!ramMax || !availBandwidth){
+    WARN_MSG("Host %s invalid: RAM %" PRIu64 ", BW %" PRIu64, host.c_str(), ramMax, availBandwidth);
+    return 0;
+  }
+  if (upSpeed >= availBandwidth || (upSpeed + addBandwidth) >= availBandwidth){
+    INFO_MSG("Host %s over bandwidth: %" PRIu64 "+%" PRIu64 " >= %" PRIu64, host.c_str(), upSpeed,
+             addBandwidth, availBandwidth);
+    return 0;
+  }
+  if (conf_streams.size() && !conf_streams.count(s) &&
+      !conf_streams.count(s.substr(0, s.find_first_of("+ ")))){
+    MEDIUM_MSG("Stream %s not available from %s", s.c_str(), host.c_str());
+    return 0;
+  }
+  // Calculate score
+  uint64_t cpu_score = (weight_cpu - (cpu * weight_cpu) / 1000);
+  uint64_t ram_score = (weight_ram - ((ramCurr * weight_ram) / ramMax));
+  uint64_t bw_score = (weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
+  uint64_t geo_score = 0;
+  if (servGeo.valid() && loc.valid()){geo_score = weight_geo - weight_geo * geoDist(servGeo, loc);}
+  uint64_t score = cpu_score + ram_score + bw_score + geo_score + (streams.count(s) ? weight_bonus : 0);
+  int64_t adjustment = 0;
+  if (tagAdjust.size()){
+    for (std::map<std::string, int32_t>::const_iterator it = tagAdjust.begin(); it != tagAdjust.end(); ++it){
+      adjustment += applyAdjustment(tags, it->first, it->second);
+    }
+  }
+  if (adjustment >= 0 || -adjustment < score){
+    score += adjustment;
+  }else{
+    score = 0;
+  }
+  // Print info on host
+  MEDIUM_MSG("%s: CPU %" PRIu64 ", RAM %" PRIu64 ", Stream %" PRIu64 ", BW %" PRIu64
+             " (max %" PRIu64 " MB/s), Geo %" PRIu64 ", tag adjustment %" PRId64 " -> %" PRIu64,
+             host.c_str(), cpu_score, ram_score, streams.count(s) ? weight_bonus : 0, bw_score,
+             availBandwidth / 1024 / 1024, geo_score, adjustment, score);
+  return score;
+}
+
+/// Scores this server as a source
+/// 0 means not possible, the higher the better.
+uint64_t hostDetails::source(const std::string &s, double lati, double longi, const std::map<std::string, int32_t> &tagAdjust, uint32_t minCpu){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  if (s.size() && (!streams.count(s) || !streams[s].inputs)){return 0;}
+  if (!ramMax || !availBandwidth){
+    WARN_MSG("Host %s invalid: RAM %" PRIu64 ", BW %" PRIu64, host.c_str(), ramMax, availBandwidth);
+    return 1;
+  }
+  if (upSpeed >= availBandwidth || (upSpeed + addBandwidth) >= availBandwidth){
+    INFO_MSG("Host %s over bandwidth: %" PRIu64 "+%" PRIu64 " >= %" PRIu64, host.c_str(), upSpeed,
+             addBandwidth, availBandwidth);
+    return 1;
+  }
+  // Calculate score
+  if (minCpu && cpu + minCpu >= 1000){return 0;}
+  uint64_t cpu_score = (weight_cpu - (cpu * weight_cpu) / 1000);
+  uint64_t ram_score = (weight_ram - ((ramCurr * weight_ram) / ramMax));
+  uint64_t bw_score = (weight_bw - (((upSpeed + addBandwidth) * weight_bw) / availBandwidth));
+  uint64_t geo_score = 0;
+  if (servGeo.valid() && lati && longi){
+    geo_score = weight_geo - weight_geo * geoDist(servGeo, geoPoint(lati, longi));
+  }
+  uint64_t score = cpu_score + ram_score + bw_score + geo_score + 1;
+  int64_t adjustment = 0;
+  if (tagAdjust.size()){
+    for (std::map<std::string, int32_t>::const_iterator it = tagAdjust.begin(); it != tagAdjust.end(); ++it){
+      adjustment += applyAdjustment(tags, it->first, it->second);
+    }
+  }
+  if (adjustment >= 0 || -adjustment < score){
+    score += adjustment;
+  }else{
+    score = 0;
+  }
+  // Print info on host
+  MEDIUM_MSG("SOURCE %s: CPU %" PRIu64 ", RAM %" PRIu64 ", Stream %" PRIu64 ", BW %" PRIu64
+             " (max %" PRIu64 " MB/s), Geo %" PRIu64 ", tag adjustment %" PRId64 " -> %" PRIu64,
+             host.c_str(), cpu_score, ram_score, streams.count(s) ? weight_bonus : 0, bw_score,
+             availBandwidth / 1024 / 1024, geo_score, adjustment, score);
+  return score;
+}
+
+std::string hostDetails::getUrl(std::string &s, std::string &proto){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  if (!outputs.count(proto)){return "";}
+  const outUrl &o = outputs[proto];
+  return o.pre + s + o.post;
+}
+
+void hostDetails::addViewer(std::string &s){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  uint64_t toAdd = 0;
+  if (streams.count(s)){
+    toAdd = streams[s].bandwidth;
+  }else{
+    if (total){
+      toAdd = (upSpeed + downSpeed) / total;
+    }else{
+      toAdd = 131072; // assume 1mbps
+    }
+  }
+  // ensure reasonable limits of bandwidth guesses
+  if (toAdd < 64 * 1024){toAdd = 64 * 1024;}// minimum of 0.5 mbps
+  if (toAdd > 1024 * 1024){toAdd = 1024 * 1024;}// maximum of 8 mbps
+  addBandwidth += toAdd;
+  rescore();
+}
+
+void hostDetails::update(JSON::Value &d){
+  if (!hostMutex){hostMutex = new tthread::mutex();}
+  tthread::lock_guard<tthread::mutex> guard(*hostMutex);
+  lastUpdate = Util::bootMS();
+  ++updates;
+  if (d.isMember("time")){
+    feedLag = Util::unixMS() - d["time"].asInt();
+    if (feedLag < 0){feedLag = 0;}// clock skew between us and the host
+  }
+  cpu = d["cpu"].asInt();
+  if (d.isMember("bwlimit") && d["bwlimit"].asInt()){availBandwidth = d["bwlimit"].asInt();}
+  if (d.isMember("loc")){
+    if (d["loc"]["lat"].asDouble() != servLati){servLati = d["loc"]["lat"].asDouble();}
+    if (d["loc"]["lon"].asDouble() != servLongi){servLongi = d["loc"]["lon"].asDouble();}
+    if (d["loc"]["name"].asStringRef() != servLoc){servLoc = d["loc"]["name"].asStringRef();}
+    if (servGeo.lat != servLati || servGeo.lon != servLongi){servGeo.set(servLati, servLongi);}
+  }
+  int64_t nRamMax = d["mem_total"].asInt();
+  int64_t nRamCur = d["mem_used"].asInt();
+  int64_t nShmMax = d["shm_total"].asInt();
+  int64_t nShmCur = d["shm_used"].asInt();
+  if (d.isMember("tags") && d["tags"].isArray()){
+    std::set<std::string> newTags;
+    jsonForEach(d["tags"], tag){
+      std::string t = tag->asString();
+      if (t.size()){newTags.insert(t);}
+    }
+    if (newTags != tags){tags = newTags;}
+  }
+  if (!nRamMax){nRamMax = 1;}
+  if (!nShmMax){nShmMax = 1;}
+  if (((nRamCur + nShmCur) * 1000) / nRamMax > (nShmCur * 1000) / nShmMax){
+    ramMax = nRamMax;
+    ramCurr = nRamCur + nShmCur;
+  }else{
+    ramMax = nShmMax;
+    ramCurr = nShmCur;
+  }
+  total = d["curr"][0u].asInt();
+  uint64_t currUp = d["bw"][0u].asInt(), currDown = d["bw"][1u].asInt();
+  uint64_t timeDiff = 0;
+  if (prevTime){
+    timeDiff = time(0) - prevTime;
+    if (timeDiff){
+      upSpeed = (currUp - upPrev) / timeDiff;
+      downSpeed = (currDown - downPrev) / timeDiff;
+    }
+  }
+  prevTime = time(0);
+  upPrev = currUp;
+  downPrev = currDown;
+
+  if (d.isMember("streams") && d["streams"].size()){
+    jsonForEach(d["streams"], it){
+      uint64_t count = (*it)["curr"][0u].asInt() + (*it)["curr"][1u].asInt() + (*it)["curr"][2u].asInt();
+      if (!count){
+        if (streams.count(it.key())){streams.erase(it.key());}
+        continue;
+      }
+      struct streamDetails &strm = streams[it.key()];
+      strm.total = (*it)["curr"][0u].asInt();
+      strm.inputs = (*it)["curr"][1u].asInt();
+      strm.bytesUp = (*it)["bw"][0u].asInt();
+      strm.bytesDown = (*it)["bw"][1u].asInt();
+      uint64_t currTotal = strm.bytesUp + strm.bytesDown;
+      if (timeDiff && count){
+        strm.bandwidth = ((currTotal - strm.prevTotal) / timeDiff) / count;
+      }else{
+        if (total){
+          strm.bandwidth = (upSpeed + downSpeed) / total;
+        }else{
+          strm.bandwidth = (upSpeed + downSpeed) + 100000;
+        }
+      }
+      strm.prevTotal = currTotal;
+    }
+    if (streams.size()){
+      std::set<std::string> eraseList;
+      for (std::map<std::string, struct streamDetails>::iterator it = streams.begin();
+           it != streams.end(); ++it){
+        if (!d["streams"].isMember(it->first)){eraseList.insert(it->first);}
+      }
+      for (std::set<std::string>::iterator it = eraseList.begin(); it != eraseList.end(); ++it){
+        streams.erase(*it);
+      }
+    }
+  }else{
+    streams.clear();
+  }
+  conf_streams.clear();
+  if (d.isMember("conf_streams") && d["conf_streams"].size()){
+    jsonForEach(d["conf_streams"], it){conf_streams.insert(it->asStringRef());}
+  }
+  outputs.clear();
+  if (d.isMember("outputs") && d["outputs"].size()){
+    jsonForEach(d["outputs"], op){outputs[op.key()] = outUrl(op->asStringRef(), host);}
+  }
+  addBandwidth *= 0.75;
+  rescore();
+}
+
+#define GEO_BUCKET_DEG 30 ///< Size in degrees of the region buckets used for ranking by location
+#define GEO_ROWS (180 / GEO_BUCKET_DEG)
+#define GEO_COLS (360 / GEO_BUCKET_DEG)
+#define GEO_BUCKETS (GEO_ROWS * GEO_COLS)
+
+/// Online hosts ordered by descending score, as {score, host index} pairs.
+/// List zero is ordered by baseScore, for requests without a location. List 1+b is ordered by
+/// baseScore plus the highest geo score any location inside region bucket b could give.
+/// A published ranking is never changed: updateRanking() builds the next one, and the balancing
+/// path holds a reference to the ranking it walks, so it is not freed while still in use.
+struct hostRanking{
+  int refs;              ///< References to this ranking; the last one to be released deletes it
+  unsigned long count;    ///< Hosts in each list
+  unsigned long capacity; ///< Room for hosts in each list
+  std::pair<uint64_t, unsigned long> *lists;
+  hostRanking(unsigned long cap){
+    refs = 1;
+    count = 0;
+    capacity = cap;
+    lists = new std::pair<uint64_t, unsigned long>[(GEO_BUCKETS + 1) * cap];
+  }
+  ~hostRanking(){delete[] lists;}
+  std::pair<uint64_t, unsigned long> *list(size_t l){return lists + l * capacity;}
+};
+
+tthread::mutex rankingMutex; ///< Guards rankingCurr and the reference counts of rankings
+hostRanking *rankingCurr = 0; ///< Most recently published ranking, holding one reference
+
+/// Returns a reference to the most recently published ranking, or null if there is none yet
+hostRanking *acquireRanking(){
+  tthread::lock_guard<tthread::mutex> guard(rankingMutex);
+  if (rankingCurr){++rankingCurr->refs;}
+  return rankingCurr;
+}
+
+/// Releases a reference returned by acquireRanking(), deleting the ranking if it was the last one
+void releaseRanking(hostRanking *R){
+  if (!R){return;}
+  tthread::lock_guard<tthread::mutex> guard(rankingMutex);
+  if (!--R->refs){delete R;}
+}
+
+/// Returns the region bucket a location falls in.
+size_t geoBucket(const geoPoint &p){
+  int row = (p.lat + 90) / GEO_BUCKET_DEG;
+  int col = (p.lon + 180) / GEO_BUCKET_DEG;
+  if (row < 0){row = 0;}
+  if (row >= GEO_ROWS){row = GEO_ROWS - 1;}
+  if (col < 0){col = 0;}
+  if (col >= GEO_COLS){col = GEO_COLS - 1;}
+  return row * GEO_COLS + col;
+}
+
+/// Sort helper placing the highest scores first
+bool rankingOrder(const std::pair<uint64_t, unsigned long> &a, const std::pair<uint64_t, unsigned long> &b){
+  return a.first > b.first;
+}
+
+/// What each host is ranked by in rankingCurr; only used by the thread calling updateRanking()
+uint64_t rankedBase[MAXHOSTS];           ///< baseScore the host is ranked by, zero if not ranked
+geoPoint rankedGeo[MAXHOSTS];            ///< Location the geo scores below are for
+uint64_t rankedGeoMax[MAXHOSTS][GEO_BUCKETS]; ///< Highest geo score per region bucket
+
+/// Updates the ranking of hosts to their current baseScore values, and publishes it.
+/// Only hosts whose score or location changed are sorted; all others keep their place, so every list
+/// is merged in a single pass instead of sorted. Only one thread may call this function.
+void updateRanking(){
+  static geoPoint centers[GEO_BUCKETS];
+  static double radius[GEO_BUCKETS];
+  static size_t rankedWeightGeo = 0;
+  static bool haveBuckets = false;
+  if (!haveBuckets){
+    // Bucket centers, and the largest distance from a center to any point in its bucket
+    for (size_t b = 0; b < GEO_BUCKETS; ++b){
+      double lat = (double)(b / GEO_COLS) * GEO_BUCKET_DEG - 90;
+      double lon = (double)(b % GEO_COLS) * GEO_BUCKET_DEG - 180;
+      double half = GEO_BUCKET_DEG / 2.0;
+      centers[b].set(lat + half, lon + half);
+      radius[b] = 0;
+      for (int y = 0; y < 3; ++y){
+        for (int x = 0; x < 3; ++x){
+          double d = geoDist(centers[b], geoPoint(lat + y * half, lon + x * half));
+          if (d > radius[b]){radius[b] = d;}
+        }
+      }
+      radius[b] *= 1.01;
+    }
+    haveBuckets = true;
+  }
+  rankingDirty = false;
+  hostRanking *prev = rankingCurr;
+  // A changed geo weight changes the scores of all hosts
+  bool allChanged = !prev || rankedWeightGeo != weight_geo;
+  rankedWeightGeo = weight_geo;
+
+  // Find the hosts whose place in the ranking changed, and update what they are ranked by
+  std::vector<bool> changed(hostsCounter, false);
+  std::vector<unsigned long> fresh; // Changed hosts that are (still) ranked
+  unsigned long kept = allChanged ? 0 : prev->count; // Hosts that keep their place
+  for (HOSTLOOP){
+    uint64_t score = 0;
+    if (HOST(i).state == STATE_ONLINE && HOST(i).details){score = HOST(i).details->baseScore;}
+    const geoPoint servGeo = score ? HOST(i).details->geo() : rankedGeo[i];
+    bool moved = servGeo.lat != rankedGeo[i].lat || servGeo.lon != rankedGeo[i].lon;
+    if (!allChanged && score == rankedBase[i] && !moved){continue;}
+    changed[i] = true;
+    if (rankedBase[i] && !allChanged){--kept;}
+    if (allChanged || moved){
+      rankedGeo[i] = servGeo;
+      for (size_t b = 0; b < GEO_BUCKETS; ++b){
+        uint64_t geoMax = 0;
+        if (servGeo.valid()){
+          double dist = geoDist(servGeo, centers[b]) - radius[b];
+          geoMax = (dist > 0) ? weight_geo - weight_geo * dist : weight_geo;
+          if (geoMax < weight_geo){++geoMax;}// Round up, rate() rounds down
+        }
+        rankedGeoMax[i][b] = geoMax;
+      }
+    }
+    rankedBase[i] = score;
+    if (score){fresh.push_back(i);}
+  }
+  if (!allChanged && fresh.empty() && kept == prev->count){return;}
+
+  // Merge the unchanged hosts of every list with the newly sorted changed ones
+  hostRanking *next = new hostRanking(hostsCounter ? hostsCounter : 1);
+  std::vector<std::pair<uint64_t, unsigned long> > sorted(fresh.size());
+  for (size_t l = 0; l <= GEO_BUCKETS; ++l){
+    for (size_t f = 0; f < fresh.size(); ++f){
+      unsigned long i = fresh[f];
+      sorted[f].first = rankedBase[i] + (l ? rankedGeoMax[i][l - 1] : 0);
+      sorted[f].second = i;
+    }
+    std::sort(sorted.begin(), sorted.end(), rankingOrder);
+    std::pair<uint64_t, unsigned long> *out = next->list(l);
+    std::pair<uint64_t, unsigned long> *old = allChanged ? 0 : prev->list(l);
+    std::pair<uint64_t, unsigned long> *oldEnd = allChanged ? 0 : old + prev->count;
+    std::vector<std::pair<uint64_t, unsigned long> >::iterator it = sorted.begin();
+    while (old != oldEnd || it != sorted.end()){
+      if (old != oldEnd && changed[old->second]){
+        ++old;
+        continue;
+      }
+      if (it == sorted.end() || (old != oldEnd && old->first >= it->first)){
+        *(out++) = *(old++);
+      }else{
+        *(out++) = *(it++);
+      }
+    }
+  }
+  next->count = kept + fresh.size();
+
+  // Publish the new ranking; the previous one goes away once the last request walking it is done
+  {
+    tthread::lock_guard<tthread::mutex> guard(rankingMutex);
+    rankingCurr = next;
+  }
+  releaseRanking(prev);
+}
+
+/// Finds the best host to send a viewer of the given stream to.
+/// Walks the ranking for the region the viewer is in from the highest score down, and stops as
+/// soon as no remaining host could beat the best score found so far, even when given the stream
+/// bonus and all positive tag adjustments. Typically only the first few hosts are scored in full.
+hostEntry *findBestHost(std::string &stream, const geoPoint &loc,
+                        const std::map<std::string, int32_t> &tagAdjust, uint64_t &bestScore){
+  uint64_t maxBonus = weight_bonus;
+  for (std::map<std::string, int32_t>::const_iterator it = tagAdjust.begin(); it != tagAdjust.end(); ++it){
+    if (it->second > 0){maxBonus += it->second;}
+  }
+  hostEntry *bestHost = 0;
+  bestScore = 0;
+  hostRanking *R = acquireRanking();
+  if (!R){return 0;}
+  std::pair<uint64_t, unsigned long> *list = R->list(loc.valid() ? geoBucket(loc) + 1 : 0);
+  for (unsigned long r = 0; r < R->count; ++r){
+    // Base scores include a +1 to tell them apart from unusable hosts
+    if (bestScore && list[r].first - 1 + maxBonus <= bestScore){break;}
+    unsigned long i = list[r].second;
+    HOSTCHECK;
+    // The exact geo score is cheap to know, so skip hosts it already rules out
+    if (bestScore && loc.valid()){
+      uint64_t maxScore = HOST(i).details->baseScore - 1 + maxBonus;
+      const geoPoint &servGeo = HOST(i).details->geo();
+      if (servGeo.valid()){maxScore += weight_geo - weight_geo * geoDist(servGeo, loc);}
+      if (maxScore <= bestScore){continue;}
+    }
+    uint64_t score = HOST(i).details->rate(stream, loc, tagAdjust);
+    if (score > bestScore){
+      bestHost = &HOST(i);
+      bestScore = score;
+    }
+  }
+  releaseRanking(R);
+  return bestHost;
+}
+
+void initHost(hostEntry &H, const std::string &N){
+  // Cancel if this host has no name set
+  if (!N.size()){return;}
+  H.details = new hostDetails();
+  H.monitor = 0;
+  memset(H.name, 0, HOSTNAMELEN);
+  memcpy(H.name, N.data(), N.size());
+  // Setting the state last makes the monitoring thread pick up this host
+  H.state = STATE_BOOT;
+  INFO_MSG("Starting monitoring %s", H.name);
+}
@@ -0,0 +1,175 @@
+#include <mist/accesslog.h>
+#include <mist/timing.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Builds the record with the given number, ending at the given time
+AccessLog::Record makeRecord(size_t i, uint64_t time){
+  AccessLog::Record R;
+  std::stringstream sess;
+  sess << "sess" << (i * 2654435761u);
+  R.time = time;
+  R.session = sess.str();
+  R.stream = (i % 7) ? "live+channel" + std::string(1, '0' + i % 5) : "vod";
+  R.connector = (i % 3) ? "HLS" : "WebRTC";
+  std::stringstream host;
+  host << "192.168." << (i % 13) << "." << (i % 211);
+  R.host = host.str();
+  R.duration = 1 + i % 3600;
+  R.up = 1000 + i * 37;
+  R.down = 100000 + i * 1009;
+  R.tags = (i % 11) ? "" : "[premium]";
+  return R;
+}
+
+/// Writes a large amount of records spanning several rotation periods through the asynchronous writer, then
+/// verifies they read back identically, that time range queries skip blocks outside the range and that a
+/// truncated file is still readable. Reports the cost of adding records and the size on disk versus text.
+int main(int argc, char **argv){
+  size_t recCount = (argc > 1 ? atoi(argv[1]) : 200000);
+  int failures = 0;
+  char dirName[] = "/tmp/access_log_XXXXXX";
+  if (!mkdtemp(dirName)){
+    std::cerr << "Could not create temporary directory" << std::endl;
+    return 1;
+  }
+  std::string dir = dirName;
+
+  // Spread the records over three hours, rotating every hour
+  uint64_t start = 1700000000 - 1700000000 % 3600;
+  uint64_t textSize = 0;
+  uint64_t addTime = 0;
+  AccessLog::Writer W;
+  if (!W.open(dir, 3600)){
+    std::cerr << "Could not open access log writer" << std::endl;
+    return 1;
+  }
+  for (size_t i = 0; i < recCount; ++i){
+    AccessLog::Record R = makeRecord(i, start + (i * 3 * 3600) / recCount);
+    std::stringstream text;
+    text << "2023-11-14 22:00:00, " << R.session << ", " << R.stream << ", " << R.connector << ", " << R.host
+         << ", " << R.duration << ", " << R.up / R.duration / 1024 << ", " << R.down / R.duration / 1024 << ", "
+         << R.tags << "\n";
+    textSize += text.str().size();
+    uint64_t t = Util::getMicros();
+    W.add(R);
+    addTime += Util::getMicros(t);
+  }
+  uint64_t closeTime = Util::getMicros();
+  W.close();
+  closeTime = Util::getMicros(closeTime);
+
+  std::deque<std::string> files;
+  AccessLog::listFiles(dir, 0, 0xFFFFFFFFFFFFFFFFull, files);
+  if (files.size() != 3){
+    std::cerr << "Wrote " << files.size() << " files, expected 3" << std::endl;
+    ++failures;
+  }
+  uint64_t diskSize = 0;
+  for (size_t f = 0; f < files.size(); ++f){
+    struct stat st;
+    if (!stat(files[f].c_str(), &st)){diskSize += st.st_size;}
+  }
+
+  // Read everything back and compare
+  size_t readCount = 0;
+  uint64_t readTime = Util::getMicros();
+  AccessLog::Block B;
+  for (size_t f = 0; f < files.size(); ++f){
+    AccessLog::Reader R(files[f]);
+    while (R.next(B)){
+      for (size_t i = 0; i < B.size(); ++i, ++readCount){
+        AccessLog::Record E = makeRecord(readCount, start + (readCount * 3 * 3600) / recCount);
+        AccessLog::Record A;
+        B.get(i, A);
+        if (A.time != E.time || A.session != E.session || A.stream != E.stream || A.connector != E.connector ||
+            A.host != E.host || A.duration != E.duration || A.up != E.up || A.down != E.down || A.tags != E.tags){
+          if (failures < 10){std::cerr << "Record " << readCount << " does not match" << std::endl;}
+          ++failures;
+        }
+      }
+    }
+  }
+  readTime = Util::getMicros(readTime);
+  if (readCount != recCount){
+    std::cerr << "Read " << readCount << " records, expected " << recCount << std::endl;
+    ++failures;
+  }
+
+  // Query the middle half hour: only the second file should be opened, and most of its blocks skipped
+  uint64_t from = start + 3600 + 900, to = start + 3600 + 2700;
+  std::deque<std::string> rangeFiles;
+  AccessLog::listFiles(dir, from, to, rangeFiles);
+  if (rangeFiles.size() != 1 || (files.size() > 1 && rangeFiles[0] != files[1])){
+    std::cerr << "Time range query selected " << rangeFiles.size() << " files, expected only the second" << std::endl;
+    ++failures;
+  }
+  size_t inRange = 0, decoded = 0;
+  uint64_t skipped = 0;
+  for (size_t f = 0; f < rangeFiles.size(); ++f){
+    AccessLog::Reader R(rangeFiles[f]);
+    while (R.next(B, from, to)){
+      decoded += B.size();
+      for (size_t i = 0; i < B.size(); ++i){
+        if (B.time[i] >= from && B.time[i] <= to){++inRange;}
+      }
+    }
+    skipped = R.skipped();
+  }
+  size_t expectRange = 0;
+  for (size_t i = 0; i < recCount; ++i){
+    uint64_t t = start + (i * 3 * 3600) / recCount;
+    if (t >= from && t <= to){++expectRange;}
+  }
+  if (inRange != expectRange){
+    std::cerr << "Time range query found " << inRange << " records, expected " << expectRange << std::endl;
+    ++failures;
+  }
+
+  // A block cut off halfway through, as after a crash, must not hide the blocks before it
+  if (files.size()){
+    struct stat st;
+    stat(files[0].c_str(), &st);
+    if (truncate(files[0].c_str(), st.st_size - 10)){
+      std::cerr << "Could not truncate file" << std::endl;
+      ++failures;
+    }
+    size_t truncCount = 0;
+    AccessLog::Reader R(files[0]);
+    while (R.next(B)){truncCount += B.size();}
+    if (!truncCount || truncCount >= recCount / 3 + 1){
+      std::cerr << "Read " << truncCount << " records from a truncated file" << std::endl;
+      ++failures;
+    }
+
+    // Records appended after a restart must not end up behind the cut off block
+    if (!W.open(dir, 3600)){
+      std::cerr << "Could not reopen access log writer" << std::endl;
+      ++failures;
+    }
+    for (size_t i = 0; i < 100; ++i){W.add(makeRecord(i, start));}
+    W.close();
+    size_t appendCount = 0;
+    AccessLog::Reader A(files[0]);
+    while (A.next(B)){appendCount += B.size();}
+    if (appendCount != truncCount + 100){
+      std::cerr << "Read " << appendCount << " records after appending 100 to a truncated file holding "
+                << truncCount << std::endl;
+      ++failures;
+    }
+  }
+
+  for (size_t f = 0; f < files.size(); ++f){unlink(files[f].c_str());}
+  rmdir(dir.c_str());
+
+  std::cerr << "Added " << recCount << " records in " << addTime << " us (" << (double)addTime / recCount
+            << " us per record), finished writing in " << closeTime << " us" << std::endl;
+  std::cerr << "Binary log: " << diskSize << " bytes, text log: " << textSize << " bytes" << std::endl;
+  std::cerr << "Read back all records in " << readTime << " us; time range query decoded " << decoded
+            << " records for " << inRange << " matches, skipping " << skipped << " blocks" << std::endl;
+  return failures;
+}
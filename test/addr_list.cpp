@@ -0,0 +1,86 @@
+#include <mist/addr_list.h>
+#include <mist/socket.h>
+#include <mist/timing.h>
+#include <iostream>
+
+int failures = 0;
+
+/// Converts a numeric address to binary IPv6 form
+std::string binAddr(const std::string &addr){
+  std::string bin = Socket::getBinForms(addr);
+  return bin.size() >= 16 ? bin.substr(0, 16) : std::string(16, (char)0);
+}
+
+/// Verifies the list matches the given address and host name as expected, both directly and in packed form
+void expect(const Socket::AddrList &L, const std::string &addr, const std::string &host, bool expected){
+  std::string packed = L.packed();
+  bool direct = L.match(binAddr(addr)) || L.matchHost(host);
+  bool fromPacked = Socket::AddrList::match(packed.data(), packed.size(), binAddr(addr)) ||
+                    Socket::AddrList::matchHost(packed.data(), packed.size(), host);
+  if (direct != expected || fromPacked != expected){
+    std::cerr << addr << " (" << host << ") " << (expected ? "should" : "should not") << " match" << std::endl;
+    ++failures;
+  }
+}
+
+/// Compiles host lists the way host limits are written, verifies their matching and reports how long
+/// matching an address against a large list takes.
+int main(int argc, char **argv){
+  Socket::AddrList L("10.0.0.0/8 192.168.1.* 172.16.5* 2001:db8::/32 fe80:1:* ::1 *.example.com media*");
+  expect(L, "10.20.30.40", "", true);
+  expect(L, "11.0.0.1", "", false);
+  expect(L, "192.168.1.77", "", true);
+  expect(L, "192.168.2.1", "", false);
+  expect(L, "172.16.5.1", "", true);
+  expect(L, "172.16.55.1", "", true);
+  expect(L, "172.16.6.1", "", false);
+  expect(L, "2001:db8:1::5", "", true);
+  expect(L, "2001:db9::5", "", false);
+  expect(L, "fe80:1:2::3", "", true);
+  expect(L, "::1", "", true);
+  expect(L, "::2", "", false);
+  expect(L, "1.2.3.4", "cdn.EXAMPLE.com", true);
+  expect(L, "1.2.3.4", "example.org", false);
+  expect(L, "1.2.3.4", "mediaserver.local", true);
+  if (!L.hasHostNames()){
+    std::cerr << "Host name patterns were not kept" << std::endl;
+    ++failures;
+  }
+  if (Socket::AddrList("1.2.3.4/40").match(binAddr("1.2.3.4")) || Socket::AddrList().compile("a*b")){
+    std::cerr << "Invalid entries were accepted" << std::endl;
+    ++failures;
+  }
+  expect(Socket::AddrList("*"), "203.0.113.9", "", true);
+  expect(Socket::AddrList(""), "203.0.113.9", "", false);
+
+  // A large list of single addresses and subnets
+  size_t entryCount = (argc > 1 ? atoi(argv[1]) : 10000);
+  std::string list;
+  for (size_t i = 0; i < entryCount; ++i){
+    char entry[32];
+    snprintf(entry, 32, "%u.%u.%u.%u%s ", 100 + (unsigned)(i % 50), (unsigned)(i / 50) % 256, (unsigned)(i * 7) % 256,
+             (unsigned)i % 256, (i % 3) ? "" : "/24");
+    list += entry;
+  }
+  uint64_t compileTime = Util::getMicros();
+  Socket::AddrList big(list);
+  std::string packed = big.packed();
+  compileTime = Util::getMicros(compileTime);
+  std::string hit = binAddr("100.0.0.0");
+  std::string miss = binAddr("99.1.2.3");
+  size_t checks = 100000;
+  size_t hits = 0;
+  uint64_t matchTime = Util::getMicros();
+  for (size_t i = 0; i < checks; ++i){
+    if (Socket::AddrList::match(packed.data(), packed.size(), (i % 2) ? hit : miss)){++hits;}
+  }
+  matchTime = Util::getMicros(matchTime);
+  if (hits != checks / 2){
+    std::cerr << hits << " matches in the large list, expected " << checks / 2 << std::endl;
+    ++failures;
+  }
+
+  std::cerr << "Compiled " << entryCount << " entries into " << packed.size() << " bytes in " << compileTime << " us" << std::endl;
+  std::cerr << checks << " matches took " << matchTime << " us" << std::endl;
+  return failures;
+}
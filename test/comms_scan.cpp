@@ -0,0 +1,213 @@
+#include <mist/comms.h>
+#include <mist/defines.h>
+#include <mist/timing.h>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/// Gives access to the page name and semaphore, like the Comms subclasses do
+class testComms : public Comms::Comms{
+public:
+  void open(bool _master, bool reIssue = false){
+    if (!sem){sem.open("/MstCommsScanTest", O_CREAT | O_RDWR, ACCESSPERMS, 1);}
+    reload("MstCommsScanTest", 1024 * 1024, _master, reIssue);
+  }
+  size_t capacity() const{return dataAccX.getRCount();}
+};
+
+size_t activeCount = 0;
+size_t disconnectCount = 0;
+
+/// Watches more processes than the pidfd budget allows under a low file descriptor limit. Verifies every process
+/// is reported correctly, that file descriptors stay available, and that running out of them is only retried
+/// after backing off.
+int watchManyProcesses(size_t procCount){
+  int failures = 0;
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  struct rlimit lowLimit = limit;
+  lowLimit.rlim_cur = 128;
+  setrlimit(RLIMIT_NOFILE, &lowLimit);
+
+  std::deque<pid_t> children;
+  for (size_t i = 0; i < procCount; ++i){
+    pid_t child = fork();
+    if (!child){
+      while (true){pause();}
+    }
+    children.push_back(child);
+  }
+
+  {
+    Util::ProcWatcher W;
+    W.update();
+    for (size_t i = 0; i < children.size(); ++i){
+      if (!W.isRunning(children[i])){
+        std::cerr << "Running process " << children[i] << " reported as stopped" << std::endl;
+        ++failures;
+      }
+    }
+    if (Util::ProcWatcher::totalWatchCount() > 128 / PROCWATCH_FD_SHARE){
+      std::cerr << "Watching " << Util::ProcWatcher::totalWatchCount() << " processes with pidfds, expected at most "
+                << 128 / PROCWATCH_FD_SHARE << std::endl;
+      ++failures;
+    }
+    int fd = open("/dev/null", O_RDONLY);
+    if (fd == -1){
+      std::cerr << "No file descriptors left after watching " << procCount << " processes" << std::endl;
+      ++failures;
+    }else{
+      close(fd);
+    }
+
+    // Stop every other process, both watched and unwatched ones
+    for (size_t i = 0; i < children.size(); i += 2){
+      kill(children[i], SIGKILL);
+      waitpid(children[i], 0, 0);
+    }
+    W.update();
+    for (size_t i = 0; i < children.size(); ++i){
+      if (W.isRunning(children[i]) != (bool)(i % 2)){
+        std::cerr << "Process " << children[i] << " reported as " << (i % 2 ? "stopped" : "running") << std::endl;
+        ++failures;
+      }
+    }
+  }
+  if (Util::ProcWatcher::totalWatchCount()){
+    std::cerr << Util::ProcWatcher::totalWatchCount() << " pidfds left open after the watcher went away" << std::endl;
+    ++failures;
+  }
+
+  // Use up all file descriptors: the watcher should notice once and stop opening pidfds for a while
+  Util::ProcWatcher W;
+  W.update();
+  W.isRunning(getpid());
+  size_t watched = W.watchCount();
+  std::deque<int> fillers;
+  int fd;
+  while ((fd = dup(0)) != -1){fillers.push_back(fd);}
+  if (!W.isRunning(children[1])){
+    std::cerr << "Running process reported as stopped while out of file descriptors" << std::endl;
+    ++failures;
+  }
+  while (fillers.size()){
+    close(fillers.front());
+    fillers.pop_front();
+  }
+  for (size_t i = 3; i < children.size(); i += 2){
+    if (!W.isRunning(children[i])){
+      std::cerr << "Running process " << children[i] << " reported as stopped" << std::endl;
+      ++failures;
+    }
+  }
+  if (W.watchCount() != watched){
+    std::cerr << "Kept opening pidfds after running out of file descriptors" << std::endl;
+    ++failures;
+  }
+  // Once the back off passed, new processes are watched with pidfds again
+  Util::sleep(PROCWATCH_FD_BACKOFF + 100);
+  W.update();
+  if (!W.isRunning(children[1]) || W.watchCount() != watched + 1){
+    std::cerr << "Not watching processes with pidfds again after backing off" << std::endl;
+    ++failures;
+  }
+
+  for (size_t i = 1; i < children.size(); i += 2){
+    kill(children[i], SIGKILL);
+    waitpid(children[i], 0, 0);
+  }
+  setrlimit(RLIMIT_NOFILE, &limit);
+  return failures;
+}
+
+/// Claims a large amount of records on a comm page and reports how long claiming and scanning them takes,
+/// compared to scanning the whole page with a liveness syscall per record. Also verifies that exited
+/// processes are detected and that the scanned range shrinks again once records are released.
+int main(int argc, char **argv){
+  size_t recCount = (argc > 1 ? atoi(argv[1]) : 50000);
+  int failures = watchManyProcesses(200);
+  testComms master;
+  master.open(true);
+  if (!master || master.recordCount() != 0){
+    std::cerr << "Could not create an empty comm page" << std::endl;
+    return 1;
+  }
+
+  uint64_t claimTime = Util::getMicros();
+  {
+    testComms client;
+    for (size_t i = 0; i < recCount; ++i){client.open(false, true);}
+    claimTime = Util::getMicros(claimTime);
+  }
+  // Keep the last claimed record active now that the client went away
+  master.setStatus(COMM_STATUS_ACTIVE, recCount - 1);
+  if (master.recordCount() != recCount){
+    std::cerr << "Scan range is " << master.recordCount() << " records, but should be " << recCount << std::endl;
+    ++failures;
+  }
+
+  // Hand the first 1000 records to a process that has exited
+  pid_t child = fork();
+  if (!child){_exit(0);}
+  waitpid(child, 0, 0);
+  for (size_t i = 0; i < 1000 && i < recCount; ++i){master.setPid(child, i);}
+
+  uint64_t scanTime = Util::getMicros();
+  COMM_LOOP(master, ++activeCount, ++disconnectCount);
+  scanTime = Util::getMicros(scanTime);
+  if (disconnectCount != std::min(recCount, (size_t)1000)){
+    std::cerr << disconnectCount << " records of the exited process were disconnected, expected 1000" << std::endl;
+    ++failures;
+  }
+
+  // What a scan used to cost: every slot of the page, with a syscall per active record
+  uint64_t legacyTime = Util::getMicros();
+  size_t legacyActive = 0;
+  for (size_t i = 0; i < master.capacity(); ++i){
+    if (master.getStatus(i) == COMM_STATUS_INVALID){continue;}
+    if (master.getPid(i) && Util::Procs::isRunning(master.getPid(i))){++legacyActive;}
+  }
+  legacyTime = Util::getMicros(legacyTime);
+
+  activeCount = 0;
+  disconnectCount = 0;
+  uint64_t rescanTime = Util::getMicros();
+  COMM_LOOP(master, ++activeCount, ++disconnectCount);
+  rescanTime = Util::getMicros(rescanTime);
+  if (activeCount != legacyActive){
+    std::cerr << "Scan saw " << activeCount << " active records, but " << legacyActive << " are active" << std::endl;
+    ++failures;
+  }
+
+  // Releasing the upper half should shrink the scanned range, and new claims should reuse the lowest free record
+  for (size_t i = recCount / 2; i < recCount; ++i){master.setStatus(COMM_STATUS_DISCONNECT, i);}
+  COMM_LOOP(master, (void)0, (void)0);
+  if (master.recordCount() != recCount / 2){
+    std::cerr << "Scan range is " << master.recordCount() << " records after releasing, but should be " << recCount / 2 << std::endl;
+    ++failures;
+  }
+  {
+    testComms client;
+    client.open(false);
+    if (master.getStatus(0) != COMM_STATUS_ACTIVE){
+      std::cerr << "New claim did not reuse the first free record" << std::endl;
+      ++failures;
+    }
+  }
+
+  // Release everything, so the page can be removed without signalling ourselves
+  for (size_t i = 0; i < master.recordCount(); ++i){
+    if (master.getStatus(i) != COMM_STATUS_INVALID){master.setStatus(COMM_STATUS_DISCONNECT, i);}
+  }
+  COMM_LOOP(master, (void)0, (void)0);
+
+  std::cerr << "Claimed " << recCount << " records in " << claimTime << " us" << std::endl;
+  std::cerr << "First scan (watching " << recCount << " records) took " << scanTime << " us" << std::endl;
+  std::cerr << "Repeated scan took " << rescanTime << " us, full page scan with a syscall per record took "
+            << legacyTime << " us" << std::endl;
+  return failures;
+}
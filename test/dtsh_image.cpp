@@ -0,0 +1,162 @@
+#include <mist/bitfields.h>
+#include <mist/dtsc.h>
+#include <mist/timing.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+/// Reads the given file into a string
+std::string readFile(const std::string &fileName){
+  std::ifstream inFile(fileName.c_str(), std::ios::binary);
+  std::stringstream inData;
+  inData << inFile.rdbuf();
+  return inData.str();
+}
+
+/// Returns the number of differences between the track metadata of both Meta objects
+int compareMeta(const DTSC::Meta &A, const DTSC::Meta &B){
+  int failures = 0;
+  std::set<size_t> tA = A.getValidTracks();
+  std::set<size_t> tB = B.getValidTracks();
+  if (tA.size() != tB.size()){
+    std::cerr << "Track count is " << tB.size() << ", but should be " << tA.size() << std::endl;
+    return 1;
+  }
+  if (A.getVod() != B.getVod() || A.getLive() != B.getLive()){
+    std::cerr << "VoD/live flags do not match" << std::endl;
+    ++failures;
+  }
+  for (std::set<size_t>::iterator a = tA.begin(), b = tB.begin(); a != tA.end(); ++a, ++b){
+    if (A.getID(*a) != B.getID(*b) || A.getType(*a) != B.getType(*b) || A.getCodec(*a) != B.getCodec(*b) ||
+        A.getInit(*a) != B.getInit(*b) || A.getLastms(*a) != B.getLastms(*b) ||
+        A.getFirstms(*a) != B.getFirstms(*b) || A.getWidth(*a) != B.getWidth(*b)){
+      std::cerr << "Track " << *a << " properties do not match" << std::endl;
+      ++failures;
+    }
+    const Util::RelAccX &kA = A.keys(*a);
+    const Util::RelAccX &kB = B.keys(*b);
+    if (kA.getPresent() != kB.getPresent() || A.parts(*a).getPresent() != B.parts(*b).getPresent() ||
+        A.fragments(*a).getPresent() != B.fragments(*b).getPresent()){
+      std::cerr << "Track " << *a << " record counts do not match" << std::endl;
+      ++failures;
+      continue;
+    }
+    for (size_t i = 0; i < kA.getPresent(); ++i){
+      if (kA.getInt("time", i) != kB.getInt("time", i) || kA.getInt("bpos", i) != kB.getInt("bpos", i) ||
+          kA.getInt("size", i) != kB.getInt("size", i) || kA.getInt("parts", i) != kB.getInt("parts", i)){
+        std::cerr << "Track " << *a << " key " << i << " does not match" << std::endl;
+        ++failures;
+        break;
+      }
+    }
+    for (size_t i = 0; i < A.parts(*a).getPresent(); ++i){
+      if (A.parts(*a).getInt("size", i) != B.parts(*b).getInt("size", i)){
+        std::cerr << "Track " << *a << " part " << i << " does not match" << std::endl;
+        ++failures;
+        break;
+      }
+    }
+  }
+  return failures;
+}
+
+/// Returns 1 if the given broken image is accepted, 0 if it is rejected as it should be
+int accepts(const std::string &image, const char *what){
+  DTSC::Meta T;
+  if (!T.fromImage("", image.data(), image.size())){return 0;}
+  std::cerr << what << " was accepted" << std::endl;
+  return 1;
+}
+
+/// Builds a VoD header, writes it in both the serialized and the image format and verifies both
+/// load back identically. Also reports how long loading each format took.
+int main(int argc, char **argv){
+  size_t partCount = (argc > 1 ? atoi(argv[1]) : 50000);
+  DTSC::Meta M("", true);
+  M.setVod(true);
+  size_t vid = M.addTrack(DEFAULT_FRAGMENT_COUNT, partCount / 25 + 1, partCount + 1);
+  M.setID(vid, 1);
+  M.setType(vid, "video");
+  M.setCodec(vid, "H264");
+  M.setInit(vid, std::string("\001\144\000\037\377\341", 6));
+  M.setWidth(vid, 1920);
+  M.setHeight(vid, 1080);
+  M.setFpks(vid, 25000);
+  size_t aud = M.addTrack(DEFAULT_FRAGMENT_COUNT, partCount / 25 + 1, partCount + 1);
+  M.setID(aud, 2);
+  M.setType(aud, "audio");
+  M.setCodec(aud, "AAC");
+  M.setRate(aud, 48000);
+  M.setChannels(aud, 2);
+  M.setSize(aud, 16);
+  uint64_t bpos = 0;
+  for (size_t i = 0; i < partCount; ++i){
+    M.update(i * 40, 0, vid, 1000 + (i % 97) * 10, bpos, !(i % 25));
+    bpos += 1000 + (i % 97) * 10;
+    M.update(i * 40, 0, aud, 300 + (i % 13), bpos, true);
+    bpos += 300 + (i % 13);
+  }
+
+  char tmpName[] = "/tmp/dtsh_image_XXXXXX";
+  int tmpFd = mkstemp(tmpName);
+  if (tmpFd < 0){
+    std::cerr << "Could not create temporary file" << std::endl;
+    return 1;
+  }
+  close(tmpFd);
+  std::string legacyFile = std::string(tmpName) + ".dtsh";
+  std::string imageFile = std::string(tmpName) + ".dtsi";
+  M.toFile(legacyFile);
+  M.toImage(imageFile);
+  std::string legacy = readFile(legacyFile);
+  std::string image = readFile(imageFile);
+  unlink(tmpName);
+  unlink(legacyFile.c_str());
+  unlink(imageFile.c_str());
+
+  int failures = 0;
+  if (DTSC::Meta::isImage(legacy.data(), legacy.size()) || !DTSC::Meta::isImage(image.data(), image.size())){
+    std::cerr << "Image detection failed" << std::endl;
+    ++failures;
+  }
+
+  uint64_t legacyTime = Util::getMicros();
+  DTSC::Packet pkt(legacy.data(), legacy.size(), true);
+  DTSC::Meta L("", pkt.getScan());
+  legacyTime = Util::getMicros(legacyTime);
+  failures += compareMeta(M, L);
+
+  uint64_t imageTime = Util::getMicros();
+  DTSC::Meta I;
+  if (!I.fromImage("", image.data(), image.size())){
+    std::cerr << "Could not load image" << std::endl;
+    return failures + 1;
+  }
+  imageTime = Util::getMicros(imageTime);
+  failures += compareMeta(M, I);
+
+  // A truncated image must be rejected rather than partially loaded
+  failures += accepts(image.substr(0, image.size() - 1), "Image missing its last byte");
+
+  // Cut off right at the first chunk header of the first track, and halfway through it
+  size_t trackPos = DTSH_IMAGE_HEADER + Bit::btohl(image.data() + 26);
+  failures += accepts(image.substr(0, trackPos + 8), "Image cut off at a chunk header");
+  failures += accepts(image.substr(0, trackPos + 12), "Image cut off inside a chunk header");
+
+  // Chunk lengths pointing past the end of the image or the page, and an absurd page size
+  std::string corrupt = image;
+  Bit::htobl((char *)corrupt.data() + trackPos + 12, 0x7FFFFFFF);
+  failures += accepts(corrupt, "Image with a chunk running past its end");
+  corrupt = image;
+  Bit::htobl((char *)corrupt.data() + trackPos + 8, Bit::btohl(image.data() + trackPos));
+  failures += accepts(corrupt, "Image with a chunk running past its page");
+  corrupt = image;
+  Bit::htobl((char *)corrupt.data() + trackPos, 0xFFFFFFFF);
+  failures += accepts(corrupt, "Image with an oversized page");
+
+  std::cerr << "Serialized header: " << legacy.size() << " bytes, loaded in " << legacyTime << " us" << std::endl;
+  std::cerr << "Header image: " << image.size() << " bytes, loaded in " << imageTime << " us" << std::endl;
+  return failures;
+}
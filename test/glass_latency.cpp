@@ -0,0 +1,231 @@
+#include "../src/output/output.h"
+#include <mist/bitfields.h>
+#include <mist/config.h>
+#include <mist/dtsc.h>
+#include <mist/instrument.h>
+#include <mist/socket.h>
+#include <mist/timing.h>
+#include <arpa/inet.h>
+#include <iostream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define FRAME_INTERVAL 40 // 25 frames per second
+#define KEY_INTERVAL 25   // One keyframe per second
+#define FRAME_HEADER 13   // 8 bytes timestamp, 4 bytes payload size, 1 byte keyframe flag
+
+/// Sends frames to the given port in real time, as an encoder would
+void runSource(uint16_t port, uint64_t duration){
+  Socket::Connection C("127.0.0.1", port, false);
+  if (!C){_exit(1);}
+  char frame[FRAME_HEADER + 2000];
+  memset(frame, 0, sizeof(frame));
+  uint64_t start = Util::bootMS();
+  for (uint64_t i = 0; i * FRAME_INTERVAL < duration && C; ++i){
+    uint64_t due = start + i * FRAME_INTERVAL;
+    uint64_t now = Util::bootMS();
+    if (due > now){Util::sleep(due - now);}
+    uint32_t size = (i % KEY_INTERVAL) ? 500 + (i % 7) * 100 : 2000;
+    Bit::htobll(frame, i * FRAME_INTERVAL);
+    Bit::htobl(frame + 8, size);
+    frame[12] = (i % KEY_INTERVAL) ? 0 : 1;
+    C.SendNow(frame, FRAME_HEADER + size);
+  }
+  C.close();
+  _exit(0);
+}
+
+/// Buffers live packets into the stream pages, the way an input does
+class glassInput : public Mist::InOutBase{
+public:
+  glassInput(const std::string &name){
+    streamName = name;
+    meta.reInit(streamName, true);
+    trk = meta.addTrack();
+    meta.setID(trk, 1);
+    meta.setType(trk, "video");
+    meta.setCodec(trk, "H264");
+  }
+  void buffer(uint64_t time, const char *data, size_t size, bool isKey){
+    bufferLivePacket(time, 0, trk, data, size, 0, isKey);
+  }
+  const DTSC::Meta &getMeta() const{return M;}
+  size_t trk;
+};
+
+/// Plays the stream a fixed time behind the live edge, sampling the glass-to-glass latency of every packet it
+/// would send the way the output loop does
+class glassOutput : public Mist::Output{
+public:
+  glassOutput(Socket::Connection &conn, const std::string &name, size_t trk, uint64_t _holdBack) : Output(conn){
+    holdBack = _holdBack;
+    streamName = name;
+    meta.reInit(streamName, false);
+    thisIdx = trk;
+  }
+  virtual ~glassOutput(){}
+  /// Sends the packet playing at the given live edge, if any
+  bool play(uint64_t liveEdge, const char *data, size_t size){
+    if (liveEdge < holdBack){return false;}
+    meta.reloadReplacedPagesIfNeeded();
+    thisPacket.genericFill(liveEdge - holdBack, 0, 1, data, size, 0, false);
+    sampleIngestDelay();
+    return true;
+  }
+  uint64_t holdBack;
+};
+
+/// How far behind the live edge an output plays, and the highest glass-to-glass latency allowed
+struct latencyBudget{
+  const char *name;
+  uint64_t holdBack;
+  uint64_t budget;
+  uint64_t samples;
+  uint64_t sum;
+  uint64_t max;
+};
+
+/// Returns the glass-to-glass totals this binary flushed to the instrumentation page
+Instrument::Histogram glassTotals(Instrument::Page &page){
+  Instrument::Histogram totals;
+  memset(&totals, 0, sizeof(totals));
+  Instrument::flush();
+  for (size_t slot = 0; slot < page.slotCount(); ++slot){
+    if (page.getName(slot) != program_invocation_short_name){continue;}
+    totals = *page.get(slot, Instrument::OUT_GLASS);
+  }
+  return totals;
+}
+
+/// Drives a synthetic live stream from a source process over loopback into the stream pages, and lets outputs
+/// playing at different distances from the live edge sample it. Verifies the glass_to_glass histogram on the
+/// instrumentation page stays within the latency budget of every output, and that the ingest stamps cannot be
+/// mistaken for a low latency.
+int main(int argc, char **argv){
+  uint64_t duration = (argc > 1 ? atoi(argv[1]) : 5) * 1000;
+  latencyBudget budgets[] ={{"realtime", 0, 250, 0, 0, 0}, {"segmented", 1000, 1250, 0, 0, 0}};
+  size_t budgetCount = sizeof(budgets) / sizeof(latencyBudget);
+  int failures = 0;
+
+  Instrument::Page page;
+  page.reload(true);
+  if (!page){
+    std::cerr << "Could not create the instrumentation page" << std::endl;
+    return 1;
+  }
+
+  Socket::Server S(0, std::string("127.0.0.1"));
+  if (!S.connected()){
+    std::cerr << "Could not listen on loopback" << std::endl;
+    return 1;
+  }
+  struct sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+  getsockname(S.getSocket(), (struct sockaddr *)&addr, &addrLen);
+  pid_t source = fork();
+  if (!source){runSource(ntohs(addr.sin_port), duration);}
+  Socket::Connection C = S.accept();
+  S.close();
+
+  Util::Config conf("glass_latency");
+  Mist::Output::config = &conf;
+  std::string name = "glasslatency" + JSON::Value(getpid()).asString();
+  Util::setStreamName(name);
+  glassInput input(name);
+  int viewers[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, viewers);
+  Socket::Connection viewer(viewers[0]);
+  std::deque<glassOutput *> outputs;
+  for (size_t b = 0; b < budgetCount; ++b){
+    outputs.push_back(new glassOutput(viewer, name, input.trk, budgets[b].holdBack));
+  }
+
+  uint64_t frames = 0;
+  Instrument::Histogram prev = glassTotals(page);
+  while (C){
+    if (!C.spool()){
+      Util::sleep(1);
+      continue;
+    }
+    while (C.Received().available(FRAME_HEADER)){
+      std::string frame = C.Received().copy(FRAME_HEADER);
+      uint32_t size = Bit::btohl(frame.data() + 8);
+      if (!C.Received().available(FRAME_HEADER + size)){break;}
+      frame = C.Received().remove(FRAME_HEADER + size);
+      uint64_t time = Bit::btohll(frame.data());
+      input.buffer(time, frame.data() + FRAME_HEADER, size, frame[12]);
+      ++frames;
+      for (size_t b = 0; b < budgetCount; ++b){
+        if (!outputs[b]->play(time, frame.data() + FRAME_HEADER, size)){continue;}
+        // Every output samples once per second, so each new sample on the page belongs to this output
+        Instrument::Histogram now = glassTotals(page);
+        if (now.count == prev.count){continue;}
+        latencyBudget &B = budgets[b];
+        uint64_t delay = (now.sum - prev.sum) / 1000;
+        B.samples += now.count - prev.count;
+        B.sum += delay;
+        if (delay > B.max){B.max = delay;}
+        // Delays well below the hold back mean the stamps do not reflect when packets came in
+        if (delay + FRAME_INTERVAL < B.holdBack){
+          if (failures < 10){
+            std::cerr << B.name << " output reports " << delay << " ms latency while playing " << B.holdBack
+                      << " ms behind" << std::endl;
+          }
+          ++failures;
+        }
+        prev = now;
+      }
+    }
+  }
+  int status = 0;
+  waitpid(source, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status)){
+    std::cerr << "Source could not send the stream" << std::endl;
+    ++failures;
+  }
+  if (frames != (duration + FRAME_INTERVAL - 1) / FRAME_INTERVAL){
+    std::cerr << "Buffered " << frames << " frames, expected " << (duration + FRAME_INTERVAL - 1) / FRAME_INTERVAL
+              << std::endl;
+    ++failures;
+  }
+
+  DTSC::Keys keys(input.getMeta().keys(input.trk));
+  for (size_t k = keys.getFirstValid(); k < keys.getEndValid(); ++k){
+    if (!keys.getIngest(k)){
+      std::cerr << "Key " << k << " has no ingest time" << std::endl;
+      ++failures;
+    }
+  }
+
+  uint64_t samples = 0;
+  for (size_t b = 0; b < budgetCount; ++b){
+    latencyBudget &B = budgets[b];
+    std::cerr << B.name << ": " << B.samples << " samples, average " << (B.samples ? B.sum / B.samples : 0)
+              << " ms, max " << B.max << " ms (budget " << B.budget << " ms)" << std::endl;
+    // Every full second of media time behind the hold back is sampled once
+    if (B.samples < (duration - B.holdBack) / 1000 || B.max > B.budget){++failures;}
+    samples += B.samples;
+    delete outputs[b];
+  }
+  Instrument::Histogram totals = glassTotals(page);
+  if (totals.count != samples || !totals.bytes){
+    std::cerr << "The glass_to_glass histogram holds " << totals.count << " samples, expected " << samples
+              << std::endl;
+    ++failures;
+  }
+
+  // Packets that were not buffered live have no ingest time
+  DTSC::Meta V("", true);
+  V.setVod(true);
+  size_t vod = V.addTrack();
+  V.setType(vod, "video");
+  V.update(0, 0, vod, 1000, 1, true);
+  if (V.getIngestTime(vod, 0)){
+    std::cerr << "VoD packet has an ingest time" << std::endl;
+    ++failures;
+  }
+  return failures;
+}
@@ -0,0 +1,94 @@
+#include <mist/instrument.h>
+#include <mist/timing.h>
+#include <mist/tinythread.h>
+#include <iostream>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define RECORD_THREADS 4
+
+/// Records 1000 timings of each point
+void recordTimings(void *){
+  for (size_t i = 0; i < 1000; ++i){
+    for (size_t p = 0; p < Instrument::POINT_COUNT; ++p){Instrument::record((Instrument::Point)p, i, 10);}
+  }
+}
+
+/// Verifies the histogram buckets stay within 1/8th of the recorded value, that the timings of threads and
+/// processes that have exited are added to the totals of their binary, and reports the cost of a single
+/// instrumentation point.
+int main(int argc, char **argv){
+  int failures = 0;
+  for (size_t b = 0; b < INSTRUMENT_BUCKETS; ++b){
+    uint64_t start = Instrument::bucketStart(b);
+    if (Instrument::bucketFor(start) != b){
+      std::cerr << "Bucket " << b << " starts at " << start << ", which is counted in bucket "
+                << Instrument::bucketFor(start) << std::endl;
+      ++failures;
+    }
+    if (b + 1 < INSTRUMENT_BUCKETS){
+      uint64_t width = Instrument::bucketStart(b + 1) - start;
+      if (Instrument::bucketFor(start + width - 1) != b || (start >= 8 && width * 8 > start)){
+        std::cerr << "Bucket " << b << " is " << width << " wide at " << start << std::endl;
+        ++failures;
+      }
+    }
+  }
+
+  Instrument::Page page;
+  page.reload(true);
+  if (!page){
+    std::cerr << "Could not create the instrumentation page" << std::endl;
+    return 1;
+  }
+
+  // Every child records 1000 timings of each point on its main thread and on several threads at once, and exits
+  // normally; both the threads and the process flush what is left when they exit
+  size_t children = 4;
+  for (size_t c = 0; c < children; ++c){
+    pid_t child = fork();
+    if (child){continue;}
+    tthread::thread *threads[RECORD_THREADS];
+    for (size_t t = 0; t < RECORD_THREADS; ++t){threads[t] = new tthread::thread(recordTimings, 0);}
+    recordTimings(0);
+    for (size_t t = 0; t < RECORD_THREADS; ++t){
+      threads[t]->join();
+      delete threads[t];
+    }
+    exit(0);
+  }
+  while (children){
+    if (wait(0) > 0){--children;}
+  }
+
+  size_t found = 0;
+  for (size_t slot = 0; slot < page.slotCount(); ++slot){
+    if (page.getName(slot) != program_invocation_short_name){continue;}
+    ++found;
+    for (size_t p = 0; p < Instrument::POINT_COUNT; ++p){
+      const Instrument::Histogram *H = page.get(slot, p);
+      uint64_t inBuckets = 0;
+      for (size_t b = 0; b < INSTRUMENT_BUCKETS; ++b){inBuckets += H->buckets[b];}
+      uint64_t timings = 4 * (RECORD_THREADS + 1) * 1000;
+      if (H->count != timings || inBuckets != timings || H->sum != timings / 1000 * 499500 ||
+          H->bytes != timings * 10 || H->max != 999){
+        std::cerr << "Totals of point " << Instrument::pointName(p) << " do not match: " << H->count
+                  << " timings, " << inBuckets << " in buckets, sum " << H->sum << ", max " << H->max << std::endl;
+        ++failures;
+      }
+    }
+  }
+  if (found != 1){
+    std::cerr << "Found " << found << " slots for this binary, expected 1" << std::endl;
+    ++failures;
+  }
+
+  size_t loops = (argc > 1 ? atoi(argv[1]) : 1000000);
+  uint64_t scopeTime = Util::getMicros();
+  for (size_t i = 0; i < loops; ++i){Instrument::Scope S(Instrument::OUT_SEND);}
+  scopeTime = Util::getMicros(scopeTime);
+  std::cerr << "Timed " << loops << " scopes in " << scopeTime << " us (" << (double)scopeTime * 1000 / loops
+            << " ns each)" << std::endl;
+  return failures;
+}
@@ -0,0 +1,175 @@
+#include "../src/utils/util_load.h"
+#include <deque>
+#include <iostream>
+#include <mist/defines.h>
+#include <mist/timing.h>
+#include <mist/tinythread.h>
+#include <sstream>
+#include <stdlib.h>
+
+#define REQUEST_COUNT 4096
+
+std::deque<std::string> streams;
+std::deque<geoPoint> locations;
+std::deque<std::map<std::string, int32_t> > adjusts;
+volatile bool readersActive = true;
+
+/// Returns the best score any host gives the given request, by scoring every host
+uint64_t fullScan(size_t r){
+  uint64_t bestScore = 0;
+  for (HOSTLOOP){
+    HOSTCHECK;
+    uint64_t score = HOST(i).details->rate(streams[r], locations[r], adjusts[r]);
+    if (score > bestScore){bestScore = score;}
+  }
+  return bestScore;
+}
+
+/// Balances requests through the ranking for as long as the readersActive flag is set,
+/// while the main thread keeps publishing new rankings
+void rankingReader(void *served){
+  size_t r = 0;
+  while (readersActive){
+    uint64_t bestScore = 0;
+    if (findBestHost(streams[r], locations[r], adjusts[r], bestScore)){++*(uint64_t *)served;}
+    r = (r + 1) % REQUEST_COUNT;
+  }
+}
+
+/// Balances random requests over simulated hosts, with simulated load updates coming in and hosts going
+/// offline and online again. Verifies the incrementally updated ranking finds the same best score as
+/// scoring every host, then prints the requests per second of both ways to balance.
+int main(int argc, char **argv){
+  size_t hostCount = argc > 1 ? atoi(argv[1]) : 1000;
+  uint64_t seconds = argc > 2 ? atoi(argv[2]) : 1;
+  if (hostCount > MAXHOSTS){hostCount = MAXHOSTS;}
+  if (Util::printDebugLevel > DLVL_WARN){Util::printDebugLevel = DLVL_WARN;}
+  int failures = 0;
+  srand(4242);
+  const char *regions[] ={"eu", "us", "asia"};
+  std::deque<JSON::Value> loads;
+  for (size_t h = 0; h < hostCount; ++h){
+    std::stringstream name;
+    name << "sim" << h;
+    initHost(HOST(hostsCounter), name.str());
+    hostEntry &E = HOST(hostsCounter);
+    ++hostsCounter;
+    JSON::Value d;
+    d["cpu"] = rand() % 1000;
+    d["mem_total"] = 16 * 1024 * 1024;
+    d["mem_used"] = rand() % (12 * 1024 * 1024);
+    d["shm_total"] = 8 * 1024 * 1024;
+    d["shm_used"] = rand() % (4 * 1024 * 1024);
+    d["bwlimit"] = 128 * 1024 * 1024;
+    d["loc"]["lat"] = (rand() % 1600) / 10.0 - 80.05;
+    d["loc"]["lon"] = (rand() % 3600) / 10.0 - 180.05;
+    d["tags"].append(regions[h % 3]);
+    d["curr"].append(0);
+    d["bw"].append(0);
+    d["bw"].append(0);
+    for (size_t s = 0; s < 10; ++s){
+      if (rand() % 3){continue;}
+      JSON::Value &strm = d["streams"]["stream" + JSON::Value(s).asString()];
+      strm["curr"].append(rand() % 100);
+      strm["curr"].append(1);
+      strm["bw"].append(0);
+      strm["bw"].append(0);
+    }
+    E.details->host = name.str();
+    E.details->update(d);
+    E.state = STATE_ONLINE;
+    loads.push_back(d);
+  }
+  // Pregenerate requests, so generating them is not part of the measurement
+  for (size_t r = 0; r < REQUEST_COUNT; ++r){
+    streams.push_back("stream" + JSON::Value((uint64_t)(rand() % 12)).asString());
+    if (r % 4){
+      locations.push_back(geoPoint((rand() % 1600) / 10.0 - 80.05, (rand() % 3600) / 10.0 - 180.05));
+    }else{
+      locations.push_back(geoPoint()); // Viewer location unknown
+    }
+    adjusts.push_back(std::map<std::string, int32_t>());
+    if (!(r % 3)){adjusts.back()[regions[rand() % 3]] = 200;}
+  }
+
+  // Every request changes the score of the host it goes to, and hosts report new loads that raise or
+  // lower their score, so each request is balanced on a ranking updated incrementally from the previous one
+  updateRanking();
+  for (size_t r = 0; r < REQUEST_COUNT; ++r){
+    if (!(r % 16)){
+      size_t h = rand() % hostCount;
+      JSON::Value d = loads[h];
+      d["cpu"] = rand() % 1000;
+      d["mem_used"] = rand() % (12 * 1024 * 1024);
+      HOST(h).details->update(d);
+    }
+    if (!(r % 256)){
+      hostEntry &E = HOST((r / 256) % hostCount);
+      E.state = (E.state == STATE_ONLINE) ? STATE_ERROR : STATE_ONLINE;
+    }
+    updateRanking();
+    uint64_t bestScore = 0;
+    hostEntry *bestHost = findBestHost(streams[r], locations[r], adjusts[r], bestScore);
+    uint64_t expected = fullScan(r);
+    if (bestScore != expected || (bestScore && (!bestHost || bestHost->state != STATE_ONLINE))){
+      if (failures < 10){
+        std::cerr << "Request " << r << " for " << streams[r] << " balanced to a host scoring " << bestScore
+                  << ", best host scores " << expected << std::endl;
+      }
+      ++failures;
+    }
+    if (bestHost){bestHost->details->addViewer(streams[r]);}
+  }
+  for (HOSTLOOP){HOST(i).state = STATE_ONLINE;}
+
+  // Measure both ways to balance, with two more threads balancing through the ranking all along
+  uint64_t readerServed[2] ={0, 0};
+  tthread::thread readerA(rankingReader, readerServed);
+  tthread::thread readerB(rankingReader, readerServed + 1);
+  for (size_t mode = 0; mode < 2; ++mode){
+    uint64_t requests = 0, unserved = 0;
+    uint64_t start = Util::bootMS();
+    uint64_t stop = start + seconds * 1000;
+    while (Util::bootMS() < stop){
+      for (size_t r = 0; r < REQUEST_COUNT; ++r, ++requests){
+        // Simulated load update from a host every 64 requests, ranking updated as the monitor would
+        if (!(requests % 64)){
+          HOST((requests / 64) % hostCount).details->update(loads[(requests / 64) % hostCount]);
+          updateRanking();
+        }
+        uint64_t bestScore = 0;
+        hostEntry *bestHost = 0;
+        if (!mode){
+          bestHost = findBestHost(streams[r], locations[r], adjusts[r], bestScore);
+        }else{
+          for (HOSTLOOP){
+            HOSTCHECK;
+            uint64_t score = HOST(i).details->rate(streams[r], locations[r], adjusts[r]);
+            if (score > bestScore){
+              bestHost = &HOST(i);
+              bestScore = score;
+            }
+          }
+        }
+        if (bestHost){
+          bestHost->details->addViewer(streams[r]);
+        }else{
+          ++unserved;
+        }
+      }
+    }
+    uint64_t duration = Util::bootMS() - start;
+    std::cout << (mode ? "Full scan: " : "Ranking:   ") << hostCount << " hosts, " << requests
+              << " requests in " << duration << " ms = " << (duration ? requests * 1000 / duration : 0)
+              << " requests/s, " << unserved << " without host" << std::endl;
+  }
+  readersActive = false;
+  readerA.join();
+  readerB.join();
+  std::cout << "Concurrent readers balanced " << readerServed[0] + readerServed[1] << " requests" << std::endl;
+  if (seconds && (!readerServed[0] || !readerServed[1])){
+    std::cerr << "Concurrent readers found no hosts" << std::endl;
+    ++failures;
+  }
+  return failures;
+}
@@ -0,0 +1,148 @@
+#include <mist/json.h>
+#include <mist/stream.h>
+#include <mist/timing.h>
+#include <mist/util.h>
+#include <iostream>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/// Returns a stream config like the controller would publish
+JSON::Value streamConf(size_t i){
+  JSON::Value conf;
+  char name[32];
+  snprintf(name, 32, "bench%zu", i);
+  conf["name"] = name;
+  conf["source"] = std::string("push://") + name;
+  conf["DVR"] = 50000;
+  conf["processes"][0u]["process"] = "AV";
+  conf["processes"][0u]["codec"] = "opus";
+  return conf;
+}
+
+/// Publishes the configs of the given amount of streams, then applies a single edit and reads it back
+/// the way inputs do. Reports how long the full publish, the single edit and the reads take, and what
+/// comparing all streams (as every config write used to do) costs.
+int benchmark(size_t count){
+  int failures = 0;
+  Util::sysSetNrOpenFiles(count + 1024);
+  std::deque<JSON::Value> confs;
+  std::map<size_t, IPC::sharedPage> pages;
+  for (size_t i = 0; i < count; ++i){confs.push_back(streamConf(i));}
+
+  char pageName[NAME_BUFFER_SIZE];
+  uint64_t publishTime = Util::getMicros();
+  for (size_t i = 0; i < count; ++i){
+    snprintf(pageName, NAME_BUFFER_SIZE, "MstTestCnf%zu", i);
+    if (!Util::writeDTSCPage(pages[i], pageName, confs[i].toPacked())){
+      std::cerr << "Could not publish config " << i << std::endl;
+      return 1;
+    }
+  }
+  publishTime = Util::getMicros(publishTime);
+
+  std::deque<JSON::Value> written = confs;
+  uint64_t compareTime = Util::getMicros();
+  size_t changed = 0;
+  for (size_t i = 0; i < count; ++i){
+    if (written[i] != confs[i]){++changed;}
+  }
+  compareTime = Util::getMicros(compareTime);
+
+  size_t edited = count / 2;
+  snprintf(pageName, NAME_BUFFER_SIZE, "MstTestCnf%zu", edited);
+  Util::DTSCShmReader reader(pageName);
+  uint64_t prevVersion = reader.getVersion();
+  confs[edited]["DVR"] = 120000;
+  uint64_t editTime = Util::getMicros();
+  Util::writeDTSCPage(pages[edited], pageName, confs[edited].toPacked());
+  editTime = Util::getMicros(editTime);
+  if (reader.isStale() || reader.getVersion() == prevVersion || reader.getMember("DVR").asInt() != 120000){
+    std::cerr << "Open reader did not see the in-place edit" << std::endl;
+    ++failures;
+  }
+
+  // Two quick writes reuse the slot an earlier read came from; that read must not change underneath
+  DTSC::Scan held = reader.getScan();
+  for (int64_t dvr = 1; dvr <= 2; ++dvr){
+    confs[edited]["DVR"] = dvr;
+    Util::writeDTSCPage(pages[edited], pageName, confs[edited].toPacked());
+  }
+  if (held.getMember("DVR").asInt() != 120000 || reader.getMember("DVR").asInt() != 2){
+    std::cerr << "Read changed by later writes, or did not see them" << std::endl;
+    ++failures;
+  }
+
+  // Reads racing a writer must always see a complete config
+  confs[edited]["name"] = "2";
+  Util::writeDTSCPage(pages[edited], pageName, confs[edited].toPacked());
+  pid_t writer = fork();
+  if (!writer){
+    for (int64_t i = 0; i < 20000; ++i){
+      confs[edited]["DVR"] = i;
+      confs[edited]["name"] = JSON::Value(i).asString();
+      Util::writeDTSCPage(pages[edited], pageName, confs[edited].toPacked());
+    }
+    _exit(0);
+  }
+  size_t torn = 0;
+  while (!waitpid(writer, 0, WNOHANG)){
+    DTSC::Scan S = reader.getScan();
+    if (S.getMember("name").asString() != JSON::Value(S.getMember("DVR").asInt()).asString()){++torn;}
+  }
+  if (torn){
+    std::cerr << torn << " reads saw a config while it was being written" << std::endl;
+    ++failures;
+  }
+  confs[edited]["DVR"] = 120000;
+  confs[edited]["name"] = "bench";
+  Util::writeDTSCPage(pages[edited], pageName, confs[edited].toPacked());
+
+  size_t checks = 100000;
+  uint64_t versionTime = Util::getMicros();
+  uint64_t versions = 0;
+  for (size_t i = 0; i < checks; ++i){
+    if (!reader.isStale()){versions += reader.getVersion();}
+  }
+  versionTime = Util::getMicros(versionTime);
+  if (versions != checks * reader.getVersion()){
+    std::cerr << "Version changed without edits" << std::endl;
+    ++failures;
+  }
+  size_t reopens = 1000;
+  uint64_t reopenTime = Util::getMicros();
+  for (size_t i = 0; i < reopens; ++i){
+    Util::DTSCShmReader tmpReader(pageName);
+    if (tmpReader.getMember("DVR").asInt() != 120000){++failures;}
+  }
+  reopenTime = Util::getMicros(reopenTime);
+
+  // A config that outgrows its page replaces it; open readers must notice and reopen
+  for (size_t i = 0; i < 100; ++i){confs[edited]["processes"][i]["process"] = "Livepeer";}
+  Util::writeDTSCPage(pages[edited], pageName, confs[edited].toPacked());
+  if (!reader.isStale()){
+    std::cerr << "Open reader was not told to reopen a replaced page" << std::endl;
+    ++failures;
+  }
+  reader.open(pageName);
+  if (reader.getMember("processes").getSize() != 100){
+    std::cerr << "Reopened reader does not see the grown config" << std::endl;
+    ++failures;
+  }
+
+  std::cerr << count << " streams: published in " << publishTime / 1000 << " ms; comparing all configs took "
+            << compareTime << " us, a single edit took " << editTime << " us" << std::endl;
+  std::cerr << "  " << checks << " version checks took " << versionTime << " us, " << reopens
+            << " page reopens and reads took " << reopenTime << " us" << std::endl;
+  if (changed){
+    std::cerr << changed << " unchanged configs compared as different" << std::endl;
+    ++failures;
+  }
+  return failures;
+}
+
+int main(int argc, char **argv){
+  int failures = 0;
+  if (argc < 2){return benchmark(10000);}
+  for (int i = 1; i < argc; ++i){failures += benchmark(atoi(argv[i]));}
+  return failures;
+}
@@ -0,0 +1,118 @@
+#include <mist/comms.h>
+#include <mist/defines.h>
+#include <mist/socket.h>
+#include <mist/timing.h>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/// Returns the name of test stream i
+std::string streamName(size_t i){
+  std::stringstream name;
+  name << "totalstest+" << i;
+  return name.str();
+}
+
+/// Lets several processes claim rows for the same streams and add to their counters concurrently, as tracker
+/// shards do, then verifies no stream got more than one row, no additions were lost and the current session
+/// counts of all columns add up. Reports how long reading the totals of all streams takes.
+int main(int argc, char **argv){
+  size_t streamCount = (argc > 1 ? atoi(argv[1]) : 1000);
+  size_t rounds = 100;
+  int failures = 0;
+  Comms::StreamTotals master;
+  master.reload(true);
+  if (!master){
+    std::cerr << "Could not create the stream totals page" << std::endl;
+    return 1;
+  }
+
+  // Every writer claims all streams and adds to their counters, in its own column
+  pid_t writers[SESSION_TRACKER_SHARDS];
+  for (size_t w = 0; w < SESSION_TRACKER_SHARDS; ++w){
+    writers[w] = fork();
+    if (writers[w]){continue;}
+    Comms::StreamTotals totals;
+    totals.reload();
+    // Rows are looked up once and then kept, like the session trackers do
+    std::vector<size_t> rows;
+    for (size_t i = 0; i < streamCount; ++i){rows.push_back(totals.find(streamName(i), true));}
+    for (size_t r = 0; r < rounds; ++r){
+      for (size_t i = 0; i < streamCount; ++i){
+        totals.add(rows[i], 1, 2, 3, 1, 0, 1);
+        totals.setCurrent(rows[i], w, i % 4, 1 + w);
+      }
+    }
+    _exit(0);
+  }
+  for (size_t w = 0; w < SESSION_TRACKER_SHARDS; ++w){waitpid(writers[w], 0, 0);}
+  // The controller fills the last column with the sessions of single-session processes
+  master.setCurrent(master.find(streamName(0)), STREAM_TOTALS_COLUMNS - 1, 0, SESSION_TRACKER_SHARDS);
+
+  size_t found = 0;
+  for (size_t row = 0; row < master.rowCount(); ++row){
+    if (master.getStream(row).substr(0, 11) == "totalstest+"){++found;}
+  }
+  if (found != streamCount){
+    std::cerr << found << " rows were claimed for " << streamCount << " streams" << std::endl;
+    ++failures;
+  }
+
+  uint64_t expectCurrent = 0;
+  for (size_t w = 0; w < SESSION_TRACKER_SHARDS; ++w){expectCurrent += 1 + w;}
+  uint64_t readTime = Util::getMicros();
+  uint64_t totalUp = 0, totalDown = 0, totalCurrent = 0;
+  for (size_t row = 0; row < master.rowCount(); ++row){
+    if (!master.isUsed(row)){continue;}
+    totalUp += master.getUp(row);
+    totalDown += master.getDown(row);
+    totalCurrent += master.getCurrent(row);
+  }
+  readTime = Util::getMicros(readTime);
+
+  for (size_t i = 0; i < streamCount; ++i){
+    size_t row = master.find(streamName(i));
+    uint64_t adds = rounds * SESSION_TRACKER_SHARDS;
+    if (master.getUp(row) != adds || master.getDown(row) != 2 * adds || master.getPacketCount(row) != 3 * adds ||
+        master.getPacketLostCount(row) != adds || master.getViewSeconds(row) != adds){
+      if (failures < 10){std::cerr << "Counters of " << streamName(i) << " do not match" << std::endl;}
+      ++failures;
+    }
+    uint64_t expect = expectCurrent + (i ? 0 : SESSION_TRACKER_SHARDS);
+    if (master.getCurrent(row) != expect || master.getCurrent(row, i % 4) != expect){
+      if (failures < 10){
+        std::cerr << streamName(i) << " has " << master.getCurrent(row) << " current sessions, expected " << expect
+                  << std::endl;
+      }
+      ++failures;
+    }
+  }
+
+  // Clearing a column removes only that writer's sessions
+  size_t row = master.find(streamName(1));
+  master.clearCurrent(row, 0);
+  if (master.getCurrent(row) != expectCurrent - 1){
+    std::cerr << "Clearing a column left " << master.getCurrent(row) << " current sessions" << std::endl;
+    ++failures;
+  }
+
+  // Traffic of hosts excepted by the controller is left out by the trackers
+  char noBandwidth[STREAM_TOTALS_NOBW];
+  memset(noBandwidth, 0, STREAM_TOTALS_NOBW);
+  std::string localhost = Socket::getBinForms("127.0.0.1/8");
+  memcpy(noBandwidth, localhost.data(), localhost.size());
+  master.setNoBandwidth(noBandwidth);
+  if (master.countsBandwidth(Socket::getBinForms("127.0.0.5").substr(0, 16)) ||
+      !master.countsBandwidth(Socket::getBinForms("10.0.0.1").substr(0, 16))){
+    std::cerr << "Bandwidth exceptions were not applied" << std::endl;
+    ++failures;
+  }
+
+  std::cerr << "Read the totals of " << streamCount << " streams (" << totalCurrent << " current sessions, "
+            << totalUp << " bytes up, " << totalDown << " bytes down) in " << readTime << " us" << std::endl;
+  return failures;
+}
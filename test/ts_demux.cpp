@@ -0,0 +1,64 @@
+#include <mist/timing.h>
+#include <mist/ts_stream.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+/// Demuxes the given TS file a number of times through TS::Stream, the way inputTS does while
+/// reading its header, and reports the throughput for a single core.
+int main(int argc, char **argv){
+  if (argc < 2){
+    std::cout << "Usage: " << argv[0] << " file.ts [iterations]" << std::endl;
+    return 1;
+  }
+  size_t iterations = (argc > 2 ? atoi(argv[2]) : 10);
+  if (!iterations){iterations = 1;}
+
+  std::ifstream inFile(argv[1], std::ios::binary);
+  std::stringstream inData;
+  inData << inFile.rdbuf();
+  std::string data = inData.str();
+  if (data.size() < 188){
+    std::cerr << "Could not read TS data from " << argv[1] << std::endl;
+    return 1;
+  }
+
+  uint64_t packets = 0, bytes = 0, keys = 0;
+  uint64_t totalMicros = 0;
+  DTSC::Packet pack;
+  for (size_t i = 0; i < iterations; ++i){
+    TS::Stream tsStream;
+    uint64_t startTime = Util::getMicros();
+    for (size_t pos = 0; pos + 188 <= data.size(); pos += 188){
+      if (data[pos] != 0x47){continue;}
+      tsStream.parse((char *)data.data() + pos, pos);
+      while (tsStream.hasPacketOnEachTrack()){
+        tsStream.getEarliestPacket(pack);
+        if (!pack){break;}
+        if (!i){
+          ++packets;
+          bytes += pack.getDataLen();
+          if (pack.getFlag("keyframe")){++keys;}
+        }
+      }
+    }
+    tsStream.finish();
+    while (tsStream.hasPacket()){
+      tsStream.getEarliestPacket(pack);
+      if (!pack){break;}
+      if (!i){
+        ++packets;
+        bytes += pack.getDataLen();
+        if (pack.getFlag("keyframe")){++keys;}
+      }
+    }
+    totalMicros += Util::getMicros(startTime);
+  }
+
+  double bits = (double)data.size() * 8 * iterations;
+  std::cout << "Demuxed " << packets << " packets (" << keys << " keyframes, " << bytes
+            << " DTSC bytes) per iteration" << std::endl;
+  std::cout << iterations << " iterations of " << data.size() << " bytes in " << totalMicros / 1000
+            << " ms: " << (totalMicros ? bits / totalMicros / 1000.0 : 0) << " Gbit/s" << std::endl;
+  return 0;
+}